@@ -118,6 +118,7 @@ void blk_rq_init(struct request_queue *q, struct request *rq)
 	rq->cmd = rq->__cmd;
 	rq->cmd_len = BLK_MAX_CDB;
 	rq->tag = -1;
+	rq->internal_tag = -1;
 	rq->start_time = jiffies;
 	set_start_time_ns(rq);
 	rq->part = NULL;
@@ -389,9 +390,10 @@ static void __blk_drain_queue(struct request_queue *q, bool drain_all)
 
 		/*
 		 * The caller might be trying to drain @q before its
-		 * elevator is initialized.
+		 * elevator is initialized. blk-mq schedulers are drained
+		 * by freezing the queue instead.
 		 */
-		if (q->elevator)
+		if (q->elevator && !q->mq_ops)
 			elv_drain_elevator(q);
 
 		blkcg_drain_queue(q);
@@ -1415,7 +1417,7 @@ void __blk_put_request(struct request_queue *q, struct request *req)
 	/* this is a bio leak */
 	WARN_ON(req->bio != NULL);
 
-	wbt_done(q->rq_wb, &req->issue_stat);
+	wbt_done(q->rq_wb, req);
 
 	/*
 	 * Request may not have originated from ll_rw_blk. if not,
@@ -1613,6 +1615,7 @@ static blk_qc_t blk_queue_bio(struct request_queue *q, struct bio *bio)
 	int el_ret, where = ELEVATOR_INSERT_SORT;
 	struct request *req;
 	unsigned int request_count = 0;
+	struct blkcg_gq *wb_blkg;
 	unsigned int wb_acct;
 
 	/*
@@ -1666,7 +1669,7 @@ static blk_qc_t blk_queue_bio(struct request_queue *q, struct bio *bio)
 	}
 
 get_rq:
-	wb_acct = wbt_wait(q->rq_wb, bio, q->queue_lock);
+	wb_acct = wbt_wait(q->rq_wb, bio, q->queue_lock, &wb_blkg);
 
 	/*
 	 * Grab a free request. This is might sleep but can not fail.
@@ -1674,13 +1677,13 @@ get_rq:
 	 */
 	req = get_request(q, bio->bi_opf, bio, GFP_NOIO);
 	if (IS_ERR(req)) {
-		__wbt_done(q->rq_wb, wb_acct);
+		__wbt_done(q->rq_wb, wb_acct, wb_blkg);
 		bio->bi_error = PTR_ERR(req);
 		bio_endio(bio);
 		goto out_unlock;
 	}
 
-	wbt_track(&req->issue_stat, wb_acct);
+	wbt_track(req, wb_acct, wb_blkg);
 
 	/*
 	 * After dropping the lock and possibly sleeping here, our request
@@ -2680,8 +2683,12 @@ void blk_finish_request(struct request *req, int error)
 {
 	struct request_queue *q = req->q;
 
-	if (req->rq_flags & RQF_STATS)
-		blk_stat_add(&q->rq_stats[rq_data_dir(req)], req);
+	if (req->rq_flags & RQF_STATS) {
+		u64 now = blk_stat_now();
+
+		blk_stat_add(&q->rq_stats[rq_data_dir(req)], req, now);
+		wbt_stat_add(q->rq_wb, req, now);
+	}
 
 	if (req->rq_flags & RQF_QUEUED)
 		blk_queue_end_tag(q, req);
@@ -2699,7 +2706,7 @@ void blk_finish_request(struct request *req, int error)
 	blk_account_io_done(req);
 
 	if (req->end_io) {
-		wbt_done(req->q->rq_wb, &req->issue_stat);
+		wbt_done(req->q->rq_wb, req);
 		req->end_io(req, error);
 	} else {
 		if (blk_bidi_rq(req))
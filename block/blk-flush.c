@@ -227,11 +227,18 @@ static void flush_end_io(struct request *flush_rq, int error)
 	if (q->mq_ops) {
 		struct blk_mq_hw_ctx *hctx;
 
-		/* release the tag's ownership to the req cloned from */
 		spin_lock_irqsave(&fq->mq_flush_lock, flags);
-		hctx = blk_mq_map_queue(q, flush_rq->mq_ctx->cpu);
-		blk_mq_tag_set_rq(hctx, flush_rq->tag, fq->orig_rq);
-		flush_rq->tag = -1;
+		if (fq->orig_rq) {
+			/* release the tag's ownership to the req cloned from */
+			hctx = blk_mq_map_queue(q, flush_rq->mq_ctx->cpu);
+			blk_mq_tag_set_rq(hctx, flush_rq->tag, fq->orig_rq);
+			fq->orig_rq = NULL;
+			flush_rq->tag = -1;
+		} else {
+			/* borrowed a scheduler tag, the driver tag is ours */
+			blk_mq_put_driver_tag(flush_rq);
+			flush_rq->internal_tag = -1;
+		}
 	}
 
 	running = &fq->flush_queue[fq->flush_running_idx];
@@ -313,17 +320,25 @@ static bool blk_kick_flush(struct request_queue *q, struct blk_flush_queue *fq)
 	/*
 	 * Borrow tag from the first request since they can't
 	 * be in flight at the same time. And acquire the tag's
-	 * ownership for flush req.
+	 * ownership for flush req. A request still waiting in the
+	 * scheduler has no driver tag yet, borrow its scheduler tag
+	 * then and let the flush get a driver tag at dispatch.
 	 */
 	if (q->mq_ops) {
 		struct blk_mq_hw_ctx *hctx;
 
 		flush_rq->mq_ctx = first_rq->mq_ctx;
-		flush_rq->tag = first_rq->tag;
-		fq->orig_rq = first_rq;
 
-		hctx = blk_mq_map_queue(q, first_rq->mq_ctx->cpu);
-		blk_mq_tag_set_rq(hctx, first_rq->tag, flush_rq);
+		if (first_rq->tag != -1) {
+			flush_rq->tag = first_rq->tag;
+			fq->orig_rq = first_rq;
+
+			hctx = blk_mq_map_queue(q, first_rq->mq_ctx->cpu);
+			blk_mq_tag_set_rq(hctx, first_rq->tag, flush_rq);
+		} else {
+			flush_rq->internal_tag = first_rq->internal_tag;
+			fq->orig_rq = NULL;
+		}
 	}
 
 	flush_rq->cmd_type = REQ_TYPE_FS;
@@ -386,6 +401,9 @@ static void mq_flush_data_end_io(struct request *rq, int error)
 
 	hctx = blk_mq_map_queue(q, ctx->cpu);
 
+	/* the data is done, a later flush step gets a driver tag again */
+	blk_mq_put_driver_tag(rq);
+
 	/*
 	 * After populating an empty queue, kick it to avoid stall.  Read
 	 * the comment in flush_end_io().
@@ -220,6 +220,13 @@ void blk_queue_split(struct request_queue *q, struct bio **bio,
 		/* there isn't chance to merge the splitted bio */
 		split->bi_opf |= REQ_NOMERGE;
 
+		/*
+		 * The submitter polls for one cookie only, the other half
+		 * would sit on a poll queue nobody reaps.
+		 */
+		split->bi_opf &= ~REQ_HIPRI;
+		(*bio)->bi_opf &= ~REQ_HIPRI;
+
 		bio_chain(split, *bio);
 		trace_block_split(q, split, (*bio)->bi_iter.bi_sector);
 		generic_make_request(*bio);
@@ -661,8 +668,12 @@ static void blk_account_io_merge(struct request *req)
 /*
  * Has to be called with the request spinlock acquired
  */
-static int attempt_merge(struct request_queue *q, struct request *req,
-			  struct request *next)
+/*
+ * Append @next to @req if the two can be merged. @next is left without
+ * bios, it's up to the caller to take it off the scheduler and free it.
+ */
+int blk_merge_requests(struct request_queue *q, struct request *req,
+		       struct request *next)
 {
 	if (!rq_mergeable(req) || !rq_mergeable(next))
 		return 0;
@@ -721,8 +732,6 @@ static int attempt_merge(struct request_queue *q, struct request *req,
 
 	req->__data_len += blk_rq_bytes(next);
 
-	elv_merge_requests(q, req, next);
-
 	/*
 	 * 'next' is going away, so update stats accordingly
 	 */
@@ -734,6 +743,16 @@ static int attempt_merge(struct request_queue *q, struct request *req,
 
 	/* owner-ship of bio passed from next to req */
 	next->bio = NULL;
+	return 1;
+}
+
+static int attempt_merge(struct request_queue *q, struct request *req,
+			  struct request *next)
+{
+	if (!blk_merge_requests(q, req, next))
+		return 0;
+
+	elv_merge_requests(q, req, next);
 	__blk_put_request(q, next);
 	return 1;
 }
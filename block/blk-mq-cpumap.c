@@ -34,7 +34,7 @@ static int get_first_sibling(unsigned int cpu)
 int blk_mq_map_queues(struct blk_mq_tag_set *set)
 {
 	unsigned int *map = set->mq_map;
-	unsigned int nr_queues = set->nr_hw_queues;
+	unsigned int nr_queues = set->nr_hw_queues - set->nr_poll_queues;
 	const struct cpumask *online_mask = cpu_online_mask;
 	unsigned int i, nr_cpus, nr_uniq_cpus, queue, first_sibling;
 	cpumask_var_t cpus;
@@ -89,6 +89,33 @@ int blk_mq_map_queues(struct blk_mq_tag_set *set)
 }
 EXPORT_SYMBOL_GPL(blk_mq_map_queues);
 
+/**
+ * blk_mq_map_poll_queues - spread the CPUs over the poll queues of a tag set
+ * @set:	tagset to provide the mapping for
+ *
+ * Poll queues have no interrupt whose affinity could be followed, so just
+ * hand out the online CPUs in order, which keeps neighbouring CPUs (and
+ * thus usually thread siblings) on the same queue.
+ */
+int blk_mq_map_poll_queues(struct blk_mq_tag_set *set)
+{
+	unsigned int first = set->nr_hw_queues - set->nr_poll_queues;
+	unsigned int nr_cpus = num_online_cpus();
+	unsigned int i, queue = 0;
+
+	for_each_possible_cpu(i) {
+		if (!cpu_online(i)) {
+			set->poll_map[i] = first;
+			continue;
+		}
+		set->poll_map[i] = first + cpu_to_queue_index(nr_cpus,
+				set->nr_poll_queues, queue++);
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(blk_mq_map_poll_queues);
+
 /*
  * We have no quick way of doing reverse lookups. This is only used at
  * queue init time, so runtime isn't important.
@@ -0,0 +1,283 @@
+/*
+ * blk-mq scheduling framework
+ *
+ * An elevator with ->uses_mq set is attached to q->elevator like the
+ * legacy schedulers, but is driven per hardware queue. Regular fs
+ * requests are inserted into the scheduler instead of the software
+ * queues, and pulled out one at a time when the hardware queue runs.
+ * Everything else (flushes, passthrough, requeues) keeps going through
+ * the software queues and is dispatched ahead of the scheduler.
+ *
+ * Requests headed for the scheduler are allocated from a per hardware
+ * queue set of scheduler tags, hctx->sched_tags, sized by nr_requests.
+ * They only take a driver tag when they are dispatched, so the scheduler
+ * gets to hold more requests than the device can have in flight and
+ * decides what goes out once a driver tag frees up.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/elevator.h>
+
+#include <trace/events/block.h>
+
+#include "blk.h"
+#include "blk-mq.h"
+#include "blk-mq-tag.h"
+#include "blk-mq-sched.h"
+
+/*
+ * Scheduler tags are allocated for the largest depth a scheduler gets,
+ * twice the device queue depth up to twice the legacy default. That
+ * leaves the scheduler requests to sort while the device is busy, and
+ * nr_requests can be changed up to it without reallocating.
+ */
+static unsigned int blk_mq_sched_max_depth(struct request_queue *q)
+{
+	return 2 * min_t(unsigned int, q->tag_set->queue_depth, BLKDEV_MAX_RQ);
+}
+
+/*
+ * Poll queues bypass the scheduler, they get neither scheduler tags nor
+ * scheduler data.
+ */
+int blk_mq_sched_init_hctx(struct request_queue *q, struct blk_mq_hw_ctx *hctx,
+			   unsigned int hctx_idx)
+{
+	struct elevator_queue *e = q->elevator;
+	int ret;
+
+	if (!e || (hctx->flags & BLK_MQ_F_POLL_QUEUE))
+		return 0;
+
+	hctx->sched_tags = blk_mq_init_rq_map(q->tag_set, hctx_idx,
+					      blk_mq_sched_max_depth(q), 0);
+	if (!hctx->sched_tags)
+		return -ENOMEM;
+	blk_mq_tag_update_depth(hctx->sched_tags, q->nr_requests);
+
+	if (e->type->mq_ops.init_hctx) {
+		ret = e->type->mq_ops.init_hctx(hctx, hctx_idx);
+		if (ret) {
+			blk_mq_free_rq_map(q->tag_set, hctx->sched_tags,
+					   hctx_idx);
+			hctx->sched_tags = NULL;
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+void blk_mq_sched_exit_hctx(struct request_queue *q, struct blk_mq_hw_ctx *hctx,
+			    unsigned int hctx_idx)
+{
+	struct elevator_queue *e = q->elevator;
+
+	if (e && hctx->sched_data && e->type->mq_ops.exit_hctx)
+		e->type->mq_ops.exit_hctx(hctx, hctx_idx);
+	hctx->sched_data = NULL;
+
+	if (hctx->sched_tags) {
+		blk_mq_free_rq_map(q->tag_set, hctx->sched_tags, hctx_idx);
+		hctx->sched_tags = NULL;
+	}
+}
+
+static void blk_mq_sched_exit_hctxs(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i)
+		blk_mq_sched_exit_hctx(q, hctx, i);
+}
+
+/*
+ * Attach scheduler @e to @q. The caller must have frozen and quiesced
+ * the queue, the reference on @e is passed to the elevator_queue.
+ */
+int blk_mq_sched_init(struct request_queue *q, struct elevator_type *e)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+	int ret;
+
+	/*
+	 * Unless the depth was changed through sysfs, give the scheduler
+	 * all the requests its tags can hold.
+	 */
+	if (q->nr_requests == q->tag_set->queue_depth)
+		q->nr_requests = blk_mq_sched_max_depth(q);
+	else
+		q->nr_requests = min_t(unsigned long, q->nr_requests,
+				       blk_mq_sched_max_depth(q));
+
+	ret = e->mq_ops.init_sched(q, e);
+	if (ret)
+		return ret;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		ret = blk_mq_sched_init_hctx(q, hctx, i);
+		if (ret) {
+			blk_mq_sched_teardown(q);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Detach the scheduler of @q. Like for blk_mq_sched_init(), the queue
+ * must be frozen and quiesced, or be on its way out.
+ */
+void blk_mq_sched_teardown(struct request_queue *q)
+{
+	struct elevator_queue *e = q->elevator;
+
+	blk_mq_sched_exit_hctxs(q);
+	q->elevator = NULL;
+	elevator_exit(e);
+}
+
+/*
+ * Try to merge @bio into @rq, a candidate the scheduler looked up in its
+ * own data structures. Returns ELEVATOR_BACK_MERGE or ELEVATOR_FRONT_MERGE
+ * if the bio was merged, so the scheduler can reposition @rq after a front
+ * merge, or ELEVATOR_NO_MERGE.
+ */
+int blk_mq_sched_try_merge(struct request_queue *q, struct request *rq,
+			   struct bio *bio)
+{
+	int type;
+
+	if (!blk_rq_merge_ok(rq, bio))
+		return ELEVATOR_NO_MERGE;
+
+	type = blk_try_merge(rq, bio);
+	if (type == ELEVATOR_BACK_MERGE) {
+		if (bio_attempt_back_merge(q, rq, bio))
+			return type;
+	} else if (type == ELEVATOR_FRONT_MERGE) {
+		if (bio_attempt_front_merge(q, rq, bio))
+			return type;
+	}
+
+	return ELEVATOR_NO_MERGE;
+}
+EXPORT_SYMBOL_GPL(blk_mq_sched_try_merge);
+
+/*
+ * Try to merge @next into @rq, after a bio merge made the two adjacent.
+ * Returns true if @next was merged, the scheduler must then take it off
+ * its lists and free it with blk_mq_free_request().
+ */
+bool blk_mq_sched_try_req_merge(struct request_queue *q, struct request *rq,
+				struct request *next)
+{
+	return blk_merge_requests(q, rq, next);
+}
+EXPORT_SYMBOL_GPL(blk_mq_sched_try_req_merge);
+
+bool __blk_mq_sched_bio_merge(struct request_queue *q, struct bio *bio)
+{
+	struct elevator_queue *e = q->elevator;
+	struct blk_mq_ctx *ctx = blk_mq_get_ctx(q);
+	struct blk_mq_hw_ctx *hctx = blk_mq_map_queue(q, ctx->cpu);
+	bool ret = false;
+
+	if (e->type->mq_ops.bio_merge) {
+		ret = e->type->mq_ops.bio_merge(hctx, bio);
+		if (ret)
+			ctx->rq_merged++;
+	}
+
+	blk_mq_put_ctx(ctx);
+	return ret;
+}
+
+/*
+ * Only regular fs requests are sorted. Anything inserted at the head is
+ * expected to go out before what is already queued, so keep that on the
+ * software queues as well. Polled requests live on a poll queue, which
+ * the scheduler never dispatches from.
+ */
+static bool blk_mq_sched_bypass_insert(struct request *rq, bool at_head)
+{
+	return at_head || rq->cmd_type != REQ_TYPE_FS ||
+		(rq->rq_flags & RQF_FLUSH_SEQ) || op_is_flush(rq->cmd_flags) ||
+		(rq->cmd_flags & REQ_HIPRI);
+}
+
+void blk_mq_sched_insert_request(struct request *rq, bool at_head,
+				 bool run_queue, bool async)
+{
+	struct request_queue *q = rq->q;
+	struct elevator_queue *e = q->elevator;
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+	struct blk_mq_hw_ctx *hctx = blk_mq_map_queue(q, ctx->cpu);
+	LIST_HEAD(list);
+
+	if (!e || blk_mq_sched_bypass_insert(rq, at_head)) {
+		blk_mq_insert_request(rq, at_head, run_queue, async);
+		return;
+	}
+
+	trace_block_rq_insert(q, rq);
+	list_add(&rq->queuelist, &list);
+	e->type->mq_ops.insert_requests(hctx, &list);
+
+	if (run_queue)
+		blk_mq_run_hw_queue(hctx, async);
+}
+
+/*
+ * Insert a list of requests that all map to @hctx, such as what comes
+ * out of a plug flush.
+ */
+void blk_mq_sched_insert_requests(struct blk_mq_hw_ctx *hctx,
+				  struct list_head *list, bool run_queue_async)
+{
+	struct elevator_queue *e = hctx->queue->elevator;
+	struct request *rq, *next;
+
+	list_for_each_entry_safe(rq, next, list, queuelist) {
+		if (blk_mq_sched_bypass_insert(rq, false)) {
+			list_del_init(&rq->queuelist);
+			blk_mq_insert_request(rq, false, false, false);
+		} else
+			trace_block_rq_insert(hctx->queue, rq);
+	}
+
+	if (!list_empty(list))
+		e->type->mq_ops.insert_requests(hctx, list);
+
+	blk_mq_run_hw_queue(hctx, run_queue_async);
+}
+
+/*
+ * Dispatch what the software queues and ->dispatch had pending first,
+ * those are requeues, flushes and passthrough requests. If the driver
+ * took them all, feed it from the scheduler one request at a time, until
+ * the scheduler runs dry or the driver is busy. Handing requests over
+ * one by one leaves them in the scheduler for as long as possible, which
+ * is where they can still be merged and sorted.
+ */
+void blk_mq_sched_dispatch_requests(struct blk_mq_hw_ctx *hctx,
+				    struct list_head *rq_list)
+{
+	struct elevator_queue *e = hctx->queue->elevator;
+	struct request *rq;
+
+	if (!list_empty(rq_list) && !blk_mq_dispatch_rq_list(hctx, rq_list))
+		return;
+
+	do {
+		rq = e->type->mq_ops.dispatch_request(hctx);
+		if (!rq)
+			break;
+		list_add(&rq->queuelist, rq_list);
+	} while (blk_mq_dispatch_rq_list(hctx, rq_list));
+}
@@ -0,0 +1,41 @@
+#ifndef BLK_MQ_SCHED_H
+#define BLK_MQ_SCHED_H
+
+#include "blk-mq.h"
+
+int blk_mq_sched_init(struct request_queue *q, struct elevator_type *e);
+void blk_mq_sched_teardown(struct request_queue *q);
+int blk_mq_sched_init_hctx(struct request_queue *q, struct blk_mq_hw_ctx *hctx,
+			   unsigned int hctx_idx);
+void blk_mq_sched_exit_hctx(struct request_queue *q, struct blk_mq_hw_ctx *hctx,
+			    unsigned int hctx_idx);
+
+int blk_mq_sched_try_merge(struct request_queue *q, struct request *rq,
+			   struct bio *bio);
+bool blk_mq_sched_try_req_merge(struct request_queue *q, struct request *rq,
+				struct request *next);
+bool __blk_mq_sched_bio_merge(struct request_queue *q, struct bio *bio);
+void blk_mq_sched_insert_request(struct request *rq, bool at_head,
+				 bool run_queue, bool async);
+void blk_mq_sched_insert_requests(struct blk_mq_hw_ctx *hctx,
+				  struct list_head *list, bool run_queue_async);
+void blk_mq_sched_dispatch_requests(struct blk_mq_hw_ctx *hctx,
+				   struct list_head *rq_list);
+
+static inline bool
+blk_mq_sched_bio_merge(struct request_queue *q, struct bio *bio)
+{
+	if (!q->elevator || blk_queue_nomerges(q) || !bio_mergeable(bio))
+		return false;
+
+	return __blk_mq_sched_bio_merge(q, bio);
+}
+
+static inline bool blk_mq_sched_has_work(struct blk_mq_hw_ctx *hctx)
+{
+	struct elevator_queue *e = hctx->queue->elevator;
+
+	return e && hctx->sched_data && e->type->mq_ops.has_work(hctx);
+}
+
+#endif
@@ -176,15 +176,16 @@ static ssize_t blk_mq_sysfs_rq_list_show(struct blk_mq_ctx *ctx, char *page)
 
 static ssize_t blk_mq_hw_sysfs_poll_show(struct blk_mq_hw_ctx *hctx, char *page)
 {
-	return sprintf(page, "considered=%lu, invoked=%lu, success=%lu\n",
-		       hctx->poll_considered, hctx->poll_invoked,
-		       hctx->poll_success);
+	return sprintf(page, "considered=%lu, invoked=%lu, success=%lu, "
+		       "slept=%lu\n", hctx->poll_considered, hctx->poll_invoked,
+		       hctx->poll_success, hctx->poll_slept);
 }
 
 static ssize_t blk_mq_hw_sysfs_poll_store(struct blk_mq_hw_ctx *hctx,
 					  const char *page, size_t size)
 {
 	hctx->poll_considered = hctx->poll_invoked = hctx->poll_success = 0;
+	hctx->poll_slept = 0;
 
 	return size;
 }
@@ -300,6 +301,89 @@ static ssize_t blk_mq_hw_sysfs_stat_show(struct blk_mq_hw_ctx *hctx, char *page)
 	return ret;
 }
 
+static const char *const blk_mq_hist_op_names[BLK_STAT_HIST_OPS] = {
+	[BLK_STAT_HIST_READ]	= "read",
+	[BLK_STAT_HIST_WRITE]	= "write",
+	[BLK_STAT_HIST_DISCARD]	= "discard",
+	[BLK_STAT_HIST_OTHER]	= "other",
+};
+
+static const char *const blk_mq_hist_size_names[BLK_STAT_HIST_SIZES] = {
+	"4k", "16k", "64k", "256k", "large",
+};
+
+/*
+ * One line per op type and size class that has samples: percentiles in
+ * nsecs, followed by the raw cumulative bucket counts up to the last
+ * non-empty bucket.
+ */
+static ssize_t blk_mq_hw_sysfs_stat_hist_show(struct blk_mq_hw_ctx *hctx,
+					      char *page)
+{
+	struct blk_stat_hist *hist;
+	ssize_t ret = 0;
+	int op, size, i, last;
+
+	if (!hctx->queue->stat_hist)
+		return sprintf(page, "disabled\n");
+
+	hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	blk_hctx_stat_hist_get(hctx, hist);
+
+	for (op = 0; op < BLK_STAT_HIST_OPS; op++) {
+		for (size = 0; size < BLK_STAT_HIST_SIZES; size++) {
+			u64 nr = blk_stat_hist_samples(hist, op, size);
+
+			if (!nr)
+				continue;
+
+			ret += scnprintf(page + ret, PAGE_SIZE - ret,
+				"%s %s: samples=%llu p50=%llu p90=%llu p99=%llu buckets=",
+				blk_mq_hist_op_names[op],
+				blk_mq_hist_size_names[size], nr,
+				blk_stat_hist_percentile(hist, op, size, 50),
+				blk_stat_hist_percentile(hist, op, size, 90),
+				blk_stat_hist_percentile(hist, op, size, 99));
+
+			last = 0;
+			for (i = 0; i < BLK_STAT_HIST_BUCKETS; i++)
+				if (hist->buckets[op][size][i])
+					last = i;
+			for (i = 0; i <= last; i++)
+				ret += scnprintf(page + ret, PAGE_SIZE - ret,
+						 "%s%llu", i ? " " : "",
+						 hist->buckets[op][size][i]);
+			ret += scnprintf(page + ret, PAGE_SIZE - ret, "\n");
+		}
+	}
+
+	kfree(hist);
+	return ret;
+}
+
+/*
+ * Writing a true value turns on histogram tracking for the whole queue,
+ * it can't be turned off again.
+ */
+static ssize_t blk_mq_hw_sysfs_stat_hist_store(struct blk_mq_hw_ctx *hctx,
+					       const char *page, size_t count)
+{
+	bool enable;
+	int ret;
+
+	ret = kstrtobool(page, &enable);
+	if (ret)
+		return ret;
+	if (!enable)
+		return -EINVAL;
+
+	ret = blk_stat_hist_enable(hctx->queue);
+	return ret ?: count;
+}
+
 static struct blk_mq_ctx_sysfs_entry blk_mq_sysfs_dispatched = {
 	.attr = {.name = "dispatched", .mode = S_IRUGO },
 	.show = blk_mq_sysfs_dispatched_show,
@@ -364,6 +448,12 @@ static struct blk_mq_hw_ctx_sysfs_entry blk_mq_hw_sysfs_stat = {
 	.store = blk_mq_hw_sysfs_stat_store,
 };
 
+static struct blk_mq_hw_ctx_sysfs_entry blk_mq_hw_sysfs_stat_hist = {
+	.attr = {.name = "stats_hist", .mode = S_IRUGO | S_IWUSR },
+	.show = blk_mq_hw_sysfs_stat_hist_show,
+	.store = blk_mq_hw_sysfs_stat_hist_store,
+};
+
 static struct attribute *default_hw_ctx_attrs[] = {
 	&blk_mq_hw_sysfs_queued.attr,
 	&blk_mq_hw_sysfs_run.attr,
@@ -374,6 +464,7 @@ static struct attribute *default_hw_ctx_attrs[] = {
 	&blk_mq_hw_sysfs_active.attr,
 	&blk_mq_hw_sysfs_poll.attr,
 	&blk_mq_hw_sysfs_stat.attr,
+	&blk_mq_hw_sysfs_stat_hist.attr,
 	NULL,
 };
 
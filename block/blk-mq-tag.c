@@ -90,9 +90,11 @@ static inline bool hctx_may_queue(struct blk_mq_hw_ctx *hctx,
 	return atomic_read(&hctx->nr_active) < depth;
 }
 
-static int __bt_get(struct blk_mq_hw_ctx *hctx, struct sbitmap_queue *bt)
+static int __bt_get(struct blk_mq_alloc_data *data, struct blk_mq_hw_ctx *hctx,
+		    struct sbitmap_queue *bt)
 {
-	if (!hctx_may_queue(hctx, bt))
+	/* fair sharing only applies to the driver tags */
+	if (!(data->flags & BLK_MQ_REQ_INTERNAL) && !hctx_may_queue(hctx, bt))
 		return -1;
 	return __sbitmap_queue_get(bt);
 }
@@ -104,7 +106,7 @@ static int bt_get(struct blk_mq_alloc_data *data, struct sbitmap_queue *bt,
 	DEFINE_WAIT(wait);
 	int tag;
 
-	tag = __bt_get(hctx, bt);
+	tag = __bt_get(data, hctx, bt);
 	if (tag != -1)
 		return tag;
 
@@ -115,7 +117,7 @@ static int bt_get(struct blk_mq_alloc_data *data, struct sbitmap_queue *bt,
 	do {
 		prepare_to_wait(&ws->wait, &wait, TASK_UNINTERRUPTIBLE);
 
-		tag = __bt_get(hctx, bt);
+		tag = __bt_get(data, hctx, bt);
 		if (tag != -1)
 			break;
 
@@ -132,7 +134,7 @@ static int bt_get(struct blk_mq_alloc_data *data, struct sbitmap_queue *bt,
 		 * Retry tag allocation after running the hardware queue,
 		 * as running the queue may also have found completions.
 		 */
-		tag = __bt_get(hctx, bt);
+		tag = __bt_get(data, hctx, bt);
 		if (tag != -1)
 			break;
 
@@ -141,12 +143,15 @@ static int bt_get(struct blk_mq_alloc_data *data, struct sbitmap_queue *bt,
 		io_schedule();
 
 		data->ctx = blk_mq_get_ctx(data->q);
-		data->hctx = blk_mq_map_queue(data->q, data->ctx->cpu);
+		data->hctx = blk_mq_map_queue_type(data->q,
+				data->hctx->flags & BLK_MQ_F_POLL_QUEUE,
+				data->ctx->cpu);
+		tags = blk_mq_tags_from_data(data);
 		if (data->flags & BLK_MQ_REQ_RESERVED) {
-			bt = &data->hctx->tags->breserved_tags;
+			bt = &tags->breserved_tags;
 		} else {
 			hctx = data->hctx;
-			bt = &hctx->tags->bitmap_tags;
+			bt = &tags->bitmap_tags;
 		}
 		finish_wait(&ws->wait, &wait);
 		ws = bt_wait_ptr(bt, hctx);
@@ -158,27 +163,28 @@ static int bt_get(struct blk_mq_alloc_data *data, struct sbitmap_queue *bt,
 
 static unsigned int __blk_mq_get_tag(struct blk_mq_alloc_data *data)
 {
+	struct blk_mq_tags *tags = blk_mq_tags_from_data(data);
 	int tag;
 
-	tag = bt_get(data, &data->hctx->tags->bitmap_tags, data->hctx,
-		     data->hctx->tags);
+	tag = bt_get(data, &tags->bitmap_tags, data->hctx, tags);
 	if (tag >= 0)
-		return tag + data->hctx->tags->nr_reserved_tags;
+		/* bt_get() may have moved us to another hctx */
+		return tag + blk_mq_tags_from_data(data)->nr_reserved_tags;
 
 	return BLK_MQ_TAG_FAIL;
 }
 
 static unsigned int __blk_mq_get_reserved_tag(struct blk_mq_alloc_data *data)
 {
+	struct blk_mq_tags *tags = blk_mq_tags_from_data(data);
 	int tag;
 
-	if (unlikely(!data->hctx->tags->nr_reserved_tags)) {
+	if (unlikely(!tags->nr_reserved_tags)) {
 		WARN_ON_ONCE(1);
 		return BLK_MQ_TAG_FAIL;
 	}
 
-	tag = bt_get(data, &data->hctx->tags->breserved_tags, NULL,
-		     data->hctx->tags);
+	tag = bt_get(data, &tags->breserved_tags, NULL, tags);
 	if (tag < 0)
 		return BLK_MQ_TAG_FAIL;
 
@@ -192,11 +198,9 @@ unsigned int blk_mq_get_tag(struct blk_mq_alloc_data *data)
 	return __blk_mq_get_tag(data);
 }
 
-void blk_mq_put_tag(struct blk_mq_hw_ctx *hctx, struct blk_mq_ctx *ctx,
-		    unsigned int tag)
+void blk_mq_put_tag(struct blk_mq_hw_ctx *hctx, struct blk_mq_tags *tags,
+		    struct blk_mq_ctx *ctx, unsigned int tag)
 {
-	struct blk_mq_tags *tags = hctx->tags;
-
 	if (tag >= tags->nr_reserved_tags) {
 		const int real_tag = tag - tags->nr_reserved_tags;
 
@@ -208,6 +212,26 @@ void blk_mq_put_tag(struct blk_mq_hw_ctx *hctx, struct blk_mq_ctx *ctx,
 	}
 }
 
+/*
+ * Free @nr regular (non-reserved) tags at once, @cpus holds the CPU of
+ * the software queue each tag was allocated for. @tags is used as scratch
+ * space and is clobbered.
+ */
+void blk_mq_put_tags(struct blk_mq_hw_ctx *hctx, unsigned int *tags,
+		     const unsigned int *cpus, unsigned int nr)
+{
+	struct blk_mq_tags *bt = hctx->tags;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		BUG_ON(tags[i] < bt->nr_reserved_tags);
+		tags[i] -= bt->nr_reserved_tags;
+		BUG_ON(tags[i] >= bt->nr_tags);
+	}
+
+	sbitmap_queue_clear_batch(&bt->bitmap_tags, tags, cpus, nr);
+}
+
 struct bt_iter_data {
 	struct blk_mq_hw_ctx *hctx;
 	busy_iter_fn *fn;
@@ -301,26 +325,52 @@ void blk_mq_tagset_busy_iter(struct blk_mq_tag_set *tagset,
 }
 EXPORT_SYMBOL(blk_mq_tagset_busy_iter);
 
+static int blk_mq_reinit_tags(struct blk_mq_tag_set *set,
+			      struct blk_mq_tags *tags)
+{
+	int i, ret;
+
+	for (i = 0; i < tags->nr_tags; i++) {
+		if (!tags->static_rqs[i])
+			continue;
+
+		ret = set->ops->reinit_request(set->driver_data,
+					tags->static_rqs[i]);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
 int blk_mq_reinit_tagset(struct blk_mq_tag_set *set)
 {
-	int i, j, ret = 0;
+	struct request_queue *q;
+	struct blk_mq_hw_ctx *hctx;
+	int i, ret = 0;
 
 	if (!set->ops->reinit_request)
 		goto out;
 
 	for (i = 0; i < set->nr_hw_queues; i++) {
-		struct blk_mq_tags *tags = set->tags[i];
+		ret = blk_mq_reinit_tags(set, set->tags[i]);
+		if (ret)
+			goto out;
+	}
 
-		for (j = 0; j < tags->nr_tags; j++) {
-			if (!tags->rqs[j])
+	/* requests parked in a scheduler carry a driver pdu as well */
+	mutex_lock(&set->tag_list_lock);
+	list_for_each_entry(q, &set->tag_list, tag_set_list) {
+		queue_for_each_hw_ctx(q, hctx, i) {
+			if (!hctx->sched_tags)
 				continue;
-
-			ret = set->ops->reinit_request(set->driver_data,
-						tags->rqs[j]);
+			ret = blk_mq_reinit_tags(set, hctx->sched_tags);
 			if (ret)
-				goto out;
+				break;
 		}
+		if (ret)
+			break;
 	}
+	mutex_unlock(&set->tag_list_lock);
 
 out:
 	return ret;
@@ -446,7 +496,7 @@ u32 blk_mq_unique_tag(struct request *rq)
 	int hwq = 0;
 
 	if (q->mq_ops) {
-		hctx = blk_mq_map_queue(q, rq->mq_ctx->cpu);
+		hctx = blk_mq_rq_hctx(rq);
 		hwq = hctx->queue_num;
 	}
 
@@ -30,6 +30,7 @@
 #include "blk.h"
 #include "blk-mq.h"
 #include "blk-mq-tag.h"
+#include "blk-mq-sched.h"
 #include "blk-stat.h"
 #include "blk-wbt.h"
 
@@ -41,7 +42,8 @@ static LIST_HEAD(all_q_list);
  */
 static bool blk_mq_hctx_has_pending(struct blk_mq_hw_ctx *hctx)
 {
-	return sbitmap_any_bit_set(&hctx->ctx_map);
+	return sbitmap_any_bit_set(&hctx->ctx_map) ||
+		blk_mq_sched_has_work(hctx);
 }
 
 /*
@@ -222,14 +224,24 @@ __blk_mq_alloc_request(struct blk_mq_alloc_data *data, unsigned int op)
 
 	tag = blk_mq_get_tag(data);
 	if (tag != BLK_MQ_TAG_FAIL) {
-		rq = data->hctx->tags->rqs[tag];
+		struct blk_mq_tags *tags = blk_mq_tags_from_data(data);
 
-		if (blk_mq_tag_busy(data->hctx)) {
-			rq->rq_flags = RQF_MQ_INFLIGHT;
-			atomic_inc(&data->hctx->nr_active);
+		rq = tags->static_rqs[tag];
+
+		if (data->flags & BLK_MQ_REQ_INTERNAL) {
+			/* the driver tag is only taken at dispatch */
+			rq->tag = -1;
+			rq->internal_tag = tag;
+		} else {
+			if (blk_mq_tag_busy(data->hctx)) {
+				rq->rq_flags = RQF_MQ_INFLIGHT;
+				atomic_inc(&data->hctx->nr_active);
+			}
+			rq->tag = tag;
+			rq->internal_tag = -1;
+			tags->rqs[tag] = rq;
 		}
 
-		rq->tag = tag;
 		blk_mq_rq_ctx_init(data->q, data->ctx, rq, op);
 		return rq;
 	}
@@ -322,18 +334,20 @@ EXPORT_SYMBOL_GPL(blk_mq_alloc_request_hctx);
 static void __blk_mq_free_request(struct blk_mq_hw_ctx *hctx,
 				  struct blk_mq_ctx *ctx, struct request *rq)
 {
-	const int tag = rq->tag;
 	struct request_queue *q = rq->q;
 
 	if (rq->rq_flags & RQF_MQ_INFLIGHT)
 		atomic_dec(&hctx->nr_active);
 
-	wbt_done(q->rq_wb, &rq->issue_stat);
+	wbt_done(q->rq_wb, rq);
 	rq->rq_flags = 0;
 
 	clear_bit(REQ_ATOM_STARTED, &rq->atomic_flags);
 	clear_bit(REQ_ATOM_POLL_SLEPT, &rq->atomic_flags);
-	blk_mq_put_tag(hctx, ctx, tag);
+	if (rq->tag != -1)
+		blk_mq_put_tag(hctx, hctx->tags, ctx, rq->tag);
+	if (rq->internal_tag != -1)
+		blk_mq_put_tag(hctx, hctx->sched_tags, ctx, rq->internal_tag);
 	blk_queue_exit(q);
 }
 
@@ -349,7 +363,7 @@ EXPORT_SYMBOL_GPL(blk_mq_free_hctx_request);
 
 void blk_mq_free_request(struct request *rq)
 {
-	blk_mq_free_hctx_request(blk_mq_map_queue(rq->q, rq->mq_ctx->cpu), rq);
+	blk_mq_free_hctx_request(blk_mq_rq_hctx(rq), rq);
 }
 EXPORT_SYMBOL_GPL(blk_mq_free_request);
 
@@ -358,7 +372,7 @@ inline void __blk_mq_end_request(struct request *rq, int error)
 	blk_account_io_done(rq);
 
 	if (rq->end_io) {
-		wbt_done(rq->q->rq_wb, &rq->issue_stat);
+		wbt_done(rq->q->rq_wb, rq);
 		rq->end_io(rq, error);
 	} else {
 		if (unlikely(blk_bidi_rq(rq)))
@@ -418,9 +432,12 @@ static void blk_mq_stat_add(struct request *rq)
 		 * to the local software queue.
 		 */
 		struct blk_mq_ctx *ctx;
+		u64 now = blk_stat_now();
 
 		ctx = __blk_mq_get_ctx(rq->q, raw_smp_processor_id());
-		blk_stat_add(&ctx->stat[rq_data_dir(rq)], rq);
+		blk_stat_add(&ctx->stat[rq_data_dir(rq)], rq, now);
+		blk_stat_hist_add(rq, now);
+		wbt_stat_add(rq->q->rq_wb, rq, now);
 	}
 }
 
@@ -457,6 +474,113 @@ void blk_mq_complete_request(struct request *rq, int error)
 }
 EXPORT_SYMBOL(blk_mq_complete_request);
 
+/**
+ * blk_mq_add_to_batch - queue a completed request for batched completion
+ * @rq:		the request being processed
+ * @batch:	batch collected by the caller
+ * @error:	completion status
+ *
+ * Description:
+ *	Marks @rq complete and adds it to @batch, to be ended later through
+ *	blk_mq_end_request_batch(). Only successful requests that would be
+ *	freed on completion qualify, for anything else %false is returned
+ *	and the driver must complete @rq through blk_mq_complete_request().
+ *	Batched requests end on the calling CPU and skip ->complete(), the
+ *	driver must do its per-request teardown before ending the batch.
+ **/
+bool blk_mq_add_to_batch(struct request *rq, struct blk_mq_comp_batch *batch,
+			 int error)
+{
+	if (error || rq->end_io || blk_bidi_rq(rq))
+		return false;
+
+	if (unlikely(blk_should_fake_timeout(rq->q)))
+		return true;
+	if (blk_mark_rq_complete(rq))
+		return true;
+
+	rq->errors = 0;
+	list_add_tail(&rq->queuelist, &batch->list);
+	batch->nr++;
+	return true;
+}
+EXPORT_SYMBOL_GPL(blk_mq_add_to_batch);
+
+#define BLK_MQ_BATCH_TAGS	32
+
+static void blk_mq_flush_tag_batch(struct blk_mq_hw_ctx *hctx,
+				   unsigned int *tags, const unsigned int *cpus,
+				   unsigned int nr)
+{
+	blk_mq_put_tags(hctx, tags, cpus, nr);
+	percpu_ref_put_many(&hctx->queue->q_usage_counter, nr);
+}
+
+/**
+ * blk_mq_end_request_batch - end all requests of a completion batch
+ * @batch:	requests collected through blk_mq_add_to_batch()
+ *
+ * Description:
+ *	Ends I/O on every request in @batch and frees them. Per request
+ *	this does what blk_mq_complete_request() and blk_mq_end_request()
+ *	would, but tags and queue references are released once per run of
+ *	requests sharing a hardware queue, which also batches the tag
+ *	waiter wakeups.
+ **/
+void blk_mq_end_request_batch(struct blk_mq_comp_batch *batch)
+{
+	struct blk_mq_hw_ctx *cur_hctx = NULL;
+	unsigned int tags[BLK_MQ_BATCH_TAGS], cpus[BLK_MQ_BATCH_TAGS];
+	unsigned int nr_tags = 0;
+	struct request *rq, *next;
+
+	list_for_each_entry_safe(rq, next, &batch->list, queuelist) {
+		struct request_queue *q = rq->q;
+		struct blk_mq_ctx *ctx = rq->mq_ctx;
+		struct blk_mq_hw_ctx *hctx = blk_mq_rq_hctx(rq);
+
+		list_del_init(&rq->queuelist);
+
+		blk_mq_stat_add(rq);
+		if (blk_update_request(rq, 0, blk_rq_bytes(rq)))
+			BUG();
+		blk_account_io_done(rq);
+
+		/* __blk_mq_free_request(), minus the tag and queue reference */
+		if (rq->rq_flags & RQF_MQ_INFLIGHT)
+			atomic_dec(&hctx->nr_active);
+		wbt_done(q->rq_wb, rq);
+		rq->rq_flags = 0;
+		clear_bit(REQ_ATOM_STARTED, &rq->atomic_flags);
+		clear_bit(REQ_ATOM_POLL_SLEPT, &rq->atomic_flags);
+		ctx->rq_completed[rq_is_sync(rq)]++;
+
+		if (rq->internal_tag != -1)
+			blk_mq_put_tag(hctx, hctx->sched_tags, ctx,
+				       rq->internal_tag);
+
+		if (rq->tag < hctx->tags->nr_reserved_tags) {
+			blk_mq_put_tag(hctx, hctx->tags, ctx, rq->tag);
+			blk_queue_exit(q);
+			continue;
+		}
+
+		if (nr_tags && (hctx != cur_hctx ||
+				nr_tags == ARRAY_SIZE(tags))) {
+			blk_mq_flush_tag_batch(cur_hctx, tags, cpus, nr_tags);
+			nr_tags = 0;
+		}
+		cur_hctx = hctx;
+		cpus[nr_tags] = ctx->cpu;
+		tags[nr_tags++] = rq->tag;
+	}
+
+	if (nr_tags)
+		blk_mq_flush_tag_batch(cur_hctx, tags, cpus, nr_tags);
+	batch->nr = 0;
+}
+EXPORT_SYMBOL_GPL(blk_mq_end_request_batch);
+
 int blk_mq_request_started(struct request *rq)
 {
 	return test_bit(REQ_ATOM_STARTED, &rq->atomic_flags);
@@ -525,6 +649,7 @@ static void __blk_mq_requeue_request(struct request *rq)
 void blk_mq_requeue_request(struct request *rq, bool kick_requeue_list)
 {
 	__blk_mq_requeue_request(rq);
+	blk_mq_put_driver_tag(rq);
 
 	BUG_ON(blk_queued_rq(rq));
 	blk_mq_add_to_requeue_list(rq, true, kick_requeue_list);
@@ -821,6 +946,94 @@ static inline unsigned int queued_to_index(unsigned int queued)
 	return min(BLK_MQ_MAX_DISPATCH_ORDER - 1, ilog2(queued) + 1);
 }
 
+/*
+ * Requests allocated from the scheduler tags only get a driver tag once
+ * they are dispatched.
+ */
+static bool blk_mq_get_driver_tag(struct blk_mq_hw_ctx *hctx,
+				  struct request *rq)
+{
+	struct blk_mq_alloc_data data;
+
+	if (rq->tag != -1)
+		return true;
+
+	blk_mq_set_alloc_data(&data, rq->q, BLK_MQ_REQ_NOWAIT, rq->mq_ctx,
+			      hctx);
+	rq->tag = blk_mq_get_tag(&data);
+	if (rq->tag == BLK_MQ_TAG_FAIL) {
+		rq->tag = -1;
+		return false;
+	}
+
+	if (blk_mq_tag_busy(hctx)) {
+		rq->rq_flags |= RQF_MQ_INFLIGHT;
+		atomic_inc(&hctx->nr_active);
+	}
+	hctx->tags->rqs[rq->tag] = rq;
+	return true;
+}
+
+static void __blk_mq_put_driver_tag(struct blk_mq_hw_ctx *hctx,
+				    struct request *rq)
+{
+	blk_mq_put_tag(hctx, hctx->tags, rq->mq_ctx, rq->tag);
+	rq->tag = -1;
+
+	if (rq->rq_flags & RQF_MQ_INFLIGHT) {
+		rq->rq_flags &= ~RQF_MQ_INFLIGHT;
+		atomic_dec(&hctx->nr_active);
+	}
+}
+
+/*
+ * Give back the driver tag of a request that still holds a scheduler tag.
+ * Requests without a scheduler tag keep theirs until they are freed.
+ */
+void blk_mq_put_driver_tag(struct request *rq)
+{
+	if (rq->tag == -1 || rq->internal_tag == -1)
+		return;
+
+	__blk_mq_put_driver_tag(blk_mq_rq_hctx(rq), rq);
+}
+
+static int blk_mq_dispatch_wake(wait_queue_t *wait, unsigned mode, int flags,
+				void *key)
+{
+	struct blk_mq_hw_ctx *hctx;
+
+	hctx = container_of(wait, struct blk_mq_hw_ctx, dispatch_wait);
+
+	list_del_init(&wait->task_list);
+	clear_bit_unlock(BLK_MQ_S_TAG_WAITING, &hctx->state);
+	blk_mq_run_hw_queue(hctx, true);
+	return 1;
+}
+
+/*
+ * Out of driver tags: get the hardware queue rerun when one is freed.
+ * Returns false if a wakeup is already pending.
+ */
+static bool blk_mq_dispatch_wait_add(struct blk_mq_hw_ctx *hctx)
+{
+	struct sbq_wait_state *ws;
+
+	if (test_and_set_bit_lock(BLK_MQ_S_TAG_WAITING, &hctx->state))
+		return false;
+
+	init_waitqueue_func_entry(&hctx->dispatch_wait, blk_mq_dispatch_wake);
+	ws = bt_wait_ptr(&hctx->tags->bitmap_tags, hctx);
+	hctx->dispatch_wait_head = &ws->wait;
+
+	/*
+	 * As soon as this returns, it's no longer safe to fiddle with
+	 * hctx->dispatch_wait, since a completion can wake us up.
+	 */
+	add_wait_queue(&ws->wait, &hctx->dispatch_wait);
+	return true;
+}
+
 bool blk_mq_dispatch_rq_list(struct blk_mq_hw_ctx *hctx, struct list_head *list)
 {
 	struct request_queue *q = hctx->queue;
@@ -828,6 +1041,7 @@ bool blk_mq_dispatch_rq_list(struct blk_mq_hw_ctx *hctx, struct list_head *list)
 	LIST_HEAD(driver_list);
 	struct list_head *dptr;
 	int queued, ret = BLK_MQ_RQ_QUEUE_OK;
+	bool no_tag = false;
 
 	/*
 	 * Start off with dptr being NULL, so we start the first request
@@ -843,6 +1057,18 @@ bool blk_mq_dispatch_rq_list(struct blk_mq_hw_ctx *hctx, struct list_head *list)
 		struct blk_mq_queue_data bd;
 
 		rq = list_first_entry(list, struct request, queuelist);
+		if (!blk_mq_get_driver_tag(hctx, rq)) {
+			/*
+			 * Leave the rest on hctx->dispatch and have a freed
+			 * tag rerun the queue. Retry once in case the last
+			 * tag was freed before we were on the wait queue.
+			 */
+			if (!blk_mq_dispatch_wait_add(hctx) ||
+			    !blk_mq_get_driver_tag(hctx, rq)) {
+				no_tag = true;
+				break;
+			}
+		}
 		list_del_init(&rq->queuelist);
 
 		bd.rq = rq;
@@ -857,6 +1083,7 @@ bool blk_mq_dispatch_rq_list(struct blk_mq_hw_ctx *hctx, struct list_head *list)
 		case BLK_MQ_RQ_QUEUE_BUSY:
 			list_add(&rq->queuelist, list);
 			__blk_mq_requeue_request(rq);
+			blk_mq_put_driver_tag(rq);
 			break;
 		default:
 			pr_err("blk-mq: bad return on queue: %d\n", ret);
@@ -896,11 +1123,14 @@ bool blk_mq_dispatch_rq_list(struct blk_mq_hw_ctx *hctx, struct list_head *list)
 		 * the requests in rq_list might get lost.
 		 *
 		 * blk_mq_run_hw_queue() already checks the STOPPED bit
+		 *
+		 * Without a driver tag, the tag wait queue reruns us instead.
 		 **/
-		blk_mq_run_hw_queue(hctx, true);
+		if (!no_tag)
+			blk_mq_run_hw_queue(hctx, true);
 	}
 
-	return ret != BLK_MQ_RQ_QUEUE_BUSY;
+	return ret != BLK_MQ_RQ_QUEUE_BUSY && !no_tag;
 }
 
 /*
@@ -935,7 +1165,11 @@ static void blk_mq_process_rq_list(struct blk_mq_hw_ctx *hctx)
 		spin_unlock(&hctx->lock);
 	}
 
-	blk_mq_dispatch_rq_list(hctx, &rq_list);
+	/* the scheduler holds no requests for poll queues */
+	if (hctx->queue->elevator && !(hctx->flags & BLK_MQ_F_POLL_QUEUE))
+		blk_mq_sched_dispatch_requests(hctx, &rq_list);
+	else
+		blk_mq_dispatch_rq_list(hctx, &rq_list);
 }
 
 static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
@@ -1007,9 +1241,9 @@ void blk_mq_run_hw_queues(struct request_queue *q, bool async)
 	int i;
 
 	queue_for_each_hw_ctx(q, hctx, i) {
-		if ((!blk_mq_hctx_has_pending(hctx) &&
-		    list_empty_careful(&hctx->dispatch)) ||
-		    blk_mq_hctx_stopped(hctx))
+		if (blk_mq_hctx_stopped(hctx) ||
+		    (!blk_mq_hctx_has_pending(hctx) &&
+		     list_empty_careful(&hctx->dispatch)))
 			continue;
 
 		blk_mq_run_hw_queue(hctx, async);
@@ -1150,12 +1384,21 @@ void blk_mq_insert_request(struct request *rq, bool at_head, bool run_queue,
 			   bool async)
 {
 	struct blk_mq_ctx *ctx = rq->mq_ctx;
-	struct request_queue *q = rq->q;
-	struct blk_mq_hw_ctx *hctx = blk_mq_map_queue(q, ctx->cpu);
+	struct blk_mq_hw_ctx *hctx = blk_mq_rq_hctx(rq);
 
-	spin_lock(&ctx->lock);
-	__blk_mq_insert_request(hctx, rq, at_head);
-	spin_unlock(&ctx->lock);
+	if (unlikely(hctx->flags & BLK_MQ_F_POLL_QUEUE)) {
+		/* no software queue feeds a poll queue */
+		spin_lock(&hctx->lock);
+		if (at_head)
+			list_add(&rq->queuelist, &hctx->dispatch);
+		else
+			list_add_tail(&rq->queuelist, &hctx->dispatch);
+		spin_unlock(&hctx->lock);
+	} else {
+		spin_lock(&ctx->lock);
+		__blk_mq_insert_request(hctx, rq, at_head);
+		spin_unlock(&ctx->lock);
+	}
 
 	if (run_queue)
 		blk_mq_run_hw_queue(hctx, async);
@@ -1172,6 +1415,11 @@ static void blk_mq_insert_requests(struct request_queue *q,
 
 	trace_block_unplug(q, depth, !from_schedule);
 
+	if (q->elevator) {
+		blk_mq_sched_insert_requests(hctx, list, from_schedule);
+		return;
+	}
+
 	/*
 	 * preemption doesn't flush plug list, so it's possible ctx->cpu is
 	 * offline now
@@ -1297,27 +1545,70 @@ static struct request *blk_mq_map_request(struct request_queue *q,
 
 	blk_queue_enter_live(q);
 	ctx = blk_mq_get_ctx(q);
-	hctx = blk_mq_map_queue(q, ctx->cpu);
+	hctx = blk_mq_map_queue_type(q, bio->bi_opf & REQ_HIPRI, ctx->cpu);
 
 	trace_block_getrq(q, bio, bio->bi_opf);
-	blk_mq_set_alloc_data(data, q, 0, ctx, hctx);
+	/* the scheduler holds no requests for poll queues */
+	blk_mq_set_alloc_data(data, q,
+			q->elevator && !(hctx->flags & BLK_MQ_F_POLL_QUEUE) ?
+			BLK_MQ_REQ_INTERNAL : 0, ctx, hctx);
 	rq = __blk_mq_alloc_request(data, bio->bi_opf);
 
 	data->hctx->queued++;
 	return rq;
 }
 
+static blk_qc_t request_to_qc_t(struct blk_mq_hw_ctx *hctx,
+				struct request *rq)
+{
+	if (rq->tag != -1)
+		return blk_tag_to_qc_t(rq->tag, hctx->queue_num);
+
+	return blk_tag_to_qc_t(rq->internal_tag, hctx->queue_num) |
+			BLK_QC_T_INTERNAL;
+}
+
+/*
+ * Add @rq to the task plug, flushing the plug first if it already holds
+ * enough. @request_count is the number of requests of @q already plugged.
+ */
+static void blk_mq_plug_request(struct request_queue *q,
+				struct blk_plug *plug, struct request *rq,
+				unsigned int request_count)
+{
+	struct request *last = NULL;
+
+	/*
+	 * @request_count may become stale because of schedule
+	 * out, so check the list again.
+	 */
+	if (list_empty(&plug->mq_list))
+		request_count = 0;
+	if (!request_count)
+		trace_block_plug(q);
+	else
+		last = list_entry_rq(plug->mq_list.prev);
+
+	if (request_count >= BLK_MAX_REQUEST_COUNT || (last &&
+	    blk_rq_bytes(last) >= BLK_PLUG_FLUSH_SIZE)) {
+		blk_flush_plug_list(plug, false);
+		trace_block_plug(q);
+	}
+
+	list_add_tail(&rq->queuelist, &plug->mq_list);
+}
+
 static void blk_mq_try_issue_directly(struct request *rq, blk_qc_t *cookie)
 {
 	int ret;
 	struct request_queue *q = rq->q;
-	struct blk_mq_hw_ctx *hctx = blk_mq_map_queue(q, rq->mq_ctx->cpu);
+	struct blk_mq_hw_ctx *hctx = blk_mq_rq_hctx(rq);
 	struct blk_mq_queue_data bd = {
 		.rq = rq,
 		.list = NULL,
 		.last = 1
 	};
-	blk_qc_t new_cookie = blk_tag_to_qc_t(rq->tag, hctx->queue_num);
+	blk_qc_t new_cookie = request_to_qc_t(hctx, rq);
 
 	if (blk_mq_hctx_stopped(hctx))
 		goto insert;
@@ -1361,6 +1652,7 @@ static blk_qc_t blk_mq_make_request(struct request_queue *q, struct bio *bio)
 	struct blk_plug *plug;
 	struct request *same_queue_rq = NULL;
 	blk_qc_t cookie;
+	struct blkcg_gq *wb_blkg;
 	unsigned int wb_acct;
 
 	blk_queue_bounce(q, &bio);
@@ -1372,21 +1664,36 @@ static blk_qc_t blk_mq_make_request(struct request_queue *q, struct bio *bio)
 
 	blk_queue_split(q, &bio, q->bio_split);
 
-	if (!is_flush_fua && !blk_queue_nomerges(q) &&
-	    blk_attempt_plug_merge(q, bio, &request_count, &same_queue_rq))
+	if (!is_flush_fua && !blk_queue_nomerges(q)) {
+		if (blk_attempt_plug_merge(q, bio, &request_count,
+					   &same_queue_rq))
+			return BLK_QC_T_NONE;
+	} else
+		request_count = blk_plug_queued_count(q);
+
+	if (!is_flush_fua && blk_mq_sched_bio_merge(q, bio))
 		return BLK_QC_T_NONE;
 
-	wb_acct = wbt_wait(q->rq_wb, bio, NULL);
+	/*
+	 * Only plain reads and writes whose submitter is going to poll for
+	 * them may take a poll queue, nothing else would ever reap them.
+	 */
+	if ((bio->bi_opf & REQ_HIPRI) &&
+	    (is_flush_fua || !q->poll_map ||
+	     !test_bit(QUEUE_FLAG_POLL, &q->queue_flags)))
+		bio->bi_opf &= ~REQ_HIPRI;
+
+	wb_acct = wbt_wait(q->rq_wb, bio, NULL, &wb_blkg);
 
 	rq = blk_mq_map_request(q, bio, &data);
 	if (unlikely(!rq)) {
-		__wbt_done(q->rq_wb, wb_acct);
+		__wbt_done(q->rq_wb, wb_acct, wb_blkg);
 		return BLK_QC_T_NONE;
 	}
 
-	wbt_track(&rq->issue_stat, wb_acct);
+	wbt_track(rq, wb_acct, wb_blkg);
 
-	cookie = blk_tag_to_qc_t(rq->tag, data.hctx->queue_num);
+	cookie = request_to_qc_t(data.hctx, rq);
 
 	if (unlikely(is_flush_fua)) {
 		blk_mq_bio_to_request(rq, bio);
@@ -1395,6 +1702,41 @@ static blk_qc_t blk_mq_make_request(struct request_queue *q, struct bio *bio)
 	}
 
 	plug = current->plug;
+
+	/*
+	 * A poll queue has no software queues and no scheduler, the request
+	 * goes straight to the driver and its submitter is waiting for it.
+	 */
+	if (data.hctx->flags & BLK_MQ_F_POLL_QUEUE) {
+		blk_mq_bio_to_request(rq, bio);
+		blk_mq_put_ctx(data.ctx);
+		if (!(data.hctx->flags & BLK_MQ_F_BLOCKING)) {
+			rcu_read_lock();
+			blk_mq_try_issue_directly(rq, &cookie);
+			rcu_read_unlock();
+		} else {
+			srcu_idx = srcu_read_lock(&data.hctx->queue_rq_srcu);
+			blk_mq_try_issue_directly(rq, &cookie);
+			srcu_read_unlock(&data.hctx->queue_rq_srcu, srcu_idx);
+		}
+		goto done;
+	}
+
+	/*
+	 * With a scheduler attached, leave sorting, merging and the choice
+	 * of when to issue to it. Plugged requests reach it in one batch
+	 * when the plug is flushed.
+	 */
+	if (q->elevator) {
+		blk_mq_bio_to_request(rq, bio);
+		blk_mq_put_ctx(data.ctx);
+		if (plug)
+			blk_mq_plug_request(q, plug, rq, request_count);
+		else
+			blk_mq_sched_insert_request(rq, false, true, !is_sync);
+		goto done;
+	}
+
 	/*
 	 * If the driver supports defer issued based on 'last', then
 	 * queue it up like normal since we can potentially save some
@@ -1468,6 +1810,7 @@ static blk_qc_t blk_sq_make_request(struct request_queue *q, struct bio *bio)
 	struct blk_mq_alloc_data data;
 	struct request *rq;
 	blk_qc_t cookie;
+	struct blkcg_gq *wb_blkg;
 	unsigned int wb_acct;
 
 	blk_queue_bounce(q, &bio);
@@ -1485,17 +1828,20 @@ static blk_qc_t blk_sq_make_request(struct request_queue *q, struct bio *bio)
 	} else
 		request_count = blk_plug_queued_count(q);
 
-	wb_acct = wbt_wait(q->rq_wb, bio, NULL);
+	if (!is_flush_fua && blk_mq_sched_bio_merge(q, bio))
+		return BLK_QC_T_NONE;
+
+	wb_acct = wbt_wait(q->rq_wb, bio, NULL, &wb_blkg);
 
 	rq = blk_mq_map_request(q, bio, &data);
 	if (unlikely(!rq)) {
-		__wbt_done(q->rq_wb, wb_acct);
+		__wbt_done(q->rq_wb, wb_acct, wb_blkg);
 		return BLK_QC_T_NONE;
 	}
 
-	wbt_track(&rq->issue_stat, wb_acct);
+	wbt_track(rq, wb_acct, wb_blkg);
 
-	cookie = blk_tag_to_qc_t(rq->tag, data.hctx->queue_num);
+	cookie = request_to_qc_t(data.hctx, rq);
 
 	if (unlikely(is_flush_fua)) {
 		blk_mq_bio_to_request(rq, bio);
@@ -1510,30 +1856,16 @@ static blk_qc_t blk_sq_make_request(struct request_queue *q, struct bio *bio)
 	 */
 	plug = current->plug;
 	if (plug) {
-		struct request *last = NULL;
-
 		blk_mq_bio_to_request(rq, bio);
-
-		/*
-		 * @request_count may become stale because of schedule
-		 * out, so check the list again.
-		 */
-		if (list_empty(&plug->mq_list))
-			request_count = 0;
-		if (!request_count)
-			trace_block_plug(q);
-		else
-			last = list_entry_rq(plug->mq_list.prev);
-
 		blk_mq_put_ctx(data.ctx);
+		blk_mq_plug_request(q, plug, rq, request_count);
+		return cookie;
+	}
 
-		if (request_count >= BLK_MAX_REQUEST_COUNT || (last &&
-		    blk_rq_bytes(last) >= BLK_PLUG_FLUSH_SIZE)) {
-			blk_flush_plug_list(plug, false);
-			trace_block_plug(q);
-		}
-
-		list_add_tail(&rq->queuelist, &plug->mq_list);
+	if (q->elevator) {
+		blk_mq_bio_to_request(rq, bio);
+		blk_mq_put_ctx(data.ctx);
+		blk_mq_sched_insert_request(rq, false, true, !is_sync);
 		return cookie;
 	}
 
@@ -1552,20 +1884,20 @@ run_queue:
 	return cookie;
 }
 
-static void blk_mq_free_rq_map(struct blk_mq_tag_set *set,
-		struct blk_mq_tags *tags, unsigned int hctx_idx)
+void blk_mq_free_rq_map(struct blk_mq_tag_set *set, struct blk_mq_tags *tags,
+		unsigned int hctx_idx)
 {
 	struct page *page;
 
-	if (tags->rqs && set->ops->exit_request) {
+	if (tags->static_rqs && set->ops->exit_request) {
 		int i;
 
 		for (i = 0; i < tags->nr_tags; i++) {
-			if (!tags->rqs[i])
+			if (!tags->static_rqs[i])
 				continue;
-			set->ops->exit_request(set->driver_data, tags->rqs[i],
-						hctx_idx, i);
-			tags->rqs[i] = NULL;
+			set->ops->exit_request(set->driver_data,
+					tags->static_rqs[i], hctx_idx, i);
+			tags->static_rqs[i] = NULL;
 		}
 	}
 
@@ -1581,6 +1913,7 @@ static void blk_mq_free_rq_map(struct blk_mq_tag_set *set,
 	}
 
 	kfree(tags->rqs);
+	kfree(tags->static_rqs);
 
 	blk_mq_free_tags(tags);
 }
@@ -1590,22 +1923,27 @@ static size_t order_to_size(unsigned int order)
 	return (size_t)PAGE_SIZE << order;
 }
 
-static struct blk_mq_tags *blk_mq_init_rq_map(struct blk_mq_tag_set *set,
-		unsigned int hctx_idx)
+/*
+ * Allocate a tag map of @depth tags and the requests that go with them.
+ * Used for the driver tags of a tag set and for the scheduler tags of a
+ * hardware queue.
+ */
+struct blk_mq_tags *blk_mq_init_rq_map(struct blk_mq_tag_set *set,
+		unsigned int hctx_idx, unsigned int depth,
+		unsigned int reserved_tags)
 {
 	struct blk_mq_tags *tags;
 	unsigned int i, j, entries_per_page, max_order = 4;
 	size_t rq_size, left;
 
-	tags = blk_mq_init_tags(set->queue_depth, set->reserved_tags,
-				set->numa_node,
+	tags = blk_mq_init_tags(depth, reserved_tags, set->numa_node,
 				BLK_MQ_FLAG_TO_ALLOC_POLICY(set->flags));
 	if (!tags)
 		return NULL;
 
 	INIT_LIST_HEAD(&tags->page_list);
 
-	tags->rqs = kzalloc_node(set->queue_depth * sizeof(struct request *),
+	tags->rqs = kzalloc_node(depth * sizeof(struct request *),
 				 GFP_NOIO | __GFP_NOWARN | __GFP_NORETRY,
 				 set->numa_node);
 	if (!tags->rqs) {
@@ -1613,15 +1951,24 @@ static struct blk_mq_tags *blk_mq_init_rq_map(struct blk_mq_tag_set *set,
 		return NULL;
 	}
 
+	tags->static_rqs = kzalloc_node(depth * sizeof(struct request *),
+				GFP_NOIO | __GFP_NOWARN | __GFP_NORETRY,
+				set->numa_node);
+	if (!tags->static_rqs) {
+		kfree(tags->rqs);
+		blk_mq_free_tags(tags);
+		return NULL;
+	}
+
 	/*
 	 * rq_size is the size of the request plus driver payload, rounded
 	 * to the cacheline size
 	 */
 	rq_size = round_up(sizeof(struct request) + set->cmd_size,
 				cache_line_size());
-	left = rq_size * set->queue_depth;
+	left = rq_size * depth;
 
-	for (i = 0; i < set->queue_depth; ) {
+	for (i = 0; i < depth; ) {
 		int this_order = max_order;
 		struct page *page;
 		int to_do;
@@ -1655,18 +2002,22 @@ static struct blk_mq_tags *blk_mq_init_rq_map(struct blk_mq_tag_set *set,
 		 */
 		kmemleak_alloc(p, order_to_size(this_order), 1, GFP_NOIO);
 		entries_per_page = order_to_size(this_order) / rq_size;
-		to_do = min(entries_per_page, set->queue_depth - i);
+		to_do = min(entries_per_page, depth - i);
 		left -= to_do * rq_size;
 		for (j = 0; j < to_do; j++) {
-			tags->rqs[i] = p;
+			struct request *rq = p;
+
+			tags->static_rqs[i] = rq;
 			if (set->ops->init_request) {
 				if (set->ops->init_request(set->driver_data,
-						tags->rqs[i], hctx_idx, i,
+						rq, hctx_idx, i,
 						set->numa_node)) {
-					tags->rqs[i] = NULL;
+					tags->static_rqs[i] = NULL;
 					goto fail;
 				}
 			}
+			/* until the tag is first handed out */
+			tags->rqs[i] = rq;
 
 			p += rq_size;
 			i++;
@@ -1732,6 +2083,19 @@ static void blk_mq_exit_hctx(struct request_queue *q,
 {
 	unsigned flush_start_tag = set->queue_depth;
 
+	/* the driver tags may be shared, don't get woken up after this */
+	if (test_bit(BLK_MQ_S_TAG_WAITING, &hctx->state)) {
+		wait_queue_head_t *wq = hctx->dispatch_wait_head;
+
+		spin_lock_irq(&wq->lock);
+		list_del_init(&hctx->dispatch_wait.task_list);
+		spin_unlock_irq(&wq->lock);
+		clear_bit_unlock(BLK_MQ_S_TAG_WAITING, &hctx->state);
+	}
+
+	/* scheduler requests were set up by the driver, free them first */
+	blk_mq_sched_exit_hctx(q, hctx, hctx_idx);
+
 	blk_mq_tag_idle(hctx);
 
 	if (set->ops->exit_request)
@@ -1788,6 +2152,7 @@ static int blk_mq_init_hctx(struct request_queue *q,
 	INIT_DELAYED_WORK(&hctx->delay_work, blk_mq_delay_work_fn);
 	spin_lock_init(&hctx->lock);
 	INIT_LIST_HEAD(&hctx->dispatch);
+	INIT_LIST_HEAD(&hctx->dispatch_wait.task_list);
 	hctx->queue = q;
 	hctx->queue_num = hctx_idx;
 	hctx->flags = set->flags & ~BLK_MQ_F_TAG_SHARED;
@@ -1827,11 +2192,19 @@ static int blk_mq_init_hctx(struct request_queue *q,
 				   flush_start_tag + hctx_idx, node))
 		goto free_fq;
 
+	if (blk_mq_sched_init_hctx(q, hctx, hctx_idx))
+		goto exit_request;
+
 	if (hctx->flags & BLK_MQ_F_BLOCKING)
 		init_srcu_struct(&hctx->queue_rq_srcu);
 
 	return 0;
 
+ exit_request:
+	if (set->ops->exit_request)
+		set->ops->exit_request(set->driver_data,
+				       hctx->fq->flush_rq, hctx_idx,
+				       flush_start_tag + hctx_idx);
  free_fq:
 	kfree(hctx->fq);
  exit_hctx:
@@ -1886,15 +2259,48 @@ static void blk_mq_map_swqueue(struct request_queue *q,
 	struct blk_mq_hw_ctx *hctx;
 	struct blk_mq_ctx *ctx;
 	struct blk_mq_tag_set *set = q->tag_set;
+	unsigned int first_poll = set->nr_hw_queues - set->nr_poll_queues;
+	bool poll;
 
 	/*
 	 * Avoid others reading imcomplete hctx->cpumask through sysfs
 	 */
 	mutex_lock(&q->sysfs_lock);
 
+	/*
+	 * Poll queues have no software queues mapped, they are only reached
+	 * through q->poll_map.  Should we be short of hardware contexts or
+	 * tags for them, fall back to the interrupt driven queues.
+	 */
+	poll = set->nr_poll_queues && q->nr_hw_queues == set->nr_hw_queues;
+	for (i = first_poll; poll && i < set->nr_hw_queues; i++) {
+		if (!set->tags[i])
+			set->tags[i] = blk_mq_init_rq_map(set, i,
+					set->queue_depth, set->reserved_tags);
+		if (!set->tags[i])
+			poll = false;
+	}
+	q->poll_map = poll ? set->poll_map : NULL;
+
 	queue_for_each_hw_ctx(q, hctx, i) {
 		cpumask_clear(hctx->cpumask);
 		hctx->nr_ctx = 0;
+		if (poll && i >= first_poll)
+			hctx->flags |= BLK_MQ_F_POLL_QUEUE;
+		else
+			hctx->flags &= ~BLK_MQ_F_POLL_QUEUE;
+	}
+
+	/*
+	 * Poll queues bypass the scheduler, drop their scheduler tags. A
+	 * queue that no longer polls needs them back, if that fails its
+	 * CPUs are moved to hctx 0 below, as for missing driver tags.
+	 */
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (hctx->flags & BLK_MQ_F_POLL_QUEUE)
+			blk_mq_sched_exit_hctx(q, hctx, i);
+		else if (q->elevator && !hctx->sched_tags)
+			blk_mq_sched_init_hctx(q, hctx, i);
 	}
 
 	/*
@@ -1908,7 +2314,9 @@ static void blk_mq_map_swqueue(struct request_queue *q,
 		hctx_idx = q->mq_map[i];
 		/* unmapped hw queue can be remapped after CPU topo changed */
 		if (!set->tags[hctx_idx]) {
-			set->tags[hctx_idx] = blk_mq_init_rq_map(set, hctx_idx);
+			set->tags[hctx_idx] = blk_mq_init_rq_map(set,
+					hctx_idx, set->queue_depth,
+					set->reserved_tags);
 
 			/*
 			 * If tags initialization fail for some hctx,
@@ -1919,6 +2327,8 @@ static void blk_mq_map_swqueue(struct request_queue *q,
 			if (!set->tags[hctx_idx])
 				q->mq_map[i] = 0;
 		}
+		if (q->elevator && !q->queue_hw_ctx[q->mq_map[i]]->sched_tags)
+			q->mq_map[i] = 0;
 
 		ctx = per_cpu_ptr(q->queue_ctx, i);
 		hctx = blk_mq_map_queue(q, i);
@@ -1926,11 +2336,26 @@ static void blk_mq_map_swqueue(struct request_queue *q,
 		cpumask_set_cpu(i, hctx->cpumask);
 		ctx->index_hw = hctx->nr_ctx;
 		hctx->ctxs[hctx->nr_ctx++] = ctx;
+
+		if (q->poll_map)
+			cpumask_set_cpu(i,
+				q->queue_hw_ctx[q->poll_map[i]]->cpumask);
 	}
 
 	mutex_unlock(&q->sysfs_lock);
 
 	queue_for_each_hw_ctx(q, hctx, i) {
+		if (hctx->flags & BLK_MQ_F_POLL_QUEUE) {
+			hctx->tags = set->tags[i];
+			/* all of its CPUs went offline, run it anywhere */
+			if (cpumask_empty(hctx->cpumask))
+				cpumask_copy(hctx->cpumask, online_mask);
+			sbitmap_resize(&hctx->ctx_map, 0);
+			hctx->next_cpu = cpumask_first(hctx->cpumask);
+			hctx->next_cpu_batch = BLK_MQ_CPU_WORK_BATCH;
+			continue;
+		}
+
 		/*
 		 * If no software queues are mapped to this hardware queue,
 		 * disable it and free the request entries.
@@ -2045,11 +2470,14 @@ void blk_mq_release(struct request_queue *q)
 	}
 
 	q->mq_map = NULL;
+	q->poll_map = NULL;
 
 	kfree(q->queue_hw_ctx);
 
 	/* ctx kobj stays in queue_ctx */
 	free_percpu(q->queue_ctx);
+
+	blk_stat_hist_free(q);
 }
 
 struct request_queue *blk_mq_init_queue(struct blk_mq_tag_set *set)
@@ -2311,7 +2739,8 @@ static int __blk_mq_alloc_rq_maps(struct blk_mq_tag_set *set)
 	int i;
 
 	for (i = 0; i < set->nr_hw_queues; i++) {
-		set->tags[i] = blk_mq_init_rq_map(set, i);
+		set->tags[i] = blk_mq_init_rq_map(set, i,
+					set->queue_depth, set->reserved_tags);
 		if (!set->tags[i])
 			goto out_unwind;
 	}
@@ -2360,6 +2789,20 @@ static int blk_mq_alloc_rq_maps(struct blk_mq_tag_set *set)
 	return 0;
 }
 
+static int blk_mq_update_queue_map(struct blk_mq_tag_set *set)
+{
+	int ret;
+
+	if (set->ops->map_queues)
+		ret = set->ops->map_queues(set);
+	else
+		ret = blk_mq_map_queues(set);
+	if (ret || !set->nr_poll_queues)
+		return ret;
+
+	return blk_mq_map_poll_queues(set);
+}
+
 /*
  * Alloc a tag set to be associated with one or more request queues.
  * May fail with EINVAL for various error conditions. May adjust the
@@ -2402,6 +2845,11 @@ int blk_mq_alloc_tag_set(struct blk_mq_tag_set *set)
 	 */
 	if (set->nr_hw_queues > nr_cpu_ids)
 		set->nr_hw_queues = nr_cpu_ids;
+	/*
+	 * At least one queue has to be left for interrupt driven I/O.
+	 */
+	if (set->nr_poll_queues >= set->nr_hw_queues)
+		set->nr_poll_queues = 0;
 
 	set->tags = kzalloc_node(nr_cpu_ids * sizeof(struct blk_mq_tags *),
 				 GFP_KERNEL, set->numa_node);
@@ -2414,10 +2862,13 @@ int blk_mq_alloc_tag_set(struct blk_mq_tag_set *set)
 	if (!set->mq_map)
 		goto out_free_tags;
 
-	if (set->ops->map_queues)
-		ret = set->ops->map_queues(set);
-	else
-		ret = blk_mq_map_queues(set);
+	/* always there, poll queues may be added by an update later */
+	set->poll_map = kzalloc_node(sizeof(*set->poll_map) * nr_cpu_ids,
+			GFP_KERNEL, set->numa_node);
+	if (!set->poll_map)
+		goto out_free_mq_map;
+
+	ret = blk_mq_update_queue_map(set);
 	if (ret)
 		goto out_free_mq_map;
 
@@ -2431,6 +2882,8 @@ int blk_mq_alloc_tag_set(struct blk_mq_tag_set *set)
 	return 0;
 
 out_free_mq_map:
+	kfree(set->poll_map);
+	set->poll_map = NULL;
 	kfree(set->mq_map);
 	set->mq_map = NULL;
 out_free_tags:
@@ -2449,6 +2902,8 @@ void blk_mq_free_tag_set(struct blk_mq_tag_set *set)
 			blk_mq_free_rq_map(set, set->tags[i], i);
 	}
 
+	kfree(set->poll_map);
+	set->poll_map = NULL;
 	kfree(set->mq_map);
 	set->mq_map = NULL;
 
@@ -2463,14 +2918,25 @@ int blk_mq_update_nr_requests(struct request_queue *q, unsigned int nr)
 	struct blk_mq_hw_ctx *hctx;
 	int i, ret;
 
-	if (!set || nr > set->queue_depth)
+	if (!set)
+		return -EINVAL;
+	/* the scheduler tags are sized at attach time, see below */
+	if (!q->elevator && nr > set->queue_depth)
 		return -EINVAL;
 
 	ret = 0;
 	queue_for_each_hw_ctx(q, hctx, i) {
-		if (!hctx->tags)
-			continue;
-		ret = blk_mq_tag_update_depth(hctx->tags, nr);
+		/*
+		 * With a scheduler the limit applies to its tags, which
+		 * can't grow beyond what blk_mq_sched_init_hctx() allocated.
+		 * Poll queues have none and keep their driver tag depth.
+		 */
+		if (q->elevator) {
+			if (hctx->sched_tags)
+				ret = blk_mq_tag_update_depth(hctx->sched_tags,
+							      nr);
+		} else if (hctx->tags)
+			ret = blk_mq_tag_update_depth(hctx->tags, nr);
 		if (ret)
 			break;
 	}
@@ -2481,19 +2947,32 @@ int blk_mq_update_nr_requests(struct request_queue *q, unsigned int nr)
 	return ret;
 }
 
-void blk_mq_update_nr_hw_queues(struct blk_mq_tag_set *set, int nr_hw_queues)
+static void __blk_mq_update_nr_hw_queues(struct blk_mq_tag_set *set,
+		int nr_hw_queues, int nr_poll_queues)
 {
 	struct request_queue *q;
 
 	if (nr_hw_queues > nr_cpu_ids)
 		nr_hw_queues = nr_cpu_ids;
-	if (nr_hw_queues < 1 || nr_hw_queues == set->nr_hw_queues)
+	if (nr_hw_queues < 1)
+		return;
+	if (nr_poll_queues < 0 || nr_poll_queues >= nr_hw_queues)
+		nr_poll_queues = 0;
+	if (nr_hw_queues == set->nr_hw_queues &&
+	    nr_poll_queues == set->nr_poll_queues)
 		return;
 
 	list_for_each_entry(q, &set->tag_list, tag_set_list)
 		blk_mq_freeze_queue(q);
 
 	set->nr_hw_queues = nr_hw_queues;
+	set->nr_poll_queues = nr_poll_queues;
+	if (blk_mq_update_queue_map(set)) {
+		/* keep going with a plain mapping rather than a stale one */
+		set->nr_poll_queues = 0;
+		blk_mq_map_queues(set);
+	}
+
 	list_for_each_entry(q, &set->tag_list, tag_set_list) {
 		blk_mq_realloc_hw_ctxs(set, q);
 
@@ -2508,14 +2987,43 @@ void blk_mq_update_nr_hw_queues(struct blk_mq_tag_set *set, int nr_hw_queues)
 	list_for_each_entry(q, &set->tag_list, tag_set_list)
 		blk_mq_unfreeze_queue(q);
 }
+
+void blk_mq_update_nr_hw_queues(struct blk_mq_tag_set *set, int nr_hw_queues)
+{
+	__blk_mq_update_nr_hw_queues(set, nr_hw_queues, set->nr_poll_queues);
+}
 EXPORT_SYMBOL_GPL(blk_mq_update_nr_hw_queues);
 
+/**
+ * blk_mq_update_nr_poll_queues - change the number of poll queues
+ * @set:		tag set to update
+ * @nr_hw_queues:	total number of hardware queues
+ * @nr_poll_queues:	how many of those, at the end, are poll queues
+ *
+ * Like blk_mq_update_nr_hw_queues(), but also changes how many of the
+ * hardware queues are reserved for polled I/O (%REQ_HIPRI).
+ */
+void blk_mq_update_nr_poll_queues(struct blk_mq_tag_set *set,
+		int nr_hw_queues, int nr_poll_queues)
+{
+	__blk_mq_update_nr_hw_queues(set, nr_hw_queues, nr_poll_queues);
+}
+EXPORT_SYMBOL_GPL(blk_mq_update_nr_poll_queues);
+
+/*
+ * A stat window that has just started holds too few completions to base
+ * the sleep time on, keep using the previous estimate until it has this
+ * many.
+ */
+#define BLK_MQ_POLL_MIN_SAMPLES	16
+
 static unsigned long blk_mq_poll_nsecs(struct request_queue *q,
 				       struct blk_mq_hw_ctx *hctx,
 				       struct request *rq)
 {
 	struct blk_rq_stat stat[2];
-	unsigned long ret = 0;
+	unsigned long window, nsecs;
+	int dir;
 
 	/*
 	 * If stats collection isn't on, don't sleep but turn it on for
@@ -2524,27 +3032,41 @@ static unsigned long blk_mq_poll_nsecs(struct request_queue *q,
 	if (!blk_stat_enable(q))
 		return 0;
 
+	if (req_op(rq) == REQ_OP_READ)
+		dir = BLK_STAT_READ;
+	else if (req_op(rq) == REQ_OP_WRITE)
+		dir = BLK_STAT_WRITE;
+	else
+		return 0;
+
 	/*
-	 * We don't have to do this once per IO, should optimize this
-	 * to just use the current window of stats until it changes
+	 * Summing up the per-ctx stats isn't free, so only do it until the
+	 * current stat window has enough samples and use the cached
+	 * estimate for the rest of it. Racing pollers may both recompute,
+	 * that's harmless. The release/acquire pair makes sure a poller
+	 * that sees the window also sees the estimate stored for it.
 	 */
+	window = ktime_to_ns(ktime_get()) >> ilog2(BLK_STAT_NSEC);
+	if (smp_load_acquire(&hctx->poll_stat_window[dir]) == window)
+		return READ_ONCE(hctx->poll_nsecs[dir]);
+
 	memset(&stat, 0, sizeof(stat));
 	blk_hctx_stat_get(hctx, stat);
+	if (stat[dir].nr_samples < BLK_MQ_POLL_MIN_SAMPLES)
+		return READ_ONCE(hctx->poll_nsecs[dir]);
 
 	/*
 	 * As an optimistic guess, use half of the mean service time
-	 * for this type of request. We can (and should) make this smarter.
-	 * For instance, if the completion latencies are tight, we can
-	 * get closer than just half the mean. This is especially
-	 * important on devices where the completion latencies are longer
-	 * than ~10 usec.
+	 * for this type of request. We can (and should) make this
+	 * smarter. For instance, if the completion latencies are
+	 * tight, we can get closer than just half the mean. This is
+	 * especially important on devices where the completion
+	 * latencies are longer than ~10 usec.
 	 */
-	if (req_op(rq) == REQ_OP_READ && stat[BLK_STAT_READ].nr_samples)
-		ret = (stat[BLK_STAT_READ].mean + 1) / 2;
-	else if (req_op(rq) == REQ_OP_WRITE && stat[BLK_STAT_WRITE].nr_samples)
-		ret = (stat[BLK_STAT_WRITE].mean + 1) / 2;
-
-	return ret;
+	nsecs = (stat[dir].mean + 1) / 2;
+	WRITE_ONCE(hctx->poll_nsecs[dir], nsecs);
+	smp_store_release(&hctx->poll_stat_window[dir], window);
+	return nsecs;
 }
 
 static bool blk_mq_poll_hybrid_sleep(struct request_queue *q,
@@ -2577,11 +3099,8 @@ static bool blk_mq_poll_hybrid_sleep(struct request_queue *q,
 		return false;
 
 	set_bit(REQ_ATOM_POLL_SLEPT, &rq->atomic_flags);
+	hctx->poll_slept++;
 
-	/*
-	 * This will be replaced with the stats tracking code, using
-	 * 'avg_completion_time / 2' as the pre-sleep target.
-	 */
 	kt = ktime_set(0, nsecs);
 
 	mode = HRTIMER_MODE_REL;
@@ -2645,6 +3164,13 @@ static bool __blk_mq_poll(struct blk_mq_hw_ctx *hctx, struct request *rq)
 		cpu_relax();
 	}
 
+	/*
+	 * Nothing but the poller completes requests on a poll queue, so the
+	 * caller must not go to sleep waiting for it, just yield the CPU.
+	 */
+	if (hctx->flags & BLK_MQ_F_POLL_QUEUE)
+		__set_current_state(TASK_RUNNING);
+
 	return false;
 }
 
@@ -2654,16 +3180,34 @@ bool blk_mq_poll(struct request_queue *q, blk_qc_t cookie)
 	struct blk_plug *plug;
 	struct request *rq;
 
-	if (!q->mq_ops || !q->mq_ops->poll || !blk_qc_t_valid(cookie) ||
-	    !test_bit(QUEUE_FLAG_POLL, &q->queue_flags))
+	if (!q->mq_ops || !q->mq_ops->poll || !blk_qc_t_valid(cookie))
+		return false;
+
+	/*
+	 * Requests already on a poll queue must be reaped even if polling
+	 * was switched off in the meantime, nothing else completes them.
+	 */
+	hctx = q->queue_hw_ctx[blk_qc_t_to_queue_num(cookie)];
+	if (!test_bit(QUEUE_FLAG_POLL, &q->queue_flags) &&
+	    !(hctx->flags & BLK_MQ_F_POLL_QUEUE))
 		return false;
 
 	plug = current->plug;
 	if (plug)
 		blk_flush_plug_list(plug, false);
 
-	hctx = q->queue_hw_ctx[blk_qc_t_to_queue_num(cookie)];
-	rq = blk_mq_tag_to_rq(hctx->tags, blk_qc_t_to_tag(cookie));
+	if (!blk_qc_t_is_internal(cookie)) {
+		rq = blk_mq_tag_to_rq(hctx->tags, blk_qc_t_to_tag(cookie));
+	} else {
+		struct blk_mq_tags *tags = hctx->sched_tags;
+
+		/* still in the scheduler, or the scheduler went away */
+		if (!tags || blk_qc_t_to_tag(cookie) >= tags->nr_tags)
+			return false;
+		rq = tags->static_rqs[blk_qc_t_to_tag(cookie)];
+		if (rq->tag == -1)
+			return false;
+	}
 
 	return __blk_mq_poll(hctx, rq);
 }
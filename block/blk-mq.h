@@ -32,6 +32,16 @@ void blk_mq_free_queue(struct request_queue *q);
 int blk_mq_update_nr_requests(struct request_queue *q, unsigned int nr);
 void blk_mq_wake_waiters(struct request_queue *q);
 bool blk_mq_dispatch_rq_list(struct blk_mq_hw_ctx *, struct list_head *);
+void blk_mq_put_driver_tag(struct request *rq);
+
+/*
+ * Request map helpers, also used for the scheduler tags
+ */
+struct blk_mq_tags *blk_mq_init_rq_map(struct blk_mq_tag_set *set,
+		unsigned int hctx_idx, unsigned int depth,
+		unsigned int reserved_tags);
+void blk_mq_free_rq_map(struct blk_mq_tag_set *set, struct blk_mq_tags *tags,
+		unsigned int hctx_idx);
 
 /*
  * CPU hotplug helpers
@@ -57,6 +67,24 @@ static inline struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *q,
 	return q->queue_hw_ctx[q->mq_map[cpu]];
 }
 
+static inline struct blk_mq_hw_ctx *blk_mq_map_queue_type(
+		struct request_queue *q, bool poll, int cpu)
+{
+	if (poll && q->poll_map)
+		return q->queue_hw_ctx[q->poll_map[cpu]];
+	return q->queue_hw_ctx[q->mq_map[cpu]];
+}
+
+/*
+ * The hardware queue @rq was allocated from.  REQ_HIPRI is only left set on
+ * requests that went to a poll queue.
+ */
+static inline struct blk_mq_hw_ctx *blk_mq_rq_hctx(struct request *rq)
+{
+	return blk_mq_map_queue_type(rq->q, rq->cmd_flags & REQ_HIPRI,
+			rq->mq_ctx->cpu);
+}
+
 /*
  * sysfs helpers
  */
@@ -110,6 +138,14 @@ static inline void blk_mq_set_alloc_data(struct blk_mq_alloc_data *data,
 	data->hctx = hctx;
 }
 
+static inline struct blk_mq_tags *blk_mq_tags_from_data(
+		struct blk_mq_alloc_data *data)
+{
+	if (data->flags & BLK_MQ_REQ_INTERNAL)
+		return data->hctx->sched_tags;
+	return data->hctx->tags;
+}
+
 static inline bool blk_mq_hctx_stopped(struct blk_mq_hw_ctx *hctx)
 {
 	return test_bit(BLK_MQ_S_STOPPED, &hctx->state);
@@ -117,7 +153,8 @@ static inline bool blk_mq_hctx_stopped(struct blk_mq_hw_ctx *hctx)
 
 static inline bool blk_mq_hw_queue_mapped(struct blk_mq_hw_ctx *hctx)
 {
-	return hctx->nr_ctx && hctx->tags;
+	return (hctx->nr_ctx || (hctx->flags & BLK_MQ_F_POLL_QUEUE)) &&
+		hctx->tags;
 }
 
 #endif
@@ -169,6 +169,67 @@ void blk_hctx_stat_get(struct blk_mq_hw_ctx *hctx, struct blk_rq_stat *dst)
 	} while (!nr);
 }
 
+/*
+ * Sum up the newest window of a per-cpu pair of read/write stats, as
+ * allocated by blk_stat_alloc_percpu().
+ */
+void blk_stat_percpu_get(struct blk_rq_stat __percpu *cpu_stat,
+			 struct blk_rq_stat *dst)
+{
+	struct blk_rq_stat *stat;
+	uint64_t latest = 0;
+	int cpu, nr;
+
+	blk_stat_init(&dst[BLK_STAT_READ]);
+	blk_stat_init(&dst[BLK_STAT_WRITE]);
+
+	nr = 0;
+	do {
+		uint64_t newest = 0;
+
+		for_each_possible_cpu(cpu) {
+			stat = per_cpu_ptr(cpu_stat, cpu);
+
+			blk_stat_flush_batch(&stat[BLK_STAT_READ]);
+			blk_stat_flush_batch(&stat[BLK_STAT_WRITE]);
+
+			if (!stat[BLK_STAT_READ].nr_samples &&
+			    !stat[BLK_STAT_WRITE].nr_samples)
+				continue;
+			if (stat[BLK_STAT_READ].time > newest)
+				newest = stat[BLK_STAT_READ].time;
+			if (stat[BLK_STAT_WRITE].time > newest)
+				newest = stat[BLK_STAT_WRITE].time;
+		}
+
+		if (!newest)
+			break;
+
+		if (newest > latest)
+			latest = newest;
+
+		for_each_possible_cpu(cpu) {
+			stat = per_cpu_ptr(cpu_stat, cpu);
+
+			if (stat[BLK_STAT_READ].time == newest) {
+				blk_stat_sum(&dst[BLK_STAT_READ],
+					     &stat[BLK_STAT_READ]);
+				nr++;
+			}
+			if (stat[BLK_STAT_WRITE].time == newest) {
+				blk_stat_sum(&dst[BLK_STAT_WRITE],
+					     &stat[BLK_STAT_WRITE]);
+				nr++;
+			}
+		}
+		/*
+		 * If we race on finding an entry, just loop back again.
+		 */
+	} while (!nr);
+
+	dst[BLK_STAT_READ].time = dst[BLK_STAT_WRITE].time = latest;
+}
+
 static void __blk_stat_init(struct blk_rq_stat *stat, s64 time_now)
 {
 	stat->min = -1ULL;
@@ -192,11 +253,74 @@ bool blk_stat_is_current(struct blk_rq_stat *stat)
 	return __blk_stat_is_current(stat, ktime_to_ns(ktime_get()));
 }
 
-void blk_stat_add(struct blk_rq_stat *stat, struct request *rq)
+static int blk_stat_hist_op(struct request *rq)
 {
-	s64 now, value;
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		return BLK_STAT_HIST_READ;
+	case REQ_OP_WRITE:
+		return BLK_STAT_HIST_WRITE;
+	case REQ_OP_DISCARD:
+	case REQ_OP_SECURE_ERASE:
+		return BLK_STAT_HIST_DISCARD;
+	default:
+		return BLK_STAT_HIST_OTHER;
+	}
+}
+
+static int blk_stat_hist_size(struct request *rq)
+{
+	unsigned int bytes = blk_rq_bytes(rq);
+	int size = 0;
+
+	/*
+	 * Size classes go up by a factor of 4, starting at 4k.
+	 */
+	while (bytes > 4096 && size < BLK_STAT_HIST_SIZES - 1) {
+		bytes = (bytes + 3) >> 2;
+		size++;
+	}
+
+	return size;
+}
+
+static int blk_stat_hist_bucket(u64 value)
+{
+	int bucket;
+
+	if (value < (1ULL << BLK_STAT_HIST_MIN_SHIFT))
+		return 0;
+
+	bucket = fls64(value) - BLK_STAT_HIST_MIN_SHIFT;
+	return min(bucket, BLK_STAT_HIST_BUCKETS - 1);
+}
+
+/*
+ * Sample the completion latency of @rq into the queue histogram, if one
+ * is enabled. Called once per completed request, unlike blk_stat_add()
+ * which also feeds the per-group stats. @now is from blk_stat_now().
+ */
+void blk_stat_hist_add(struct request *rq, u64 now)
+{
+	struct blk_stat_hist __percpu *cpu_hist;
+	s64 value;
+
+	cpu_hist = READ_ONCE(rq->q->stat_hist);
+	if (!cpu_hist)
+		return;
+
+	if (now < blk_stat_time(&rq->issue_stat))
+		return;
+	value = now - blk_stat_time(&rq->issue_stat);
+
+	this_cpu_inc(cpu_hist->buckets[blk_stat_hist_op(rq)]
+			[blk_stat_hist_size(rq)][blk_stat_hist_bucket(value)]);
+}
+
+void blk_stat_add(struct blk_rq_stat *stat, struct request *rq, u64 now)
+{
+	s64 value;
 
-	now = __blk_stat_time(ktime_to_ns(ktime_get()));
 	if (now < blk_stat_time(&rq->issue_stat))
 		return;
 
@@ -204,6 +328,7 @@ void blk_stat_add(struct blk_rq_stat *stat, struct request *rq)
 		__blk_stat_init(stat, now);
 
 	value = now - blk_stat_time(&rq->issue_stat);
+
 	if (value > stat->max)
 		stat->max = value;
 	if (value < stat->min)
@@ -236,12 +361,180 @@ void blk_stat_clear(struct request_queue *q)
 	}
 }
 
+void blk_stat_percpu_clear(struct blk_rq_stat __percpu *cpu_stat)
+{
+	struct blk_rq_stat *stat;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		stat = per_cpu_ptr(cpu_stat, cpu);
+		blk_stat_init(&stat[BLK_STAT_READ]);
+		blk_stat_init(&stat[BLK_STAT_WRITE]);
+	}
+}
+
+struct blk_rq_stat __percpu *blk_stat_alloc_percpu(gfp_t gfp)
+{
+	struct blk_rq_stat __percpu *cpu_stat;
+
+	cpu_stat = __alloc_percpu_gfp(2 * sizeof(struct blk_rq_stat),
+				      __alignof__(struct blk_rq_stat), gfp);
+	if (cpu_stat)
+		blk_stat_percpu_clear(cpu_stat);
+
+	return cpu_stat;
+}
+
 void blk_stat_set_issue_time(struct blk_issue_stat *stat)
 {
 	stat->time = (stat->time & BLK_STAT_MASK) |
 			(ktime_to_ns(ktime_get()) & BLK_STAT_TIME_MASK);
 }
 
+/*
+ * Enable latency histogram tracking. Only blk-mq completions are sampled,
+ * legacy requests no longer know their size by the time they complete.
+ * Like the stats flag, this stays on for the lifetime of the queue.
+ */
+int blk_stat_hist_enable(struct request_queue *q)
+{
+	struct blk_stat_hist __percpu *cpu_hist;
+
+	if (!q->mq_ops)
+		return -EINVAL;
+	if (q->stat_hist)
+		return 0;
+
+	cpu_hist = alloc_percpu(struct blk_stat_hist);
+	if (!cpu_hist)
+		return -ENOMEM;
+
+	if (cmpxchg(&q->stat_hist, NULL, cpu_hist))
+		free_percpu(cpu_hist);
+
+	blk_stat_enable(q);
+	return 0;
+}
+
+void blk_stat_hist_free(struct request_queue *q)
+{
+	free_percpu(q->stat_hist);
+	q->stat_hist = NULL;
+}
+
+void blk_stat_hist_sum(struct blk_stat_hist *dst,
+		       const struct blk_stat_hist *src)
+{
+	int op, size, i;
+
+	for (op = 0; op < BLK_STAT_HIST_OPS; op++)
+		for (size = 0; size < BLK_STAT_HIST_SIZES; size++)
+			for (i = 0; i < BLK_STAT_HIST_BUCKETS; i++)
+				dst->buckets[op][size][i] +=
+					READ_ONCE(src->buckets[op][size][i]);
+}
+
+void blk_hctx_stat_hist_get(struct blk_mq_hw_ctx *hctx,
+			    struct blk_stat_hist *dst)
+{
+	struct blk_stat_hist __percpu *cpu_hist = hctx->queue->stat_hist;
+	struct blk_mq_ctx *ctx;
+	unsigned int i;
+
+	memset(dst, 0, sizeof(*dst));
+	if (!cpu_hist)
+		return;
+
+	hctx_for_each_ctx(hctx, ctx, i)
+		blk_stat_hist_sum(dst, per_cpu_ptr(cpu_hist, ctx->cpu));
+}
+
+void blk_queue_stat_hist_get(struct request_queue *q,
+			     struct blk_stat_hist *dst)
+{
+	int cpu;
+
+	memset(dst, 0, sizeof(*dst));
+	if (!q->stat_hist)
+		return;
+
+	for_each_possible_cpu(cpu)
+		blk_stat_hist_sum(dst, per_cpu_ptr(q->stat_hist, cpu));
+}
+
+/*
+ * Turn the cumulative counts in @dst into the delta since @prev
+ */
+void blk_stat_hist_sub(struct blk_stat_hist *dst,
+		       const struct blk_stat_hist *prev)
+{
+	int op, size, i;
+
+	for (op = 0; op < BLK_STAT_HIST_OPS; op++)
+		for (size = 0; size < BLK_STAT_HIST_SIZES; size++)
+			for (i = 0; i < BLK_STAT_HIST_BUCKETS; i++)
+				dst->buckets[op][size][i] -=
+					prev->buckets[op][size][i];
+}
+
+/*
+ * Number of samples for @op, and for size class @size, or all sizes if
+ * @size is -1.
+ */
+u64 blk_stat_hist_samples(struct blk_stat_hist *hist, int op, int size)
+{
+	u64 nr = 0;
+	int s, i;
+
+	for (s = 0; s < BLK_STAT_HIST_SIZES; s++) {
+		if (size != -1 && s != size)
+			continue;
+		for (i = 0; i < BLK_STAT_HIST_BUCKETS; i++)
+			nr += hist->buckets[op][s][i];
+	}
+
+	return nr;
+}
+
+/*
+ * Return the @pct percentile latency in nsecs for @op and size class
+ * @size (-1 for all sizes). Within a bucket, we interpolate linearly
+ * between its bounds. Returns 0 if there are no samples.
+ */
+u64 blk_stat_hist_percentile(struct blk_stat_hist *hist, int op, int size,
+			     unsigned int pct)
+{
+	u64 nr, target, seen = 0;
+	int s, i;
+
+	nr = blk_stat_hist_samples(hist, op, size);
+	if (!nr)
+		return 0;
+
+	target = div_u64(nr * min(pct, 100U) + 99, 100);
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < BLK_STAT_HIST_BUCKETS; i++) {
+		u64 cnt = 0, lo, hi;
+
+		for (s = 0; s < BLK_STAT_HIST_SIZES; s++)
+			if (size == -1 || s == size)
+				cnt += hist->buckets[op][s][i];
+
+		if (seen + cnt < target) {
+			seen += cnt;
+			continue;
+		}
+
+		lo = i ? 1ULL << (BLK_STAT_HIST_MIN_SHIFT + i - 1) : 0;
+		hi = 1ULL << (BLK_STAT_HIST_MIN_SHIFT + i);
+		return lo + div64_u64((hi - lo) * (target - seen), cnt);
+	}
+
+	return 1ULL << (BLK_STAT_HIST_MIN_SHIFT + BLK_STAT_HIST_BUCKETS - 1);
+}
+
 /*
  * Enable stat tracking, return whether it was enabled
  */
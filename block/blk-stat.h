@@ -1,6 +1,8 @@
 #ifndef BLK_STAT_H
 #define BLK_STAT_H
 
+#include <linux/ktime.h>
+
 /*
  * ~0.13s window as a power-of-2 (2^27 nsecs)
  */
@@ -8,9 +10,9 @@
 #define BLK_STAT_NSEC_MASK	~(BLK_STAT_NSEC - 1)
 
 /*
- * Upper 3 bits can be used elsewhere
+ * Upper 4 bits can be used elsewhere
  */
-#define BLK_STAT_RES_BITS	3
+#define BLK_STAT_RES_BITS	4
 #define BLK_STAT_SHIFT		(64 - BLK_STAT_RES_BITS)
 #define BLK_STAT_TIME_MASK	((1ULL << BLK_STAT_SHIFT) - 1)
 #define BLK_STAT_MASK		~BLK_STAT_TIME_MASK
@@ -20,7 +22,30 @@ enum {
 	BLK_STAT_WRITE,
 };
 
-void blk_stat_add(struct blk_rq_stat *, struct request *);
+/*
+ * Completion latency histogram, split by operation type and request size.
+ * Bucket 0 holds completions below 1usec, every following bucket covers
+ * one power of two of nsecs, the last one is open ended (~8.6s and up).
+ * Counters are cumulative, consumers look at deltas between snapshots.
+ */
+enum {
+	BLK_STAT_HIST_READ	= 0,
+	BLK_STAT_HIST_WRITE,
+	BLK_STAT_HIST_DISCARD,
+	BLK_STAT_HIST_OTHER,
+	BLK_STAT_HIST_OPS,
+};
+
+#define BLK_STAT_HIST_SIZES	5	/* <=4k, <=16k, <=64k, <=256k, more */
+#define BLK_STAT_HIST_BUCKETS	25
+#define BLK_STAT_HIST_MIN_SHIFT	10	/* upper bound of bucket 0, 2^10 nsec */
+
+struct blk_stat_hist {
+	u64 buckets[BLK_STAT_HIST_OPS][BLK_STAT_HIST_SIZES][BLK_STAT_HIST_BUCKETS];
+};
+
+void blk_stat_add(struct blk_rq_stat *, struct request *, u64);
+void blk_stat_hist_add(struct request *, u64);
 void blk_hctx_stat_get(struct blk_mq_hw_ctx *, struct blk_rq_stat *);
 void blk_queue_stat_get(struct request_queue *, struct blk_rq_stat *);
 void blk_stat_clear(struct request_queue *);
@@ -28,6 +53,18 @@ void blk_stat_init(struct blk_rq_stat *);
 bool blk_stat_is_current(struct blk_rq_stat *);
 void blk_stat_set_issue_time(struct blk_issue_stat *);
 bool blk_stat_enable(struct request_queue *);
+struct blk_rq_stat __percpu *blk_stat_alloc_percpu(gfp_t);
+void blk_stat_percpu_get(struct blk_rq_stat __percpu *, struct blk_rq_stat *);
+void blk_stat_percpu_clear(struct blk_rq_stat __percpu *);
+
+int blk_stat_hist_enable(struct request_queue *);
+void blk_stat_hist_free(struct request_queue *);
+void blk_hctx_stat_hist_get(struct blk_mq_hw_ctx *, struct blk_stat_hist *);
+void blk_queue_stat_hist_get(struct request_queue *, struct blk_stat_hist *);
+void blk_stat_hist_sum(struct blk_stat_hist *, const struct blk_stat_hist *);
+void blk_stat_hist_sub(struct blk_stat_hist *, const struct blk_stat_hist *);
+u64 blk_stat_hist_samples(struct blk_stat_hist *, int, int);
+u64 blk_stat_hist_percentile(struct blk_stat_hist *, int, int, unsigned int);
 
 static inline u64 __blk_stat_time(u64 time)
 {
@@ -39,4 +76,13 @@ static inline u64 blk_stat_time(struct blk_issue_stat *stat)
 	return __blk_stat_time(stat->time);
 }
 
+/*
+ * Completion timestamp to hand to blk_stat_add() and friends, taken once
+ * per completed request.
+ */
+static inline u64 blk_stat_now(void)
+{
+	return __blk_stat_time(ktime_to_ns(ktime_get()));
+}
+
 #endif
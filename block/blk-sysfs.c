@@ -13,6 +13,7 @@
 
 #include "blk.h"
 #include "blk-mq.h"
+#include "blk-mq-sched.h"
 #include "blk-wbt.h"
 
 struct queue_sysfs_entry {
@@ -380,6 +381,14 @@ static ssize_t queue_poll_delay_store(struct request_queue *q, const char *page,
 	if (err < 0)
 		return err;
 
+	/*
+	 * -1 disables hybrid polling, 0 sleeps for half the mean completion
+	 * time of the hardware queue, and anything else is a fixed sleep
+	 * time in usecs before we start spinning.
+	 */
+	if (val < -1 || val > INT_MAX / 1000)
+		return -EINVAL;
+
 	if (val == -1)
 		q->poll_nsec = -1;
 	else
@@ -460,6 +469,31 @@ static ssize_t queue_wb_lat_store(struct request_queue *q, const char *page,
 	return count;
 }
 
+static ssize_t queue_wb_lat_pct_show(struct request_queue *q, char *page)
+{
+	if (!q->rq_wb)
+		return -EINVAL;
+
+	return sprintf(page, "%u\n", q->rq_wb->lat_pct);
+}
+
+static ssize_t queue_wb_lat_pct_store(struct request_queue *q,
+				      const char *page, size_t count)
+{
+	unsigned long val;
+	ssize_t ret;
+
+	if (!q->rq_wb)
+		return -EINVAL;
+
+	ret = queue_var_store(&val, page, count);
+	if (ret < 0)
+		return ret;
+
+	ret = wbt_set_lat_pct(q->rq_wb, val);
+	return ret ?: count;
+}
+
 static ssize_t queue_wc_show(struct request_queue *q, char *page)
 {
 	if (test_bit(QUEUE_FLAG_WC, &q->queue_flags))
@@ -691,6 +725,12 @@ static struct queue_sysfs_entry queue_wb_lat_entry = {
 	.store = queue_wb_lat_store,
 };
 
+static struct queue_sysfs_entry queue_wb_lat_pct_entry = {
+	.attr = {.name = "wbt_lat_pct", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_wb_lat_pct_show,
+	.store = queue_wb_lat_pct_store,
+};
+
 static struct attribute *default_attrs[] = {
 	&queue_requests_entry.attr,
 	&queue_ra_entry.attr,
@@ -723,6 +763,7 @@ static struct attribute *default_attrs[] = {
 	&queue_dax_entry.attr,
 	&queue_stats_entry.attr,
 	&queue_wb_lat_entry.attr,
+	&queue_wb_lat_pct_entry.attr,
 	&queue_poll_delay_entry.attr,
 	NULL,
 };
@@ -806,7 +847,10 @@ static void blk_release_queue(struct kobject *kobj)
 		spin_lock_irq(q->queue_lock);
 		ioc_clear_queue(q);
 		spin_unlock_irq(q->queue_lock);
-		elevator_exit(q->elevator);
+		if (q->mq_ops)
+			blk_mq_sched_teardown(q);
+		else
+			elevator_exit(q->elevator);
 	}
 
 	blk_exit_rl(&q->root_rl);
@@ -897,7 +941,7 @@ int blk_register_queue(struct gendisk *disk)
 
 	blk_wb_init(q);
 
-	if (!q->request_fn)
+	if (!q->elevator)
 		return 0;
 
 	ret = elv_register_queue(q);
@@ -922,7 +966,7 @@ void blk_unregister_queue(struct gendisk *disk)
 	if (q->mq_ops)
 		blk_mq_unregister_dev(disk_to_dev(disk), q);
 
-	if (q->request_fn)
+	if (q->elevator)
 		elv_unregister_queue(q);
 
 	kobject_uevent(&q->kobj, KOBJ_REMOVE);
@@ -11,6 +11,7 @@
 #include <linux/blktrace_api.h>
 #include <linux/blk-cgroup.h>
 #include "blk.h"
+#include "blk-stat.h"
 
 /* Max dispatch from a group in 1 round */
 static int throtl_grp_quantum = 8;
@@ -21,6 +22,23 @@ static int throtl_quantum = 32;
 /* Throttling is performed over 100ms slice and after that slice is renewed */
 static unsigned long throtl_slice = HZ/10;	/* 100 ms */
 
+/*
+ * Floor applied to groups without a low limit while the queue runs at
+ * low limits, so that they are not starved completely.
+ */
+#define MIN_THROTL_BPS	(320 * 1024)
+#define MIN_THROTL_IOPS	10
+
+/*
+ * A group is idle if it doesn't issue IO for longer than the idle
+ * threshold.  The threshold follows the completion latency measured by
+ * blk-stat, a few completions worth of time, capped by the default.
+ */
+#define DFL_IDLE_THRESHOLD_SSD	1000		/* 1 ms */
+#define DFL_IDLE_THRESHOLD_HD	(100 * 1000)	/* 100 ms */
+#define MIN_IDLE_THRESHOLD	50		/* 50 us */
+#define IDLE_THRESHOLD_LAT_MULT	4
+
 static struct blkcg_policy blkcg_policy_throtl;
 
 /* A workqueue to queue throttle related work */
@@ -76,6 +94,12 @@ struct throtl_service_queue {
 	struct timer_list	pending_timer;	/* fires on first_pending_disptime */
 };
 
+enum {
+	LIMIT_LOW,
+	LIMIT_MAX,
+	LIMIT_CNT,
+};
+
 enum tg_state_flags {
 	THROTL_TG_PENDING	= 1 << 0,	/* on parent's pending tree */
 	THROTL_TG_WAS_EMPTY	= 1 << 1,	/* bio_lists[] became non-empty */
@@ -119,20 +143,37 @@ struct throtl_grp {
 	/* are there any throtl rules between this group and td? */
 	bool has_rules[2];
 
-	/* bytes per second rate limits */
-	uint64_t bps[2];
+	/* bytes per second rate limits, 0 means no low limit */
+	uint64_t bps[2][LIMIT_CNT];
 
-	/* IOPS limits */
-	unsigned int iops[2];
+	/* IOPS limits, 0 means no low limit */
+	unsigned int iops[2][LIMIT_CNT];
 
 	/* Number of bytes disptached in current slice */
 	uint64_t bytes_disp[2];
 	/* Number of bio's dispatched in current slice */
 	unsigned int io_disp[2];
 
+	/* dispatched since last_check_time, for the upgrade/downgrade checks */
+	unsigned long last_check_time;
+	uint64_t last_bytes_disp[2];
+	unsigned int last_io_disp[2];
+
+	/* last time the group ran into (or above) its low limit */
+	unsigned long last_low_overflow_time[2];
+
+	/* submission time of the last bio and averaged gap between bios, usec */
+	u64 last_io_time;
+	u64 avg_idletime;
+
 	/* When did we start a new slice */
 	unsigned long slice_start[2];
 	unsigned long slice_end[2];
+
+	/* throttling statistics, see throtl_add_bio_tg() */
+	uint64_t nr_throttled[2];
+	uint64_t throttle_start[2];	/* nsecs, valid while bios are queued */
+	uint64_t throttle_time[2];	/* nsecs */
 };
 
 struct throtl_data
@@ -145,6 +186,17 @@ struct throtl_data
 	/* Total Number of queued bios on READ and WRITE lists */
 	unsigned int nr_queued[2];
 
+	/* LIMIT_LOW while any group has a low limit and isn't idle */
+	unsigned int limit_index;
+	bool limit_valid[LIMIT_CNT];
+
+	unsigned long low_upgrade_time;
+	unsigned long low_downgrade_time;
+
+	/* usecs, see throtl_update_idle_threshold() */
+	u64 idle_threshold;
+	unsigned long idle_threshold_time;
+
 	/* Work for dispatching throttled bios */
 	struct work_struct dispatch_work;
 };
@@ -224,6 +276,64 @@ static struct throtl_data *sq_to_td(struct throtl_service_queue *sq)
 	}								\
 } while (0)
 
+/*
+ * tg_bps_limit - the bps limit in effect for @tg
+ *
+ * While the queue runs at low limits, a group's low limit applies, capped
+ * by its max limit.  Leaves without any low limit get a small floor so
+ * that they are throttled hard but not starved; intermediate groups
+ * without one don't restrict their children.
+ */
+static uint64_t tg_bps_limit(struct throtl_grp *tg, int rw)
+{
+	struct blkcg_gq *blkg = tg_to_blkg(tg);
+	struct throtl_data *td = tg->td;
+	uint64_t ret;
+
+	if (cgroup_subsys_on_dfl(io_cgrp_subsys) && !blkg->parent)
+		return -1;
+
+	ret = tg->bps[rw][LIMIT_MAX];
+	if (td->limit_index != LIMIT_LOW)
+		return ret;
+
+	if (!tg->bps[rw][LIMIT_LOW]) {
+		if (!list_empty(&blkg->blkcg->css.children) ||
+		    tg->iops[rw][LIMIT_LOW])
+			return -1;
+		return min_t(uint64_t, ret, MIN_THROTL_BPS);
+	}
+	return min(tg->bps[rw][LIMIT_LOW], ret);
+}
+
+static unsigned int tg_iops_limit(struct throtl_grp *tg, int rw)
+{
+	struct blkcg_gq *blkg = tg_to_blkg(tg);
+	struct throtl_data *td = tg->td;
+	unsigned int ret;
+
+	if (cgroup_subsys_on_dfl(io_cgrp_subsys) && !blkg->parent)
+		return -1;
+
+	ret = tg->iops[rw][LIMIT_MAX];
+	if (td->limit_index != LIMIT_LOW)
+		return ret;
+
+	if (!tg->iops[rw][LIMIT_LOW]) {
+		if (!list_empty(&blkg->blkcg->css.children) ||
+		    tg->bps[rw][LIMIT_LOW])
+			return -1;
+		return min_t(unsigned int, ret, MIN_THROTL_IOPS);
+	}
+	return min(tg->iops[rw][LIMIT_LOW], ret);
+}
+
+static bool tg_has_low_limit(struct throtl_grp *tg)
+{
+	return tg->bps[READ][LIMIT_LOW] || tg->bps[WRITE][LIMIT_LOW] ||
+		tg->iops[READ][LIMIT_LOW] || tg->iops[WRITE][LIMIT_LOW];
+}
+
 static void throtl_qnode_init(struct throtl_qnode *qn, struct throtl_grp *tg)
 {
 	INIT_LIST_HEAD(&qn->node);
@@ -334,10 +444,14 @@ static struct blkg_policy_data *throtl_pd_alloc(gfp_t gfp, int node)
 	}
 
 	RB_CLEAR_NODE(&tg->rb_node);
-	tg->bps[READ] = -1;
-	tg->bps[WRITE] = -1;
-	tg->iops[READ] = -1;
-	tg->iops[WRITE] = -1;
+	tg->bps[READ][LIMIT_MAX] = -1;
+	tg->bps[WRITE][LIMIT_MAX] = -1;
+	tg->iops[READ][LIMIT_MAX] = -1;
+	tg->iops[WRITE][LIMIT_MAX] = -1;
+
+	tg->last_check_time = jiffies;
+	tg->last_low_overflow_time[READ] = jiffies;
+	tg->last_low_overflow_time[WRITE] = jiffies;
 
 	return &tg->pd;
 }
@@ -372,15 +486,43 @@ static void throtl_pd_init(struct blkg_policy_data *pd)
  * Set has_rules[] if @tg or any of its parents have limits configured.
  * This doesn't require walking up to the top of the hierarchy as the
  * parent's has_rules[] is guaranteed to be correct.
+ *
+ * Once any group has a low limit, every non-root group is subject to
+ * throttling: groups without a low limit are held at the floor of
+ * tg_bps_limit() while the queue runs at low limits, and all of them
+ * feed the idle detection.
  */
 static void tg_update_has_rules(struct throtl_grp *tg)
 {
 	struct throtl_grp *parent_tg = sq_to_tg(tg->service_queue.parent_sq);
+	bool low = tg->td->limit_valid[LIMIT_LOW] && tg_to_blkg(tg)->parent;
 	int rw;
 
 	for (rw = READ; rw <= WRITE; rw++)
 		tg->has_rules[rw] = (parent_tg && parent_tg->has_rules[rw]) ||
-				    (tg->bps[rw] != -1 || tg->iops[rw] != -1);
+				    low ||
+				    (tg->bps[rw][LIMIT_MAX] != -1 ||
+				     tg->iops[rw][LIMIT_MAX] != -1);
+}
+
+static void blk_throtl_update_limit_valid(struct throtl_data *td)
+{
+	struct cgroup_subsys_state *pos_css;
+	struct blkcg_gq *blkg;
+	bool low_valid = false;
+
+	rcu_read_lock();
+	blkg_for_each_descendant_post(blkg, pos_css, td->queue->root_blkg) {
+		struct throtl_grp *tg = blkg_to_tg(blkg);
+
+		if (tg && tg_has_low_limit(tg)) {
+			low_valid = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	td->limit_valid[LIMIT_LOW] = low_valid;
 }
 
 static void throtl_pd_online(struct blkg_policy_data *pd)
@@ -392,6 +534,29 @@ static void throtl_pd_online(struct blkg_policy_data *pd)
 	tg_update_has_rules(pd_to_tg(pd));
 }
 
+static void throtl_pd_offline(struct blkg_policy_data *pd)
+{
+	struct throtl_grp *tg = pd_to_tg(pd);
+	struct throtl_data *td = tg->td;
+
+	tg->bps[READ][LIMIT_LOW] = 0;
+	tg->bps[WRITE][LIMIT_LOW] = 0;
+	tg->iops[READ][LIMIT_LOW] = 0;
+	tg->iops[WRITE][LIMIT_LOW] = 0;
+
+	/* the whole tree is being torn down */
+	if (blk_queue_dying(td->queue))
+		return;
+
+	/*
+	 * Queued bios pick up the max limits on their next dispatch, no
+	 * need to kick dispatching from here.
+	 */
+	blk_throtl_update_limit_valid(td);
+	if (!td->limit_valid[LIMIT_LOW])
+		td->limit_index = LIMIT_MAX;
+}
+
 static void throtl_pd_free(struct blkg_policy_data *pd)
 {
 	struct throtl_grp *tg = pd_to_tg(pd);
@@ -632,11 +797,11 @@ static inline void throtl_trim_slice(struct throtl_grp *tg, bool rw)
 
 	if (!nr_slices)
 		return;
-	tmp = tg->bps[rw] * throtl_slice * nr_slices;
+	tmp = tg_bps_limit(tg, rw) * throtl_slice * nr_slices;
 	do_div(tmp, HZ);
 	bytes_trim = tmp;
 
-	io_trim = (tg->iops[rw] * throtl_slice * nr_slices)/HZ;
+	io_trim = (tg_iops_limit(tg, rw) * throtl_slice * nr_slices)/HZ;
 
 	if (!bytes_trim && !io_trim)
 		return;
@@ -663,6 +828,7 @@ static bool tg_with_in_iops_limit(struct throtl_grp *tg, struct bio *bio,
 				  unsigned long *wait)
 {
 	bool rw = bio_data_dir(bio);
+	unsigned int iops_limit = tg_iops_limit(tg, rw);
 	unsigned int io_allowed;
 	unsigned long jiffy_elapsed, jiffy_wait, jiffy_elapsed_rnd;
 	u64 tmp;
@@ -682,7 +848,7 @@ static bool tg_with_in_iops_limit(struct throtl_grp *tg, struct bio *bio,
 	 * have been trimmed.
 	 */
 
-	tmp = (u64)tg->iops[rw] * jiffy_elapsed_rnd;
+	tmp = (u64)iops_limit * jiffy_elapsed_rnd;
 	do_div(tmp, HZ);
 
 	if (tmp > UINT_MAX)
@@ -697,7 +863,7 @@ static bool tg_with_in_iops_limit(struct throtl_grp *tg, struct bio *bio,
 	}
 
 	/* Calc approx time to dispatch */
-	jiffy_wait = ((tg->io_disp[rw] + 1) * HZ)/tg->iops[rw] + 1;
+	jiffy_wait = ((tg->io_disp[rw] + 1) * HZ)/iops_limit + 1;
 
 	if (jiffy_wait > jiffy_elapsed)
 		jiffy_wait = jiffy_wait - jiffy_elapsed;
@@ -713,6 +879,7 @@ static bool tg_with_in_bps_limit(struct throtl_grp *tg, struct bio *bio,
 				 unsigned long *wait)
 {
 	bool rw = bio_data_dir(bio);
+	u64 bps_limit = tg_bps_limit(tg, rw);
 	u64 bytes_allowed, extra_bytes, tmp;
 	unsigned long jiffy_elapsed, jiffy_wait, jiffy_elapsed_rnd;
 
@@ -724,7 +891,7 @@ static bool tg_with_in_bps_limit(struct throtl_grp *tg, struct bio *bio,
 
 	jiffy_elapsed_rnd = roundup(jiffy_elapsed_rnd, throtl_slice);
 
-	tmp = tg->bps[rw] * jiffy_elapsed_rnd;
+	tmp = bps_limit * jiffy_elapsed_rnd;
 	do_div(tmp, HZ);
 	bytes_allowed = tmp;
 
@@ -736,7 +903,7 @@ static bool tg_with_in_bps_limit(struct throtl_grp *tg, struct bio *bio,
 
 	/* Calc approx time to dispatch */
 	extra_bytes = tg->bytes_disp[rw] + bio->bi_iter.bi_size - bytes_allowed;
-	jiffy_wait = div64_u64(extra_bytes * HZ, tg->bps[rw]);
+	jiffy_wait = div64_u64(extra_bytes * HZ, bps_limit);
 
 	if (!jiffy_wait)
 		jiffy_wait = 1;
@@ -771,7 +938,7 @@ static bool tg_may_dispatch(struct throtl_grp *tg, struct bio *bio,
 	       bio != throtl_peek_queued(&tg->service_queue.queued[rw]));
 
 	/* If tg->bps = -1, then BW is unlimited */
-	if (tg->bps[rw] == -1 && tg->iops[rw] == -1) {
+	if (tg_bps_limit(tg, rw) == -1 && tg_iops_limit(tg, rw) == -1) {
 		if (wait)
 			*wait = 0;
 		return true;
@@ -816,6 +983,8 @@ static void throtl_charge_bio(struct throtl_grp *tg, struct bio *bio)
 	/* Charge the bio to the group */
 	tg->bytes_disp[rw] += bio->bi_iter.bi_size;
 	tg->io_disp[rw]++;
+	tg->last_bytes_disp[rw] += bio->bi_iter.bi_size;
+	tg->last_io_disp[rw]++;
 
 	/*
 	 * BIO_THROTTLED is used to prevent the same bio to be throttled
@@ -850,9 +1019,14 @@ static void throtl_add_bio_tg(struct bio *bio, struct throtl_qnode *qn,
 	 * direction, queueing @bio can change when @tg should be
 	 * dispatched.  Mark that @tg was empty.  This is automatically
 	 * cleaered on the next tg_update_disptime().
+	 *
+	 * This also opens a throttling period for the statistics, it's
+	 * closed when tg_dispatch_one_bio() empties the queue again.
 	 */
-	if (!sq->nr_queued[rw])
+	if (!sq->nr_queued[rw]) {
 		tg->flags |= THROTL_TG_WAS_EMPTY;
+		tg->throttle_start[rw] = ktime_get_ns();
+	}
 
 	throtl_qnode_add_bio(bio, qn, &sq->queued[rw]);
 
@@ -912,6 +1086,8 @@ static void tg_dispatch_one_bio(struct throtl_grp *tg, bool rw)
 	 */
 	bio = throtl_pop_queued(&sq->queued[rw], &tg_to_put);
 	sq->nr_queued[rw]--;
+	if (!sq->nr_queued[rw])
+		tg->throttle_time[rw] += ktime_get_ns() - tg->throttle_start[rw];
 
 	throtl_charge_bio(tg, bio);
 
@@ -999,6 +1175,296 @@ static int throtl_select_dispatch(struct throtl_service_queue *parent_sq)
 	return nr_disp;
 }
 
+/*
+ * The idle threshold follows the device: a few times the mean completion
+ * latency blk-stat measured in its last window, bounded by the static
+ * default for the device type.  Without samples the previous value stays.
+ * Refreshed at most once a slice.
+ */
+static void throtl_update_idle_threshold(struct throtl_data *td)
+{
+	struct request_queue *q = td->queue;
+	struct blk_rq_stat stat[2];
+	u64 dft, mean, thresh;
+
+	dft = blk_queue_nonrot(q) ? DFL_IDLE_THRESHOLD_SSD :
+				    DFL_IDLE_THRESHOLD_HD;
+	if (!td->idle_threshold)
+		td->idle_threshold = dft;
+
+	if (time_before(jiffies, td->idle_threshold_time + throtl_slice))
+		return;
+	td->idle_threshold_time = jiffies;
+
+	blk_queue_stat_get(q, stat);
+	if (!stat[BLK_STAT_READ].nr_samples &&
+	    !stat[BLK_STAT_WRITE].nr_samples)
+		return;
+
+	mean = max(stat[BLK_STAT_READ].mean, stat[BLK_STAT_WRITE].mean);
+	thresh = div_u64(mean * IDLE_THRESHOLD_LAT_MULT, NSEC_PER_USEC);
+	td->idle_threshold = clamp_t(u64, thresh, MIN_IDLE_THRESHOLD, dft);
+}
+
+/*
+ * Called for every bio submitted while low limits are configured.  A bio
+ * counts as activity for its group and every ancestor, so intermediate
+ * groups are idle only if their whole subtree is.
+ */
+static void throtl_update_idletime(struct throtl_grp *tg)
+{
+	u64 now = ktime_get_ns() >> 10;
+
+	for (; tg; tg = sq_to_tg(tg->service_queue.parent_sq)) {
+		if (tg->last_io_time)
+			tg->avg_idletime = (tg->avg_idletime * 7 + now -
+					    tg->last_io_time) >> 3;
+		tg->last_io_time = now;
+	}
+}
+
+static bool throtl_tg_is_idle(struct throtl_grp *tg)
+{
+	u64 now = ktime_get_ns() >> 10;
+	u64 thresh = tg->td->idle_threshold;
+
+	return now - tg->last_io_time > thresh || tg->avg_idletime > thresh;
+}
+
+static unsigned long __tg_last_low_overflow_time(struct throtl_grp *tg)
+{
+	unsigned long rtime = jiffies, wtime = jiffies;
+
+	if (tg->bps[READ][LIMIT_LOW] || tg->iops[READ][LIMIT_LOW])
+		rtime = tg->last_low_overflow_time[READ];
+	if (tg->bps[WRITE][LIMIT_LOW] || tg->iops[WRITE][LIMIT_LOW])
+		wtime = tg->last_low_overflow_time[WRITE];
+	return min(rtime, wtime);
+}
+
+/* the latest time @tg or one of its ancestors with a low limit hit it */
+static unsigned long tg_last_low_overflow_time(struct throtl_grp *tg)
+{
+	unsigned long ret = __tg_last_low_overflow_time(tg);
+	struct throtl_grp *parent = tg;
+
+	while ((parent = sq_to_tg(parent->service_queue.parent_sq))) {
+		/*
+		 * A parent without low limit always reaches it, its overflow
+		 * time says nothing about its children.
+		 */
+		if (!tg_has_low_limit(parent))
+			break;
+		if (time_after(__tg_last_low_overflow_time(parent), ret))
+			ret = __tg_last_low_overflow_time(parent);
+	}
+	return ret;
+}
+
+/*
+ * A group doesn't need the queue to stay at low limits if it is already
+ * being throttled at its low limit, has no low limit, or is idle.
+ */
+static bool throtl_tg_can_upgrade(struct throtl_grp *tg)
+{
+	struct throtl_service_queue *sq = &tg->service_queue;
+	bool read_limit, write_limit;
+
+	read_limit = tg->bps[READ][LIMIT_LOW] || tg->iops[READ][LIMIT_LOW];
+	write_limit = tg->bps[WRITE][LIMIT_LOW] || tg->iops[WRITE][LIMIT_LOW];
+	if (!read_limit && !write_limit)
+		return true;
+	if (read_limit && sq->nr_queued[READ] &&
+	    (!write_limit || sq->nr_queued[WRITE]))
+		return true;
+	if (write_limit && sq->nr_queued[WRITE] &&
+	    (!read_limit || sq->nr_queued[READ]))
+		return true;
+
+	if (time_after_eq(jiffies,
+			  tg_last_low_overflow_time(tg) + throtl_slice) &&
+	    throtl_tg_is_idle(tg))
+		return true;
+	return false;
+}
+
+static bool throtl_hierarchy_can_upgrade(struct throtl_grp *tg)
+{
+	while (true) {
+		if (throtl_tg_can_upgrade(tg))
+			return true;
+		tg = sq_to_tg(tg->service_queue.parent_sq);
+		if (!tg || !tg_to_blkg(tg)->parent)
+			return false;
+	}
+}
+
+/*
+ * The queue can switch to max limits once every leaf group, other than
+ * @this_tg which the caller already knows about, is satisfied.
+ */
+static bool throtl_can_upgrade(struct throtl_data *td,
+			       struct throtl_grp *this_tg)
+{
+	struct cgroup_subsys_state *pos_css;
+	struct blkcg_gq *blkg;
+	bool ret = true;
+
+	if (td->limit_index != LIMIT_LOW)
+		return false;
+
+	if (time_before(jiffies, td->low_downgrade_time + throtl_slice))
+		return false;
+
+	throtl_update_idle_threshold(td);
+
+	rcu_read_lock();
+	blkg_for_each_descendant_post(blkg, pos_css, td->queue->root_blkg) {
+		struct throtl_grp *tg = blkg_to_tg(blkg);
+
+		if (tg == this_tg)
+			continue;
+		if (!list_empty(&blkg->blkcg->css.children))
+			continue;
+		if (!throtl_hierarchy_can_upgrade(tg)) {
+			ret = false;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return ret;
+}
+
+/*
+ * Switch to max limits and immediately dispatch whatever the new limits
+ * allow, bios held back under the low limits would otherwise wait out
+ * their old dispatch times.
+ */
+static void throtl_upgrade_state(struct throtl_data *td)
+{
+	struct cgroup_subsys_state *pos_css;
+	struct blkcg_gq *blkg;
+
+	throtl_log(&td->service_queue, "upgrade to max");
+	td->limit_index = LIMIT_MAX;
+	td->low_upgrade_time = jiffies;
+
+	rcu_read_lock();
+	blkg_for_each_descendant_post(blkg, pos_css, td->queue->root_blkg) {
+		struct throtl_grp *tg = blkg_to_tg(blkg);
+		struct throtl_service_queue *sq = &tg->service_queue;
+
+		tg->disptime = jiffies - 1;
+		throtl_select_dispatch(sq);
+		throtl_schedule_next_dispatch(sq, true);
+	}
+	rcu_read_unlock();
+
+	throtl_select_dispatch(&td->service_queue);
+	throtl_schedule_next_dispatch(&td->service_queue, true);
+	queue_work(kthrotld_workqueue, &td->dispatch_work);
+}
+
+static void throtl_downgrade_state(struct throtl_data *td)
+{
+	throtl_log(&td->service_queue, "downgrade to low");
+	td->limit_index = LIMIT_LOW;
+	td->low_downgrade_time = jiffies;
+}
+
+static void throtl_upgrade_check(struct throtl_grp *tg)
+{
+	unsigned long now = jiffies;
+	int rw;
+
+	if (tg->td->limit_index != LIMIT_LOW)
+		return;
+
+	if (time_after(tg->last_check_time + throtl_slice, now))
+		return;
+	tg->last_check_time = now;
+
+	/* throtl_downgrade_check() measures from the last check on */
+	for (rw = READ; rw <= WRITE; rw++) {
+		tg->last_bytes_disp[rw] = 0;
+		tg->last_io_disp[rw] = 0;
+	}
+
+	if (!time_after_eq(now,
+			   __tg_last_low_overflow_time(tg) + throtl_slice))
+		return;
+
+	if (throtl_can_upgrade(tg->td, NULL))
+		throtl_upgrade_state(tg->td);
+}
+
+/*
+ * A group which isn't idle but stays below its low limit for a whole
+ * slice is being squeezed by the others, go back to low limits.
+ */
+static bool throtl_tg_can_downgrade(struct throtl_grp *tg)
+{
+	struct throtl_data *td = tg->td;
+	unsigned long now = jiffies;
+
+	return time_after_eq(now, td->low_upgrade_time + throtl_slice) &&
+	       time_after_eq(now, tg_last_low_overflow_time(tg) + throtl_slice) &&
+	       (!throtl_tg_is_idle(tg) ||
+		!list_empty(&tg_to_blkg(tg)->blkcg->css.children));
+}
+
+static bool throtl_hierarchy_can_downgrade(struct throtl_grp *tg)
+{
+	while (true) {
+		if (!throtl_tg_can_downgrade(tg))
+			return false;
+		tg = sq_to_tg(tg->service_queue.parent_sq);
+		if (!tg || !tg_to_blkg(tg)->parent)
+			return true;
+	}
+}
+
+static void throtl_downgrade_check(struct throtl_grp *tg)
+{
+	unsigned long now = jiffies;
+	unsigned long elapsed;
+	int rw;
+
+	if (tg->td->limit_index != LIMIT_MAX ||
+	    !tg->td->limit_valid[LIMIT_LOW])
+		return;
+	if (!list_empty(&tg_to_blkg(tg)->blkcg->css.children))
+		return;
+	if (time_after(tg->last_check_time + throtl_slice, now))
+		return;
+
+	elapsed = now - tg->last_check_time;
+	tg->last_check_time = now;
+
+	if (time_before(now, tg_last_low_overflow_time(tg) + throtl_slice))
+		return;
+
+	for (rw = READ; rw <= WRITE; rw++) {
+		u64 bps = tg->last_bytes_disp[rw] * HZ;
+		u64 iops = (u64)tg->last_io_disp[rw] * HZ;
+
+		do_div(bps, elapsed);
+		do_div(iops, elapsed);
+		if ((tg->bps[rw][LIMIT_LOW] && bps >= tg->bps[rw][LIMIT_LOW]) ||
+		    (tg->iops[rw][LIMIT_LOW] && iops >= tg->iops[rw][LIMIT_LOW]))
+			tg->last_low_overflow_time[rw] = now;
+	}
+
+	throtl_update_idle_threshold(tg->td);
+	if (throtl_hierarchy_can_downgrade(tg))
+		throtl_downgrade_state(tg->td);
+
+	for (rw = READ; rw <= WRITE; rw++) {
+		tg->last_bytes_disp[rw] = 0;
+		tg->last_io_disp[rw] = 0;
+	}
+}
+
 /**
  * throtl_pending_timer_fn - timer function for service_queue->pending_timer
  * @arg: the throtl_service_queue being serviced
@@ -1025,6 +1491,8 @@ static void throtl_pending_timer_fn(unsigned long arg)
 	int ret;
 
 	spin_lock_irq(q->queue_lock);
+	if (throtl_can_upgrade(td, NULL))
+		throtl_upgrade_state(td);
 again:
 	parent_sq = sq->parent_sq;
 	dispatched = false;
@@ -1142,7 +1610,44 @@ static int tg_print_conf_uint(struct seq_file *sf, void *v)
 	return 0;
 }
 
-static void tg_conf_updated(struct throtl_grp *tg)
+/*
+ * Number of bios held back by each group and for how long it had bios
+ * queued, including the ongoing period.
+ */
+static u64 tg_prfill_throttle_stat(struct seq_file *sf,
+				   struct blkg_policy_data *pd, int off)
+{
+	struct throtl_grp *tg = pd_to_tg(pd);
+	const char *dname = blkg_dev_name(pd->blkg);
+	u64 now = ktime_get_ns();
+	u64 time[2];
+	int rw;
+
+	if (!dname)
+		return 0;
+
+	for (rw = READ; rw <= WRITE; rw++) {
+		time[rw] = tg->throttle_time[rw];
+		if (tg->service_queue.nr_queued[rw])
+			time[rw] += now - tg->throttle_start[rw];
+	}
+
+	seq_printf(sf, "%s rthrottled=%llu wthrottled=%llu rthrottle_usec=%llu wthrottle_usec=%llu\n",
+		   dname, tg->nr_throttled[READ], tg->nr_throttled[WRITE],
+		   div_u64(time[READ], NSEC_PER_USEC),
+		   div_u64(time[WRITE], NSEC_PER_USEC));
+	return 0;
+}
+
+static int tg_print_throttle_stat(struct seq_file *sf, void *v)
+{
+	blkcg_print_blkgs(sf, css_to_blkcg(seq_css(sf)),
+			  tg_prfill_throttle_stat, &blkcg_policy_throtl, 0,
+			  false);
+	return 0;
+}
+
+static void tg_conf_updated(struct throtl_grp *tg, bool global)
 {
 	struct throtl_service_queue *sq = &tg->service_queue;
 	struct cgroup_subsys_state *pos_css;
@@ -1150,17 +1655,19 @@ static void tg_conf_updated(struct throtl_grp *tg)
 
 	throtl_log(&tg->service_queue,
 		   "limit change rbps=%llu wbps=%llu riops=%u wiops=%u",
-		   tg->bps[READ], tg->bps[WRITE],
-		   tg->iops[READ], tg->iops[WRITE]);
+		   tg_bps_limit(tg, READ), tg_bps_limit(tg, WRITE),
+		   tg_iops_limit(tg, READ), tg_iops_limit(tg, WRITE));
 
 	/*
-	 * Update has_rules[] flags for the updated tg's subtree.  A tg is
-	 * considered to have rules if either the tg itself or any of its
-	 * ancestors has rules.  This identifies groups without any
-	 * restrictions in the whole hierarchy and allows them to bypass
-	 * blk-throttle.
+	 * Update has_rules[] flags for the updated tg's subtree, or for the
+	 * whole tree if @global, when low limits were turned on or off for
+	 * the queue.  A tg is considered to have rules if either the tg
+	 * itself or any of its ancestors has rules.  This identifies groups
+	 * without any restrictions in the whole hierarchy and allows them
+	 * to bypass blk-throttle.
 	 */
-	blkg_for_each_descendant_pre(blkg, pos_css, tg_to_blkg(tg))
+	blkg_for_each_descendant_pre(blkg, pos_css,
+			global ? tg->td->queue->root_blkg : tg_to_blkg(tg))
 		tg_update_has_rules(blkg_to_tg(blkg));
 
 	/*
@@ -1206,7 +1713,7 @@ static ssize_t tg_set_conf(struct kernfs_open_file *of,
 	else
 		*(unsigned int *)((void *)tg + of_cft(of)->private) = v;
 
-	tg_conf_updated(tg);
+	tg_conf_updated(tg, false);
 	ret = 0;
 out_finish:
 	blkg_conf_finish(&ctx);
@@ -1228,25 +1735,25 @@ static ssize_t tg_set_conf_uint(struct kernfs_open_file *of,
 static struct cftype throtl_legacy_files[] = {
 	{
 		.name = "throttle.read_bps_device",
-		.private = offsetof(struct throtl_grp, bps[READ]),
+		.private = offsetof(struct throtl_grp, bps[READ][LIMIT_MAX]),
 		.seq_show = tg_print_conf_u64,
 		.write = tg_set_conf_u64,
 	},
 	{
 		.name = "throttle.write_bps_device",
-		.private = offsetof(struct throtl_grp, bps[WRITE]),
+		.private = offsetof(struct throtl_grp, bps[WRITE][LIMIT_MAX]),
 		.seq_show = tg_print_conf_u64,
 		.write = tg_set_conf_u64,
 	},
 	{
 		.name = "throttle.read_iops_device",
-		.private = offsetof(struct throtl_grp, iops[READ]),
+		.private = offsetof(struct throtl_grp, iops[READ][LIMIT_MAX]),
 		.seq_show = tg_print_conf_uint,
 		.write = tg_set_conf_uint,
 	},
 	{
 		.name = "throttle.write_iops_device",
-		.private = offsetof(struct throtl_grp, iops[WRITE]),
+		.private = offsetof(struct throtl_grp, iops[WRITE][LIMIT_MAX]),
 		.seq_show = tg_print_conf_uint,
 		.write = tg_set_conf_uint,
 	},
@@ -1260,67 +1767,89 @@ static struct cftype throtl_legacy_files[] = {
 		.private = (unsigned long)&blkcg_policy_throtl,
 		.seq_show = blkg_print_stat_ios,
 	},
+	{
+		.name = "throttle.stat",
+		.seq_show = tg_print_throttle_stat,
+	},
 	{ }	/* terminate */
 };
 
-static u64 tg_prfill_max(struct seq_file *sf, struct blkg_policy_data *pd,
-			 int off)
+static u64 tg_prfill_limit(struct seq_file *sf, struct blkg_policy_data *pd,
+			   int off)
 {
 	struct throtl_grp *tg = pd_to_tg(pd);
 	const char *dname = blkg_dev_name(pd->blkg);
 	char bufs[4][21] = { "max", "max", "max", "max" };
+	u64 bps_dft = off == LIMIT_LOW ? 0 : -1;
+	unsigned int iops_dft = off == LIMIT_LOW ? 0 : -1;
 
 	if (!dname)
 		return 0;
-	if (tg->bps[READ] == -1 && tg->bps[WRITE] == -1 &&
-	    tg->iops[READ] == -1 && tg->iops[WRITE] == -1)
+	if (tg->bps[READ][off] == bps_dft && tg->bps[WRITE][off] == bps_dft &&
+	    tg->iops[READ][off] == iops_dft && tg->iops[WRITE][off] == iops_dft)
 		return 0;
 
-	if (tg->bps[READ] != -1)
-		snprintf(bufs[0], sizeof(bufs[0]), "%llu", tg->bps[READ]);
-	if (tg->bps[WRITE] != -1)
-		snprintf(bufs[1], sizeof(bufs[1]), "%llu", tg->bps[WRITE]);
-	if (tg->iops[READ] != -1)
-		snprintf(bufs[2], sizeof(bufs[2]), "%u", tg->iops[READ]);
-	if (tg->iops[WRITE] != -1)
-		snprintf(bufs[3], sizeof(bufs[3]), "%u", tg->iops[WRITE]);
+	if (tg->bps[READ][off] != -1)
+		snprintf(bufs[0], sizeof(bufs[0]), "%llu", tg->bps[READ][off]);
+	if (tg->bps[WRITE][off] != -1)
+		snprintf(bufs[1], sizeof(bufs[1]), "%llu", tg->bps[WRITE][off]);
+	if (tg->iops[READ][off] != -1)
+		snprintf(bufs[2], sizeof(bufs[2]), "%u", tg->iops[READ][off]);
+	if (tg->iops[WRITE][off] != -1)
+		snprintf(bufs[3], sizeof(bufs[3]), "%u", tg->iops[WRITE][off]);
 
 	seq_printf(sf, "%s rbps=%s wbps=%s riops=%s wiops=%s\n",
 		   dname, bufs[0], bufs[1], bufs[2], bufs[3]);
 	return 0;
 }
 
-static int tg_print_max(struct seq_file *sf, void *v)
+static int tg_print_limit(struct seq_file *sf, void *v)
 {
-	blkcg_print_blkgs(sf, css_to_blkcg(seq_css(sf)), tg_prfill_max,
+	blkcg_print_blkgs(sf, css_to_blkcg(seq_css(sf)), tg_prfill_limit,
 			  &blkcg_policy_throtl, seq_cft(sf)->private, false);
 	return 0;
 }
 
-static ssize_t tg_set_max(struct kernfs_open_file *of,
-			  char *buf, size_t nbytes, loff_t off)
+/*
+ * "max" limits are hard caps, 0 isn't a valid one.  "low" limits are
+ * what a group is guaranteed while others are busy, 0 removes the
+ * guarantee.  Writing "max" means no limit, for a low limit that's 0.
+ * A low limit can't be set above the max limit of the same group.
+ */
+static ssize_t tg_set_limit(struct kernfs_open_file *of,
+			    char *buf, size_t nbytes, loff_t off)
 {
 	struct blkcg *blkcg = css_to_blkcg(of_css(of));
+	int index = of_cft(of)->private;
 	struct blkg_conf_ctx ctx;
 	struct throtl_grp *tg;
-	u64 v[4];
-	int ret;
+	struct throtl_data *td;
+	int other = index == LIMIT_LOW ? LIMIT_MAX : LIMIT_LOW;
+	bool low_valid;
+	u64 v[4], o[4];
+	int i, ret;
 
 	ret = blkg_conf_prep(blkcg, &blkcg_policy_throtl, buf, &ctx);
 	if (ret)
 		return ret;
 
 	tg = blkg_to_tg(ctx.blkg);
+	td = tg->td;
 
-	v[0] = tg->bps[READ];
-	v[1] = tg->bps[WRITE];
-	v[2] = tg->iops[READ];
-	v[3] = tg->iops[WRITE];
+	v[0] = tg->bps[READ][index];
+	v[1] = tg->bps[WRITE][index];
+	v[2] = tg->iops[READ][index];
+	v[3] = tg->iops[WRITE][index];
+
+	o[0] = tg->bps[READ][other];
+	o[1] = tg->bps[WRITE][other];
+	o[2] = tg->iops[READ][other];
+	o[3] = tg->iops[WRITE][other];
 
 	while (true) {
 		char tok[27];	/* wiops=18446744073709551616 */
 		char *p;
-		u64 val = -1;
+		u64 val = index == LIMIT_LOW ? 0 : -1;
 		int len;
 
 		if (sscanf(ctx.body, "%26s%n", tok, &len) != 1)
@@ -1336,7 +1865,7 @@ static ssize_t tg_set_max(struct kernfs_open_file *of,
 			goto out_finish;
 
 		ret = -ERANGE;
-		if (!val)
+		if (!val && index == LIMIT_MAX)
 			goto out_finish;
 
 		ret = -EINVAL;
@@ -1352,12 +1881,38 @@ static ssize_t tg_set_max(struct kernfs_open_file *of,
 			goto out_finish;
 	}
 
-	tg->bps[READ] = v[0];
-	tg->bps[WRITE] = v[1];
-	tg->iops[READ] = v[2];
-	tg->iops[WRITE] = v[3];
+	ret = -EINVAL;
+	for (i = 0; i < 4; i++) {
+		u64 low = index == LIMIT_LOW ? v[i] : o[i];
+		u64 max = index == LIMIT_LOW ? o[i] : v[i];
+
+		if (low > max)
+			goto out_finish;
+	}
+
+	tg->bps[READ][index] = v[0];
+	tg->bps[WRITE][index] = v[1];
+	tg->iops[READ][index] = v[2];
+	tg->iops[WRITE][index] = v[3];
 
-	tg_conf_updated(tg);
+	/*
+	 * Newly configured low limits take effect right away, the queue
+	 * upgrades again once the groups are satisfied.  Completion
+	 * latencies feed the idle detection, make sure they're collected.
+	 */
+	low_valid = td->limit_valid[LIMIT_LOW];
+	if (index == LIMIT_LOW) {
+		blk_throtl_update_limit_valid(td);
+		if (td->limit_valid[LIMIT_LOW]) {
+			blk_stat_enable(td->queue);
+			throtl_update_idle_threshold(td);
+			throtl_downgrade_state(td);
+		} else if (td->limit_index == LIMIT_LOW) {
+			throtl_upgrade_state(td);
+		}
+	}
+
+	tg_conf_updated(tg, td->limit_valid[LIMIT_LOW] != low_valid);
 	ret = 0;
 out_finish:
 	blkg_conf_finish(&ctx);
@@ -1365,11 +1920,23 @@ out_finish:
 }
 
 static struct cftype throtl_files[] = {
+	{
+		.name = "low",
+		.flags = CFTYPE_NOT_ON_ROOT,
+		.private = LIMIT_LOW,
+		.seq_show = tg_print_limit,
+		.write = tg_set_limit,
+	},
 	{
 		.name = "max",
 		.flags = CFTYPE_NOT_ON_ROOT,
-		.seq_show = tg_print_max,
-		.write = tg_set_max,
+		.private = LIMIT_MAX,
+		.seq_show = tg_print_limit,
+		.write = tg_set_limit,
+	},
+	{
+		.name = "throttle.stat",
+		.seq_show = tg_print_throttle_stat,
 	},
 	{ }	/* terminate */
 };
@@ -1388,6 +1955,7 @@ static struct blkcg_policy blkcg_policy_throtl = {
 	.pd_alloc_fn		= throtl_pd_alloc,
 	.pd_init_fn		= throtl_pd_init,
 	.pd_online_fn		= throtl_pd_online,
+	.pd_offline_fn		= throtl_pd_offline,
 	.pd_free_fn		= throtl_pd_free,
 };
 
@@ -1411,16 +1979,33 @@ bool blk_throtl_bio(struct request_queue *q, struct blkcg_gq *blkg,
 	if (unlikely(blk_queue_bypass(q)))
 		goto out_unlock;
 
+	if (tg->td->limit_valid[LIMIT_LOW])
+		throtl_update_idletime(tg);
+
 	sq = &tg->service_queue;
 
+again:
 	while (true) {
+		throtl_downgrade_check(tg);
+		throtl_upgrade_check(tg);
+
 		/* throtl is FIFO - if bios are already queued, should queue */
 		if (sq->nr_queued[rw])
 			break;
 
-		/* if above limits, break to queue */
-		if (!tg_may_dispatch(tg, bio, NULL))
+		/*
+		 * If above limits, break to queue.  At low limits, being
+		 * held back might be the last thing keeping the queue
+		 * there, check before queueing.
+		 */
+		if (!tg_may_dispatch(tg, bio, NULL)) {
+			tg->last_low_overflow_time[rw] = jiffies;
+			if (throtl_can_upgrade(tg->td, tg)) {
+				throtl_upgrade_state(tg->td);
+				goto again;
+			}
 			break;
+		}
 
 		/* within limits, let's charge and dispatch directly */
 		throtl_charge_bio(tg, bio);
@@ -1453,11 +2038,13 @@ bool blk_throtl_bio(struct request_queue *q, struct blkcg_gq *blkg,
 	/* out-of-limit, queue to @tg */
 	throtl_log(sq, "[%c] bio. bdisp=%llu sz=%u bps=%llu iodisp=%u iops=%u queued=%d/%d",
 		   rw == READ ? 'R' : 'W',
-		   tg->bytes_disp[rw], bio->bi_iter.bi_size, tg->bps[rw],
-		   tg->io_disp[rw], tg->iops[rw],
+		   tg->bytes_disp[rw], bio->bi_iter.bi_size,
+		   tg_bps_limit(tg, rw),
+		   tg->io_disp[rw], tg_iops_limit(tg, rw),
 		   sq->nr_queued[READ], sq->nr_queued[WRITE]);
 
 	bio_associate_current(bio);
+	tg->nr_throttled[rw]++;
 	tg->td->nr_queued[rw]++;
 	throtl_add_bio_tg(bio, qn, tg);
 	throttled = true;
@@ -1565,6 +2152,11 @@ int blk_throtl_init(struct request_queue *q)
 	q->td = td;
 	td->queue = q;
 
+	td->limit_valid[LIMIT_MAX] = true;
+	td->limit_index = LIMIT_MAX;
+	td->low_upgrade_time = jiffies;
+	td->low_downgrade_time = jiffies;
+
 	/* activate policy */
 	ret = blkcg_activate_policy(q, &blkcg_policy_throtl);
 	if (ret)
@@ -14,15 +14,22 @@
  *   scaling step of 0 if reads show up or the heavy writers finish. Unlike
  *   positive scaling steps where we shrink the monitoring window, a negative
  *   scaling step retains the default step==0 window size.
+ * - With blkcg, a cgroup can be given its own latency target per device.
+ *   Such a group gets a private rq_wait budget for its buffered writeback,
+ *   and its own window of completion latencies. Groups that miss their
+ *   target are scaled down first, and the whole device is only scaled down
+ *   if no group could be blamed for a latency violation.
  *
  * Copyright (C) 2016 Jens Axboe
  *
  */
 #include <linux/kernel.h>
+#include <linux/module.h>
 #include <linux/blk_types.h>
 #include <linux/slab.h>
 #include <linux/backing-dev.h>
 #include <linux/swap.h>
+#include <linux/blk-cgroup.h>
 
 #include "blk-wbt.h"
 
@@ -53,6 +60,13 @@ enum {
 	RWB_UNKNOWN_BUMP	= 5,
 };
 
+enum {
+	LAT_OK = 1,
+	LAT_UNKNOWN,
+	LAT_UNKNOWN_WRITES,
+	LAT_EXCEEDED,
+};
+
 static inline bool rwb_enabled(struct rq_wb *rwb)
 {
 	return rwb && rwb->wb_normal != 0;
@@ -118,15 +132,39 @@ static void rwb_wake_all(struct rq_wb *rwb)
 	}
 }
 
-void __wbt_done(struct rq_wb *rwb, enum wbt_flags wb_acct)
+/*
+ * Scale a queue depth down by 'step' halvings, never going below 1.
+ */
+static inline unsigned int scale_depth(unsigned int depth, int step)
 {
-	struct rq_wait *rqw;
-	int inflight, limit;
+	if (!depth || step <= 0)
+		return depth;
 
-	if (!(wb_acct & WBT_TRACKED))
-		return;
+	return 1 + ((depth - 1) >> min(31, step));
+}
+
+/*
+ * Groups with a latency target each have their own budget. The device
+ * wide limits are split between those and the budget everybody else
+ * shares, so adding groups doesn't add depth. kswapd keeps its full
+ * budget, it has to make progress.
+ */
+static unsigned int wbt_share(struct rq_wb *rwb, unsigned int depth,
+			      bool shared)
+{
+	unsigned int shares = READ_ONCE(rwb->nr_grp_targets) + 1;
+
+	if (!shared || shares == 1 || !depth)
+		return depth;
+
+	return max(1U, depth / shares);
+}
+
+static void rqw_done(struct rq_wb *rwb, struct rq_wait *rqw, int step,
+		     bool shared)
+{
+	int inflight, limit;
 
-	rqw = get_rq_wait(rwb, wb_acct & WBT_KSWAPD);
 	inflight = atomic_dec_return(&rqw->inflight);
 
 	/*
@@ -135,6 +173,8 @@ void __wbt_done(struct rq_wb *rwb, enum wbt_flags wb_acct)
 	 */
 	if (unlikely(!rwb_enabled(rwb))) {
 		rwb_wake_all(rwb);
+		if (waitqueue_active(&rqw->wait))
+			wake_up_all(&rqw->wait);
 		return;
 	}
 
@@ -145,7 +185,8 @@ void __wbt_done(struct rq_wb *rwb, enum wbt_flags wb_acct)
 	if (rwb->wc && !wb_recent_wait(rwb))
 		limit = 0;
 	else
-		limit = rwb->wb_normal;
+		limit = scale_depth(wbt_share(rwb, rwb->wb_normal, shared),
+				    step);
 
 	/*
 	 * Don't wake anyone up if we are above the normal limit.
@@ -156,19 +197,420 @@ void __wbt_done(struct rq_wb *rwb, enum wbt_flags wb_acct)
 	if (waitqueue_active(&rqw->wait)) {
 		int diff = limit - inflight;
 
-		if (!inflight || diff >= rwb->wb_background / 2)
+		if (!inflight ||
+		    diff >= scale_depth(wbt_share(rwb, rwb->wb_background,
+						  shared), step) / 2)
 			wake_up_all(&rqw->wait);
 	}
 }
 
+#ifdef CONFIG_BLK_CGROUP
+
+struct wbt_grp {
+	/* must be the first member */
+	struct blkg_policy_data pd;
+
+	/* latency target, 0 if this group doesn't have one */
+	u64 min_lat_nsec;
+
+	/*
+	 * How many times this group has been scaled down on top of the
+	 * device wide limits, and the number of consecutive windows without
+	 * enough samples to judge it.
+	 */
+	int scale_step;
+	unsigned int unknown_cnt;
+
+	/* budget for buffered writeback issued from this group */
+	struct rq_wait rq_wait;
+
+	/* per-cpu read/write latency windows, see blk_stat_alloc_percpu() */
+	struct blk_rq_stat __percpu *cpu_stat;
+
+	/* on rq_wb->grp_list while ->min_lat_nsec is set */
+	struct list_head node;
+};
+
+static struct blkcg_policy blkcg_policy_wbt;
+
+static inline struct wbt_grp *pd_to_wg(struct blkg_policy_data *pd)
+{
+	return pd ? container_of(pd, struct wbt_grp, pd) : NULL;
+}
+
+static inline struct wbt_grp *blkg_to_wg(struct blkcg_gq *blkg)
+{
+	return pd_to_wg(blkg_to_pd(blkg, &blkcg_policy_wbt));
+}
+
+static inline struct blkcg_gq *wg_to_blkg(struct wbt_grp *wg)
+{
+	return pd_to_blkg(&wg->pd);
+}
+
+/*
+ * Look up the group @bio belongs to. If it has a latency target, grab a
+ * reference to its blkg, which is dropped again from __wbt_done().
+ */
+static struct wbt_grp *wbt_bio_grp(struct rq_wb *rwb, struct bio *bio)
+{
+	struct blkcg_gq *blkg;
+	struct wbt_grp *wg = NULL;
+
+	if (!READ_ONCE(rwb->nr_grp_targets))
+		return NULL;
+
+	rcu_read_lock();
+	blkg = blkg_lookup(bio_blkcg(bio), rwb->queue);
+	if (blkg) {
+		wg = blkg_to_wg(blkg);
+		if (wg && (!READ_ONCE(wg->min_lat_nsec) ||
+			   !atomic_inc_not_zero(&blkg->refcnt)))
+			wg = NULL;
+	}
+	rcu_read_unlock();
+
+	return wg;
+}
+
+/*
+ * The group a request is charged to is found through ->rl, which points at
+ * that group's request_list. The legacy path has already set it up for the
+ * bio's blkg in get_request(), blk-mq requests don't use it otherwise.
+ */
+static bool wbt_rq_set_blkg(struct request *rq, struct blkcg_gq *blkg)
+{
+	struct request_queue *q = rq->q;
+
+	if (!q->mq_ops)
+		return rq->rl && rq->rl->blkg == blkg;
+
+	if (blkg == q->root_blkg)
+		rq->rl = &q->root_rl;
+	else
+		rq->rl = &blkg->rl;
+	return true;
+}
+
+static struct blkcg_gq *wbt_rq_blkg(struct request *rq)
+{
+	if (!(wbt_stat_to_mask(&rq->issue_stat) & WBT_GRP))
+		return NULL;
+
+	return rq->rl->blkg;
+}
+
+void wbt_stat_add(struct rq_wb *rwb, struct request *rq, u64 now)
+{
+	struct blkcg_gq *blkg = wbt_rq_blkg(rq);
+	struct blk_rq_stat *stat;
+	struct wbt_grp *wg;
+
+	if (!rwb || !blkg)
+		return;
+
+	wg = blkg_to_wg(blkg);
+	if (!wg)
+		return;
+
+	stat = get_cpu_ptr(wg->cpu_stat);
+	blk_stat_add(&stat[rq_data_dir(rq)], rq, now);
+	put_cpu_ptr(wg->cpu_stat);
+}
+
+/*
+ * A group is judged on its own completions only. Since we only throttle
+ * its writes, both its read and its write latencies count against the
+ * target: a group whose writeback is queued so deep that it misses its
+ * target is the one we want to back off first.
+ */
+static int wbt_grp_latency_exceeded(struct wbt_grp *wg,
+				    struct blk_rq_stat *stat)
+{
+	const bool reads = stat[BLK_STAT_READ].nr_samples >= 1;
+	const bool writes = stat[BLK_STAT_WRITE].nr_samples >=
+				RWB_MIN_WRITE_SAMPLES;
+
+	if (reads && stat[BLK_STAT_READ].min > wg->min_lat_nsec)
+		return LAT_EXCEEDED;
+	if (writes && stat[BLK_STAT_WRITE].min > wg->min_lat_nsec)
+		return LAT_EXCEEDED;
+	if (reads || writes)
+		return LAT_OK;
+
+	return LAT_UNKNOWN;
+}
+
+/*
+ * Evaluate the latency window of every group with a target. Groups that
+ * missed their target get their writeback depth halved, groups that are
+ * comfortably within it get it back. Returns true if a group was scaled
+ * down. Only the timer updates the group state, so the groups are walked
+ * under RCU rather than with the queue lock held.
+ */
+static bool wbt_grps_update(struct rq_wb *rwb)
+{
+	struct blk_rq_stat stat[2];
+	struct wbt_grp *wg;
+	bool throttled = false;
+
+	if (!READ_ONCE(rwb->nr_grp_targets))
+		return false;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(wg, &rwb->grp_list, node) {
+		if (!READ_ONCE(wg->min_lat_nsec))
+			continue;
+
+		blk_stat_percpu_get(wg->cpu_stat, stat);
+
+		switch (wbt_grp_latency_exceeded(wg, stat)) {
+		case LAT_EXCEEDED:
+			if (scale_depth(wbt_share(rwb, rwb->wb_max, true),
+					wg->scale_step) > 1) {
+				wg->scale_step++;
+				throttled = true;
+			}
+			wg->unknown_cnt = 0;
+			break;
+		case LAT_OK:
+			if (wg->scale_step)
+				wg->scale_step--;
+			wg->unknown_cnt = 0;
+			break;
+		default:
+			if (++wg->unknown_cnt < RWB_UNKNOWN_BUMP)
+				continue;
+			/*
+			 * Nothing to judge the group by for a while, slowly
+			 * hand back the depth we took away.
+			 */
+			if (wg->scale_step)
+				wg->scale_step--;
+			wg->unknown_cnt = 0;
+			break;
+		}
+
+		blk_stat_percpu_clear(wg->cpu_stat);
+		if (waitqueue_active(&wg->rq_wait.wait))
+			wake_up_all(&wg->rq_wait.wait);
+	}
+	rcu_read_unlock();
+
+	return throttled;
+}
+
+static struct blkg_policy_data *wbt_pd_alloc(gfp_t gfp, int node)
+{
+	struct wbt_grp *wg;
+
+	wg = kzalloc_node(sizeof(*wg), gfp, node);
+	if (!wg)
+		return NULL;
+
+	wg->cpu_stat = blk_stat_alloc_percpu(gfp);
+	if (!wg->cpu_stat) {
+		kfree(wg);
+		return NULL;
+	}
+
+	atomic_set(&wg->rq_wait.inflight, 0);
+	init_waitqueue_head(&wg->rq_wait.wait);
+
+	return &wg->pd;
+}
+
+static void wbt_pd_offline(struct blkg_policy_data *pd)
+{
+	struct wbt_grp *wg = pd_to_wg(pd);
+	struct rq_wb *rwb = pd->blkg->q->rq_wb;
+
+	if (wg->min_lat_nsec && rwb) {
+		rwb->nr_grp_targets--;
+		list_del_rcu(&wg->node);
+	}
+	wg->min_lat_nsec = 0;
+}
+
+static void wbt_pd_free(struct blkg_policy_data *pd)
+{
+	struct wbt_grp *wg = pd_to_wg(pd);
+
+	free_percpu(wg->cpu_stat);
+	kfree(wg);
+}
+
+static u64 wbt_prfill_lat(struct seq_file *sf, struct blkg_policy_data *pd,
+			  int off)
+{
+	struct wbt_grp *wg = pd_to_wg(pd);
+
+	if (!wg->min_lat_nsec)
+		return 0;
+	return __blkg_prfill_u64(sf, pd, div_u64(wg->min_lat_nsec, 1000));
+}
+
+static int wbt_print_lat(struct seq_file *sf, void *v)
+{
+	blkcg_print_blkgs(sf, css_to_blkcg(seq_css(sf)), wbt_prfill_lat,
+			  &blkcg_policy_wbt, seq_cft(sf)->private, false);
+	return 0;
+}
+
+static ssize_t wbt_set_lat(struct kernfs_open_file *of, char *buf,
+			   size_t nbytes, loff_t off)
+{
+	struct blkcg *blkcg = css_to_blkcg(of_css(of));
+	struct blkg_conf_ctx ctx;
+	struct wbt_grp *wg;
+	struct rq_wb *rwb;
+	int ret;
+	u64 v;
+
+	ret = blkg_conf_prep(blkcg, &blkcg_policy_wbt, buf, &ctx);
+	if (ret)
+		return ret;
+
+	ret = -EINVAL;
+	if (sscanf(ctx.body, "%llu", &v) != 1)
+		goto out_finish;
+
+	rwb = ctx.blkg->q->rq_wb;
+	if (!rwb)
+		goto out_finish;
+
+	wg = blkg_to_wg(ctx.blkg);
+	if (!wg->min_lat_nsec && v) {
+		rwb->nr_grp_targets++;
+		list_add_tail_rcu(&wg->node, &rwb->grp_list);
+	} else if (wg->min_lat_nsec && !v) {
+		rwb->nr_grp_targets--;
+		list_del_rcu(&wg->node);
+	}
+
+	wg->min_lat_nsec = v * 1000ULL;
+	wg->scale_step = 0;
+	wg->unknown_cnt = 0;
+	blk_stat_percpu_clear(wg->cpu_stat);
+	if (waitqueue_active(&wg->rq_wait.wait))
+		wake_up_all(&wg->rq_wait.wait);
+
+	ret = 0;
+out_finish:
+	blkg_conf_finish(&ctx);
+	return ret ?: nbytes;
+}
+
+static struct cftype wbt_legacy_files[] = {
+	{
+		.name = "wbt.lat_usec",
+		.seq_show = wbt_print_lat,
+		.write = wbt_set_lat,
+	},
+	{ }	/* terminate */
+};
+
+static struct cftype wbt_files[] = {
+	{
+		.name = "wbt.lat_usec",
+		.flags = CFTYPE_NOT_ON_ROOT,
+		.seq_show = wbt_print_lat,
+		.write = wbt_set_lat,
+	},
+	{ }	/* terminate */
+};
+
+static struct blkcg_policy blkcg_policy_wbt = {
+	.dfl_cftypes		= wbt_files,
+	.legacy_cftypes		= wbt_legacy_files,
+
+	.pd_alloc_fn		= wbt_pd_alloc,
+	.pd_offline_fn		= wbt_pd_offline,
+	.pd_free_fn		= wbt_pd_free,
+};
+
+static int __init wbt_policy_init(void)
+{
+	return blkcg_policy_register(&blkcg_policy_wbt);
+}
+subsys_initcall(wbt_policy_init);
+
+#else /* CONFIG_BLK_CGROUP */
+
+struct wbt_grp {
+	int scale_step;
+	struct rq_wait rq_wait;
+};
+
+static inline struct wbt_grp *blkg_to_wg(struct blkcg_gq *blkg)
+{
+	return NULL;
+}
+
+static inline struct blkcg_gq *wg_to_blkg(struct wbt_grp *wg)
+{
+	return NULL;
+}
+
+static inline struct wbt_grp *wbt_bio_grp(struct rq_wb *rwb, struct bio *bio)
+{
+	return NULL;
+}
+
+static inline bool wbt_rq_set_blkg(struct request *rq, struct blkcg_gq *blkg)
+{
+	return false;
+}
+
+static inline struct blkcg_gq *wbt_rq_blkg(struct request *rq)
+{
+	return NULL;
+}
+
+void wbt_stat_add(struct rq_wb *rwb, struct request *rq, u64 now)
+{
+}
+
+static inline bool wbt_grps_update(struct rq_wb *rwb)
+{
+	return false;
+}
+
+#endif /* CONFIG_BLK_CGROUP */
+
+void __wbt_done(struct rq_wb *rwb, enum wbt_flags wb_acct,
+		struct blkcg_gq *blkg)
+{
+	struct wbt_grp *wg = blkg ? blkg_to_wg(blkg) : NULL;
+
+	if (wb_acct & WBT_TRACKED) {
+		if (wg && !(wb_acct & WBT_KSWAPD)) {
+			atomic_dec(&rwb->grp_inflight);
+			rqw_done(rwb, &wg->rq_wait, wg->scale_step, true);
+		} else
+			rqw_done(rwb, get_rq_wait(rwb, wb_acct & WBT_KSWAPD), 0,
+				 !(wb_acct & WBT_KSWAPD));
+	}
+
+	if (blkg)
+		blkg_put(blkg);
+}
+
 /*
  * Called on completion of a request. Note that it's also called when
  * a request is merged, when the request gets freed.
  */
-void wbt_done(struct rq_wb *rwb, struct blk_issue_stat *stat)
+void wbt_done(struct rq_wb *rwb, struct request *rq)
 {
-	if (!rwb)
+	struct blk_issue_stat *stat = &rq->issue_stat;
+	struct blkcg_gq *blkg = wbt_rq_blkg(rq);
+
+	if (!rwb) {
+		if (blkg)
+			blkg_put(blkg);
+		wbt_clear_state(stat);
 		return;
+	}
 
 	if (!wbt_is_tracked(stat)) {
 		if (rwb->sync_cookie == stat) {
@@ -178,12 +620,34 @@ void wbt_done(struct rq_wb *rwb, struct blk_issue_stat *stat)
 
 		if (wbt_is_read(stat))
 			wb_timestamp(rwb, &rwb->last_comp);
-		wbt_clear_state(stat);
-	} else {
+	} else
 		WARN_ON_ONCE(stat == rwb->sync_cookie);
-		__wbt_done(rwb, wbt_stat_to_mask(stat));
-		wbt_clear_state(stat);
+
+	__wbt_done(rwb, wbt_stat_to_mask(stat), blkg);
+	wbt_clear_state(stat);
+}
+
+/*
+ * Mark @rq with the flags wbt_wait() returned for its bio. The reference
+ * to @blkg is kept until wbt_done().
+ */
+void wbt_track(struct request *rq, enum wbt_flags wb_acct,
+	       struct blkcg_gq *blkg)
+{
+	if (blkg) {
+		if (wbt_rq_set_blkg(rq, blkg)) {
+			wb_acct |= WBT_GRP;
+		} else {
+			/*
+			 * The group went offline before the legacy path got
+			 * its request_list, settle the charge right away.
+			 */
+			__wbt_done(rq->q->rq_wb, wb_acct, blkg);
+			wb_acct &= WBT_READ;
+		}
 	}
+
+	rq->issue_stat.time |= ((u64) wb_acct) << BLK_STAT_SHIFT;
 }
 
 /*
@@ -224,7 +688,7 @@ static bool calc_wb_limits(struct rq_wb *rwb)
 		 */
 		depth = min_t(unsigned int, RWB_DEF_DEPTH, rwb->queue_depth);
 		if (rwb->scale_step > 0)
-			depth = 1 + ((depth - 1) >> min(31, rwb->scale_step));
+			depth = scale_depth(depth, rwb->scale_step);
 		else if (rwb->scale_step < 0) {
 			unsigned int maxd = 3 * rwb->queue_depth / 4;
 
@@ -270,14 +734,8 @@ static u64 rwb_sync_issue_lat(struct rq_wb *rwb)
 	return now - issue;
 }
 
-enum {
-	LAT_OK = 1,
-	LAT_UNKNOWN,
-	LAT_UNKNOWN_WRITES,
-	LAT_EXCEEDED,
-};
-
-static int __latency_exceeded(struct rq_wb *rwb, struct blk_rq_stat *stat)
+static int __latency_exceeded(struct rq_wb *rwb, struct blk_rq_stat *stat,
+			      u64 pct_lat)
 {
 	struct backing_dev_info *bdi = rwb->queue->backing_dev_info;
 	u64 thislat;
@@ -315,10 +773,12 @@ static int __latency_exceeded(struct rq_wb *rwb, struct blk_rq_stat *stat)
 	}
 
 	/*
-	 * If the 'min' latency exceeds our target, step down.
+	 * If the 'min' latency, or the configured read percentile, exceeds
+	 * our target, step down.
 	 */
-	if (stat[BLK_STAT_READ].min > rwb->min_lat_nsec) {
-		trace_wbt_lat(bdi, stat[BLK_STAT_READ].min);
+	thislat = pct_lat ?: stat[BLK_STAT_READ].min;
+	if (thislat > rwb->min_lat_nsec) {
+		trace_wbt_lat(bdi, thislat);
 		trace_wbt_stat(bdi, stat);
 		return LAT_EXCEEDED;
 	}
@@ -329,12 +789,40 @@ static int __latency_exceeded(struct rq_wb *rwb, struct blk_rq_stat *stat)
 	return LAT_OK;
 }
 
+/*
+ * Read completion percentile over the histogram samples that came in
+ * since the last window, or 0 if percentile mode is off or we don't have
+ * samples.
+ */
+static u64 rwb_pct_lat(struct rq_wb *rwb)
+{
+	unsigned int pct = READ_ONCE(rwb->lat_pct);
+	u64 lat;
+
+	if (!pct)
+		return 0;
+
+	/*
+	 * Pairs with the barrier in wbt_set_lat_pct(), the buffers are
+	 * in place once the percentile is visible.
+	 */
+	smp_rmb();
+
+	blk_queue_stat_hist_get(rwb->queue, rwb->hist);
+	blk_stat_hist_sub(rwb->hist, rwb->hist_prev);
+	lat = blk_stat_hist_percentile(rwb->hist, BLK_STAT_HIST_READ, -1, pct);
+
+	/* Fold the window back in, ->hist_prev is now the current total */
+	blk_stat_hist_sum(rwb->hist_prev, rwb->hist);
+	return lat;
+}
+
 static int latency_exceeded(struct rq_wb *rwb)
 {
 	struct blk_rq_stat stat[2];
 
 	blk_queue_stat_get(rwb->queue, stat);
-	return __latency_exceeded(rwb, stat);
+	return __latency_exceeded(rwb, stat, rwb_pct_lat(rwb));
 }
 
 static void rwb_trace_step(struct rq_wb *rwb, const char *msg)
@@ -419,9 +907,11 @@ static void wb_timer_fn(unsigned long data)
 {
 	struct rq_wb *rwb = (struct rq_wb *) data;
 	unsigned int inflight = wbt_inflight(rwb);
+	bool grp_throttled;
 	int status;
 
 	status = latency_exceeded(rwb);
+	grp_throttled = wbt_grps_update(rwb);
 
 	trace_wbt_timer(rwb->queue->backing_dev_info, status, rwb->scale_step,
 			inflight);
@@ -433,7 +923,13 @@ static void wb_timer_fn(unsigned long data)
 	 */
 	switch (status) {
 	case LAT_EXCEEDED:
-		scale_down(rwb, true);
+		/*
+		 * If a group missed its own target, it was just scaled down.
+		 * Give that a window to take effect before we throttle
+		 * everybody else as well.
+		 */
+		if (!grp_throttled)
+			scale_down(rwb, true);
 		break;
 	case LAT_OK:
 		scale_up(rwb);
@@ -516,7 +1012,8 @@ static inline unsigned int get_limit(struct rq_wb *rwb, unsigned long rw)
 }
 
 static inline bool may_queue(struct rq_wb *rwb, struct rq_wait *rqw,
-			     wait_queue_t *wait, unsigned long rw)
+			     wait_queue_t *wait, unsigned long rw, int *step,
+			     bool shared)
 {
 	/*
 	 * inc it here even if disabled, since we'll dec it at completion.
@@ -536,28 +1033,42 @@ static inline bool may_queue(struct rq_wb *rwb, struct rq_wait *rqw,
 	    rqw->wait.task_list.next != &wait->task_list)
 		return false;
 
-	return atomic_inc_below(&rqw->inflight, get_limit(rwb, rw));
+	return atomic_inc_below(&rqw->inflight,
+			scale_depth(wbt_share(rwb, get_limit(rwb, rw), shared),
+				    READ_ONCE(*step)));
 }
 
 /*
  * Block if we will exceed our limit, or if we are currently waiting for
- * the timer to kick off queuing again.
+ * the timer to kick off queuing again. If @wg is set, the write is charged
+ * to that group's budget instead of the device wide one.
  */
-static void __wbt_wait(struct rq_wb *rwb, unsigned long rw, spinlock_t *lock)
+static void __wbt_wait(struct rq_wb *rwb, struct wbt_grp *wg,
+		       unsigned long rw, spinlock_t *lock)
 	__releases(lock)
 	__acquires(lock)
 {
-	struct rq_wait *rqw = get_rq_wait(rwb, current_is_kswapd());
+	struct rq_wait *rqw;
+	int dev_step = 0, *step = &dev_step;
+	bool shared = true;
 	DEFINE_WAIT(wait);
 
-	if (may_queue(rwb, rqw, &wait, rw))
+	if (wg) {
+		rqw = &wg->rq_wait;
+		step = &wg->scale_step;
+	} else {
+		shared = !current_is_kswapd();
+		rqw = get_rq_wait(rwb, !shared);
+	}
+
+	if (may_queue(rwb, rqw, &wait, rw, step, shared))
 		return;
 
 	do {
 		prepare_to_wait_exclusive(&rqw->wait, &wait,
 						TASK_UNINTERRUPTIBLE);
 
-		if (may_queue(rwb, rqw, &wait, rw))
+		if (may_queue(rwb, rqw, &wait, rw, step, shared))
 			break;
 
 		if (lock) {
@@ -595,31 +1106,47 @@ static inline bool wbt_should_throttle(struct rq_wb *rwb, struct bio *bio)
  * May sleep, if we have exceeded the writeback limits. Caller can pass
  * in an irq held spinlock, if it holds one when calling this function.
  * If we do sleep, we'll release and re-grab it.
+ *
+ * If the bio belongs to a cgroup with a latency target, a reference to
+ * its blkg is returned in @blkgp. The caller must hand it to wbt_track()
+ * or __wbt_done() along with the returned flags.
  */
-enum wbt_flags wbt_wait(struct rq_wb *rwb, struct bio *bio, spinlock_t *lock)
+enum wbt_flags wbt_wait(struct rq_wb *rwb, struct bio *bio, spinlock_t *lock,
+			struct blkcg_gq **blkgp)
 {
+	struct wbt_grp *wg;
 	unsigned int ret = 0;
 
+	*blkgp = NULL;
+
 	if (!rwb_enabled(rwb))
 		return 0;
 
 	if (bio_op(bio) == REQ_OP_READ)
 		ret = WBT_READ;
 
+	wg = wbt_bio_grp(rwb, bio);
+	if (wg)
+		*blkgp = wg_to_blkg(wg);
+
 	if (!wbt_should_throttle(rwb, bio)) {
 		if (ret & WBT_READ)
 			wb_timestamp(rwb, &rwb->last_issue);
 		return ret;
 	}
 
-	__wbt_wait(rwb, bio->bi_opf, lock);
+	if (current_is_kswapd()) {
+		ret |= WBT_KSWAPD;
+		wg = NULL;
+	}
+
+	__wbt_wait(rwb, wg, bio->bi_opf, lock);
+	if (wg)
+		atomic_inc(&rwb->grp_inflight);
 
 	if (!timer_pending(&rwb->window_timer))
 		rwb_arm_timer(rwb);
 
-	if (current_is_kswapd())
-		ret |= WBT_KSWAPD;
-
 	return ret | WBT_TRACKED;
 }
 
@@ -660,6 +1187,39 @@ void wbt_set_queue_depth(struct rq_wb *rwb, unsigned int depth)
 	}
 }
 
+/*
+ * Switch between judging the window by its minimum read latency
+ * (@pct == 0), and by the @pct read percentile. The latter needs the
+ * queue latency histogram, which only blk-mq queues have.
+ */
+int wbt_set_lat_pct(struct rq_wb *rwb, unsigned int pct)
+{
+	int ret;
+
+	if (pct > 100)
+		return -EINVAL;
+
+	if (pct && !rwb->hist) {
+		ret = blk_stat_hist_enable(rwb->queue);
+		if (ret)
+			return ret;
+
+		rwb->hist = kzalloc(sizeof(*rwb->hist), GFP_KERNEL);
+		rwb->hist_prev = kzalloc(sizeof(*rwb->hist_prev), GFP_KERNEL);
+		if (!rwb->hist || !rwb->hist_prev) {
+			kfree(rwb->hist);
+			kfree(rwb->hist_prev);
+			rwb->hist = rwb->hist_prev = NULL;
+			return -ENOMEM;
+		}
+		blk_queue_stat_hist_get(rwb->queue, rwb->hist_prev);
+		smp_wmb();
+	}
+
+	WRITE_ONCE(rwb->lat_pct, pct);
+	return 0;
+}
+
 void wbt_set_write_cache(struct rq_wb *rwb, bool write_cache_on)
 {
 	if (rwb)
@@ -715,6 +1275,8 @@ int wbt_init(struct request_queue *q)
 		atomic_set(&rwb->rq_wait[i].inflight, 0);
 		init_waitqueue_head(&rwb->rq_wait[i].wait);
 	}
+	atomic_set(&rwb->grp_inflight, 0);
+	INIT_LIST_HEAD(&rwb->grp_list);
 
 	setup_timer(&rwb->window_timer, wb_timer_fn, (unsigned long) rwb);
 	rwb->wc = 1;
@@ -731,6 +1293,14 @@ int wbt_init(struct request_queue *q)
 	q->rq_wb = rwb;
 	blk_stat_enable(q);
 
+#ifdef CONFIG_BLK_CGROUP
+	if (blkcg_activate_policy(q, &blkcg_policy_wbt)) {
+		q->rq_wb = NULL;
+		kfree(rwb);
+		return -ENOMEM;
+	}
+#endif
+
 	rwb->min_lat_nsec = wbt_default_latency_nsec(q);
 
 	wbt_set_queue_depth(rwb, blk_queue_depth(q));
@@ -745,7 +1315,12 @@ void wbt_exit(struct request_queue *q)
 
 	if (rwb) {
 		del_timer_sync(&rwb->window_timer);
+#ifdef CONFIG_BLK_CGROUP
+		blkcg_deactivate_policy(q, &blkcg_policy_wbt);
+#endif
 		q->rq_wb = NULL;
+		kfree(rwb->hist);
+		kfree(rwb->hist_prev);
 		kfree(rwb);
 	}
 }
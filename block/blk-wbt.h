@@ -13,8 +13,9 @@ enum wbt_flags {
 	WBT_TRACKED		= 1,	/* write, tracked for throttling */
 	WBT_READ		= 2,	/* read */
 	WBT_KSWAPD		= 4,	/* write, from kswapd */
+	WBT_GRP			= 8,	/* charged to the group in rq->rl */
 
-	WBT_NR_BITS		= 3,	/* number of bits */
+	WBT_NR_BITS		= 4,	/* number of bits */
 };
 
 enum {
@@ -40,11 +41,6 @@ static inline enum wbt_flags wbt_stat_to_mask(struct blk_issue_stat *stat)
 	return (stat->time & BLK_STAT_MASK) >> BLK_STAT_SHIFT;
 }
 
-static inline void wbt_track(struct blk_issue_stat *stat, enum wbt_flags wb_acct)
-{
-	stat->time |= ((u64) wb_acct) << BLK_STAT_SHIFT;
-}
-
 static inline bool wbt_is_tracked(struct blk_issue_stat *stat)
 {
 	return (stat->time >> BLK_STAT_SHIFT) & WBT_TRACKED;
@@ -92,8 +88,29 @@ struct rq_wb {
 	unsigned long last_issue;		/* last non-throttled issue */
 	unsigned long last_comp;		/* last non-throttled comp */
 	unsigned long min_lat_nsec;
+
+	/*
+	 * If set, compare this read completion percentile against
+	 * ->min_lat_nsec, instead of the window minimum. Computed from
+	 * the queue latency histogram, ->hist_prev holds the snapshot
+	 * taken at the end of the previous window.
+	 */
+	unsigned int lat_pct;
+	struct blk_stat_hist *hist;
+	struct blk_stat_hist *hist_prev;
+
 	struct request_queue *queue;
 	struct rq_wait rq_wait[WBT_NUM_RWQ];
+
+	/*
+	 * Number of cgroups with a latency target on this queue, and the
+	 * writes in flight against their private rq_wait budgets. The
+	 * groups themselves sit on ->grp_list, which is modified under the
+	 * queue lock and walked under RCU.
+	 */
+	unsigned int nr_grp_targets;
+	atomic_t grp_inflight;
+	struct list_head grp_list;
 };
 
 static inline unsigned int wbt_inflight(struct rq_wb *rwb)
@@ -103,14 +120,17 @@ static inline unsigned int wbt_inflight(struct rq_wb *rwb)
 	for (i = 0; i < WBT_NUM_RWQ; i++)
 		ret += atomic_read(&rwb->rq_wait[i].inflight);
 
-	return ret;
+	return ret + atomic_read(&rwb->grp_inflight);
 }
 
 #ifdef CONFIG_BLK_WBT
 
-void __wbt_done(struct rq_wb *, enum wbt_flags);
-void wbt_done(struct rq_wb *, struct blk_issue_stat *);
-enum wbt_flags wbt_wait(struct rq_wb *, struct bio *, spinlock_t *);
+void __wbt_done(struct rq_wb *, enum wbt_flags, struct blkcg_gq *);
+void wbt_done(struct rq_wb *, struct request *);
+void wbt_track(struct request *, enum wbt_flags, struct blkcg_gq *);
+enum wbt_flags wbt_wait(struct rq_wb *, struct bio *, spinlock_t *,
+			struct blkcg_gq **);
+void wbt_stat_add(struct rq_wb *, struct request *, u64);
 int wbt_init(struct request_queue *);
 void wbt_exit(struct request_queue *);
 void wbt_update_limits(struct rq_wb *);
@@ -120,22 +140,33 @@ void wbt_disable_default(struct request_queue *);
 
 void wbt_set_queue_depth(struct rq_wb *, unsigned int);
 void wbt_set_write_cache(struct rq_wb *, bool);
+int wbt_set_lat_pct(struct rq_wb *, unsigned int);
 
 u64 wbt_default_latency_nsec(struct request_queue *);
 
 #else
 
-static inline void __wbt_done(struct rq_wb *rwb, enum wbt_flags flags)
+static inline void __wbt_done(struct rq_wb *rwb, enum wbt_flags flags,
+			      struct blkcg_gq *blkg)
+{
+}
+static inline void wbt_done(struct rq_wb *rwb, struct request *rq)
 {
 }
-static inline void wbt_done(struct rq_wb *rwb, struct blk_issue_stat *stat)
+static inline void wbt_track(struct request *rq, enum wbt_flags flags,
+			     struct blkcg_gq *blkg)
 {
 }
 static inline enum wbt_flags wbt_wait(struct rq_wb *rwb, struct bio *bio,
-				      spinlock_t *lock)
+				      spinlock_t *lock, struct blkcg_gq **blkgp)
 {
+	*blkgp = NULL;
 	return 0;
 }
+static inline void wbt_stat_add(struct rq_wb *rwb, struct request *rq,
+				u64 now)
+{
+}
 static inline int wbt_init(struct request_queue *q)
 {
 	return -EINVAL;
@@ -161,6 +192,10 @@ static inline void wbt_set_queue_depth(struct rq_wb *rwb, unsigned int depth)
 static inline void wbt_set_write_cache(struct rq_wb *rwb, bool wc)
 {
 }
+static inline int wbt_set_lat_pct(struct rq_wb *rwb, unsigned int pct)
+{
+	return -EINVAL;
+}
 static inline u64 wbt_default_latency_nsec(struct request_queue *q)
 {
 	return 0;
@@ -40,6 +40,7 @@
 #include <trace/events/block.h>
 
 #include "blk.h"
+#include "blk-mq-sched.h"
 
 static DEFINE_SPINLOCK(elv_list_lock);
 static LIST_HEAD(elv_list);
@@ -200,6 +201,10 @@ int elevator_init(struct request_queue *q, char *name)
 		e = elevator_get(name, true);
 		if (!e)
 			return -EINVAL;
+		if (e->uses_mq) {
+			elevator_put(e);
+			return -EINVAL;
+		}
 	}
 
 	/*
@@ -212,6 +217,10 @@ int elevator_init(struct request_queue *q, char *name)
 		if (!e)
 			printk(KERN_ERR "I/O scheduler %s not found\n",
 							chosen_elevator);
+		else if (e->uses_mq) {
+			elevator_put(e);
+			e = NULL;
+		}
 	}
 
 	if (!e) {
@@ -234,7 +243,10 @@ EXPORT_SYMBOL(elevator_init);
 void elevator_exit(struct elevator_queue *e)
 {
 	mutex_lock(&e->sysfs_lock);
-	if (e->type->ops.elevator_exit_fn)
+	if (e->type->uses_mq) {
+		if (e->type->mq_ops.exit_sched)
+			e->type->mq_ops.exit_sched(e);
+	} else if (e->type->ops.elevator_exit_fn)
 		e->type->ops.elevator_exit_fn(e);
 	mutex_unlock(&e->sysfs_lock);
 
@@ -941,6 +953,48 @@ fail_init:
 	return err;
 }
 
+/*
+ * blk-mq version of elevator_switch(), @new_e may be NULL to run without
+ * a scheduler. There's no going back to the old scheduler if setting up
+ * the new one fails, the queue is left without one instead.
+ */
+static int elevator_switch_mq(struct request_queue *q,
+			      struct elevator_type *new_e)
+{
+	int err = 0;
+
+	blk_mq_freeze_queue(q);
+	blk_mq_quiesce_queue(q);
+
+	if (q->elevator) {
+		if (q->elevator->registered)
+			elv_unregister_queue(q);
+		blk_mq_sched_teardown(q);
+	}
+
+	if (new_e) {
+		err = blk_mq_sched_init(q, new_e);
+		if (!err && q->kobj.state_in_sysfs) {
+			err = elv_register_queue(q);
+			if (err)
+				blk_mq_sched_teardown(q);
+		}
+	}
+
+	/* without a scheduler, nr_requests limits the driver tags again */
+	if (!q->elevator)
+		blk_mq_update_nr_requests(q, min_t(unsigned long,
+				q->nr_requests, q->tag_set->queue_depth));
+
+	blk_mq_start_stopped_hw_queues(q, true);
+	blk_mq_unfreeze_queue(q);
+
+	if (!err)
+		blk_add_trace_msg(q, "elv switch: %s",
+				  new_e ? new_e->elevator_name : "none");
+	return err;
+}
+
 /*
  * Switch this queue to the given IO scheduler.
  */
@@ -949,21 +1003,45 @@ static int __elevator_change(struct request_queue *q, const char *name)
 	char elevator_name[ELV_NAME_MAX];
 	struct elevator_type *e;
 
-	if (!q->elevator)
+	if (!q->elevator && !q->mq_ops)
 		return -ENXIO;
 
 	strlcpy(elevator_name, name, sizeof(elevator_name));
-	e = elevator_get(strstrip(elevator_name), true);
+	strstrip(elevator_name);
+
+	if (q->mq_ops && !strcmp(elevator_name, "none")) {
+		if (!q->elevator)
+			return 0;
+		return elevator_switch_mq(q, NULL);
+	}
+
+	e = elevator_get(elevator_name, true);
 	if (!e) {
 		printk(KERN_ERR "elevator: type %s not found\n", elevator_name);
 		return -EINVAL;
 	}
 
-	if (!strcmp(elevator_name, q->elevator->type->elevator_name)) {
+	if (q->elevator &&
+	    !strcmp(elevator_name, q->elevator->type->elevator_name)) {
 		elevator_put(e);
 		return 0;
 	}
 
+	/* blk-mq queues can only run blk-mq schedulers, and vice versa */
+	if (e->uses_mq != !!q->mq_ops) {
+		elevator_put(e);
+		return -EINVAL;
+	}
+
+	/* the driver ties its per request data to the driver tag */
+	if (q->mq_ops && (q->tag_set->flags & BLK_MQ_F_NO_SCHED)) {
+		elevator_put(e);
+		return -EINVAL;
+	}
+
+	if (q->mq_ops)
+		return elevator_switch_mq(q, e);
+
 	return elevator_switch(q, e);
 }
 
@@ -985,7 +1063,7 @@ ssize_t elv_iosched_store(struct request_queue *q, const char *name,
 {
 	int ret;
 
-	if (!q->elevator)
+	if (!q->elevator && !q->mq_ops)
 		return count;
 
 	ret = __elevator_change(q, name);
@@ -999,24 +1077,32 @@ ssize_t elv_iosched_store(struct request_queue *q, const char *name,
 ssize_t elv_iosched_show(struct request_queue *q, char *name)
 {
 	struct elevator_queue *e = q->elevator;
-	struct elevator_type *elv;
+	struct elevator_type *elv = NULL;
 	struct elevator_type *__e;
 	int len = 0;
 
-	if (!q->elevator || !blk_queue_stackable(q))
+	if (!q->mq_ops && (!q->elevator || !blk_queue_stackable(q)))
 		return sprintf(name, "none\n");
+	if (q->mq_ops && (q->tag_set->flags & BLK_MQ_F_NO_SCHED))
+		return sprintf(name, "[none]\n");
 
-	elv = e->type;
+	if (e)
+		elv = e->type;
 
 	spin_lock(&elv_list_lock);
 	list_for_each_entry(__e, &elv_list, list) {
-		if (!strcmp(elv->elevator_name, __e->elevator_name))
+		if (__e->uses_mq != !!q->mq_ops)
+			continue;
+		if (elv && !strcmp(elv->elevator_name, __e->elevator_name))
 			len += sprintf(name+len, "[%s] ", elv->elevator_name);
 		else
 			len += sprintf(name+len, "%s ", __e->elevator_name);
 	}
 	spin_unlock(&elv_list_lock);
 
+	if (q->mq_ops)
+		len += sprintf(name+len, elv ? "none" : "[none]");
+
 	len += sprintf(len+name, "\n");
 	return len;
 }
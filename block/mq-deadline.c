@@ -0,0 +1,573 @@
+/*
+ *  MQ Deadline i/o scheduler - adaptation of the legacy deadline scheduler,
+ *  for the blk-mq scheduling framework
+ *
+ *  Copyright (C) 2002 Jens Axboe <axboe@kernel.dk>
+ */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/elevator.h>
+#include <linux/bio.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/init.h>
+#include <linux/compiler.h>
+#include <linux/rbtree.h>
+
+#include "blk.h"
+#include "blk-mq.h"
+#include "blk-mq-sched.h"
+
+/*
+ * See Documentation/block/deadline-iosched.txt
+ */
+static const int read_expire = HZ / 2;  /* max time before a read is submitted. */
+static const int write_expire = 5 * HZ; /* ditto for writes, these limits are SOFT! */
+static const int writes_starved = 2;    /* max times reads can starve a write */
+static const int fifo_batch = 16;       /* # of sequential requests treated as one
+				     by the above parameters. For throughput. */
+
+/*
+ * settings that change how the i/o scheduler behaves, shared by all
+ * hardware queues
+ */
+struct deadline_data {
+	int fifo_expire[2];
+	int fifo_batch;
+	int writes_starved;
+	int front_merges;
+};
+
+/*
+ * run time data, one per hardware queue
+ */
+struct deadline_hctx {
+	spinlock_t lock;
+
+	/*
+	 * requests are present on both sort_list and fifo_list
+	 */
+	struct rb_root sort_list[2];
+	struct list_head fifo_list[2];
+
+	/*
+	 * next in sort order. read, write or both are NULL
+	 */
+	struct request *next_rq[2];
+	unsigned int batching;		/* number of sequential requests made */
+	unsigned int starved;		/* times reads have starved writes */
+};
+
+static inline struct rb_root *
+deadline_rb_root(struct deadline_hctx *dh, struct request *rq)
+{
+	return &dh->sort_list[rq_data_dir(rq)];
+}
+
+/*
+ * get the request after `rq' in sector-sorted order
+ */
+static inline struct request *
+deadline_latter_request(struct request *rq)
+{
+	struct rb_node *node = rb_next(&rq->rb_node);
+
+	if (node)
+		return rb_entry_rq(node);
+
+	return NULL;
+}
+
+/*
+ * get the request before `rq' in sector-sorted order
+ */
+static inline struct request *
+deadline_former_request(struct request *rq)
+{
+	struct rb_node *node = rb_prev(&rq->rb_node);
+
+	if (node)
+		return rb_entry_rq(node);
+
+	return NULL;
+}
+
+/*
+ * find the request with the highest start sector below @sector, the only
+ * candidate for a back merge of a bio starting at @sector
+ */
+static struct request *
+deadline_rb_find_before(struct rb_root *root, sector_t sector)
+{
+	struct rb_node *n = root->rb_node;
+	struct request *rq, *found = NULL;
+
+	while (n) {
+		rq = rb_entry_rq(n);
+
+		if (blk_rq_pos(rq) < sector) {
+			found = rq;
+			n = n->rb_right;
+		} else
+			n = n->rb_left;
+	}
+
+	return found;
+}
+
+static inline void
+deadline_del_rq_rb(struct deadline_hctx *dh, struct request *rq)
+{
+	const int data_dir = rq_data_dir(rq);
+
+	if (dh->next_rq[data_dir] == rq)
+		dh->next_rq[data_dir] = deadline_latter_request(rq);
+
+	elv_rb_del(deadline_rb_root(dh, rq), rq);
+}
+
+/*
+ * add rq to rbtree and fifo
+ */
+static void
+deadline_add_request(struct deadline_data *dd, struct deadline_hctx *dh,
+		     struct request *rq)
+{
+	const int data_dir = rq_data_dir(rq);
+
+	elv_rb_add(deadline_rb_root(dh, rq), rq);
+
+	/*
+	 * set expire time and add to fifo list
+	 */
+	rq->fifo_time = jiffies + dd->fifo_expire[data_dir];
+	list_add_tail(&rq->queuelist, &dh->fifo_list[data_dir]);
+}
+
+/*
+ * remove rq from rbtree and fifo.
+ */
+static void
+deadline_remove_request(struct deadline_hctx *dh, struct request *rq)
+{
+	rq_fifo_clear(rq);
+	deadline_del_rq_rb(dh, rq);
+}
+
+/*
+ * next was merged into rq, drop it. rq inherits the earlier deadline of
+ * the two.
+ */
+static void
+deadline_merged_requests(struct deadline_hctx *dh, struct request *rq,
+			 struct request *next)
+{
+	if (time_before((unsigned long)next->fifo_time,
+			(unsigned long)rq->fifo_time)) {
+		list_move(&rq->queuelist, &next->queuelist);
+		rq->fifo_time = next->fifo_time;
+	}
+
+	deadline_remove_request(dh, next);
+}
+
+/*
+ * take rq off the sort and fifo list, it's going to the driver
+ */
+static void
+deadline_move_request(struct deadline_hctx *dh, struct request *rq)
+{
+	const int data_dir = rq_data_dir(rq);
+
+	dh->next_rq[READ] = NULL;
+	dh->next_rq[WRITE] = NULL;
+	dh->next_rq[data_dir] = deadline_latter_request(rq);
+
+	deadline_remove_request(dh, rq);
+}
+
+/*
+ * deadline_check_fifo returns 0 if there are no expired requests on the fifo,
+ * 1 otherwise. Requires !list_empty(&dh->fifo_list[data_dir])
+ */
+static inline int deadline_check_fifo(struct deadline_hctx *dh, int ddir)
+{
+	struct request *rq = rq_entry_fifo(dh->fifo_list[ddir].next);
+
+	/*
+	 * rq is expired!
+	 */
+	if (time_after_eq(jiffies, (unsigned long)rq->fifo_time))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * select the best request according to read/write expire, fifo_batch, etc
+ */
+static struct request *
+__deadline_dispatch_request(struct deadline_data *dd, struct deadline_hctx *dh)
+{
+	const int reads = !list_empty(&dh->fifo_list[READ]);
+	const int writes = !list_empty(&dh->fifo_list[WRITE]);
+	struct request *rq;
+	int data_dir;
+
+	/*
+	 * batches are currently reads XOR writes
+	 */
+	if (dh->next_rq[WRITE])
+		rq = dh->next_rq[WRITE];
+	else
+		rq = dh->next_rq[READ];
+
+	if (rq && dh->batching < dd->fifo_batch)
+		/* we have a next request are still entitled to batch */
+		goto dispatch_request;
+
+	/*
+	 * at this point we are not running a batch. select the appropriate
+	 * data direction (read / write)
+	 */
+
+	if (reads) {
+		BUG_ON(RB_EMPTY_ROOT(&dh->sort_list[READ]));
+
+		if (writes && (dh->starved++ >= dd->writes_starved))
+			goto dispatch_writes;
+
+		data_dir = READ;
+
+		goto dispatch_find_request;
+	}
+
+	/*
+	 * there are either no reads or writes have been starved
+	 */
+
+	if (writes) {
+dispatch_writes:
+		BUG_ON(RB_EMPTY_ROOT(&dh->sort_list[WRITE]));
+
+		dh->starved = 0;
+
+		data_dir = WRITE;
+
+		goto dispatch_find_request;
+	}
+
+	return NULL;
+
+dispatch_find_request:
+	/*
+	 * we are not running a batch, find best request for selected data_dir
+	 */
+	if (deadline_check_fifo(dh, data_dir) || !dh->next_rq[data_dir]) {
+		/*
+		 * A deadline has expired, the last request was in the other
+		 * direction, or we have run out of higher-sectored requests.
+		 * Start again from the request with the earliest expiry time.
+		 */
+		rq = rq_entry_fifo(dh->fifo_list[data_dir].next);
+	} else {
+		/*
+		 * The last req was the same dir and we have a next request in
+		 * sort order. No expired requests so continue on from here.
+		 */
+		rq = dh->next_rq[data_dir];
+	}
+
+	dh->batching = 0;
+
+dispatch_request:
+	/*
+	 * rq is the selected appropriate request.
+	 */
+	dh->batching++;
+	deadline_move_request(dh, rq);
+
+	return rq;
+}
+
+static struct request *deadline_dispatch_request(struct blk_mq_hw_ctx *hctx)
+{
+	struct deadline_data *dd = hctx->queue->elevator->elevator_data;
+	struct deadline_hctx *dh = hctx->sched_data;
+	struct request *rq;
+
+	spin_lock(&dh->lock);
+	rq = __deadline_dispatch_request(dd, dh);
+	spin_unlock(&dh->lock);
+
+	return rq;
+}
+
+static void deadline_insert_requests(struct blk_mq_hw_ctx *hctx,
+				     struct list_head *list)
+{
+	struct deadline_data *dd = hctx->queue->elevator->elevator_data;
+	struct deadline_hctx *dh = hctx->sched_data;
+	struct request *rq;
+
+	spin_lock(&dh->lock);
+	while (!list_empty(list)) {
+		rq = list_first_entry(list, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+		deadline_add_request(dd, dh, rq);
+	}
+	spin_unlock(&dh->lock);
+}
+
+static bool deadline_has_work(struct blk_mq_hw_ctx *hctx)
+{
+	struct deadline_hctx *dh = hctx->sched_data;
+
+	return !list_empty_careful(&dh->fifo_list[READ]) ||
+		!list_empty_careful(&dh->fifo_list[WRITE]);
+}
+
+/*
+ * Merge @bio into a request that hasn't been dispatched yet. Sequential
+ * streams keep growing their requests here while the device is busy.
+ */
+static bool deadline_bio_merge(struct blk_mq_hw_ctx *hctx, struct bio *bio)
+{
+	struct request_queue *q = hctx->queue;
+	struct deadline_data *dd = q->elevator->elevator_data;
+	struct deadline_hctx *dh = hctx->sched_data;
+	struct rb_root *root = &dh->sort_list[bio_data_dir(bio)];
+	sector_t sector = bio->bi_iter.bi_sector;
+	int ret = ELEVATOR_NO_MERGE;
+	struct request *rq, *other, *free = NULL;
+
+	spin_lock(&dh->lock);
+
+	/*
+	 * check for back merge
+	 */
+	rq = deadline_rb_find_before(root, sector);
+	if (rq && blk_rq_pos(rq) + blk_rq_sectors(rq) == sector)
+		ret = blk_mq_sched_try_merge(q, rq, bio);
+
+	/*
+	 * check for front merge, the request start moves so reposition it
+	 */
+	if (ret == ELEVATOR_NO_MERGE && dd->front_merges) {
+		rq = elv_rb_find(root, bio_end_sector(bio));
+		if (rq) {
+			ret = blk_mq_sched_try_merge(q, rq, bio);
+			if (ret == ELEVATOR_FRONT_MERGE) {
+				elv_rb_del(root, rq);
+				elv_rb_add(root, rq);
+			}
+		}
+	}
+
+	/*
+	 * the grown request may now reach its neighbour, merge the two
+	 */
+	if (ret == ELEVATOR_BACK_MERGE) {
+		other = deadline_latter_request(rq);
+		if (other && blk_mq_sched_try_req_merge(q, rq, other)) {
+			deadline_merged_requests(dh, rq, other);
+			free = other;
+		}
+	} else if (ret == ELEVATOR_FRONT_MERGE) {
+		other = deadline_former_request(rq);
+		if (other && blk_mq_sched_try_req_merge(q, other, rq)) {
+			deadline_merged_requests(dh, other, rq);
+			free = rq;
+		}
+	}
+
+	spin_unlock(&dh->lock);
+
+	if (free)
+		blk_mq_free_request(free);
+	return ret != ELEVATOR_NO_MERGE;
+}
+
+static int deadline_init_hctx(struct blk_mq_hw_ctx *hctx, unsigned int index)
+{
+	struct deadline_hctx *dh;
+
+	dh = kzalloc_node(sizeof(*dh), GFP_KERNEL, hctx->numa_node);
+	if (!dh)
+		return -ENOMEM;
+
+	spin_lock_init(&dh->lock);
+	INIT_LIST_HEAD(&dh->fifo_list[READ]);
+	INIT_LIST_HEAD(&dh->fifo_list[WRITE]);
+	dh->sort_list[READ] = RB_ROOT;
+	dh->sort_list[WRITE] = RB_ROOT;
+
+	hctx->sched_data = dh;
+	return 0;
+}
+
+static void deadline_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int index)
+{
+	struct deadline_hctx *dh = hctx->sched_data;
+	struct request *rq;
+	int dir;
+
+	/*
+	 * The queue is frozen, nothing should be left. If something is, fail
+	 * it while its scheduler tag is still around.
+	 */
+	WARN_ON_ONCE(!list_empty(&dh->fifo_list[READ]) ||
+		     !list_empty(&dh->fifo_list[WRITE]));
+	for (dir = READ; dir <= WRITE; dir++) {
+		while (!list_empty(&dh->fifo_list[dir])) {
+			rq = rq_entry_fifo(dh->fifo_list[dir].next);
+			deadline_remove_request(dh, rq);
+			blk_mq_end_request(rq, -EIO);
+		}
+	}
+
+	kfree(dh);
+}
+
+static void deadline_exit_queue(struct elevator_queue *e)
+{
+	kfree(e->elevator_data);
+}
+
+/*
+ * initialize elevator private data (deadline_data).
+ */
+static int deadline_init_queue(struct request_queue *q, struct elevator_type *e)
+{
+	struct deadline_data *dd;
+	struct elevator_queue *eq;
+
+	eq = elevator_alloc(q, e);
+	if (!eq)
+		return -ENOMEM;
+
+	dd = kzalloc_node(sizeof(*dd), GFP_KERNEL, q->node);
+	if (!dd) {
+		kobject_put(&eq->kobj);
+		return -ENOMEM;
+	}
+	eq->elevator_data = dd;
+
+	dd->fifo_expire[READ] = read_expire;
+	dd->fifo_expire[WRITE] = write_expire;
+	dd->writes_starved = writes_starved;
+	dd->front_merges = 1;
+	dd->fifo_batch = fifo_batch;
+
+	q->elevator = eq;
+	return 0;
+}
+
+/*
+ * sysfs parts below
+ */
+
+static ssize_t
+deadline_var_show(int var, char *page)
+{
+	return sprintf(page, "%d\n", var);
+}
+
+static ssize_t
+deadline_var_store(int *var, const char *page, size_t count)
+{
+	char *p = (char *) page;
+
+	*var = simple_strtol(p, &p, 10);
+	return count;
+}
+
+#define SHOW_FUNCTION(__FUNC, __VAR, __CONV)				\
+static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
+{									\
+	struct deadline_data *dd = e->elevator_data;			\
+	int __data = __VAR;						\
+	if (__CONV)							\
+		__data = jiffies_to_msecs(__data);			\
+	return deadline_var_show(__data, (page));			\
+}
+SHOW_FUNCTION(deadline_read_expire_show, dd->fifo_expire[READ], 1);
+SHOW_FUNCTION(deadline_write_expire_show, dd->fifo_expire[WRITE], 1);
+SHOW_FUNCTION(deadline_writes_starved_show, dd->writes_starved, 0);
+SHOW_FUNCTION(deadline_front_merges_show, dd->front_merges, 0);
+SHOW_FUNCTION(deadline_fifo_batch_show, dd->fifo_batch, 0);
+#undef SHOW_FUNCTION
+
+#define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
+static ssize_t __FUNC(struct elevator_queue *e, const char *page, size_t count)	\
+{									\
+	struct deadline_data *dd = e->elevator_data;			\
+	int __data;							\
+	int ret = deadline_var_store(&__data, (page), count);		\
+	if (__data < (MIN))						\
+		__data = (MIN);						\
+	else if (__data > (MAX))					\
+		__data = (MAX);						\
+	if (__CONV)							\
+		*(__PTR) = msecs_to_jiffies(__data);			\
+	else								\
+		*(__PTR) = __data;					\
+	return ret;							\
+}
+STORE_FUNCTION(deadline_read_expire_store, &dd->fifo_expire[READ], 0, INT_MAX, 1);
+STORE_FUNCTION(deadline_write_expire_store, &dd->fifo_expire[WRITE], 0, INT_MAX, 1);
+STORE_FUNCTION(deadline_writes_starved_store, &dd->writes_starved, INT_MIN, INT_MAX, 0);
+STORE_FUNCTION(deadline_front_merges_store, &dd->front_merges, 0, 1, 0);
+STORE_FUNCTION(deadline_fifo_batch_store, &dd->fifo_batch, 0, INT_MAX, 0);
+#undef STORE_FUNCTION
+
+#define DD_ATTR(name) \
+	__ATTR(name, S_IRUGO|S_IWUSR, deadline_##name##_show, \
+				      deadline_##name##_store)
+
+static struct elv_fs_entry deadline_attrs[] = {
+	DD_ATTR(read_expire),
+	DD_ATTR(write_expire),
+	DD_ATTR(writes_starved),
+	DD_ATTR(front_merges),
+	DD_ATTR(fifo_batch),
+	__ATTR_NULL
+};
+
+static struct elevator_type mq_deadline = {
+	.mq_ops = {
+		.init_sched		= deadline_init_queue,
+		.exit_sched		= deadline_exit_queue,
+		.init_hctx		= deadline_init_hctx,
+		.exit_hctx		= deadline_exit_hctx,
+		.bio_merge		= deadline_bio_merge,
+		.insert_requests	= deadline_insert_requests,
+		.dispatch_request	= deadline_dispatch_request,
+		.has_work		= deadline_has_work,
+	},
+
+	.uses_mq = true,
+	.elevator_attrs = deadline_attrs,
+	.elevator_name = "mq-deadline",
+	.elevator_owner = THIS_MODULE,
+};
+
+static int __init deadline_init(void)
+{
+	return elv_register(&mq_deadline);
+}
+
+static void __exit deadline_exit(void)
+{
+	elv_unregister(&mq_deadline);
+}
+
+module_init(deadline_init);
+module_exit(deadline_exit);
+
+MODULE_AUTHOR("Jens Axboe");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("MQ deadline IO scheduler");
+MODULE_ALIAS("mq-deadline-iosched");
@@ -122,6 +122,7 @@ static void
 do_sync_gen_syndrome(struct page **blocks, unsigned int offset, int disks,
 		     size_t len, struct async_submit_ctl *submit)
 {
+	const struct raid6_sized_calls *calls;
 	void **srcs;
 	int i;
 	int start = -1, stop = disks - 3;
@@ -144,12 +145,13 @@ do_sync_gen_syndrome(struct page **blocks, unsigned int offset, int disks,
 			}
 		}
 	}
+	calls = raid6_calls_for(len);
 	if (submit->flags & ASYNC_TX_PQ_XOR_DST) {
-		BUG_ON(!raid6_call.xor_syndrome);
+		BUG_ON(!calls->xor_syndrome);
 		if (start >= 0)
-			raid6_call.xor_syndrome(disks, start, stop, len, srcs);
+			calls->xor_syndrome(disks, start, stop, len, srcs);
 	} else
-		raid6_call.gen_syndrome(disks, len, srcs);
+		calls->gen_syndrome(disks, len, srcs);
 	async_tx_sync_epilog(submit);
 }
 
@@ -24,6 +24,7 @@
 #include <linux/mm.h>
 #include <linux/random.h>
 #include <linux/module.h>
+#include <linux/raid/pq.h>
 
 #undef pr
 #define pr(fmt, args...) pr_info("raid6test: " fmt, ##args)
@@ -65,7 +66,7 @@ static char disk_type(int d, int disks)
 }
 
 /* Recover two failed blocks. */
-static void raid6_dual_recov(int disks, size_t bytes, int faila, int failb, struct page **ptrs)
+static void async_dual_recov(int disks, size_t bytes, int faila, int failb, struct page **ptrs)
 {
 	struct async_submit_ctl submit;
 	struct completion cmp;
@@ -127,7 +128,7 @@ static void raid6_dual_recov(int disks, size_t bytes, int faila, int failb, stru
 		   __func__, faila, failb, result);
 }
 
-static int test_disks(int i, int j, int disks)
+static int test_disks(int i, int j, int disks, size_t bytes)
 {
 	int erra, errb;
 
@@ -137,10 +138,10 @@ static int test_disks(int i, int j, int disks)
 	dataptrs[i] = recovi;
 	dataptrs[j] = recovj;
 
-	raid6_dual_recov(disks, PAGE_SIZE, i, j, dataptrs);
+	async_dual_recov(disks, bytes, i, j, dataptrs);
 
-	erra = memcmp(page_address(data[i]), page_address(recovi), PAGE_SIZE);
-	errb = memcmp(page_address(data[j]), page_address(recovj), PAGE_SIZE);
+	erra = memcmp(page_address(data[i]), page_address(recovi), bytes);
+	errb = memcmp(page_address(data[j]), page_address(recovj), bytes);
 
 	pr("%s(%d, %d): faila=%3d(%c)  failb=%3d(%c)  %s\n",
 	   __func__, i, j, i, disk_type(i, disks), j, disk_type(j, disks),
@@ -152,7 +153,7 @@ static int test_disks(int i, int j, int disks)
 	return erra || errb;
 }
 
-static int test(int disks, int *tests)
+static int test(int disks, size_t bytes, int *tests)
 {
 	struct dma_async_tx_descriptor *tx;
 	struct async_submit_ctl submit;
@@ -173,7 +174,7 @@ static int test(int disks, int *tests)
 	/* Generate assumed good syndrome */
 	init_completion(&cmp);
 	init_async_submit(&submit, ASYNC_TX_ACK, NULL, callback, &cmp, addr_conv);
-	tx = async_gen_syndrome(dataptrs, 0, disks, PAGE_SIZE, &submit);
+	tx = async_gen_syndrome(dataptrs, 0, disks, bytes, &submit);
 	async_tx_issue_pending(tx);
 
 	if (wait_for_completion_timeout(&cmp, msecs_to_jiffies(3000)) == 0) {
@@ -181,11 +182,11 @@ static int test(int disks, int *tests)
 		return 1;
 	}
 
-	pr("testing the %d-disk case...\n", disks);
+	pr("testing the %d-disk case, %zu bytes...\n", disks, bytes);
 	for (i = 0; i < disks-1; i++)
 		for (j = i+1; j < disks; j++) {
 			(*tests)++;
-			err += test_disks(i, j, disks);
+			err += test_disks(i, j, disks, bytes);
 		}
 
 	return err;
@@ -196,7 +197,7 @@ static int raid6_test(void)
 {
 	int err = 0;
 	int tests = 0;
-	int i;
+	int i, s;
 
 	for (i = 0; i < NDISKS+3; i++) {
 		data[i] = alloc_page(GFP_KERNEL);
@@ -207,27 +208,32 @@ static int raid6_test(void)
 		}
 	}
 
-	/* the 4-disk and 5-disk cases are special for the recovery code */
-	if (NDISKS > 4)
-		err += test(4, &tests);
-	if (NDISKS > 5)
-		err += test(5, &tests);
-	/* the 11 and 12 disk cases are special for ioatdma (p-disabled
-	 * q-continuation without extended descriptor)
-	 */
-	if (NDISKS > 12) {
-		err += test(11, &tests);
-		err += test(12, &tests);
-	}
+	/* each size class may be served by a different algorithm */
+	for (s = 0; s < RAID6_NR_SIZES; s++) {
+		size_t bytes = raid6_sized[s].bytes;
+
+		/* the 4-disk and 5-disk cases are special for the recovery code */
+		if (NDISKS > 4)
+			err += test(4, bytes, &tests);
+		if (NDISKS > 5)
+			err += test(5, bytes, &tests);
+		/* the 11 and 12 disk cases are special for ioatdma (p-disabled
+		 * q-continuation without extended descriptor)
+		 */
+		if (NDISKS > 12) {
+			err += test(11, bytes, &tests);
+			err += test(12, bytes, &tests);
+		}
 
-	/* the 24 disk case is special for ioatdma as it is the boudary point
-	 * at which it needs to switch from 8-source ops to 16-source
-	 * ops for continuation (assumes DMA_HAS_PQ_CONTINUE is not set)
-	 */
-	if (NDISKS > 24)
-		err += test(24, &tests);
+		/* the 24 disk case is special for ioatdma as it is the boudary point
+		 * at which it needs to switch from 8-source ops to 16-source
+		 * ops for continuation (assumes DMA_HAS_PQ_CONTINUE is not set)
+		 */
+		if (NDISKS > 24)
+			err += test(24, bytes, &tests);
 
-	err += test(NDISKS, &tests);
+		err += test(NDISKS, bytes, &tests);
+	}
 
 	pr("\n");
 	pr("complete (%d tests, %d failure%s)\n",
@@ -857,20 +857,53 @@ static void loop_config_discard(struct loop_device *lo)
 	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, q);
 }
 
+static void loop_stop_workers(struct loop_device *lo, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		flush_kthread_worker(&lo->workers[i].worker);
+		kthread_stop(lo->workers[i].task);
+	}
+	kfree(lo->workers);
+	lo->workers = NULL;
+	lo->nr_workers = 0;
+}
+
 static void loop_unprepare_queue(struct loop_device *lo)
 {
-	flush_kthread_worker(&lo->worker);
-	kthread_stop(lo->worker_task);
+	loop_stop_workers(lo, lo->nr_workers);
 }
 
+/*
+ * Each hardware queue gets its own submission thread, so requests on
+ * different queues reach the backing file in parallel.
+ */
 static int loop_prepare_queue(struct loop_device *lo)
 {
-	init_kthread_worker(&lo->worker);
-	lo->worker_task = kthread_run(kthread_worker_fn,
-			&lo->worker, "loop%d", lo->lo_number);
-	if (IS_ERR(lo->worker_task))
+	unsigned int i, nr = lo->tag_set.nr_hw_queues;
+	struct loop_worker *w;
+
+	lo->workers = kcalloc(nr, sizeof(*lo->workers), GFP_KERNEL);
+	if (!lo->workers)
 		return -ENOMEM;
-	set_user_nice(lo->worker_task, MIN_NICE);
+
+	for (i = 0; i < nr; i++) {
+		w = &lo->workers[i];
+		init_kthread_worker(&w->worker);
+		if (nr == 1)
+			w->task = kthread_run(kthread_worker_fn, &w->worker,
+					      "loop%d", lo->lo_number);
+		else
+			w->task = kthread_run(kthread_worker_fn, &w->worker,
+					      "loop%d/%u", lo->lo_number, i);
+		if (IS_ERR(w->task)) {
+			loop_stop_workers(lo, i);
+			return -ENOMEM;
+		}
+		set_user_nice(w->task, MIN_NICE);
+	}
+	lo->nr_workers = nr;
 	return 0;
 }
 
@@ -1657,6 +1690,9 @@ module_param(max_loop, int, S_IRUGO);
 MODULE_PARM_DESC(max_loop, "Maximum number of loop devices");
 module_param(max_part, int, S_IRUGO);
 MODULE_PARM_DESC(max_part, "Maximum number of partitions per loop device");
+static unsigned int nr_hw_queues = 1;
+module_param(nr_hw_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_hw_queues, "Number of hardware queues, each with its own submission thread, per loop device");
 MODULE_LICENSE("GPL");
 MODULE_ALIAS_BLOCKDEV_MAJOR(LOOP_MAJOR);
 
@@ -1709,13 +1745,13 @@ static int loop_queue_rq(struct blk_mq_hw_ctx *hctx,
 	if (lo->lo_state != Lo_bound)
 		return BLK_MQ_RQ_QUEUE_ERROR;
 
-	if (lo->use_dio && (req_op(cmd->rq) != REQ_OP_FLUSH ||
+	if (lo->use_dio && !(req_op(cmd->rq) == REQ_OP_FLUSH ||
 	    req_op(cmd->rq) == REQ_OP_DISCARD))
 		cmd->use_aio = true;
 	else
 		cmd->use_aio = false;
 
-	queue_kthread_work(&lo->worker, &cmd->work);
+	queue_kthread_work(&lo->workers[hctx->queue_num].worker, &cmd->work);
 
 	return BLK_MQ_RQ_QUEUE_OK;
 }
@@ -1790,7 +1826,8 @@ static int loop_add(struct loop_device **l, int i)
 
 	err = -ENOMEM;
 	lo->tag_set.ops = &loop_mq_ops;
-	lo->tag_set.nr_hw_queues = 1;
+	lo->tag_set.nr_hw_queues = clamp_t(unsigned int, nr_hw_queues, 1,
+					   nr_cpu_ids);
 	lo->tag_set.queue_depth = 128;
 	lo->tag_set.numa_node = NUMA_NO_NODE;
 	lo->tag_set.cmd_size = sizeof(struct loop_cmd);
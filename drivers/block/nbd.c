@@ -34,41 +34,53 @@
 #include <linux/kthread.h>
 #include <linux/types.h>
 #include <linux/debugfs.h>
+#include <linux/blk-mq.h>
+#include <linux/workqueue.h>
 
 #include <linux/uaccess.h>
 #include <asm/types.h>
 
 #include <linux/nbd.h>
 
+struct nbd_sock {
+	struct socket *sock;
+	struct mutex tx_lock;
+};
+
+#define NBD_TIMEDOUT			0
+#define NBD_DISCONNECT_REQUESTED	1
+#define NBD_DISCONNECTED		2
+
 struct nbd_device {
 	u32 flags;
-	struct socket * sock;	/* If == NULL, device is not ready, yet	*/
+	unsigned long runtime_flags;
+	struct nbd_sock **socks;	/* one per hardware queue */
+	int num_connections;
 	int magic;
 
-	spinlock_t queue_lock;
-	struct list_head queue_head;	/* Requests waiting result */
-	struct request *active_req;
-	wait_queue_head_t active_wq;
-	struct list_head waiting_queue;	/* Requests to be sent */
-	wait_queue_head_t waiting_wq;
+	struct blk_mq_tag_set tag_set;
 
-	struct mutex tx_lock;
+	struct mutex config_lock;
 	struct gendisk *disk;
 	int blksize;
 	loff_t bytesize;
 	int xmit_timeout;
-	bool disconnect; /* a disconnect has been requested by user */
 
-	struct timer_list timeout_timer;
-	spinlock_t tasks_lock;
+	atomic_t recv_threads;
+	wait_queue_head_t recv_wq;
 	struct task_struct *task_recv;
-	struct task_struct *task_send;
 
 #if IS_ENABLED(CONFIG_DEBUG_FS)
 	struct dentry *dbg_dir;
 #endif
 };
 
+struct nbd_cmd {
+	struct nbd_device *nbd;
+	struct completion send_complete;
+	u32 cookie;		/* bumped every time the request is sent */
+};
+
 #if IS_ENABLED(CONFIG_DEBUG_FS)
 static struct dentry *nbd_dbg_dir;
 #endif
@@ -80,18 +92,7 @@ static struct dentry *nbd_dbg_dir;
 static unsigned int nbds_max = 16;
 static struct nbd_device *nbd_dev;
 static int max_part;
-
-/*
- * Use just one lock (or at most 1 per NIC). Two arguments for this:
- * 1. Each NIC is essentially a synchronization point for all servers
- *    accessed through that NIC so there's no need to have more locks
- *    than NICs anyway.
- * 2. More locks lead to more "Dirty cache line bouncing" which will slow
- *    down each lock to the point where they're actually slower than just
- *    a single lock.
- * Thanks go to Jens Axboe and Al Viro for their LKML emails explaining this!
- */
-static DEFINE_SPINLOCK(nbd_lock);
+static struct workqueue_struct *recv_workqueue;
 
 static inline struct device *nbd_to_dev(struct nbd_device *nbd)
 {
@@ -110,64 +111,59 @@ static const char *nbdcmd_to_ascii(int cmd)
 	return "invalid";
 }
 
-static void nbd_end_request(struct nbd_device *nbd, struct request *req)
+static void nbd_end_request(struct nbd_cmd *cmd)
 {
+	struct nbd_device *nbd = cmd->nbd;
+	struct request *req = blk_mq_rq_from_pdu(cmd);
 	int error = req->errors ? -EIO : 0;
-	struct request_queue *q = req->q;
-	unsigned long flags;
 
-	dev_dbg(nbd_to_dev(nbd), "request %p: %s\n", req,
+	dev_dbg(nbd_to_dev(nbd), "request %p: %s\n", cmd,
 		error ? "failed" : "done");
 
-	spin_lock_irqsave(q->queue_lock, flags);
-	__blk_end_request_all(req, error);
-	spin_unlock_irqrestore(q->queue_lock, flags);
+	blk_mq_complete_request(req, error);
 }
 
 /*
- * Forcibly shutdown the socket causing all listeners to error
+ * Forcibly shutdown the sockets causing all listeners to error
  */
 static void sock_shutdown(struct nbd_device *nbd)
 {
-	if (!nbd->sock)
+	int i;
+
+	if (!nbd->num_connections)
+		return;
+	if (test_and_set_bit(NBD_DISCONNECTED, &nbd->runtime_flags))
 		return;
 
-	dev_warn(disk_to_dev(nbd->disk), "shutting down socket\n");
-	kernel_sock_shutdown(nbd->sock, SHUT_RDWR);
-	nbd->sock = NULL;
-	del_timer_sync(&nbd->timeout_timer);
+	dev_warn(disk_to_dev(nbd->disk), "shutting down sockets\n");
+	for (i = 0; i < nbd->num_connections; i++)
+		kernel_sock_shutdown(nbd->socks[i]->sock, SHUT_RDWR);
 }
 
-static void nbd_xmit_timeout(unsigned long arg)
+static enum blk_eh_timer_return nbd_xmit_timeout(struct request *req,
+						 bool reserved)
 {
-	struct nbd_device *nbd = (struct nbd_device *)arg;
-	unsigned long flags;
-
-	if (list_empty(&nbd->queue_head))
-		return;
-
-	nbd->disconnect = true;
+	struct nbd_cmd *cmd = blk_mq_rq_to_pdu(req);
+	struct nbd_device *nbd = cmd->nbd;
 
-	spin_lock_irqsave(&nbd->tasks_lock, flags);
+	if (!nbd->xmit_timeout)
+		return BLK_EH_RESET_TIMER;
 
-	if (nbd->task_recv)
-		force_sig(SIGKILL, nbd->task_recv);
-
-	if (nbd->task_send)
-		force_sig(SIGKILL, nbd->task_send);
-
-	spin_unlock_irqrestore(&nbd->tasks_lock, flags);
+	dev_err(nbd_to_dev(nbd), "Connection timed out, shutting down connection\n");
+	set_bit(NBD_TIMEDOUT, &nbd->runtime_flags);
+	req->errors++;
+	sock_shutdown(nbd);
 
-	dev_err(nbd_to_dev(nbd), "Connection timed out, killed receiver and sender, shutting down connection\n");
+	return BLK_EH_HANDLED;
 }
 
 /*
  *  Send or receive packet.
  */
-static int sock_xmit(struct nbd_device *nbd, int send, void *buf, int size,
-		int msg_flags)
+static int sock_xmit(struct nbd_device *nbd, int index, int send, void *buf,
+		     int size, int msg_flags)
 {
-	struct socket *sock = nbd->sock;
+	struct socket *sock = nbd->socks[index]->sock;
 	int result;
 	struct msghdr msg;
 	struct kvec iov;
@@ -215,34 +211,31 @@ static int sock_xmit(struct nbd_device *nbd, int send, void *buf, int size,
 	sigprocmask(SIG_SETMASK, &oldset, NULL);
 	tsk_restore_flags(current, pflags, PF_MEMALLOC);
 
-	if (!send && nbd->xmit_timeout)
-		mod_timer(&nbd->timeout_timer, jiffies + nbd->xmit_timeout);
-
 	return result;
 }
 
-static inline int sock_send_bvec(struct nbd_device *nbd, struct bio_vec *bvec,
-		int flags)
+static inline int sock_send_bvec(struct nbd_device *nbd, int index,
+				 struct bio_vec *bvec, int flags)
 {
 	int result;
 	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(nbd, 1, kaddr + bvec->bv_offset,
+	result = sock_xmit(nbd, index, 1, kaddr + bvec->bv_offset,
 			   bvec->bv_len, flags);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
-/* always call with the tx_lock held */
-static int nbd_send_req(struct nbd_device *nbd, struct request *req)
+/* always call with the tx_lock of the socket held */
+static int nbd_send_cmd(struct nbd_device *nbd, struct nbd_cmd *cmd, int index)
 {
+	struct request *req = blk_mq_rq_from_pdu(cmd);
 	int result, flags;
 	struct nbd_request request;
 	unsigned long size = blk_rq_bytes(req);
 	u32 type;
+	u32 tag = blk_mq_unique_tag(req);
 
-	if (req->cmd_type == REQ_TYPE_DRV_PRIV)
-		type = NBD_CMD_DISC;
-	else if (req_op(req) == REQ_OP_DISCARD)
+	if (req_op(req) == REQ_OP_DISCARD)
 		type = NBD_CMD_TRIM;
 	else if (req_op(req) == REQ_OP_FLUSH)
 		type = NBD_CMD_FLUSH;
@@ -254,16 +247,17 @@ static int nbd_send_req(struct nbd_device *nbd, struct request *req)
 	memset(&request, 0, sizeof(request));
 	request.magic = htonl(NBD_REQUEST_MAGIC);
 	request.type = htonl(type);
-	if (type != NBD_CMD_FLUSH && type != NBD_CMD_DISC) {
+	if (type != NBD_CMD_FLUSH) {
 		request.from = cpu_to_be64((u64)blk_rq_pos(req) << 9);
 		request.len = htonl(size);
 	}
-	memcpy(request.handle, &req, sizeof(req));
+	memcpy(request.handle, &tag, sizeof(tag));
+	memcpy(request.handle + sizeof(tag), &cmd->cookie, sizeof(cmd->cookie));
 
 	dev_dbg(nbd_to_dev(nbd), "request %p: sending control (%s@%llu,%uB)\n",
-		req, nbdcmd_to_ascii(type),
+		cmd, nbdcmd_to_ascii(type),
 		(unsigned long long)blk_rq_pos(req) << 9, blk_rq_bytes(req));
-	result = sock_xmit(nbd, 1, &request, sizeof(request),
+	result = sock_xmit(nbd, index, 1, &request, sizeof(request),
 			(type == NBD_CMD_WRITE) ? MSG_MORE : 0);
 	if (result <= 0) {
 		dev_err(disk_to_dev(nbd->disk),
@@ -283,8 +277,8 @@ static int nbd_send_req(struct nbd_device *nbd, struct request *req)
 			if (!rq_iter_last(bvec, iter))
 				flags = MSG_MORE;
 			dev_dbg(nbd_to_dev(nbd), "request %p: sending %d bytes data\n",
-				req, bvec.bv_len);
-			result = sock_send_bvec(nbd, &bvec, flags);
+				cmd, bvec.bv_len);
+			result = sock_send_bvec(nbd, index, &bvec, flags);
 			if (result <= 0) {
 				dev_err(disk_to_dev(nbd->disk),
 					"Send data failed (result %d)\n",
@@ -296,51 +290,39 @@ static int nbd_send_req(struct nbd_device *nbd, struct request *req)
 	return 0;
 }
 
-static struct request *nbd_find_request(struct nbd_device *nbd,
-					struct request *xreq)
-{
-	struct request *req, *tmp;
-	int err;
-
-	err = wait_event_interruptible(nbd->active_wq, nbd->active_req != xreq);
-	if (unlikely(err))
-		return ERR_PTR(err);
-
-	spin_lock(&nbd->queue_lock);
-	list_for_each_entry_safe(req, tmp, &nbd->queue_head, queuelist) {
-		if (req != xreq)
-			continue;
-		list_del_init(&req->queuelist);
-		spin_unlock(&nbd->queue_lock);
-		return req;
-	}
-	spin_unlock(&nbd->queue_lock);
-
-	return ERR_PTR(-ENOENT);
-}
-
-static inline int sock_recv_bvec(struct nbd_device *nbd, struct bio_vec *bvec)
+static inline int sock_recv_bvec(struct nbd_device *nbd, int index,
+				 struct bio_vec *bvec)
 {
 	int result;
 	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(nbd, 0, kaddr + bvec->bv_offset, bvec->bv_len,
-			MSG_WAITALL);
+	result = sock_xmit(nbd, index, 0, kaddr + bvec->bv_offset,
+			   bvec->bv_len, MSG_WAITALL);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
-/* NULL returned = something went wrong, inform userspace */
-static struct request *nbd_read_stat(struct nbd_device *nbd)
+/*
+ * The reply handle is the unique tag of the request, which names both
+ * the hardware queue and the tag within it, followed by the cookie the
+ * request was sent with. A late reply to a request that timed out can
+ * name a tag that has been reused since, the cookie won't match then.
+ */
+static struct nbd_cmd *nbd_read_stat(struct nbd_device *nbd, int index)
 {
 	int result;
 	struct nbd_reply reply;
-	struct request *req;
+	struct nbd_cmd *cmd;
+	struct request *req = NULL;
+	u16 hwq;
+	u32 tag, cookie;
 
 	reply.magic = 0;
-	result = sock_xmit(nbd, 0, &reply, sizeof(reply), MSG_WAITALL);
+	result = sock_xmit(nbd, index, 0, &reply, sizeof(reply), MSG_WAITALL);
 	if (result <= 0) {
-		dev_err(disk_to_dev(nbd->disk),
-			"Receive control failed (result %d)\n", result);
+		if (!test_bit(NBD_DISCONNECTED, &nbd->runtime_flags) &&
+		    !test_bit(NBD_DISCONNECT_REQUESTED, &nbd->runtime_flags))
+			dev_err(disk_to_dev(nbd->disk),
+				"Receive control failed (result %d)\n", result);
 		return ERR_PTR(result);
 	}
 
@@ -350,42 +332,50 @@ static struct request *nbd_read_stat(struct nbd_device *nbd)
 		return ERR_PTR(-EPROTO);
 	}
 
-	req = nbd_find_request(nbd, *(struct request **)reply.handle);
-	if (IS_ERR(req)) {
-		result = PTR_ERR(req);
-		if (result != -ENOENT)
-			return ERR_PTR(result);
-
-		dev_err(disk_to_dev(nbd->disk), "Unexpected reply (%p)\n",
-			reply.handle);
+	memcpy(&tag, reply.handle, sizeof(tag));
+	memcpy(&cookie, reply.handle + sizeof(tag), sizeof(cookie));
+	hwq = blk_mq_unique_tag_to_hwq(tag);
+	if (hwq < nbd->tag_set.nr_hw_queues)
+		req = blk_mq_tag_to_rq(nbd->tag_set.tags[hwq],
+				       blk_mq_unique_tag_to_tag(tag));
+	if (!req || !blk_mq_request_started(req)) {
+		dev_err(disk_to_dev(nbd->disk), "Unexpected reply (%d) %p\n",
+			tag, req);
 		return ERR_PTR(-EBADR);
 	}
+	cmd = blk_mq_rq_to_pdu(req);
+	if (cmd->cookie != cookie) {
+		dev_err(disk_to_dev(nbd->disk),
+			"Stale reply (%d) %p, cookie %u, expected %u\n",
+			tag, req, cookie, cmd->cookie);
+		return ERR_PTR(-ENOENT);
+	}
 
 	if (ntohl(reply.error)) {
 		dev_err(disk_to_dev(nbd->disk), "Other side returned error (%d)\n",
 			ntohl(reply.error));
 		req->errors++;
-		return req;
+		return cmd;
 	}
 
-	dev_dbg(nbd_to_dev(nbd), "request %p: got reply\n", req);
+	dev_dbg(nbd_to_dev(nbd), "request %p: got reply\n", cmd);
 	if (rq_data_dir(req) != WRITE) {
 		struct req_iterator iter;
 		struct bio_vec bvec;
 
 		rq_for_each_segment(bvec, req, iter) {
-			result = sock_recv_bvec(nbd, &bvec);
+			result = sock_recv_bvec(nbd, index, &bvec);
 			if (result <= 0) {
 				dev_err(disk_to_dev(nbd->disk), "Receive data failed (result %d)\n",
 					result);
 				req->errors++;
-				return req;
+				return cmd;
 			}
 			dev_dbg(nbd_to_dev(nbd), "request %p: got %d bytes data\n",
-				req, bvec.bv_len);
+				cmd, bvec.bv_len);
 		}
 	}
-	return req;
+	return cmd;
 }
 
 static ssize_t pid_show(struct device *dev,
@@ -402,196 +392,109 @@ static struct device_attribute pid_attr = {
 	.show = pid_show,
 };
 
-static int nbd_thread_recv(struct nbd_device *nbd)
+struct recv_thread_args {
+	struct work_struct work;
+	struct nbd_device *nbd;
+	int index;
+};
+
+/* One of these runs per connection, for as long as NBD_DO_IT lasts. */
+static void recv_work(struct work_struct *work)
 {
-	struct request *req;
-	int ret;
-	unsigned long flags;
+	struct recv_thread_args *args = container_of(work,
+						     struct recv_thread_args,
+						     work);
+	struct nbd_device *nbd = args->nbd;
+	struct nbd_cmd *cmd;
+	int ret = 0;
 
 	BUG_ON(nbd->magic != NBD_MAGIC);
 
-	sk_set_memalloc(nbd->sock->sk);
-
-	spin_lock_irqsave(&nbd->tasks_lock, flags);
-	nbd->task_recv = current;
-	spin_unlock_irqrestore(&nbd->tasks_lock, flags);
-
-	ret = device_create_file(disk_to_dev(nbd->disk), &pid_attr);
-	if (ret) {
-		dev_err(disk_to_dev(nbd->disk), "device_create_file failed!\n");
-
-		spin_lock_irqsave(&nbd->tasks_lock, flags);
-		nbd->task_recv = NULL;
-		spin_unlock_irqrestore(&nbd->tasks_lock, flags);
-
-		return ret;
-	}
-
 	while (1) {
-		req = nbd_read_stat(nbd);
-		if (IS_ERR(req)) {
-			ret = PTR_ERR(req);
+		cmd = nbd_read_stat(nbd, args->index);
+		if (IS_ERR(cmd)) {
+			ret = PTR_ERR(cmd);
 			break;
 		}
 
-		nbd_end_request(nbd, req);
+		/* the reply can beat nbd_queue_rq() to the finish line */
+		wait_for_completion(&cmd->send_complete);
+		nbd_end_request(cmd);
 	}
 
-	device_remove_file(disk_to_dev(nbd->disk), &pid_attr);
+	/*
+	 * One connection going down takes the others with it, unless the
+	 * user asked for the disconnect and they are all going anyway.
+	 */
+	if (ret && !test_bit(NBD_DISCONNECT_REQUESTED, &nbd->runtime_flags))
+		sock_shutdown(nbd);
 
-	spin_lock_irqsave(&nbd->tasks_lock, flags);
-	nbd->task_recv = NULL;
-	spin_unlock_irqrestore(&nbd->tasks_lock, flags);
+	atomic_dec(&nbd->recv_threads);
+	wake_up(&nbd->recv_wq);
+}
 
-	if (signal_pending(current)) {
-		ret = kernel_dequeue_signal(NULL);
-		dev_warn(nbd_to_dev(nbd), "pid %d, %s, got signal %d\n",
-			 task_pid_nr(current), current->comm, ret);
-		mutex_lock(&nbd->tx_lock);
-		sock_shutdown(nbd);
-		mutex_unlock(&nbd->tx_lock);
-		ret = -ETIMEDOUT;
-	}
+static void nbd_clear_req(struct request *req, void *data, bool reserved)
+{
+	struct nbd_cmd *cmd;
 
-	return ret;
+	if (!blk_mq_request_started(req))
+		return;
+	cmd = blk_mq_rq_to_pdu(req);
+	req->errors++;
+	nbd_end_request(cmd);
 }
 
 static void nbd_clear_que(struct nbd_device *nbd)
 {
-	struct request *req;
-
 	BUG_ON(nbd->magic != NBD_MAGIC);
 
 	/*
-	 * Because we have set nbd->sock to NULL under the tx_lock, all
-	 * modifications to the list must have completed by now.  For
-	 * the same reason, the active_req must be NULL.
-	 *
-	 * As a consequence, we don't need to take the spin lock while
-	 * purging the list here.
+	 * The receive threads are gone and the sockets are shut down, so
+	 * nothing else will complete what is still in flight.
 	 */
-	BUG_ON(nbd->sock);
-	BUG_ON(nbd->active_req);
+	blk_mq_tagset_busy_iter(&nbd->tag_set, nbd_clear_req, NULL);
+	dev_dbg(disk_to_dev(nbd->disk), "queue cleared\n");
+}
 
-	while (!list_empty(&nbd->queue_head)) {
-		req = list_entry(nbd->queue_head.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
-		req->errors++;
-		nbd_end_request(nbd, req);
-	}
+static int nbd_handle_cmd(struct nbd_cmd *cmd, int index)
+{
+	struct request *req = blk_mq_rq_from_pdu(cmd);
+	struct nbd_device *nbd = cmd->nbd;
+	struct nbd_sock *nsock;
+	int ret;
 
-	while (!list_empty(&nbd->waiting_queue)) {
-		req = list_entry(nbd->waiting_queue.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
-		req->errors++;
-		nbd_end_request(nbd, req);
+	if (index >= nbd->num_connections) {
+		dev_err_ratelimited(disk_to_dev(nbd->disk),
+				    "Attempted send on invalid socket\n");
+		return -EINVAL;
 	}
-	dev_dbg(disk_to_dev(nbd->disk), "queue cleared\n");
-}
 
+	if (test_bit(NBD_DISCONNECTED, &nbd->runtime_flags)) {
+		dev_err_ratelimited(disk_to_dev(nbd->disk),
+				    "Attempted send on closed socket\n");
+		return -EINVAL;
+	}
 
-static void nbd_handle_req(struct nbd_device *nbd, struct request *req)
-{
 	if (req->cmd_type != REQ_TYPE_FS)
-		goto error_out;
+		return -EIO;
 
 	if (rq_data_dir(req) == WRITE &&
 	    (nbd->flags & NBD_FLAG_READ_ONLY)) {
 		dev_err(disk_to_dev(nbd->disk),
 			"Write on read-only\n");
-		goto error_out;
+		return -EIO;
 	}
 
 	req->errors = 0;
 
-	mutex_lock(&nbd->tx_lock);
-	if (unlikely(!nbd->sock)) {
-		mutex_unlock(&nbd->tx_lock);
-		dev_err(disk_to_dev(nbd->disk),
-			"Attempted send on closed socket\n");
-		goto error_out;
-	}
-
-	nbd->active_req = req;
-
-	if (nbd->xmit_timeout && list_empty_careful(&nbd->queue_head))
-		mod_timer(&nbd->timeout_timer, jiffies + nbd->xmit_timeout);
-
-	if (nbd_send_req(nbd, req) != 0) {
+	nsock = nbd->socks[index];
+	mutex_lock(&nsock->tx_lock);
+	ret = nbd_send_cmd(nbd, cmd, index);
+	if (ret)
 		dev_err(disk_to_dev(nbd->disk), "Request send failed\n");
-		req->errors++;
-		nbd_end_request(nbd, req);
-	} else {
-		spin_lock(&nbd->queue_lock);
-		list_add_tail(&req->queuelist, &nbd->queue_head);
-		spin_unlock(&nbd->queue_lock);
-	}
-
-	nbd->active_req = NULL;
-	mutex_unlock(&nbd->tx_lock);
-	wake_up_all(&nbd->active_wq);
-
-	return;
-
-error_out:
-	req->errors++;
-	nbd_end_request(nbd, req);
-}
-
-static int nbd_thread_send(void *data)
-{
-	struct nbd_device *nbd = data;
-	struct request *req;
-	unsigned long flags;
-
-	spin_lock_irqsave(&nbd->tasks_lock, flags);
-	nbd->task_send = current;
-	spin_unlock_irqrestore(&nbd->tasks_lock, flags);
-
-	set_user_nice(current, MIN_NICE);
-	while (!kthread_should_stop() || !list_empty(&nbd->waiting_queue)) {
-		/* wait for something to do */
-		wait_event_interruptible(nbd->waiting_wq, ({
-					 klp_kgraft_mark_task_safe(current);
-					 kthread_should_stop() ||
-					 !list_empty(&nbd->waiting_queue); }));
-
-		if (signal_pending(current)) {
-			int ret = kernel_dequeue_signal(NULL);
-
-			dev_warn(nbd_to_dev(nbd), "pid %d, %s, got signal %d\n",
-				 task_pid_nr(current), current->comm, ret);
-			mutex_lock(&nbd->tx_lock);
-			sock_shutdown(nbd);
-			mutex_unlock(&nbd->tx_lock);
-			break;
-		}
-
-		/* extract request */
-		if (list_empty(&nbd->waiting_queue))
-			continue;
-
-		spin_lock_irq(&nbd->queue_lock);
-		req = list_entry(nbd->waiting_queue.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
-		spin_unlock_irq(&nbd->queue_lock);
+	mutex_unlock(&nsock->tx_lock);
 
-		/* handle request */
-		nbd_handle_req(nbd, req);
-	}
-
-	spin_lock_irqsave(&nbd->tasks_lock, flags);
-	nbd->task_send = NULL;
-	spin_unlock_irqrestore(&nbd->tasks_lock, flags);
-
-	/* Clear maybe pending signals */
-	if (signal_pending(current))
-		kernel_dequeue_signal(NULL);
-
-	return 0;
+	return ret;
 }
 
 /*
@@ -601,125 +504,182 @@ static int nbd_thread_send(void *data)
  *   { printk( "Warning: Ignoring result!\n"); nbd_end_request( req ); }
  */
 
-static void nbd_request_handler(struct request_queue *q)
-		__releases(q->queue_lock) __acquires(q->queue_lock)
+static int nbd_queue_rq(struct blk_mq_hw_ctx *hctx,
+			const struct blk_mq_queue_data *bd)
 {
-	struct request *req;
-	
-	while ((req = blk_fetch_request(q)) != NULL) {
-		struct nbd_device *nbd;
+	struct nbd_cmd *cmd = blk_mq_rq_to_pdu(bd->rq);
+	int ret;
 
-		spin_unlock_irq(q->queue_lock);
+	/*
+	 * The request is sent straight from here, hardware queue N going
+	 * out on connection N. Until the send is done the receive side
+	 * must not complete the request, see recv_work().
+	 */
+	init_completion(&cmd->send_complete);
+	cmd->cookie++;
+	blk_mq_start_request(bd->rq);
+	ret = nbd_handle_cmd(cmd, hctx->queue_num);
+	complete(&cmd->send_complete);
 
-		nbd = req->rq_disk->private_data;
+	return ret ? BLK_MQ_RQ_QUEUE_ERROR : BLK_MQ_RQ_QUEUE_OK;
+}
 
-		BUG_ON(nbd->magic != NBD_MAGIC);
+static int nbd_init_request(void *data, struct request *rq,
+			    unsigned int hctx_idx, unsigned int request_idx,
+			    unsigned int numa_node)
+{
+	struct nbd_cmd *cmd = blk_mq_rq_to_pdu(rq);
 
-		dev_dbg(nbd_to_dev(nbd), "request %p: dequeued (flags=%x)\n",
-			req, req->cmd_type);
+	cmd->nbd = data;
+	return 0;
+}
 
-		if (unlikely(!nbd->sock)) {
-			dev_err_ratelimited(disk_to_dev(nbd->disk),
-					    "Attempted send on closed socket\n");
-			req->errors++;
-			nbd_end_request(nbd, req);
-			spin_lock_irq(q->queue_lock);
-			continue;
-		}
+static struct blk_mq_ops nbd_mq_ops = {
+	.queue_rq	= nbd_queue_rq,
+	.init_request	= nbd_init_request,
+	.timeout	= nbd_xmit_timeout,
+};
 
-		spin_lock_irq(&nbd->queue_lock);
-		list_add_tail(&req->queuelist, &nbd->waiting_queue);
-		spin_unlock_irq(&nbd->queue_lock);
+static int nbd_dev_dbg_init(struct nbd_device *nbd);
+static void nbd_dev_dbg_close(struct nbd_device *nbd);
+
+static void send_disconnects(struct nbd_device *nbd)
+{
+	struct nbd_request request = {};
+	int i, ret;
+
+	request.magic = htonl(NBD_REQUEST_MAGIC);
+	request.type = htonl(NBD_CMD_DISC);
 
-		wake_up(&nbd->waiting_wq);
+	for (i = 0; i < nbd->num_connections; i++) {
+		struct nbd_sock *nsock = nbd->socks[i];
 
-		spin_lock_irq(q->queue_lock);
+		mutex_lock(&nsock->tx_lock);
+		ret = sock_xmit(nbd, i, 1, &request, sizeof(request), 0);
+		if (ret <= 0)
+			dev_err(disk_to_dev(nbd->disk),
+				"Send disconnect failed %d\n", ret);
+		mutex_unlock(&nsock->tx_lock);
 	}
 }
 
-static int nbd_dev_dbg_init(struct nbd_device *nbd);
-static void nbd_dev_dbg_close(struct nbd_device *nbd);
+static void nbd_free_socks(struct nbd_device *nbd)
+{
+	int i;
 
-/* Must be called with tx_lock held */
+	/* nbd_queue_rq() looks at the sockets without the config_lock */
+	blk_mq_freeze_queue(nbd->disk->queue);
+	for (i = 0; i < nbd->num_connections; i++) {
+		sockfd_put(nbd->socks[i]->sock);
+		kfree(nbd->socks[i]);
+	}
+	kfree(nbd->socks);
+	nbd->socks = NULL;
+	nbd->num_connections = 0;
+	blk_mq_unfreeze_queue(nbd->disk->queue);
+}
+
+static void nbd_size_update(struct nbd_device *nbd, struct block_device *bdev)
+{
+	bdev->bd_inode->i_size = nbd->bytesize;
+	set_blocksize(bdev, nbd->blksize);
+	set_capacity(nbd->disk, nbd->bytesize >> 9);
+}
+
+/* Must be called with config_lock held */
 
 static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
 		       unsigned int cmd, unsigned long arg)
 {
 	switch (cmd) {
 	case NBD_DISCONNECT: {
-		struct request sreq;
-
 		dev_info(disk_to_dev(nbd->disk), "NBD_DISCONNECT\n");
-		if (!nbd->sock)
+		if (!nbd->socks)
 			return -EINVAL;
 
-		mutex_unlock(&nbd->tx_lock);
+		mutex_unlock(&nbd->config_lock);
 		fsync_bdev(bdev);
-		mutex_lock(&nbd->tx_lock);
-		blk_rq_init(NULL, &sreq);
-		sreq.cmd_type = REQ_TYPE_DRV_PRIV;
+		mutex_lock(&nbd->config_lock);
 
 		/* Check again after getting mutex back.  */
-		if (!nbd->sock)
+		if (!nbd->socks)
 			return -EINVAL;
 
-		nbd->disconnect = true;
-
-		nbd_send_req(nbd, &sreq);
+		if (!test_and_set_bit(NBD_DISCONNECT_REQUESTED,
+				      &nbd->runtime_flags))
+			send_disconnects(nbd);
 		return 0;
 	}
- 
-	case NBD_CLEAR_SOCK: {
-		struct socket *sock = nbd->sock;
-		nbd->sock = NULL;
+
+	case NBD_CLEAR_SOCK:
+		sock_shutdown(nbd);
+		/*
+		 * The receive workers of a running NBD_DO_IT complete
+		 * requests until they notice the shutdown, wait for them
+		 * before failing what is left.
+		 */
+		wait_event(nbd->recv_wq, atomic_read(&nbd->recv_threads) == 0);
 		nbd_clear_que(nbd);
-		BUG_ON(!list_empty(&nbd->queue_head));
-		BUG_ON(!list_empty(&nbd->waiting_queue));
 		kill_bdev(bdev);
-		if (sock)
-			sockfd_put(sock);
+		/* a running NBD_DO_IT drops the sockets on its way out */
+		if (!nbd->task_recv) {
+			nbd_free_socks(nbd);
+			nbd->runtime_flags = 0;
+		}
 		return 0;
-	}
 
 	case NBD_SET_SOCK: {
+		struct nbd_sock **socks;
+		struct nbd_sock *nsock;
 		struct socket *sock;
 		int err;
-		if (nbd->sock)
+
+		/* connections can only be added before NBD_DO_IT */
+		if (nbd->task_recv)
 			return -EBUSY;
+
 		sock = sockfd_lookup(arg, &err);
-		if (sock) {
-			nbd->sock = sock;
-			if (max_part > 0)
-				bdev->bd_invalidated = 1;
-			nbd->disconnect = false; /* we're connected now */
-			return 0;
+		if (!sock)
+			return -EINVAL;
+
+		socks = krealloc(nbd->socks, (nbd->num_connections + 1) *
+				 sizeof(*socks), GFP_KERNEL);
+		if (!socks) {
+			sockfd_put(sock);
+			return -ENOMEM;
 		}
-		return -EINVAL;
+		nbd->socks = socks;
+
+		nsock = kzalloc(sizeof(*nsock), GFP_KERNEL);
+		if (!nsock) {
+			sockfd_put(sock);
+			return -ENOMEM;
+		}
+		mutex_init(&nsock->tx_lock);
+		nsock->sock = sock;
+		socks[nbd->num_connections++] = nsock;
+
+		if (max_part > 0)
+			bdev->bd_invalidated = 1;
+		return 0;
 	}
 
 	case NBD_SET_BLKSIZE:
 		nbd->blksize = arg;
 		nbd->bytesize &= ~(nbd->blksize-1);
-		bdev->bd_inode->i_size = nbd->bytesize;
-		set_blocksize(bdev, nbd->blksize);
-		set_capacity(nbd->disk, nbd->bytesize >> 9);
+		nbd_size_update(nbd, bdev);
 		return 0;
 
 	case NBD_SET_SIZE:
 		nbd->bytesize = arg & ~(nbd->blksize-1);
-		bdev->bd_inode->i_size = nbd->bytesize;
-		set_blocksize(bdev, nbd->blksize);
-		set_capacity(nbd->disk, nbd->bytesize >> 9);
+		nbd_size_update(nbd, bdev);
 		return 0;
 
 	case NBD_SET_TIMEOUT:
 		nbd->xmit_timeout = arg * HZ;
 		if (arg)
-			mod_timer(&nbd->timeout_timer,
-				  jiffies + nbd->xmit_timeout);
-		else
-			del_timer_sync(&nbd->timeout_timer);
-
+			blk_queue_rq_timeout(nbd->disk->queue,
+					     nbd->xmit_timeout);
 		return 0;
 
 	case NBD_SET_FLAGS:
@@ -728,22 +688,36 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
 
 	case NBD_SET_SIZE_BLOCKS:
 		nbd->bytesize = ((u64) arg) * nbd->blksize;
-		bdev->bd_inode->i_size = nbd->bytesize;
-		set_blocksize(bdev, nbd->blksize);
-		set_capacity(nbd->disk, nbd->bytesize >> 9);
+		nbd_size_update(nbd, bdev);
 		return 0;
 
 	case NBD_DO_IT: {
-		struct task_struct *thread;
-		struct socket *sock;
-		int error;
+		struct recv_thread_args *args;
+		int num_connections = nbd->num_connections;
+		int error = 0, i;
 
 		if (nbd->task_recv)
 			return -EBUSY;
-		if (!nbd->sock)
+		if (!nbd->socks)
 			return -EINVAL;
+		if (num_connections > 1 &&
+		    !(nbd->flags & NBD_FLAG_CAN_MULTI_CONN)) {
+			dev_err(disk_to_dev(nbd->disk),
+				"server does not support multiple connections per device\n");
+			error = -EINVAL;
+			goto out_err;
+		}
+
+		args = kcalloc(num_connections, sizeof(*args), GFP_KERNEL);
+		if (!args) {
+			error = -ENOMEM;
+			goto out_err;
+		}
+
+		blk_mq_update_nr_hw_queues(&nbd->tag_set, num_connections);
 
-		mutex_unlock(&nbd->tx_lock);
+		nbd->task_recv = current;
+		mutex_unlock(&nbd->config_lock);
 
 		if (nbd->flags & NBD_FLAG_READ_ONLY)
 			set_device_ro(bdev, true);
@@ -755,37 +729,55 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
 		else
 			blk_queue_write_cache(nbd->disk->queue, false, false);
 
-		thread = kthread_run(nbd_thread_send, nbd, "%s",
-				     nbd_name(nbd));
-		if (IS_ERR(thread)) {
-			mutex_lock(&nbd->tx_lock);
-			return PTR_ERR(thread);
+		error = device_create_file(disk_to_dev(nbd->disk), &pid_attr);
+		if (error) {
+			dev_err(disk_to_dev(nbd->disk), "device_create_file failed!\n");
+			goto out_recv;
 		}
 
 		nbd_dev_dbg_init(nbd);
-		error = nbd_thread_recv(nbd);
-		nbd_dev_dbg_close(nbd);
-		kthread_stop(thread);
-
-		mutex_lock(&nbd->tx_lock);
+		for (i = 0; i < num_connections; i++) {
+			sk_set_memalloc(nbd->socks[i]->sock->sk);
+			atomic_inc(&nbd->recv_threads);
+			INIT_WORK(&args[i].work, recv_work);
+			args[i].nbd = nbd;
+			args[i].index = i;
+			queue_work(recv_workqueue, &args[i].work);
+		}
 
+		if (wait_event_interruptible(nbd->recv_wq,
+				atomic_read(&nbd->recv_threads) == 0)) {
+			dev_warn(nbd_to_dev(nbd), "pid %d, %s, got signal\n",
+				 task_pid_nr(current), current->comm);
+			sock_shutdown(nbd);
+		}
+		for (i = 0; i < num_connections; i++)
+			flush_work(&args[i].work);
+		nbd_dev_dbg_close(nbd);
+		device_remove_file(disk_to_dev(nbd->disk), &pid_attr);
+out_recv:
+		kfree(args);
+		mutex_lock(&nbd->config_lock);
+		nbd->task_recv = NULL;
+out_err:
 		sock_shutdown(nbd);
-		sock = nbd->sock;
-		nbd->sock = NULL;
 		nbd_clear_que(nbd);
 		kill_bdev(bdev);
 		queue_flag_clear_unlocked(QUEUE_FLAG_DISCARD, nbd->disk->queue);
 		set_device_ro(bdev, false);
-		if (sock)
-			sockfd_put(sock);
+		nbd_free_socks(nbd);
 		nbd->flags = 0;
 		nbd->bytesize = 0;
 		bdev->bd_inode->i_size = 0;
 		set_capacity(nbd->disk, 0);
 		if (max_part > 0)
 			blkdev_reread_part(bdev);
-		if (nbd->disconnect) /* user requested, ignore socket errors */
-			return 0;
+		/* user requested, ignore socket errors */
+		if (test_bit(NBD_DISCONNECT_REQUESTED, &nbd->runtime_flags))
+			error = 0;
+		else if (test_bit(NBD_TIMEDOUT, &nbd->runtime_flags))
+			error = -ETIMEDOUT;
+		nbd->runtime_flags = 0;
 		return error;
 	}
 
@@ -798,9 +790,9 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
 
 	case NBD_PRINT_DEBUG:
 		dev_info(disk_to_dev(nbd->disk),
-			"next = %p, prev = %p, head = %p\n",
-			nbd->queue_head.next, nbd->queue_head.prev,
-			&nbd->queue_head);
+			"connections = %d, receive threads = %d, flags = %lx\n",
+			nbd->num_connections, atomic_read(&nbd->recv_threads),
+			nbd->runtime_flags);
 		return 0;
 	}
 	return -ENOTTY;
@@ -817,9 +809,9 @@ static int nbd_ioctl(struct block_device *bdev, fmode_t mode,
 
 	BUG_ON(nbd->magic != NBD_MAGIC);
 
-	mutex_lock(&nbd->tx_lock);
+	mutex_lock(&nbd->config_lock);
 	error = __nbd_ioctl(bdev, nbd, cmd, arg);
-	mutex_unlock(&nbd->tx_lock);
+	mutex_unlock(&nbd->config_lock);
 
 	return error;
 }
@@ -838,8 +830,7 @@ static int nbd_dbg_tasks_show(struct seq_file *s, void *unused)
 
 	if (nbd->task_recv)
 		seq_printf(s, "recv: %d\n", task_pid_nr(nbd->task_recv));
-	if (nbd->task_send)
-		seq_printf(s, "send: %d\n", task_pid_nr(nbd->task_send));
+	seq_printf(s, "connections: %d\n", nbd->num_connections);
 
 	return 0;
 }
@@ -873,6 +864,8 @@ static int nbd_dbg_flags_show(struct seq_file *s, void *unused)
 		seq_puts(s, "NBD_FLAG_SEND_FLUSH\n");
 	if (flags & NBD_FLAG_SEND_TRIM)
 		seq_puts(s, "NBD_FLAG_SEND_TRIM\n");
+	if (flags & NBD_FLAG_CAN_MULTI_CONN)
+		seq_puts(s, "NBD_FLAG_CAN_MULTI_CONN\n");
 
 	return 0;
 }
@@ -1028,21 +1021,48 @@ static int __init nbd_init(void)
 	if (!nbd_dev)
 		return -ENOMEM;
 
+	recv_workqueue = alloc_workqueue("knbd-recv",
+					 WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+	if (!recv_workqueue)
+		goto out_free_nbd;
+
 	for (i = 0; i < nbds_max; i++) {
+		struct blk_mq_tag_set *set = &nbd_dev[i].tag_set;
+		struct request_queue *q;
 		struct gendisk *disk = alloc_disk(1 << part_shift);
-		if (!disk)
+		if (!disk) {
+			err = -ENOMEM;
 			goto out;
+		}
 		nbd_dev[i].disk = disk;
+
 		/*
-		 * The new linux 2.5 block layer implementation requires
-		 * every gendisk to have its very own request_queue struct.
-		 * These structs are big so we dynamically allocate them.
+		 * Start out with a single hardware queue, NBD_DO_IT resizes
+		 * the tag set to one queue per connection.
 		 */
-		disk->queue = blk_init_queue(nbd_request_handler, &nbd_lock);
-		if (!disk->queue) {
+		set->ops = &nbd_mq_ops;
+		set->nr_hw_queues = 1;
+		set->queue_depth = 128;
+		set->numa_node = NUMA_NO_NODE;
+		set->cmd_size = sizeof(struct nbd_cmd);
+		set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_SG_MERGE |
+			BLK_MQ_F_BLOCKING;
+		set->driver_data = &nbd_dev[i];
+
+		err = blk_mq_alloc_tag_set(set);
+		if (err) {
+			put_disk(disk);
+			goto out;
+		}
+
+		q = blk_mq_init_queue(set);
+		if (IS_ERR(q)) {
+			err = PTR_ERR(q);
+			blk_mq_free_tag_set(set);
 			put_disk(disk);
 			goto out;
 		}
+		disk->queue = q;
 		/*
 		 * Tell the block layer that we are not a rotational device
 		 */
@@ -1067,16 +1087,9 @@ static int __init nbd_init(void)
 	for (i = 0; i < nbds_max; i++) {
 		struct gendisk *disk = nbd_dev[i].disk;
 		nbd_dev[i].magic = NBD_MAGIC;
-		INIT_LIST_HEAD(&nbd_dev[i].waiting_queue);
-		spin_lock_init(&nbd_dev[i].queue_lock);
-		spin_lock_init(&nbd_dev[i].tasks_lock);
-		INIT_LIST_HEAD(&nbd_dev[i].queue_head);
-		mutex_init(&nbd_dev[i].tx_lock);
-		init_timer(&nbd_dev[i].timeout_timer);
-		nbd_dev[i].timeout_timer.function = nbd_xmit_timeout;
-		nbd_dev[i].timeout_timer.data = (unsigned long)&nbd_dev[i];
-		init_waitqueue_head(&nbd_dev[i].active_wq);
-		init_waitqueue_head(&nbd_dev[i].waiting_wq);
+		mutex_init(&nbd_dev[i].config_lock);
+		atomic_set(&nbd_dev[i].recv_threads, 0);
+		init_waitqueue_head(&nbd_dev[i].recv_wq);
 		nbd_dev[i].blksize = 1024;
 		nbd_dev[i].bytesize = 0;
 		disk->major = NBD_MAJOR;
@@ -1092,8 +1105,11 @@ static int __init nbd_init(void)
 out:
 	while (i--) {
 		blk_cleanup_queue(nbd_dev[i].disk->queue);
+		blk_mq_free_tag_set(&nbd_dev[i].tag_set);
 		put_disk(nbd_dev[i].disk);
 	}
+	destroy_workqueue(recv_workqueue);
+out_free_nbd:
 	kfree(nbd_dev);
 	return err;
 }
@@ -1110,9 +1126,11 @@ static void __exit nbd_cleanup(void)
 		if (disk) {
 			del_gendisk(disk);
 			blk_cleanup_queue(disk->queue);
+			blk_mq_free_tag_set(&nbd_dev[i].tag_set);
 			put_disk(disk);
 		}
 	}
+	destroy_workqueue(recv_workqueue);
 	unregister_blkdev(NBD_MAJOR, "nbd");
 	kfree(nbd_dev);
 	printk(KERN_INFO "nbd: unregistered device at major %d\n", NBD_MAJOR);
@@ -9,6 +9,31 @@
 #include <linux/blk-mq.h>
 #include <linux/hrtimer.h>
 #include <linux/lightnvm.h>
+#include <linux/sbitmap.h>
+#include <linux/kthread.h>
+#include <linux/cpu.h>
+#include <linux/configfs.h>
+#include <linux/badblocks.h>
+#include <linux/radix-tree.h>
+#include <linux/highmem.h>
+#include <linux/random.h>
+#include <linux/vmalloc.h>
+#include <linux/sizes.h>
+
+#define SECTOR_SHIFT		9
+#define PAGE_SECTORS_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
+#define PAGE_SECTORS		(1 << PAGE_SECTORS_SHIFT)
+#define SECTOR_MASK		(PAGE_SECTORS - 1)
+
+#define FREE_BATCH		16
+
+#define TICKS_PER_SEC		50ULL
+#define TIMER_INTERVAL		(NSEC_PER_SEC / TICKS_PER_SEC)
+
+static inline u64 mb_per_tick(int mbps)
+{
+	return (1 << 20) / TICKS_PER_SEC * ((u64) mbps);
+}
 
 struct nullb_cmd {
 	struct list_head list;
@@ -17,25 +42,97 @@ struct nullb_cmd {
 	struct request *rq;
 	struct bio *bio;
 	unsigned int tag;
+	unsigned int tag_cpu;
+	int error;
 	struct nullb_queue *nq;
 	struct hrtimer timer;
 };
 
 struct nullb_queue {
-	unsigned long *tag_map;
-	wait_queue_head_t wait;
+	struct sbitmap_queue tags;
+	atomic_t wait_index;
 	unsigned int queue_depth;
+	struct nullb_device *dev;
 
 	struct nullb_cmd *cmds;
+
+	/* completions pending the queue timer, for complete_batch */
+	struct llist_head cq;
+	struct hrtimer cq_timer;
+};
+
+/*
+ * Status flags for nullb_device.
+ *
+ * CONFIGURED:	Device has been configured and turned on. Cannot reconfigure.
+ * UP:		Device is currently on and visible in userspace.
+ * THROTTLED:	Device is being throttled.
+ */
+enum nullb_device_flags {
+	NULLB_DEV_FL_CONFIGURED	= 0,
+	NULLB_DEV_FL_UP		= 1,
+	NULLB_DEV_FL_THROTTLED	= 2,
+};
+
+/*
+ * A page of the backing store. @bitmap tracks which sectors have been
+ * written, the others read back as zeroes.
+ */
+struct nullb_page {
+	struct page *page;
+	DECLARE_BITMAP(bitmap, PAGE_SECTORS);
+};
+
+/*
+ * Configuration of a device. Devices created at module load take it from
+ * the module parameters, devices created through configfs start out with
+ * the same defaults and can be changed until they are powered on.
+ */
+struct nullb_device {
+	struct nullb *nullb;
+	struct config_item item;
+	struct radix_tree_root data; /* data stored in the disk */
+	struct badblocks badblocks;
+	unsigned long flags; /* device flags */
+
+	unsigned int nr_zones;
+	struct blk_zone *zones;
+	sector_t zone_size_sects;
+
+	unsigned long size; /* device size in MB */
+	unsigned long completion_nsec; /* time in ns to complete a request */
+	unsigned int latency_dist; /* distribution of completion times */
+	unsigned long completion_jitter_nsec; /* spread for latency_dist=1 */
+	unsigned int tail_permille; /* requests per 1000 taking tail_nsec */
+	unsigned long tail_nsec; /* completion time of tail requests */
+	unsigned int submit_queues; /* number of submission queues */
+	int home_node; /* home node for the device */
+	unsigned int queue_mode; /* block interface */
+	unsigned int blocksize; /* block size */
+	unsigned int irqmode; /* IRQ completion handler */
+	unsigned int hw_queue_depth; /* queue depth */
+	unsigned int index; /* index of the disk, only valid with a disk */
+	unsigned int mbps; /* Bandwidth throttle cap (in MB/s) */
+	unsigned long zone_size; /* zone size in MB if device is zoned */
+	unsigned int zone_nr_conv; /* number of conventional zones */
+	bool use_lightnvm; /* register as a LightNVM device */
+	bool use_per_node_hctx; /* use per-node allocation for hardware context */
+	bool complete_batch; /* complete requests in batches from a timer */
+	bool power; /* power on/off the device */
+	bool memory_backed; /* if data is stored in memory */
+	bool discard; /* if support discard */
+	bool zoned; /* if device is zoned */
 };
 
 struct nullb {
+	struct nullb_device *dev;
 	struct list_head list;
 	unsigned int index;
 	struct request_queue *q;
 	struct gendisk *disk;
 	struct blk_mq_tag_set tag_set;
-	struct hrtimer timer;
+	struct hrtimer bw_timer;
+	atomic_long_t cur_bytes;
 	unsigned int queue_depth;
 	spinlock_t lock;
 
@@ -62,15 +159,21 @@ enum {
 	NULL_Q_MQ		= 2,
 };
 
-static int submit_queues;
-module_param(submit_queues, int, S_IRUGO);
+enum {
+	NULL_LAT_FIXED		= 0,
+	NULL_LAT_UNIFORM	= 1,
+	NULL_LAT_EXP		= 2,
+};
+
+static int g_submit_queues;
+module_param_named(submit_queues, g_submit_queues, int, S_IRUGO);
 MODULE_PARM_DESC(submit_queues, "Number of submission queues");
 
-static int home_node = NUMA_NO_NODE;
-module_param(home_node, int, S_IRUGO);
+static int g_home_node = NUMA_NO_NODE;
+module_param_named(home_node, g_home_node, int, S_IRUGO);
 MODULE_PARM_DESC(home_node, "Home node for the device");
 
-static int queue_mode = NULL_Q_MQ;
+static int g_queue_mode = NULL_Q_MQ;
 
 static int null_param_store_val(const char *str, int *val, int min, int max)
 {
@@ -89,7 +192,7 @@ static int null_param_store_val(const char *str, int *val, int min, int max)
 
 static int null_set_queue_mode(const char *str, const struct kernel_param *kp)
 {
-	return null_param_store_val(str, &queue_mode, NULL_Q_BIO, NULL_Q_MQ);
+	return null_param_store_val(str, &g_queue_mode, NULL_Q_BIO, NULL_Q_MQ);
 }
 
 static const struct kernel_param_ops null_queue_mode_param_ops = {
@@ -97,30 +200,30 @@ static const struct kernel_param_ops null_queue_mode_param_ops = {
 	.get	= param_get_int,
 };
 
-device_param_cb(queue_mode, &null_queue_mode_param_ops, &queue_mode, S_IRUGO);
+device_param_cb(queue_mode, &null_queue_mode_param_ops, &g_queue_mode, S_IRUGO);
 MODULE_PARM_DESC(queue_mode, "Block interface to use (0=bio,1=rq,2=multiqueue)");
 
-static int gb = 250;
-module_param(gb, int, S_IRUGO);
+static int g_gb = 250;
+module_param_named(gb, g_gb, int, S_IRUGO);
 MODULE_PARM_DESC(gb, "Size in GB");
 
-static int bs = 512;
-module_param(bs, int, S_IRUGO);
+static int g_bs = 512;
+module_param_named(bs, g_bs, int, S_IRUGO);
 MODULE_PARM_DESC(bs, "Block size (in bytes)");
 
 static int nr_devices = 2;
 module_param(nr_devices, int, S_IRUGO);
 MODULE_PARM_DESC(nr_devices, "Number of devices to register");
 
-static bool use_lightnvm;
-module_param(use_lightnvm, bool, S_IRUGO);
+static bool g_use_lightnvm;
+module_param_named(use_lightnvm, g_use_lightnvm, bool, S_IRUGO);
 MODULE_PARM_DESC(use_lightnvm, "Register as a LightNVM device");
 
-static int irqmode = NULL_IRQ_SOFTIRQ;
+static int g_irqmode = NULL_IRQ_SOFTIRQ;
 
 static int null_set_irqmode(const char *str, const struct kernel_param *kp)
 {
-	return null_param_store_val(str, &irqmode, NULL_IRQ_NONE,
+	return null_param_store_val(str, &g_irqmode, NULL_IRQ_NONE,
 					NULL_IRQ_TIMER);
 }
 
@@ -129,45 +232,484 @@ static const struct kernel_param_ops null_irqmode_param_ops = {
 	.get	= param_get_int,
 };
 
-device_param_cb(irqmode, &null_irqmode_param_ops, &irqmode, S_IRUGO);
+device_param_cb(irqmode, &null_irqmode_param_ops, &g_irqmode, S_IRUGO);
 MODULE_PARM_DESC(irqmode, "IRQ completion handler. 0-none, 1-softirq, 2-timer");
 
-static unsigned long completion_nsec = 10000;
-module_param(completion_nsec, ulong, S_IRUGO);
+static unsigned long g_completion_nsec = 10000;
+module_param_named(completion_nsec, g_completion_nsec, ulong, S_IRUGO);
 MODULE_PARM_DESC(completion_nsec, "Time in ns to complete a request in hardware. Default: 10,000ns");
 
-static int hw_queue_depth = 64;
-module_param(hw_queue_depth, int, S_IRUGO);
+static int g_latency_dist = NULL_LAT_FIXED;
+
+static int null_set_latency_dist(const char *str,
+				 const struct kernel_param *kp)
+{
+	return null_param_store_val(str, &g_latency_dist, NULL_LAT_FIXED,
+					NULL_LAT_EXP);
+}
+
+static const struct kernel_param_ops null_latency_dist_param_ops = {
+	.set	= null_set_latency_dist,
+	.get	= param_get_int,
+};
+
+device_param_cb(latency_dist, &null_latency_dist_param_ops, &g_latency_dist,
+		S_IRUGO);
+MODULE_PARM_DESC(latency_dist, "Distribution of completion times with irqmode=2. 0-fixed, 1-uniform within completion_nsec +/- completion_jitter_nsec, 2-exponential with mean completion_nsec");
+
+static unsigned long g_completion_jitter_nsec;
+module_param_named(completion_jitter_nsec, g_completion_jitter_nsec, ulong,
+		   S_IRUGO);
+MODULE_PARM_DESC(completion_jitter_nsec, "Spread of completion times with latency_dist=1. Default: 0");
+
+static int g_tail_permille;
+
+static int null_set_tail_permille(const char *str,
+				  const struct kernel_param *kp)
+{
+	return null_param_store_val(str, &g_tail_permille, 0, 1000);
+}
+
+static const struct kernel_param_ops null_tail_permille_param_ops = {
+	.set	= null_set_tail_permille,
+	.get	= param_get_int,
+};
+
+device_param_cb(tail_permille, &null_tail_permille_param_ops,
+		&g_tail_permille, S_IRUGO);
+MODULE_PARM_DESC(tail_permille, "With irqmode=2, this many requests out of 1000 take tail_nsec to complete. Default: 0");
+
+static unsigned long g_tail_nsec;
+module_param_named(tail_nsec, g_tail_nsec, ulong, S_IRUGO);
+MODULE_PARM_DESC(tail_nsec, "Completion time of the requests picked by tail_permille. Default: 0");
+
+static bool g_complete_batch;
+module_param_named(complete_batch, g_complete_batch, bool, S_IRUGO);
+MODULE_PARM_DESC(complete_batch, "With queue_mode=2 and irqmode=2, complete all requests pending on a hardware queue from one timer, as a batch. Default: false");
+
+static int g_hw_queue_depth = 64;
+module_param_named(hw_queue_depth, g_hw_queue_depth, int, S_IRUGO);
 MODULE_PARM_DESC(hw_queue_depth, "Queue depth for each hardware queue. Default: 64");
 
-static bool use_per_node_hctx = false;
-module_param(use_per_node_hctx, bool, S_IRUGO);
+static bool g_use_per_node_hctx;
+module_param_named(use_per_node_hctx, g_use_per_node_hctx, bool, S_IRUGO);
 MODULE_PARM_DESC(use_per_node_hctx, "Use per-node allocation for hardware context queues. Default: false");
 
-static void put_tag(struct nullb_queue *nq, unsigned int tag)
+static bool g_memory_backed;
+module_param_named(memory_backed, g_memory_backed, bool, S_IRUGO);
+MODULE_PARM_DESC(memory_backed, "Store written data in memory, with queue_mode=0 or 2. Default: false");
+
+static bool g_discard;
+module_param_named(discard, g_discard, bool, S_IRUGO);
+MODULE_PARM_DESC(discard, "Support discard operations (requires memory_backed). Default: false");
+
+static unsigned int g_mbps;
+module_param_named(mbps, g_mbps, uint, S_IRUGO);
+MODULE_PARM_DESC(mbps, "Cap the bandwidth to this many MB/s, with queue_mode=1 or 2. Default: 0 (no cap)");
+
+static bool g_zoned;
+module_param_named(zoned, g_zoned, bool, S_IRUGO);
+MODULE_PARM_DESC(zoned, "Make device a host-managed zoned block device. Default: false");
+
+static unsigned long g_zone_size = 256;
+module_param_named(zone_size, g_zone_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(zone_size, "Zone size in MB when block device is zoned. Must be power-of-two: Default: 256");
+
+static unsigned int g_zone_nr_conv;
+module_param_named(zone_nr_conv, g_zone_nr_conv, uint, S_IRUGO);
+MODULE_PARM_DESC(zone_nr_conv, "Number of conventional zones when block device is zoned. Default: 0");
+
+static int tag_bench;
+module_param(tag_bench, int, S_IRUGO);
+MODULE_PARM_DESC(tag_bench, "Time this many tag allocations per cpu on the first device at load, for a growing number of cpus. Default: 0 (off)");
+
+static struct nullb_device *null_alloc_dev(void);
+static void null_free_dev(struct nullb_device *dev);
+static void null_del_dev(struct nullb *nullb);
+static int null_add_dev(struct nullb_device *dev);
+
+static inline struct nullb_device *to_nullb_device(struct config_item *item)
 {
-	clear_bit_unlock(tag, nq->tag_map);
+	return item ? container_of(item, struct nullb_device, item) : NULL;
+}
 
-	if (waitqueue_active(&nq->wait))
-		wake_up(&nq->wait);
+static inline ssize_t nullb_device_uint_attr_show(unsigned int val, char *page)
+{
+	return snprintf(page, PAGE_SIZE, "%u\n", val);
 }
 
-static unsigned int get_tag(struct nullb_queue *nq)
+static inline ssize_t nullb_device_int_attr_show(int val, char *page)
 {
-	unsigned int tag;
+	return snprintf(page, PAGE_SIZE, "%d\n", val);
+}
 
-	do {
-		tag = find_first_zero_bit(nq->tag_map, nq->queue_depth);
-		if (tag >= nq->queue_depth)
-			return -1U;
-	} while (test_and_set_bit_lock(tag, nq->tag_map));
+static inline ssize_t nullb_device_ulong_attr_show(unsigned long val,
+	char *page)
+{
+	return snprintf(page, PAGE_SIZE, "%lu\n", val);
+}
+
+static inline ssize_t nullb_device_bool_attr_show(bool val, char *page)
+{
+	return snprintf(page, PAGE_SIZE, "%u\n", val);
+}
+
+static ssize_t nullb_device_uint_attr_store(unsigned int *val,
+	const char *page, size_t count)
+{
+	unsigned int tmp;
+	int result;
+
+	result = kstrtouint(page, 0, &tmp);
+	if (result)
+		return result;
+
+	*val = tmp;
+	return count;
+}
+
+static ssize_t nullb_device_int_attr_store(int *val, const char *page,
+	size_t count)
+{
+	int tmp;
+	int result;
+
+	result = kstrtoint(page, 0, &tmp);
+	if (result)
+		return result;
+
+	*val = tmp;
+	return count;
+}
+
+static ssize_t nullb_device_ulong_attr_store(unsigned long *val,
+	const char *page, size_t count)
+{
+	int result;
+	unsigned long tmp;
+
+	result = kstrtoul(page, 0, &tmp);
+	if (result)
+		return result;
+
+	*val = tmp;
+	return count;
+}
+
+static ssize_t nullb_device_bool_attr_store(bool *val, const char *page,
+	size_t count)
+{
+	bool tmp;
+	int result;
+
+	result = kstrtobool(page,  &tmp);
+	if (result)
+		return result;
+
+	*val = tmp;
+	return count;
+}
+
+/* The following macro should only be used with TYPE = {uint, int, ulong, bool}. */
+#define NULLB_DEVICE_ATTR(NAME, TYPE)					\
+static ssize_t								\
+nullb_device_##NAME##_show(struct config_item *item, char *page)	\
+{									\
+	return nullb_device_##TYPE##_attr_show(				\
+				to_nullb_device(item)->NAME, page);	\
+}									\
+static ssize_t								\
+nullb_device_##NAME##_store(struct config_item *item, const char *page,	\
+			    size_t count)				\
+{									\
+	if (test_bit(NULLB_DEV_FL_CONFIGURED, &to_nullb_device(item)->flags)) \
+		return -EBUSY;						\
+	return nullb_device_##TYPE##_attr_store(			\
+			&to_nullb_device(item)->NAME, page, count);	\
+}									\
+CONFIGFS_ATTR(nullb_device_, NAME);
+
+NULLB_DEVICE_ATTR(size, ulong);
+NULLB_DEVICE_ATTR(completion_nsec, ulong);
+NULLB_DEVICE_ATTR(latency_dist, uint);
+NULLB_DEVICE_ATTR(completion_jitter_nsec, ulong);
+NULLB_DEVICE_ATTR(tail_permille, uint);
+NULLB_DEVICE_ATTR(tail_nsec, ulong);
+NULLB_DEVICE_ATTR(submit_queues, uint);
+NULLB_DEVICE_ATTR(home_node, int);
+NULLB_DEVICE_ATTR(queue_mode, uint);
+NULLB_DEVICE_ATTR(blocksize, uint);
+NULLB_DEVICE_ATTR(irqmode, uint);
+NULLB_DEVICE_ATTR(hw_queue_depth, uint);
+NULLB_DEVICE_ATTR(index, uint);
+NULLB_DEVICE_ATTR(use_lightnvm, bool);
+NULLB_DEVICE_ATTR(use_per_node_hctx, bool);
+NULLB_DEVICE_ATTR(complete_batch, bool);
+NULLB_DEVICE_ATTR(memory_backed, bool);
+NULLB_DEVICE_ATTR(discard, bool);
+NULLB_DEVICE_ATTR(mbps, uint);
+NULLB_DEVICE_ATTR(zoned, bool);
+NULLB_DEVICE_ATTR(zone_size, ulong);
+NULLB_DEVICE_ATTR(zone_nr_conv, uint);
+
+static ssize_t nullb_device_power_show(struct config_item *item, char *page)
+{
+	return nullb_device_bool_attr_show(to_nullb_device(item)->power, page);
+}
+
+static ssize_t nullb_device_power_store(struct config_item *item,
+				     const char *page, size_t count)
+{
+	struct nullb_device *dev = to_nullb_device(item);
+	bool newp = false;
+	ssize_t ret;
+
+	ret = nullb_device_bool_attr_store(&newp, page, count);
+	if (ret < 0)
+		return ret;
+
+	if (!dev->power && newp) {
+		if (test_and_set_bit(NULLB_DEV_FL_UP, &dev->flags))
+			return count;
+		ret = null_add_dev(dev);
+		if (ret) {
+			clear_bit(NULLB_DEV_FL_UP, &dev->flags);
+			return ret;
+		}
+
+		set_bit(NULLB_DEV_FL_CONFIGURED, &dev->flags);
+		dev->power = newp;
+	} else if (dev->power && !newp) {
+		mutex_lock(&lock);
+		dev->power = newp;
+		null_del_dev(dev->nullb);
+		mutex_unlock(&lock);
+		clear_bit(NULLB_DEV_FL_UP, &dev->flags);
+		clear_bit(NULLB_DEV_FL_CONFIGURED, &dev->flags);
+	}
+
+	return count;
+}
+
+CONFIGFS_ATTR(nullb_device_, power);
+
+static ssize_t nullb_device_badblocks_show(struct config_item *item, char *page)
+{
+	struct nullb_device *t_dev = to_nullb_device(item);
+
+	return badblocks_show(&t_dev->badblocks, page, 0);
+}
+
+/*
+ * "+start-end" marks the sectors from start to end (inclusive) bad, and
+ * "-start-end" clears them again. Works while the device is up.
+ */
+static ssize_t nullb_device_badblocks_store(struct config_item *item,
+				     const char *page, size_t count)
+{
+	struct nullb_device *t_dev = to_nullb_device(item);
+	char *orig, *buf, *tmp;
+	u64 start, end;
+	int ret;
+
+	orig = kstrndup(page, count, GFP_KERNEL);
+	if (!orig)
+		return -ENOMEM;
+
+	buf = strstrip(orig);
+
+	ret = -EINVAL;
+	if (buf[0] != '+' && buf[0] != '-')
+		goto out;
+	tmp = strchr(&buf[1], '-');
+	if (!tmp)
+		goto out;
+	*tmp = '\0';
+	ret = kstrtoull(buf + 1, 0, &start);
+	if (ret)
+		goto out;
+	ret = kstrtoull(tmp + 1, 0, &end);
+	if (ret)
+		goto out;
+	ret = -EINVAL;
+	if (start > end)
+		goto out;
+	/* enable badblocks */
+	cmpxchg(&t_dev->badblocks.shift, -1, 0);
+	if (buf[0] == '+') {
+		ret = badblocks_set(&t_dev->badblocks, start,
+			end - start + 1, 1);
+		if (ret)
+			ret = -ENOSPC;
+	} else {
+		ret = badblocks_clear(&t_dev->badblocks, start,
+			end - start + 1);
+	}
+	if (ret == 0)
+		ret = count;
+out:
+	kfree(orig);
+	return ret;
+}
+CONFIGFS_ATTR(nullb_device_, badblocks);
+
+static struct configfs_attribute *nullb_device_attrs[] = {
+	&nullb_device_attr_size,
+	&nullb_device_attr_completion_nsec,
+	&nullb_device_attr_latency_dist,
+	&nullb_device_attr_completion_jitter_nsec,
+	&nullb_device_attr_tail_permille,
+	&nullb_device_attr_tail_nsec,
+	&nullb_device_attr_submit_queues,
+	&nullb_device_attr_home_node,
+	&nullb_device_attr_queue_mode,
+	&nullb_device_attr_blocksize,
+	&nullb_device_attr_irqmode,
+	&nullb_device_attr_hw_queue_depth,
+	&nullb_device_attr_index,
+	&nullb_device_attr_use_lightnvm,
+	&nullb_device_attr_use_per_node_hctx,
+	&nullb_device_attr_complete_batch,
+	&nullb_device_attr_power,
+	&nullb_device_attr_memory_backed,
+	&nullb_device_attr_discard,
+	&nullb_device_attr_mbps,
+	&nullb_device_attr_badblocks,
+	&nullb_device_attr_zoned,
+	&nullb_device_attr_zone_size,
+	&nullb_device_attr_zone_nr_conv,
+	NULL,
+};
+
+static void nullb_device_release(struct config_item *item)
+{
+	null_free_dev(to_nullb_device(item));
+}
+
+static struct configfs_item_operations nullb_device_ops = {
+	.release	= nullb_device_release,
+};
+
+static struct config_item_type nullb_device_type = {
+	.ct_item_ops	= &nullb_device_ops,
+	.ct_attrs	= nullb_device_attrs,
+	.ct_owner	= THIS_MODULE,
+};
+
+static struct
+config_item *nullb_group_make_item(struct config_group *group, const char *name)
+{
+	struct nullb_device *dev;
+
+	dev = null_alloc_dev();
+	if (!dev)
+		return ERR_PTR(-ENOMEM);
+
+	config_item_init_type_name(&dev->item, name, &nullb_device_type);
+
+	return &dev->item;
+}
+
+static void
+nullb_group_drop_item(struct config_group *group, struct config_item *item)
+{
+	struct nullb_device *dev = to_nullb_device(item);
 
-	return tag;
+	if (test_and_clear_bit(NULLB_DEV_FL_UP, &dev->flags)) {
+		mutex_lock(&lock);
+		dev->power = false;
+		null_del_dev(dev->nullb);
+		mutex_unlock(&lock);
+	}
+
+	config_item_put(item);
+}
+
+static ssize_t memb_group_features_show(struct config_item *item, char *page)
+{
+	return snprintf(page, PAGE_SIZE,
+			"memory_backed,discard,bandwidth,badblocks,zoned,latency_dist\n");
+}
+
+CONFIGFS_ATTR_RO(memb_group_, features);
+
+static struct configfs_attribute *nullb_group_attrs[] = {
+	&memb_group_attr_features,
+	NULL,
+};
+
+static struct configfs_group_operations nullb_group_ops = {
+	.make_item	= nullb_group_make_item,
+	.drop_item	= nullb_group_drop_item,
+};
+
+static struct config_item_type nullb_group_type = {
+	.ct_group_ops	= &nullb_group_ops,
+	.ct_attrs	= nullb_group_attrs,
+	.ct_owner	= THIS_MODULE,
+};
+
+static struct configfs_subsystem nullb_subsys = {
+	.su_group = {
+		.cg_item = {
+			.ci_namebuf = "nullb",
+			.ci_type = &nullb_group_type,
+		},
+	},
+};
+
+static struct nullb_device *null_alloc_dev(void)
+{
+	struct nullb_device *dev;
+
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev)
+		return NULL;
+	INIT_RADIX_TREE(&dev->data, GFP_ATOMIC);
+	if (badblocks_init(&dev->badblocks, 0)) {
+		kfree(dev);
+		return NULL;
+	}
+
+	dev->size = g_gb * 1024;
+	dev->completion_nsec = g_completion_nsec;
+	dev->latency_dist = g_latency_dist;
+	dev->completion_jitter_nsec = g_completion_jitter_nsec;
+	dev->tail_permille = g_tail_permille;
+	dev->tail_nsec = g_tail_nsec;
+	dev->submit_queues = g_submit_queues;
+	dev->home_node = g_home_node;
+	dev->queue_mode = g_queue_mode;
+	dev->blocksize = g_bs;
+	dev->irqmode = g_irqmode;
+	dev->hw_queue_depth = g_hw_queue_depth;
+	dev->use_lightnvm = g_use_lightnvm;
+	dev->use_per_node_hctx = g_use_per_node_hctx;
+	dev->complete_batch = g_complete_batch;
+	dev->memory_backed = g_memory_backed;
+	dev->discard = g_discard;
+	dev->mbps = g_mbps;
+	dev->zoned = g_zoned;
+	dev->zone_size = g_zone_size;
+	dev->zone_nr_conv = g_zone_nr_conv;
+	return dev;
+}
+
+static void null_free_device_storage(struct nullb_device *dev);
+
+static void null_free_dev(struct nullb_device *dev)
+{
+	if (!dev)
+		return;
+
+	null_free_device_storage(dev);
+	badblocks_exit(&dev->badblocks);
+	kfree(dev);
 }
 
 static void free_cmd(struct nullb_cmd *cmd)
 {
-	put_tag(cmd->nq, cmd->tag);
+	sbitmap_queue_clear(&cmd->nq->tags, cmd->tag, cmd->tag_cpu);
 }
 
 static enum hrtimer_restart null_cmd_timer_expired(struct hrtimer *timer);
@@ -175,14 +717,16 @@ static enum hrtimer_restart null_cmd_timer_expired(struct hrtimer *timer);
 static struct nullb_cmd *__alloc_cmd(struct nullb_queue *nq)
 {
 	struct nullb_cmd *cmd;
-	unsigned int tag;
+	unsigned int cpu;
+	int tag;
 
-	tag = get_tag(nq);
-	if (tag != -1U) {
+	tag = sbitmap_queue_get(&nq->tags, &cpu);
+	if (tag >= 0) {
 		cmd = &nq->cmds[tag];
 		cmd->tag = tag;
+		cmd->tag_cpu = cpu;
 		cmd->nq = nq;
-		if (irqmode == NULL_IRQ_TIMER) {
+		if (nq->dev->irqmode == NULL_IRQ_TIMER) {
 			hrtimer_init(&cmd->timer, CLOCK_MONOTONIC,
 				     HRTIMER_MODE_REL);
 			cmd->timer.function = null_cmd_timer_expired;
@@ -195,6 +739,7 @@ static struct nullb_cmd *__alloc_cmd(struct nullb_queue *nq)
 
 static struct nullb_cmd *alloc_cmd(struct nullb_queue *nq, int can_wait)
 {
+	struct sbq_wait_state *ws;
 	struct nullb_cmd *cmd;
 	DEFINE_WAIT(wait);
 
@@ -202,35 +747,41 @@ static struct nullb_cmd *alloc_cmd(struct nullb_queue *nq, int can_wait)
 	if (cmd || !can_wait)
 		return cmd;
 
+	ws = sbq_wait_ptr(&nq->tags, &nq->wait_index);
 	do {
-		prepare_to_wait(&nq->wait, &wait, TASK_UNINTERRUPTIBLE);
+		prepare_to_wait(&ws->wait, &wait, TASK_UNINTERRUPTIBLE);
 		cmd = __alloc_cmd(nq);
 		if (cmd)
 			break;
 
 		io_schedule();
+
+		finish_wait(&ws->wait, &wait);
+		ws = sbq_wait_ptr(&nq->tags, &nq->wait_index);
 	} while (1);
 
-	finish_wait(&nq->wait, &wait);
+	finish_wait(&ws->wait, &wait);
 	return cmd;
 }
 
 static void end_cmd(struct nullb_cmd *cmd)
 {
 	struct request_queue *q = NULL;
+	int queue_mode = cmd->nq->dev->queue_mode;
 
 	if (cmd->rq)
 		q = cmd->rq->q;
 
 	switch (queue_mode)  {
 	case NULL_Q_MQ:
-		blk_mq_end_request(cmd->rq, 0);
+		blk_mq_end_request(cmd->rq, cmd->error);
 		return;
 	case NULL_Q_RQ:
 		INIT_LIST_HEAD(&cmd->rq->queuelist);
-		blk_end_request_all(cmd->rq, 0);
+		blk_end_request_all(cmd->rq, cmd->error);
 		break;
 	case NULL_Q_BIO:
+		cmd->bio->bi_error = cmd->error;
 		bio_endio(cmd->bio);
 		break;
 	}
@@ -254,29 +805,678 @@ static enum hrtimer_restart null_cmd_timer_expired(struct hrtimer *timer)
 	return HRTIMER_NORESTART;
 }
 
+/*
+ * -ln(u) * @mean for u uniform in (0, 1], which is exponentially
+ * distributed with mean @mean. log2 is approximated in 16.16 fixed point
+ * by the position of the top bit plus a linear interpolation of the bits
+ * below it, good to within a few percent.
+ */
+static u64 null_exp_nsec(u64 mean)
+{
+	u32 r = prandom_u32() | 1;
+	unsigned int msb = ilog2(r);
+	u64 log2_r, neg_log2_u;
+
+	log2_r = ((u64)msb << 16) + ((((u64)r << 16) >> msb) - (1 << 16));
+	neg_log2_u = (32ULL << 16) - log2_r;
+
+	/* ln(x) = log2(x) * ln(2), ln(2) ~= 45426 / 2^16 */
+	return (mean * ((neg_log2_u * 45426) >> 16)) >> 16;
+}
+
+/*
+ * Completion time of the next request in timer mode: completion_nsec,
+ * either fixed, spread uniformly by completion_jitter_nsec around it, or
+ * as the mean of an exponential distribution. On top of that, a share of
+ * tail_permille requests takes tail_nsec instead, to model latency
+ * outliers.
+ */
+static u64 null_cmd_latency(struct nullb_device *dev)
+{
+	u64 nsec = dev->completion_nsec;
+	u32 jitter;
+
+	if (dev->tail_permille &&
+	    prandom_u32_max(1000) < dev->tail_permille)
+		return dev->tail_nsec;
+
+	switch (dev->latency_dist) {
+	case NULL_LAT_UNIFORM:
+		jitter = min3((u64)dev->completion_jitter_nsec, nsec,
+			      (u64)(U32_MAX / 2));
+		if (jitter)
+			nsec = nsec - jitter + prandom_u32_max(2 * jitter + 1);
+		break;
+	case NULL_LAT_EXP:
+		nsec = null_exp_nsec(nsec);
+		break;
+	}
+
+	return nsec;
+}
+
 static void null_cmd_end_timer(struct nullb_cmd *cmd)
 {
-	ktime_t kt = ktime_set(0, completion_nsec);
+	ktime_t kt = ns_to_ktime(null_cmd_latency(cmd->nq->dev));
 
 	hrtimer_start(&cmd->timer, kt, HRTIMER_MODE_REL);
 }
 
+/*
+ * Batched timer completion: the first request queued on an idle queue
+ * arms the queue timer, and everything that arrived by the time it fires
+ * is ended as one batch, like a driver reaping a completion queue.
+ */
+static enum hrtimer_restart null_cq_timer_expired(struct hrtimer *timer)
+{
+	struct nullb_queue *nq = container_of(timer, struct nullb_queue,
+					      cq_timer);
+	DEFINE_BLK_MQ_COMP_BATCH(batch);
+	struct nullb_cmd *cmd, *next;
+	struct llist_node *entry;
+
+	entry = llist_reverse_order(llist_del_all(&nq->cq));
+	llist_for_each_entry_safe(cmd, next, entry, ll_list) {
+		if (!blk_mq_add_to_batch(cmd->rq, &batch, cmd->error))
+			end_cmd(cmd);
+	}
+	blk_mq_end_request_batch(&batch);
+
+	return HRTIMER_NORESTART;
+}
+
+static void null_cq_add(struct nullb_cmd *cmd)
+{
+	struct nullb_queue *nq = cmd->nq;
+
+	if (llist_add(&cmd->ll_list, &nq->cq))
+		hrtimer_start(&nq->cq_timer,
+			      ns_to_ktime(null_cmd_latency(nq->dev)),
+			      HRTIMER_MODE_REL);
+}
+
 static void null_softirq_done_fn(struct request *rq)
 {
-	if (queue_mode == NULL_Q_MQ)
+	struct nullb *nullb = rq->q->queuedata;
+
+	if (nullb->dev->queue_mode == NULL_Q_MQ)
 		end_cmd(blk_mq_rq_to_pdu(rq));
 	else
 		end_cmd(rq->special);
 }
 
-static inline void null_handle_cmd(struct nullb_cmd *cmd)
+static struct nullb_page *null_alloc_page(gfp_t gfp_flags)
+{
+	struct nullb_page *t_page;
+
+	t_page = kzalloc(sizeof(struct nullb_page), gfp_flags);
+	if (!t_page)
+		return NULL;
+
+	t_page->page = alloc_pages(gfp_flags, 0);
+	if (!t_page->page) {
+		kfree(t_page);
+		return NULL;
+	}
+
+	return t_page;
+}
+
+static void null_free_page(struct nullb_page *t_page)
+{
+	__free_page(t_page->page);
+	kfree(t_page);
+}
+
+static void null_free_device_storage(struct nullb_device *dev)
+{
+	unsigned long pos = 0;
+	int nr_pages;
+	struct nullb_page *ret, *t_pages[FREE_BATCH];
+
+	do {
+		int i;
+
+		nr_pages = radix_tree_gang_lookup(&dev->data,
+				(void **)t_pages, pos, FREE_BATCH);
+
+		for (i = 0; i < nr_pages; i++) {
+			pos = t_pages[i]->page->index;
+			ret = radix_tree_delete(&dev->data, pos);
+			WARN_ON(ret != t_pages[i]);
+			null_free_page(ret);
+		}
+
+		pos++;
+	} while (nr_pages == FREE_BATCH);
+}
+
+static struct nullb_page *null_lookup_page(struct nullb *nullb,
+	sector_t sector)
+{
+	return radix_tree_lookup(&nullb->dev->data,
+				 sector >> PAGE_SECTORS_SHIFT);
+}
+
+/*
+ * Called with nullb->lock held, drops it to allocate. Only used from
+ * contexts that may sleep, see null_validate_conf().
+ */
+static struct nullb_page *null_insert_page(struct nullb *nullb,
+	sector_t sector)
+	__releases(&nullb->lock)
+	__acquires(&nullb->lock)
+{
+	u64 idx = sector >> PAGE_SECTORS_SHIFT;
+	struct nullb_page *t_page, *exist;
+
+	t_page = null_lookup_page(nullb, sector);
+	if (t_page)
+		return t_page;
+
+	spin_unlock_irq(&nullb->lock);
+
+	t_page = null_alloc_page(GFP_NOIO);
+	if (!t_page)
+		goto out_lock;
+
+	if (radix_tree_preload(GFP_NOIO))
+		goto out_freepage;
+
+	spin_lock_irq(&nullb->lock);
+	t_page->page->index = idx;
+	if (radix_tree_insert(&nullb->dev->data, idx, t_page)) {
+		exist = radix_tree_lookup(&nullb->dev->data, idx);
+		null_free_page(t_page);
+		t_page = exist;
+	}
+	radix_tree_preload_end();
+
+	return t_page;
+out_freepage:
+	null_free_page(t_page);
+out_lock:
+	spin_lock_irq(&nullb->lock);
+	return null_lookup_page(nullb, sector);
+}
+
+static int copy_to_nullb(struct nullb *nullb, struct page *source,
+	unsigned int off, sector_t sector, size_t n)
+{
+	size_t temp, count = 0;
+	unsigned int offset;
+	struct nullb_page *t_page;
+	void *dst, *src;
+
+	while (count < n) {
+		offset = (sector & SECTOR_MASK) << SECTOR_SHIFT;
+		temp = min_t(size_t, PAGE_SIZE - offset, n - count);
+
+		t_page = null_insert_page(nullb, sector);
+		if (!t_page)
+			return -ENOSPC;
+
+		src = kmap_atomic(source);
+		dst = kmap_atomic(t_page->page);
+		memcpy(dst + offset, src + off + count, temp);
+		kunmap_atomic(dst);
+		kunmap_atomic(src);
+
+		bitmap_set(t_page->bitmap, sector & SECTOR_MASK,
+			   temp >> SECTOR_SHIFT);
+
+		count += temp;
+		sector += temp >> SECTOR_SHIFT;
+	}
+	return 0;
+}
+
+static int copy_from_nullb(struct nullb *nullb, struct page *dest,
+	unsigned int off, sector_t sector, size_t n)
 {
-	/* Complete IO by inline, softirq or timer */
-	switch (irqmode) {
+	size_t temp, count = 0;
+	unsigned int offset, i;
+	struct nullb_page *t_page;
+	void *dst, *src;
+
+	while (count < n) {
+		offset = (sector & SECTOR_MASK) << SECTOR_SHIFT;
+		temp = min_t(size_t, PAGE_SIZE - offset, n - count);
+
+		t_page = null_lookup_page(nullb, sector);
+
+		dst = kmap_atomic(dest);
+		src = t_page ? kmap_atomic(t_page->page) : NULL;
+		for (i = 0; i < temp >> SECTOR_SHIFT; i++) {
+			unsigned int s = (sector & SECTOR_MASK) + i;
+			void *to = dst + off + count + (i << SECTOR_SHIFT);
+
+			if (src && test_bit(s, t_page->bitmap))
+				memcpy(to, src + (s << SECTOR_SHIFT),
+				       1 << SECTOR_SHIFT);
+			else
+				memset(to, 0, 1 << SECTOR_SHIFT);
+		}
+		if (src)
+			kunmap_atomic(src);
+		kunmap_atomic(dst);
+
+		count += temp;
+		sector += temp >> SECTOR_SHIFT;
+	}
+	return 0;
+}
+
+static void null_handle_discard(struct nullb *nullb, sector_t sector,
+	size_t n)
+{
+	struct nullb_device *dev = nullb->dev;
+	struct nullb_page *t_page;
+	unsigned int offset;
+	size_t temp;
+
+	spin_lock_irq(&nullb->lock);
+	while (n > 0) {
+		offset = (sector & SECTOR_MASK) << SECTOR_SHIFT;
+		temp = min_t(size_t, PAGE_SIZE - offset, n);
+
+		t_page = null_lookup_page(nullb, sector);
+		if (t_page) {
+			bitmap_clear(t_page->bitmap, sector & SECTOR_MASK,
+				     temp >> SECTOR_SHIFT);
+			if (bitmap_empty(t_page->bitmap, PAGE_SECTORS)) {
+				radix_tree_delete(&dev->data,
+						  t_page->page->index);
+				null_free_page(t_page);
+			}
+		}
+
+		sector += temp >> SECTOR_SHIFT;
+		n -= temp;
+	}
+	spin_unlock_irq(&nullb->lock);
+}
+
+static int null_transfer(struct nullb *nullb, struct page *page,
+	unsigned int len, unsigned int off, bool is_write, sector_t sector)
+{
+	if (!is_write) {
+		copy_from_nullb(nullb, page, off, sector, len);
+		flush_dcache_page(page);
+		return 0;
+	}
+
+	flush_dcache_page(page);
+	return copy_to_nullb(nullb, page, off, sector, len);
+}
+
+static int null_handle_rq(struct nullb_cmd *cmd)
+{
+	struct request *rq = cmd->rq;
+	struct nullb *nullb = cmd->nq->dev->nullb;
+	int err;
+	unsigned int len;
+	sector_t sector;
+	struct req_iterator iter;
+	struct bio_vec bvec;
+
+	sector = blk_rq_pos(rq);
+
+	if (req_op(rq) == REQ_OP_DISCARD ||
+	    req_op(rq) == REQ_OP_WRITE_ZEROES) {
+		null_handle_discard(nullb, sector, blk_rq_bytes(rq));
+		return 0;
+	}
+
+	spin_lock_irq(&nullb->lock);
+	rq_for_each_segment(bvec, rq, iter) {
+		len = bvec.bv_len;
+		err = null_transfer(nullb, bvec.bv_page, len, bvec.bv_offset,
+				     op_is_write(req_op(rq)), sector);
+		if (err) {
+			spin_unlock_irq(&nullb->lock);
+			return err;
+		}
+		sector += len >> SECTOR_SHIFT;
+	}
+	spin_unlock_irq(&nullb->lock);
+
+	return 0;
+}
+
+static int null_handle_bio(struct nullb_cmd *cmd)
+{
+	struct bio *bio = cmd->bio;
+	struct nullb *nullb = cmd->nq->dev->nullb;
+	int err;
+	unsigned int len;
+	sector_t sector;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	sector = bio->bi_iter.bi_sector;
+
+	if (bio_op(bio) == REQ_OP_DISCARD ||
+	    bio_op(bio) == REQ_OP_WRITE_ZEROES) {
+		null_handle_discard(nullb, sector, bio->bi_iter.bi_size);
+		return 0;
+	}
+
+	spin_lock_irq(&nullb->lock);
+	bio_for_each_segment(bvec, bio, iter) {
+		len = bvec.bv_len;
+		err = null_transfer(nullb, bvec.bv_page, len, bvec.bv_offset,
+				     op_is_write(bio_op(bio)), sector);
+		if (err) {
+			spin_unlock_irq(&nullb->lock);
+			return err;
+		}
+		sector += len >> SECTOR_SHIFT;
+	}
+	spin_unlock_irq(&nullb->lock);
+
+	return 0;
+}
+
+#ifdef CONFIG_BLK_DEV_ZONED
+
+#define MB_TO_SECTS(mb) (((sector_t)mb * SZ_1M) >> SECTOR_SHIFT)
+
+static inline unsigned int null_zone_no(struct nullb_device *dev,
+					sector_t sect)
+{
+	return sect >> ilog2(dev->zone_size_sects);
+}
+
+static int null_zone_init(struct nullb_device *dev)
+{
+	sector_t dev_size = MB_TO_SECTS(dev->size);
+	struct blk_zone *zone;
+	sector_t sector = 0;
+	unsigned int i;
+
+	if (!is_power_of_2(dev->zone_size)) {
+		pr_err("null_blk: zone_size must be power-of-two\n");
+		return -EINVAL;
+	}
+
+	dev->zone_size_sects = MB_TO_SECTS(dev->zone_size);
+	dev->nr_zones = dev_size >> ilog2(dev->zone_size_sects);
+	if (!dev->nr_zones) {
+		pr_err("null_blk: device smaller than one zone\n");
+		return -EINVAL;
+	}
+
+	if (dev->zone_nr_conv >= dev->nr_zones) {
+		dev->zone_nr_conv = dev->nr_zones - 1;
+		pr_info("null_blk: changed the number of conventional zones to %u",
+			dev->zone_nr_conv);
+	}
+
+	dev->zones = vzalloc(dev->nr_zones * sizeof(struct blk_zone));
+	if (!dev->zones)
+		return -ENOMEM;
+
+	for (i = 0; i < dev->nr_zones; i++) {
+		zone = &dev->zones[i];
+
+		zone->start = sector;
+		zone->len = dev->zone_size_sects;
+		if (i < dev->zone_nr_conv) {
+			zone->wp = zone->start + zone->len;
+			zone->type = BLK_ZONE_TYPE_CONVENTIONAL;
+			zone->cond = BLK_ZONE_COND_NOT_WP;
+		} else {
+			zone->wp = zone->start;
+			zone->type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+			zone->cond = BLK_ZONE_COND_EMPTY;
+		}
+
+		sector += dev->zone_size_sects;
+	}
+
+	return 0;
+}
+
+static void null_zone_exit(struct nullb_device *dev)
+{
+	vfree(dev->zones);
+	dev->zones = NULL;
+}
+
+static void null_zone_setup_queue(struct nullb *nullb)
+{
+	struct nullb_device *dev = nullb->dev;
+
+	nullb->q->limits.zoned = BLK_ZONED_HM;
+	blk_queue_chunk_sectors(nullb->q, dev->zone_size_sects);
+}
+
+/*
+ * The zone report goes into the data buffer: a header with the number of
+ * zones reported, followed by the zones starting at the one containing
+ * the request sector, as many as fit.
+ */
+static void null_zone_report(struct nullb_device *dev, struct bio *bio)
+{
+	unsigned int zno = null_zone_no(dev, bio->bi_iter.bi_sector);
+	unsigned int nr, nr_rep = 0, skip = sizeof(struct blk_zone_report_hdr);
+	struct blk_zone_report_hdr *hdr;
+	struct bio_vec bvec, first = { };
+	struct bvec_iter iter;
+	void *addr;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		if (!first.bv_page) {
+			/* the header has to fit in the first segment */
+			if (bvec.bv_len < skip)
+				return;
+			first = bvec;
+		}
+		if (zno >= dev->nr_zones)
+			break;
+
+		nr = (bvec.bv_len - skip) / sizeof(struct blk_zone);
+		nr = min(nr, dev->nr_zones - zno);
+
+		addr = kmap_atomic(bvec.bv_page);
+		memcpy(addr + bvec.bv_offset + skip, &dev->zones[zno],
+		       nr * sizeof(struct blk_zone));
+		kunmap_atomic(addr);
+
+		zno += nr;
+		nr_rep += nr;
+		skip = 0;
+	}
+
+	if (!first.bv_page)
+		return;
+
+	addr = kmap_atomic(first.bv_page);
+	hdr = addr + first.bv_offset;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->nr_zones = nr_rep;
+	kunmap_atomic(addr);
+}
+
+static int null_zone_write(struct nullb_device *dev, sector_t sector,
+			   unsigned int nr_sectors)
+{
+	struct blk_zone *zone = &dev->zones[null_zone_no(dev, sector)];
+
+	switch (zone->cond) {
+	case BLK_ZONE_COND_FULL:
+		/* Cannot write to a full zone */
+		return -EIO;
+	case BLK_ZONE_COND_EMPTY:
+	case BLK_ZONE_COND_IMP_OPEN:
+		/* Writes must be at the write pointer position */
+		if (sector != zone->wp ||
+		    sector + nr_sectors > zone->start + zone->len)
+			return -EIO;
+
+		if (zone->cond == BLK_ZONE_COND_EMPTY)
+			zone->cond = BLK_ZONE_COND_IMP_OPEN;
+
+		zone->wp += nr_sectors;
+		if (zone->wp == zone->start + zone->len)
+			zone->cond = BLK_ZONE_COND_FULL;
+		return 0;
+	case BLK_ZONE_COND_NOT_WP:
+		return 0;
+	default:
+		/* Invalid zone condition */
+		return -EIO;
+	}
+}
+
+static int null_zone_reset(struct nullb_device *dev, sector_t sector)
+{
+	struct blk_zone *zone = &dev->zones[null_zone_no(dev, sector)];
+
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return -EIO;
+
+	zone->cond = BLK_ZONE_COND_EMPTY;
+	zone->wp = zone->start;
+	return 0;
+}
+
+/*
+ * Zone state changes are serialized by nullb->lock, the write pointer
+ * checks happen at submission just like a device would do them.
+ */
+static int null_handle_zoned(struct nullb_cmd *cmd, unsigned int op,
+			     sector_t sector, unsigned int nr_sectors)
+{
+	struct nullb_device *dev = cmd->nq->dev;
+	struct nullb *nullb = dev->nullb;
+	unsigned long flags;
+	struct bio *bio;
+	int err = 0;
+
+	switch (op) {
+	case REQ_OP_ZONE_REPORT:
+		bio = dev->queue_mode == NULL_Q_BIO ? cmd->bio : cmd->rq->bio;
+		spin_lock_irqsave(&nullb->lock, flags);
+		null_zone_report(dev, bio);
+		spin_unlock_irqrestore(&nullb->lock, flags);
+		break;
+	case REQ_OP_ZONE_RESET:
+		spin_lock_irqsave(&nullb->lock, flags);
+		err = null_zone_reset(dev, sector);
+		spin_unlock_irqrestore(&nullb->lock, flags);
+		if (!err && dev->memory_backed)
+			null_handle_discard(nullb, sector,
+				dev->zone_size_sects << SECTOR_SHIFT);
+		break;
+	case REQ_OP_WRITE:
+	case REQ_OP_WRITE_ZEROES:
+		spin_lock_irqsave(&nullb->lock, flags);
+		err = null_zone_write(dev, sector, nr_sectors);
+		spin_unlock_irqrestore(&nullb->lock, flags);
+		break;
+	}
+
+	return err;
+}
+#else
+static int null_zone_init(struct nullb_device *dev)
+{
+	pr_err("null_blk: CONFIG_BLK_DEV_ZONED not enabled\n");
+	return -EINVAL;
+}
+static void null_zone_exit(struct nullb_device *dev) {}
+static void null_zone_setup_queue(struct nullb *nullb) {}
+static int null_handle_zoned(struct nullb_cmd *cmd, unsigned int op,
+			     sector_t sector, unsigned int nr_sectors)
+{
+	return -EOPNOTSUPP;
+}
+#endif /* CONFIG_BLK_DEV_ZONED */
+
+static void null_restart_queue_async(struct nullb *nullb)
+{
+	struct request_queue *q = nullb->q;
+	unsigned long flags;
+
+	if (nullb->dev->queue_mode == NULL_Q_MQ) {
+		blk_mq_start_stopped_hw_queues(q, true);
+	} else {
+		spin_lock_irqsave(q->queue_lock, flags);
+		if (blk_queue_stopped(q))
+			blk_start_queue_async(q);
+		spin_unlock_irqrestore(q->queue_lock, flags);
+	}
+}
+
+/*
+ * Bandwidth cap: every tick hands out a budget of bytes. Requests are
+ * issued while there is budget left, after that the queue is stopped
+ * until the timer refills it. The timer stops itself once a tick passes
+ * without any IO and is restarted by the next request.
+ */
+static enum hrtimer_restart nullb_bwtimer_fn(struct hrtimer *timer)
+{
+	struct nullb *nullb = container_of(timer, struct nullb, bw_timer);
+	ktime_t timer_interval = ktime_set(0, TIMER_INTERVAL);
+	unsigned int mbps = nullb->dev->mbps;
+
+	if (!test_bit(NULLB_DEV_FL_THROTTLED, &nullb->dev->flags))
+		return HRTIMER_NORESTART;
+
+	if (atomic_long_read(&nullb->cur_bytes) == mb_per_tick(mbps))
+		return HRTIMER_NORESTART;
+
+	atomic_long_set(&nullb->cur_bytes, mb_per_tick(mbps));
+	null_restart_queue_async(nullb);
+
+	hrtimer_forward_now(&nullb->bw_timer, timer_interval);
+
+	return HRTIMER_RESTART;
+}
+
+static void nullb_setup_bwtimer(struct nullb *nullb)
+{
+	ktime_t timer_interval = ktime_set(0, TIMER_INTERVAL);
+
+	hrtimer_init(&nullb->bw_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	nullb->bw_timer.function = nullb_bwtimer_fn;
+	atomic_long_set(&nullb->cur_bytes, mb_per_tick(nullb->dev->mbps));
+	hrtimer_start(&nullb->bw_timer, timer_interval, HRTIMER_MODE_REL);
+}
+
+/*
+ * Charge @bytes against the current tick. Returns false if the budget
+ * ran out, the hardware queues are stopped then.
+ */
+static bool null_mq_charge_bw(struct nullb *nullb, unsigned int bytes)
+{
+	if (!hrtimer_active(&nullb->bw_timer))
+		hrtimer_restart(&nullb->bw_timer);
+
+	if (atomic_long_read(&nullb->cur_bytes) > 0) {
+		atomic_long_sub(bytes, &nullb->cur_bytes);
+		return true;
+	}
+
+	blk_mq_stop_hw_queues(nullb->q);
+	/* race with the timer refilling the budget */
+	if (atomic_long_read(&nullb->cur_bytes) > 0)
+		null_restart_queue_async(nullb);
+	return false;
+}
+
+/* Complete IO by inline, softirq or timer */
+static void null_complete_cmd(struct nullb_cmd *cmd)
+{
+	struct nullb_device *dev = cmd->nq->dev;
+
+	switch (dev->irqmode) {
 	case NULL_IRQ_SOFTIRQ:
-		switch (queue_mode)  {
+		switch (dev->queue_mode)  {
 		case NULL_Q_MQ:
-			blk_mq_complete_request(cmd->rq, cmd->rq->errors);
+			blk_mq_complete_request(cmd->rq, cmd->error);
 			break;
 		case NULL_Q_RQ:
 			blk_complete_request(cmd->rq);
@@ -293,11 +1493,65 @@ static inline void null_handle_cmd(struct nullb_cmd *cmd)
 		end_cmd(cmd);
 		break;
 	case NULL_IRQ_TIMER:
-		null_cmd_end_timer(cmd);
+		if (dev->queue_mode == NULL_Q_MQ && dev->complete_batch)
+			null_cq_add(cmd);
+		else
+			null_cmd_end_timer(cmd);
 		break;
 	}
 }
 
+static void null_handle_cmd(struct nullb_cmd *cmd)
+{
+	struct nullb_device *dev = cmd->nq->dev;
+	unsigned int op, nr_sectors;
+	sector_t sector;
+	int err = 0;
+
+	if (dev->queue_mode == NULL_Q_BIO) {
+		op = bio_op(cmd->bio);
+		sector = cmd->bio->bi_iter.bi_sector;
+		nr_sectors = bio_sectors(cmd->bio);
+	} else {
+		/* leave LightNVM and other passthrough commands alone */
+		if (cmd->rq->cmd_type != REQ_TYPE_FS)
+			goto out;
+		op = req_op(cmd->rq);
+		sector = blk_rq_pos(cmd->rq);
+		nr_sectors = blk_rq_sectors(cmd->rq);
+	}
+
+	if (op == REQ_OP_FLUSH)
+		goto out;
+
+	if (dev->badblocks.shift != -1 && nr_sectors) {
+		sector_t first_bad;
+		int bad_sectors;
+
+		if (badblocks_check(&dev->badblocks, sector, nr_sectors,
+				    &first_bad, &bad_sectors)) {
+			err = -EIO;
+			goto out;
+		}
+	}
+
+	if (dev->zoned) {
+		err = null_handle_zoned(cmd, op, sector, nr_sectors);
+		if (err || op == REQ_OP_ZONE_REPORT || op == REQ_OP_ZONE_RESET)
+			goto out;
+	}
+
+	if (dev->memory_backed) {
+		if (dev->queue_mode == NULL_Q_BIO)
+			err = null_handle_bio(cmd);
+		else
+			err = null_handle_rq(cmd);
+	}
+out:
+	cmd->error = err;
+	null_complete_cmd(cmd);
+}
+
 static struct nullb_queue *nullb_to_queue(struct nullb *nullb)
 {
 	int index = 0;
@@ -311,9 +1565,14 @@ static struct nullb_queue *nullb_to_queue(struct nullb *nullb)
 static blk_qc_t null_queue_bio(struct request_queue *q, struct bio *bio)
 {
 	struct nullb *nullb = q->queuedata;
-	struct nullb_queue *nq = nullb_to_queue(nullb);
+	struct nullb_queue *nq;
 	struct nullb_cmd *cmd;
 
+	/* zone and page boundaries matter once data or zones are kept */
+	if (nullb->dev->memory_backed || nullb->dev->zoned)
+		blk_queue_split(q, &bio, q->bio_split);
+
+	nq = nullb_to_queue(nullb);
 	cmd = alloc_cmd(nq, 1);
 	cmd->bio = bio;
 
@@ -340,13 +1599,34 @@ static int null_rq_prep_fn(struct request_queue *q, struct request *req)
 
 static void null_request_fn(struct request_queue *q)
 {
+	struct nullb *nullb = q->queuedata;
+	bool throttled = test_bit(NULLB_DEV_FL_THROTTLED, &nullb->dev->flags);
 	struct request *rq;
 
-	while ((rq = blk_fetch_request(q)) != NULL) {
-		struct nullb_cmd *cmd = rq->special;
+	while (true) {
+		/*
+		 * The bandwidth timer restarts the queue under the queue
+		 * lock after refilling, so checking and stopping here can't
+		 * miss a refill.
+		 */
+		if (throttled) {
+			if (!hrtimer_active(&nullb->bw_timer))
+				hrtimer_restart(&nullb->bw_timer);
+			if (atomic_long_read(&nullb->cur_bytes) <= 0) {
+				blk_stop_queue(q);
+				break;
+			}
+		}
+
+		rq = blk_fetch_request(q);
+		if (!rq)
+			break;
+
+		if (throttled)
+			atomic_long_sub(blk_rq_bytes(rq), &nullb->cur_bytes);
 
 		spin_unlock_irq(q->queue_lock);
-		null_handle_cmd(cmd);
+		null_handle_cmd(rq->special);
 		spin_lock_irq(q->queue_lock);
 	}
 }
@@ -355,13 +1635,21 @@ static int null_queue_rq(struct blk_mq_hw_ctx *hctx,
 			 const struct blk_mq_queue_data *bd)
 {
 	struct nullb_cmd *cmd = blk_mq_rq_to_pdu(bd->rq);
+	struct nullb_queue *nq = hctx->driver_data;
+	struct nullb_device *dev = nq->dev;
 
-	if (irqmode == NULL_IRQ_TIMER) {
+	might_sleep_if(hctx->flags & BLK_MQ_F_BLOCKING);
+
+	if (test_bit(NULLB_DEV_FL_THROTTLED, &dev->flags) &&
+	    !null_mq_charge_bw(dev->nullb, blk_rq_bytes(bd->rq)))
+		return BLK_MQ_RQ_QUEUE_BUSY;
+
+	if (dev->irqmode == NULL_IRQ_TIMER && !dev->complete_batch) {
 		hrtimer_init(&cmd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 		cmd->timer.function = null_cmd_timer_expired;
 	}
 	cmd->rq = bd->rq;
-	cmd->nq = hctx->driver_data;
+	cmd->nq = nq;
 
 	blk_mq_start_request(bd->rq);
 
@@ -374,8 +1662,9 @@ static void null_init_queue(struct nullb *nullb, struct nullb_queue *nq)
 	BUG_ON(!nullb);
 	BUG_ON(!nq);
 
-	init_waitqueue_head(&nq->wait);
+	atomic_set(&nq->wait_index, 0);
 	nq->queue_depth = nullb->queue_depth;
+	nq->dev = nullb->dev;
 }
 
 static int null_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
@@ -388,6 +1677,10 @@ static int null_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
 	null_init_queue(nullb, nq);
 	nullb->nr_queues++;
 
+	init_llist_head(&nq->cq);
+	hrtimer_init(&nq->cq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	nq->cq_timer.function = null_cq_timer_expired;
+
 	return 0;
 }
 
@@ -399,7 +1692,9 @@ static struct blk_mq_ops null_mq_ops = {
 
 static void cleanup_queue(struct nullb_queue *nq)
 {
-	kfree(nq->tag_map);
+	if (nq->dev->queue_mode == NULL_Q_MQ)
+		hrtimer_cancel(&nq->cq_timer);
+	sbitmap_queue_free(&nq->tags);
 	kfree(nq->cmds);
 }
 
@@ -453,7 +1748,8 @@ static int null_lnvm_submit_io(struct nvm_dev *dev, struct nvm_rq *rqd)
 
 static int null_lnvm_id(struct nvm_dev *dev, struct nvm_id *id)
 {
-	sector_t size = gb * 1024 * 1024 * 1024ULL;
+	struct nullb *nullb = dev->q->queuedata;
+	sector_t size = (sector_t)nullb->dev->size * 1024 * 1024ULL;
 	sector_t blksize;
 	struct nvm_id_group *grp;
 
@@ -476,7 +1772,7 @@ static int null_lnvm_id(struct nvm_dev *dev, struct nvm_id *id)
 	id->ppaf.ch_offset = 56;
 	id->ppaf.ch_len = 8;
 
-	do_div(size, bs); /* convert size to pages */
+	do_div(size, nullb->dev->blocksize); /* convert size to pages */
 	do_div(size, 256); /* concert size to pgs pr blk */
 	grp = &id->groups[0];
 	grp->mtype = 0;
@@ -490,8 +1786,8 @@ static int null_lnvm_id(struct nvm_dev *dev, struct nvm_id *id)
 	grp->num_blk = blksize;
 	grp->num_pln = 1;
 
-	grp->fpg_sz = bs;
-	grp->csecs = bs;
+	grp->fpg_sz = nullb->dev->blocksize;
+	grp->csecs = nullb->dev->blocksize;
 	grp->trdt = 25000;
 	grp->trdm = 25000;
 	grp->tprt = 500000;
@@ -499,7 +1795,7 @@ static int null_lnvm_id(struct nvm_dev *dev, struct nvm_id *id)
 	grp->tbet = 1500000;
 	grp->tbem = 1500000;
 	grp->mpos = 0x010101; /* single plane rwe */
-	grp->cpar = hw_queue_depth;
+	grp->cpar = nullb->dev->hw_queue_depth;
 
 	return 0;
 }
@@ -566,19 +1862,37 @@ static void null_nvm_unregister(struct nullb *nullb) {}
 
 static void null_del_dev(struct nullb *nullb)
 {
+	struct nullb_device *dev = nullb->dev;
+	bool throttled;
+
 	list_del_init(&nullb->list);
 
-	if (use_lightnvm)
+	if (dev->use_lightnvm)
 		null_nvm_unregister(nullb);
 	else
 		del_gendisk(nullb->disk);
+
+	/* let the queue drain without a cap, requeued requests included */
+	throttled = test_and_clear_bit(NULLB_DEV_FL_THROTTLED, &dev->flags);
+	if (throttled) {
+		hrtimer_cancel(&nullb->bw_timer);
+		atomic_long_set(&nullb->cur_bytes, LONG_MAX);
+		null_restart_queue_async(nullb);
+	}
+
 	blk_cleanup_queue(nullb->q);
-	if (queue_mode == NULL_Q_MQ)
+	/* a submitter racing with the above may have rearmed it */
+	if (throttled)
+		hrtimer_cancel(&nullb->bw_timer);
+	if (dev->queue_mode == NULL_Q_MQ)
 		blk_mq_free_tag_set(&nullb->tag_set);
-	if (!use_lightnvm)
+	if (!dev->use_lightnvm)
 		put_disk(nullb->disk);
 	cleanup_queues(nullb);
+	if (dev->zoned)
+		null_zone_exit(dev);
 	kfree(nullb);
+	dev->nullb = NULL;
 }
 
 static int null_open(struct block_device *bdev, fmode_t mode)
@@ -599,15 +1913,14 @@ static const struct block_device_operations null_fops = {
 static int setup_commands(struct nullb_queue *nq)
 {
 	struct nullb_cmd *cmd;
-	int i, tag_size;
+	int i;
 
 	nq->cmds = kzalloc(nq->queue_depth * sizeof(*cmd), GFP_KERNEL);
 	if (!nq->cmds)
 		return -ENOMEM;
 
-	tag_size = ALIGN(nq->queue_depth, BITS_PER_LONG) / BITS_PER_LONG;
-	nq->tag_map = kzalloc(tag_size * sizeof(unsigned long), GFP_KERNEL);
-	if (!nq->tag_map) {
+	if (sbitmap_queue_init_node(&nq->tags, nq->queue_depth, -1, false,
+				    GFP_KERNEL, nq->dev->home_node)) {
 		kfree(nq->cmds);
 		return -ENOMEM;
 	}
@@ -624,13 +1937,13 @@ static int setup_commands(struct nullb_queue *nq)
 
 static int setup_queues(struct nullb *nullb)
 {
-	nullb->queues = kzalloc(submit_queues * sizeof(struct nullb_queue),
-								GFP_KERNEL);
+	nullb->queues = kzalloc(nullb->dev->submit_queues *
+		sizeof(struct nullb_queue), GFP_KERNEL);
 	if (!nullb->queues)
 		return -ENOMEM;
 
 	nullb->nr_queues = 0;
-	nullb->queue_depth = hw_queue_depth;
+	nullb->queue_depth = nullb->dev->hw_queue_depth;
 
 	return 0;
 }
@@ -640,7 +1953,7 @@ static int init_driver_queues(struct nullb *nullb)
 	struct nullb_queue *nq;
 	int i, ret = 0;
 
-	for (i = 0; i < submit_queues; i++) {
+	for (i = 0; i < nullb->dev->submit_queues; i++) {
 		nq = &nullb->queues[i];
 
 		null_init_queue(nullb, nq);
@@ -658,10 +1971,14 @@ static int null_gendisk_register(struct nullb *nullb)
 	struct gendisk *disk;
 	sector_t size;
 
-	disk = nullb->disk = alloc_disk_node(1, home_node);
+	disk = nullb->disk = alloc_disk_node(1, nullb->dev->home_node);
 	if (!disk)
 		return -ENOMEM;
-	size = gb * 1024 * 1024 * 1024ULL;
+	if (nullb->dev->zoned)
+		size = (sector_t)nullb->dev->nr_zones *
+			nullb->dev->zone_size_sects << 9;
+	else
+		size = (sector_t)nullb->dev->size * 1024 * 1024ULL;
 	set_capacity(disk, size >> 9);
 
 	disk->flags |= GENHD_FL_EXT_DEVT | GENHD_FL_SUPPRESS_PARTITION_INFO;
@@ -676,34 +1993,105 @@ static int null_gendisk_register(struct nullb *nullb)
 	return 0;
 }
 
-static int null_add_dev(void)
+static void null_config_discard(struct nullb *nullb)
+{
+	if (!nullb->dev->discard)
+		return;
+	nullb->q->limits.discard_granularity = nullb->dev->blocksize;
+	nullb->q->limits.discard_alignment = nullb->dev->blocksize;
+	blk_queue_max_discard_sectors(nullb->q, UINT_MAX >> 9);
+	blk_queue_max_write_zeroes_sectors(nullb->q, UINT_MAX >> 9);
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, nullb->q);
+}
+
+static int null_validate_conf(struct nullb_device *dev)
+{
+	if (dev->queue_mode > NULL_Q_MQ || dev->irqmode > NULL_IRQ_TIMER ||
+	    dev->latency_dist > NULL_LAT_EXP || dev->tail_permille > 1000)
+		return -EINVAL;
+
+	if (dev->blocksize > PAGE_SIZE || !is_power_of_2(dev->blocksize) ||
+	    dev->blocksize < 512) {
+		pr_warn("null_blk: invalid block size\n");
+		pr_warn("null_blk: defaults block size to %lu\n", PAGE_SIZE);
+		dev->blocksize = PAGE_SIZE;
+	}
+
+	if (dev->use_lightnvm && dev->blocksize != 4096) {
+		pr_warn("null_blk: LightNVM only supports 4k block size\n");
+		pr_warn("null_blk: defaults block size to 4k\n");
+		dev->blocksize = 4096;
+	}
+
+	if (dev->use_lightnvm && dev->queue_mode != NULL_Q_MQ) {
+		pr_warn("null_blk: LightNVM only supported for blk-mq\n");
+		pr_warn("null_blk: defaults queue mode to blk-mq\n");
+		dev->queue_mode = NULL_Q_MQ;
+	}
+
+	if (dev->use_lightnvm && (dev->memory_backed || dev->zoned)) {
+		pr_warn("null_blk: LightNVM doesn't support memory backing or zones\n");
+		dev->memory_backed = false;
+		dev->zoned = false;
+	}
+
+	if (dev->queue_mode == NULL_Q_MQ && dev->use_per_node_hctx) {
+		if (dev->submit_queues != nr_online_nodes)
+			dev->submit_queues = nr_online_nodes;
+	} else if (dev->submit_queues > nr_cpu_ids)
+		dev->submit_queues = nr_cpu_ids;
+	else if (!dev->submit_queues)
+		dev->submit_queues = 1;
+
+	/* the legacy request path completes from atomic context */
+	if (dev->queue_mode == NULL_Q_RQ && dev->memory_backed) {
+		pr_warn("null_blk: memory backing requires queue_mode 0 or 2\n");
+		return -EINVAL;
+	}
+
+	dev->discard = dev->discard && dev->memory_backed;
+
+	/* bio mode has no way to push back, so there is nothing to cap */
+	if (dev->queue_mode == NULL_Q_BIO)
+		dev->mbps = 0;
+
+	return 0;
+}
+
+static int null_add_dev(struct nullb_device *dev)
 {
 	struct nullb *nullb;
 	int rv;
 
-	nullb = kzalloc_node(sizeof(*nullb), GFP_KERNEL, home_node);
+	rv = null_validate_conf(dev);
+	if (rv)
+		return rv;
+
+	nullb = kzalloc_node(sizeof(*nullb), GFP_KERNEL, dev->home_node);
 	if (!nullb) {
 		rv = -ENOMEM;
 		goto out;
 	}
+	nullb->dev = dev;
+	dev->nullb = nullb;
 
 	spin_lock_init(&nullb->lock);
 
-	if (queue_mode == NULL_Q_MQ && use_per_node_hctx)
-		submit_queues = nr_online_nodes;
-
 	rv = setup_queues(nullb);
 	if (rv)
 		goto out_free_nullb;
 
-	if (queue_mode == NULL_Q_MQ) {
+	if (dev->queue_mode == NULL_Q_MQ) {
 		nullb->tag_set.ops = &null_mq_ops;
-		nullb->tag_set.nr_hw_queues = submit_queues;
-		nullb->tag_set.queue_depth = hw_queue_depth;
-		nullb->tag_set.numa_node = home_node;
+		nullb->tag_set.nr_hw_queues = dev->submit_queues;
+		nullb->tag_set.queue_depth = dev->hw_queue_depth;
+		nullb->tag_set.numa_node = dev->home_node;
 		nullb->tag_set.cmd_size	= sizeof(struct nullb_cmd);
 		nullb->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
 		nullb->tag_set.driver_data = nullb;
+		/* page allocations for the backing store may sleep */
+		if (dev->memory_backed)
+			nullb->tag_set.flags |= BLK_MQ_F_BLOCKING;
 
 		rv = blk_mq_alloc_tag_set(&nullb->tag_set);
 		if (rv)
@@ -714,8 +2102,8 @@ static int null_add_dev(void)
 			rv = -ENOMEM;
 			goto out_cleanup_tags;
 		}
-	} else if (queue_mode == NULL_Q_BIO) {
-		nullb->q = blk_alloc_queue_node(GFP_KERNEL, home_node);
+	} else if (dev->queue_mode == NULL_Q_BIO) {
+		nullb->q = blk_alloc_queue_node(GFP_KERNEL, dev->home_node);
 		if (!nullb->q) {
 			rv = -ENOMEM;
 			goto out_cleanup_queues;
@@ -725,7 +2113,8 @@ static int null_add_dev(void)
 		if (rv)
 			goto out_cleanup_blk_queue;
 	} else {
-		nullb->q = blk_init_queue_node(null_request_fn, &nullb->lock, home_node);
+		nullb->q = blk_init_queue_node(null_request_fn, &nullb->lock,
+						dev->home_node);
 		if (!nullb->q) {
 			rv = -ENOMEM;
 			goto out_cleanup_queues;
@@ -737,113 +2126,269 @@ static int null_add_dev(void)
 			goto out_cleanup_blk_queue;
 	}
 
+	if (dev->mbps) {
+		set_bit(NULLB_DEV_FL_THROTTLED, &dev->flags);
+		nullb_setup_bwtimer(nullb);
+	}
+
 	nullb->q->queuedata = nullb;
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, nullb->q);
 	queue_flag_clear_unlocked(QUEUE_FLAG_ADD_RANDOM, nullb->q);
 
+	if (dev->zoned) {
+		rv = null_zone_init(dev);
+		if (rv)
+			goto out_cleanup_bw;
+		null_zone_setup_queue(nullb);
+	}
+
 	mutex_lock(&lock);
 	nullb->index = nullb_indexes++;
+	dev->index = nullb->index;
 	mutex_unlock(&lock);
 
-	blk_queue_logical_block_size(nullb->q, bs);
-	blk_queue_physical_block_size(nullb->q, bs);
+	blk_queue_logical_block_size(nullb->q, dev->blocksize);
+	blk_queue_physical_block_size(nullb->q, dev->blocksize);
+
+	null_config_discard(nullb);
 
 	sprintf(nullb->disk_name, "nullb%d", nullb->index);
 
-	if (use_lightnvm)
+	if (dev->use_lightnvm)
 		rv = null_nvm_register(nullb);
 	else
 		rv = null_gendisk_register(nullb);
 
 	if (rv)
-		goto out_cleanup_blk_queue;
+		goto out_cleanup_zone;
 
 	mutex_lock(&lock);
 	list_add_tail(&nullb->list, &nullb_list);
 	mutex_unlock(&lock);
 
 	return 0;
+out_cleanup_zone:
+	if (dev->zoned)
+		null_zone_exit(dev);
+out_cleanup_bw:
+	if (test_and_clear_bit(NULLB_DEV_FL_THROTTLED, &dev->flags))
+		hrtimer_cancel(&nullb->bw_timer);
 out_cleanup_blk_queue:
 	blk_cleanup_queue(nullb->q);
 out_cleanup_tags:
-	if (queue_mode == NULL_Q_MQ)
+	if (dev->queue_mode == NULL_Q_MQ)
 		blk_mq_free_tag_set(&nullb->tag_set);
 out_cleanup_queues:
 	cleanup_queues(nullb);
 out_free_nullb:
 	kfree(nullb);
+	dev->nullb = NULL;
 out:
 	return rv;
 }
 
-static int __init null_init(void)
-{
-	int ret = 0;
-	unsigned int i;
+/*
+ * Tag allocation microbenchmark. One thread per cpu allocates and frees a
+ * tag in a loop, for 1, 2, 4, ... up to all online cpus, so the cost of
+ * an allocation can be compared as more cpus contend for the same map.
+ * Failed allocations take time too, so the cost is given per attempt,
+ * with the failures reported next to it.
+ */
+struct null_bench_thread {
+	struct null_tag_bench *bench;
+	u64 nsecs;
+	unsigned int allocs;
+	unsigned int failed;
+};
+
+struct null_tag_bench {
 	struct nullb *nullb;
+	struct completion start;
+	struct completion done;
+	atomic_t running;
+};
 
-	if (bs > PAGE_SIZE) {
-		pr_warn("null_blk: invalid block size\n");
-		pr_warn("null_blk: defaults block size to %lu\n", PAGE_SIZE);
-		bs = PAGE_SIZE;
-	}
+static bool null_bench_alloc_free(struct nullb *nullb)
+{
+	struct nullb_cmd *cmd;
+	struct request *rq;
 
-	if (use_lightnvm && bs != 4096) {
-		pr_warn("null_blk: LightNVM only supports 4k block size\n");
-		pr_warn("null_blk: defaults block size to 4k\n");
-		bs = 4096;
+	if (nullb->dev->queue_mode == NULL_Q_MQ) {
+		rq = blk_mq_alloc_request(nullb->q, READ, BLK_MQ_REQ_NOWAIT);
+		if (IS_ERR(rq))
+			return false;
+		blk_mq_free_request(rq);
+		return true;
 	}
 
-	if (use_lightnvm && queue_mode != NULL_Q_MQ) {
-		pr_warn("null_blk: LightNVM only supported for blk-mq\n");
-		pr_warn("null_blk: defaults queue mode to blk-mq\n");
-		queue_mode = NULL_Q_MQ;
+	cmd = __alloc_cmd(nullb_to_queue(nullb));
+	if (!cmd)
+		return false;
+	free_cmd(cmd);
+	return true;
+}
+
+static int null_tag_bench_fn(void *data)
+{
+	struct null_bench_thread *t = data;
+	struct null_tag_bench *b = t->bench;
+	ktime_t start;
+	int i;
+
+	wait_for_completion(&b->start);
+
+	start = ktime_get();
+	for (i = 0; i < tag_bench; i++) {
+		if (null_bench_alloc_free(b->nullb))
+			t->allocs++;
+		else
+			t->failed++;
 	}
+	t->nsecs = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	if (atomic_dec_and_test(&b->running))
+		complete(&b->done);
+	return 0;
+}
+
+static int null_tag_bench_run(struct nullb *nullb,
+			      struct null_bench_thread *threads,
+			      unsigned int nr_threads)
+{
+	struct null_tag_bench b = { .nullb = nullb };
+	struct task_struct *task;
+	unsigned int i, cpu;
+	u64 nsecs = 0, allocs = 0, failed = 0;
+
+	init_completion(&b.start);
+	init_completion(&b.done);
+	atomic_set(&b.running, nr_threads);
+
+	i = 0;
+	for_each_online_cpu(cpu) {
+		if (i == nr_threads)
+			break;
 
-	if (queue_mode == NULL_Q_MQ && use_per_node_hctx) {
-		if (submit_queues < nr_online_nodes) {
-			pr_warn("null_blk: submit_queues param is set to %u.",
-							nr_online_nodes);
-			submit_queues = nr_online_nodes;
+		memset(&threads[i], 0, sizeof(threads[i]));
+		threads[i].bench = &b;
+		task = kthread_create_on_node(null_tag_bench_fn, &threads[i],
+					      cpu_to_node(cpu), "null_bench/%u",
+					      cpu);
+		if (IS_ERR(task)) {
+			/* account for the threads that will never run */
+			if (atomic_sub_and_test(nr_threads - i, &b.running))
+				complete(&b.done);
+			complete_all(&b.start);
+			wait_for_completion(&b.done);
+			return PTR_ERR(task);
 		}
-	} else if (submit_queues > nr_cpu_ids)
-		submit_queues = nr_cpu_ids;
-	else if (!submit_queues)
-		submit_queues = 1;
+		kthread_bind(task, cpu);
+		wake_up_process(task);
+		i++;
+	}
+
+	complete_all(&b.start);
+	wait_for_completion(&b.done);
+
+	for (i = 0; i < nr_threads; i++) {
+		nsecs += threads[i].nsecs;
+		allocs += threads[i].allocs;
+		failed += threads[i].failed;
+	}
+
+	pr_info("null: tag bench: %u cpus, %llu ns per attempt, %llu of %llu failed\n",
+		nr_threads,
+		allocs + failed ? div64_u64(nsecs, allocs + failed) : 0ULL,
+		failed, allocs + failed);
+	return 0;
+}
+
+static void null_tag_bench(struct nullb *nullb)
+{
+	struct null_bench_thread *threads;
+	unsigned int nr, nr_cpus;
+
+	get_online_cpus();
+
+	nr_cpus = num_online_cpus();
+	threads = kcalloc(nr_cpus, sizeof(*threads), GFP_KERNEL);
+	if (!threads)
+		goto out;
+
+	for (nr = 1; ; nr = min(nr * 2, nr_cpus)) {
+		if (null_tag_bench_run(nullb, threads, nr))
+			break;
+		if (nr == nr_cpus)
+			break;
+	}
+
+	kfree(threads);
+out:
+	put_online_cpus();
+}
+
+static int __init null_init(void)
+{
+	int ret = 0;
+	unsigned int i;
+	struct nullb *nullb;
+	struct nullb_device *dev;
+
+	config_group_init(&nullb_subsys.su_group);
+	mutex_init(&nullb_subsys.su_mutex);
+
+	ret = configfs_register_subsystem(&nullb_subsys);
+	if (ret)
+		return ret;
 
 	mutex_init(&lock);
 
 	null_major = register_blkdev(0, "nullb");
-	if (null_major < 0)
-		return null_major;
-
-	if (use_lightnvm) {
-		ppa_cache = kmem_cache_create("ppa_cache", 64 * sizeof(u64),
-								0, 0, NULL);
-		if (!ppa_cache) {
-			pr_err("null_blk: unable to create ppa cache\n");
-			ret = -ENOMEM;
-			goto err_ppa;
-		}
+	if (null_major < 0) {
+		ret = null_major;
+		goto err_conf;
+	}
+
+	/* configfs devices may turn on LightNVM at any time */
+	ppa_cache = kmem_cache_create("ppa_cache", 64 * sizeof(u64),
+							0, 0, NULL);
+	if (!ppa_cache) {
+		pr_err("null_blk: unable to create ppa cache\n");
+		ret = -ENOMEM;
+		goto err_ppa;
 	}
 
 	for (i = 0; i < nr_devices; i++) {
-		ret = null_add_dev();
-		if (ret)
+		dev = null_alloc_dev();
+		if (!dev) {
+			ret = -ENOMEM;
+			goto err_dev;
+		}
+		ret = null_add_dev(dev);
+		if (ret) {
+			null_free_dev(dev);
 			goto err_dev;
+		}
 	}
 
+	if (tag_bench > 0 && !g_use_lightnvm && !list_empty(&nullb_list))
+		null_tag_bench(list_first_entry(&nullb_list, struct nullb, list));
+
 	pr_info("null: module loaded\n");
 	return 0;
 
 err_dev:
 	while (!list_empty(&nullb_list)) {
 		nullb = list_entry(nullb_list.next, struct nullb, list);
+		dev = nullb->dev;
 		null_del_dev(nullb);
+		null_free_dev(dev);
 	}
 	kmem_cache_destroy(ppa_cache);
 err_ppa:
 	unregister_blkdev(null_major, "nullb");
+err_conf:
+	configfs_unregister_subsystem(&nullb_subsys);
 	return ret;
 }
 
@@ -851,12 +2396,18 @@ static void __exit null_exit(void)
 {
 	struct nullb *nullb;
 
+	configfs_unregister_subsystem(&nullb_subsys);
+
 	unregister_blkdev(null_major, "nullb");
 
 	mutex_lock(&lock);
 	while (!list_empty(&nullb_list)) {
+		struct nullb_device *dev;
+
 		nullb = list_entry(nullb_list.next, struct nullb, list);
+		dev = nullb->dev;
 		null_del_dev(nullb);
+		null_free_dev(dev);
 	}
 	mutex_unlock(&lock);
 
@@ -13,12 +13,17 @@
 #include <linux/slab.h>
 #include <linux/wait.h>
 #include <linux/sched.h>
+#include <linux/cpu.h>
+#include <linux/percpu.h>
 
 #include "zcomp.h"
 #include "zcomp_lzo.h"
 #ifdef CONFIG_ZRAM_LZ4_COMPRESS
 #include "zcomp_lz4.h"
 #endif
+#ifdef CONFIG_ZRAM_LZ4HC_COMPRESS
+#include "zcomp_lz4hc.h"
+#endif
 
 /*
  * single zcomp_strm backend
@@ -43,10 +48,22 @@ struct zcomp_strm_multi {
 	wait_queue_head_t strm_wait;
 };
 
+/*
+ * per-cpu zcomp_strm backend
+ */
+struct zcomp_strm_percpu {
+	struct zcomp_strm __percpu *strm;
+	struct zcomp *comp;
+	struct notifier_block notifier;
+};
+
 static struct zcomp_backend *backends[] = {
 	&zcomp_lzo,
 #ifdef CONFIG_ZRAM_LZ4_COMPRESS
 	&zcomp_lz4,
+#endif
+#ifdef CONFIG_ZRAM_LZ4HC_COMPRESS
+	&zcomp_lz4hc,
 #endif
 	NULL
 };
@@ -218,6 +235,153 @@ static int zcomp_strm_multi_create(struct zcomp *comp, int max_strm)
 	return 0;
 }
 
+/*
+ * Streams of cpus that are not online have no buffers, their users
+ * retry with the stream of the cpu they run on now.
+ */
+static int zcomp_strm_percpu_init(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	void *private, *buffer;
+
+	private = comp->backend->create();
+	buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (!private || !buffer) {
+		if (private)
+			comp->backend->destroy(private);
+		free_pages((unsigned long)buffer, 1);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&zstrm->lock);
+	zstrm->private = private;
+	zstrm->buffer = buffer;
+	mutex_unlock(&zstrm->lock);
+	return 0;
+}
+
+static void zcomp_strm_percpu_deinit(struct zcomp *comp,
+		struct zcomp_strm *zstrm)
+{
+	mutex_lock(&zstrm->lock);
+	if (zstrm->private)
+		comp->backend->destroy(zstrm->private);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	zstrm->private = NULL;
+	zstrm->buffer = NULL;
+	mutex_unlock(&zstrm->lock);
+}
+
+/*
+ * Take the stream of the current cpu. Nothing is shared between cpus,
+ * so the mutex is uncontended unless the task got preempted or migrated
+ * while holding it, and zram can still sleep in zs_malloc() with the
+ * stream held.
+ */
+static struct zcomp_strm *zcomp_strm_percpu_find(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs = comp->stream;
+	struct zcomp_strm *zstrm;
+
+	for (;;) {
+		zstrm = raw_cpu_ptr(zs->strm);
+		mutex_lock(&zstrm->lock);
+		if (likely(zstrm->buffer))
+			return zstrm;
+		mutex_unlock(&zstrm->lock);
+	}
+}
+
+static void zcomp_strm_percpu_release(struct zcomp *comp,
+		struct zcomp_strm *zstrm)
+{
+	mutex_unlock(&zstrm->lock);
+}
+
+static bool zcomp_strm_percpu_set_max_streams(struct zcomp *comp, int num_strm)
+{
+	/* there is always one stream per online cpu */
+	return num_strm >= num_online_cpus();
+}
+
+static int zcomp_strm_percpu_notify(struct notifier_block *nb,
+		unsigned long action, void *hcpu)
+{
+	struct zcomp_strm_percpu *zs = container_of(nb,
+			struct zcomp_strm_percpu, notifier);
+	struct zcomp_strm *zstrm = per_cpu_ptr(zs->strm, (long)hcpu);
+
+	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_UP_PREPARE:
+		if (zcomp_strm_percpu_init(zs->comp, zstrm))
+			return notifier_from_errno(-ENOMEM);
+		break;
+	case CPU_DEAD:
+	case CPU_UP_CANCELED:
+		zcomp_strm_percpu_deinit(zs->comp, zstrm);
+		break;
+	}
+	return NOTIFY_OK;
+}
+
+static void zcomp_strm_percpu_free(struct zcomp_strm_percpu *zs)
+{
+	unsigned long cpu;
+
+	for_each_possible_cpu(cpu)
+		zcomp_strm_percpu_deinit(zs->comp, per_cpu_ptr(zs->strm, cpu));
+	free_percpu(zs->strm);
+	kfree(zs);
+}
+
+static void zcomp_strm_percpu_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs = comp->stream;
+
+	unregister_cpu_notifier(&zs->notifier);
+	zcomp_strm_percpu_free(zs);
+}
+
+static int zcomp_strm_percpu_create(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs;
+	unsigned long cpu;
+	int ret = 0;
+
+	comp->destroy = zcomp_strm_percpu_destroy;
+	comp->strm_find = zcomp_strm_percpu_find;
+	comp->strm_release = zcomp_strm_percpu_release;
+	comp->set_max_streams = zcomp_strm_percpu_set_max_streams;
+	zs = kzalloc(sizeof(struct zcomp_strm_percpu), GFP_KERNEL);
+	if (!zs)
+		return -ENOMEM;
+
+	zs->strm = alloc_percpu(struct zcomp_strm);
+	if (!zs->strm) {
+		kfree(zs);
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu)
+		mutex_init(&per_cpu_ptr(zs->strm, cpu)->lock);
+
+	comp->stream = zs;
+	zs->comp = comp;
+	zs->notifier.notifier_call = zcomp_strm_percpu_notify;
+
+	cpu_notifier_register_begin();
+	for_each_online_cpu(cpu) {
+		ret = zcomp_strm_percpu_init(comp, per_cpu_ptr(zs->strm, cpu));
+		if (ret)
+			break;
+	}
+	if (!ret)
+		__register_cpu_notifier(&zs->notifier);
+	cpu_notifier_register_done();
+
+	if (ret)
+		zcomp_strm_percpu_free(zs);
+	return ret;
+}
+
 static struct zcomp_strm *zcomp_strm_single_find(struct zcomp *comp)
 {
 	struct zcomp_strm_single *zs = comp->stream;
@@ -319,6 +483,15 @@ int zcomp_decompress(struct zcomp *comp, const unsigned char *src,
 	return comp->backend->decompress(src, src_len, dst);
 }
 
+int zcomp_decompress_partial(struct zcomp *comp, const unsigned char *src,
+		size_t src_len, unsigned char *dst, size_t dst_len)
+{
+	if (dst_len < PAGE_SIZE && comp->backend->decompress_partial)
+		return comp->backend->decompress_partial(src, src_len, dst,
+				dst_len);
+	return comp->backend->decompress(src, src_len, dst);
+}
+
 void zcomp_destroy(struct zcomp *comp)
 {
 	comp->destroy(comp);
@@ -331,7 +504,11 @@ void zcomp_destroy(struct zcomp *comp)
  * backend pointer or ERR_PTR if things went bad. ERR_PTR(-EINVAL)
  * if requested algorithm is not supported, ERR_PTR(-ENOMEM) in
  * case of allocation error, or any other error potentially
- * returned by functions zcomp_strm_{multi,single}_create.
+ * returned by functions zcomp_strm_{percpu,multi,single}_create.
+ *
+ * With at least as many streams as online cpus, every cpu gets its own
+ * stream and nothing is shared on the compression path. A lower
+ * max_strm caps the memory spent on streams instead.
  */
 struct zcomp *zcomp_create(const char *compress, int max_strm)
 {
@@ -348,7 +525,9 @@ struct zcomp *zcomp_create(const char *compress, int max_strm)
 		return ERR_PTR(-ENOMEM);
 
 	comp->backend = backend;
-	if (max_strm > 1)
+	if (max_strm >= num_online_cpus())
+		error = zcomp_strm_percpu_create(comp);
+	else if (max_strm > 1)
 		error = zcomp_strm_multi_create(comp, max_strm);
 	else
 		error = zcomp_strm_single_create(comp);
@@ -23,6 +23,8 @@ struct zcomp_strm {
 	void *private;
 	/* used in multi stream backend, protected by backend strm_lock */
 	struct list_head list;
+	/* used in per-cpu stream backend, serializes users of one cpu's stream */
+	struct mutex lock;
 };
 
 /* static compression backend */
@@ -32,6 +34,9 @@ struct zcomp_backend {
 
 	int (*decompress)(const unsigned char *src, size_t src_len,
 			unsigned char *dst);
+	/* optional, may stop once the first dst_len bytes are decoded */
+	int (*decompress_partial)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t dst_len);
 
 	void *(*create)(void);
 	void (*destroy)(void *private);
@@ -64,6 +69,8 @@ int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
 
 int zcomp_decompress(struct zcomp *comp, const unsigned char *src,
 		size_t src_len, unsigned char *dst);
+int zcomp_decompress_partial(struct zcomp *comp, const unsigned char *src,
+		size_t src_len, unsigned char *dst, size_t dst_len);
 
 bool zcomp_set_max_streams(struct zcomp *comp, int num_strm);
 #endif /* _ZCOMP_H_ */
@@ -57,9 +57,22 @@ static int zcomp_lz4_decompress(const unsigned char *src, size_t src_len,
 	return lz4_decompress_unknownoutputsize(src, src_len, dst, &dst_len);
 }
 
+static int zcomp_lz4_decompress_partial(const unsigned char *src,
+		size_t src_len, unsigned char *dst, size_t len)
+{
+	size_t dst_len = PAGE_SIZE;
+	int ret;
+
+	ret = lz4_decompress_partial(src, src_len, dst, &dst_len, len);
+	if (!ret && dst_len < len)
+		ret = -EINVAL;
+	return ret;
+}
+
 struct zcomp_backend zcomp_lz4 = {
 	.compress = zcomp_lz4_compress,
 	.decompress = zcomp_lz4_decompress,
+	.decompress_partial = zcomp_lz4_decompress_partial,
 	.create = zcomp_lz4_create,
 	.destroy = zcomp_lz4_destroy,
 	.name = "lz4",
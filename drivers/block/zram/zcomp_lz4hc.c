@@ -0,0 +1,68 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/lz4.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+
+#include "zcomp_lz4hc.h"
+
+/*
+ * lz4hc produces the lz4 format, only compresses harder and a lot
+ * slower, so it is meant for recompressing pages in the background.
+ * Its working memory is large, hence no kzalloc() attempt first.
+ */
+static void *zcomp_lz4hc_create(void)
+{
+	return __vmalloc(LZ4HC_MEM_COMPRESS,
+			GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN |
+			__GFP_ZERO | __GFP_HIGHMEM,
+			PAGE_KERNEL);
+}
+
+static void zcomp_lz4hc_destroy(void *private)
+{
+	vfree(private);
+}
+
+static int zcomp_lz4hc_compress(const unsigned char *src, unsigned char *dst,
+		size_t *dst_len, void *private)
+{
+	/* return  : Success if return 0 */
+	return lz4hc_compress(src, PAGE_SIZE, dst, dst_len, private);
+}
+
+static int zcomp_lz4hc_decompress(const unsigned char *src, size_t src_len,
+		unsigned char *dst)
+{
+	size_t dst_len = PAGE_SIZE;
+	/* return  : Success if return 0 */
+	return lz4_decompress_unknownoutputsize(src, src_len, dst, &dst_len);
+}
+
+static int zcomp_lz4hc_decompress_partial(const unsigned char *src,
+		size_t src_len, unsigned char *dst, size_t len)
+{
+	size_t dst_len = PAGE_SIZE;
+	int ret;
+
+	ret = lz4_decompress_partial(src, src_len, dst, &dst_len, len);
+	if (!ret && dst_len < len)
+		ret = -EINVAL;
+	return ret;
+}
+
+struct zcomp_backend zcomp_lz4hc = {
+	.compress = zcomp_lz4hc_compress,
+	.decompress = zcomp_lz4hc_decompress,
+	.decompress_partial = zcomp_lz4hc_decompress_partial,
+	.create = zcomp_lz4hc_create,
+	.destroy = zcomp_lz4hc_destroy,
+	.name = "lz4hc",
+};
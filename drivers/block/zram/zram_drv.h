@@ -16,6 +16,7 @@
 #define _ZRAM_DRV_H_
 
 #include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/zsmalloc.h>
 
 #include "zcomp.h"
@@ -55,13 +56,20 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
  * The lower ZRAM_FLAG_SHIFT bits is for object size (excluding header),
  * the higher bits is for zram_pageflags.
  */
-#define ZRAM_FLAG_SHIFT 24
+#define ZRAM_FLAG_SHIFT (PAGE_SHIFT + 1)
 
 /* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO = ZRAM_FLAG_SHIFT,
+	/* Page consists of one repeated word, stored in table.element */
+	ZRAM_SAME = ZRAM_FLAG_SHIFT,
 	ZRAM_ACCESS,	/* page is now accessed */
+	ZRAM_WB,	/* page is stored on backing_dev, block in table.element */
+	ZRAM_UNDER_WB,	/* page is being written back to backing_dev */
+	ZRAM_HUGE,	/* incompressible page, stored as is */
+	ZRAM_IDLE,	/* not accessed since last idle marking */
+	ZRAM_RECOMP,	/* compressed with the secondary algorithm */
+	ZRAM_INCOMPRESSIBLE,	/* recompression did not save anything */
+	ZRAM_UNDER_RECOMP,	/* page is being recompressed */
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -70,7 +78,10 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct zram_table_entry {
-	unsigned long handle;
+	union {
+		unsigned long handle;
+		unsigned long element;
+	};
 	unsigned long value;
 };
 
@@ -82,9 +93,16 @@ struct zram_stats {
 	atomic64_t failed_writes;	/* can happen when memory is too low */
 	atomic64_t invalid_io;	/* non-page-aligned I/O requests */
 	atomic64_t notify_free;	/* no. of swap slot free notifications */
-	atomic64_t zero_pages;		/* no. of zero filled pages */
+	atomic64_t same_pages;		/* no. of same element filled pages */
 	atomic64_t pages_stored;	/* no. of pages currently stored */
 	atomic_long_t max_used_pages;	/* no. of maximum pages stored */
+	atomic64_t num_recompressed;	/* no. of pages recompressed */
+	atomic64_t recomp_saved;	/* bytes saved by recompression */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	atomic64_t bd_count;		/* no. of pages in backing device */
+	atomic64_t bd_reads;		/* no. of reads from backing device */
+	atomic64_t bd_writes;		/* no. of writes to backing device */
+#endif
 };
 
 struct zram_meta {
@@ -92,9 +110,22 @@ struct zram_meta {
 	struct zs_pool *mem_pool;
 };
 
+/* what the secondary algorithm recompresses */
+enum zram_recomp_mode {
+	ZRAM_RECOMP_ALL,
+	ZRAM_RECOMP_IDLE,
+	ZRAM_RECOMP_HUGE,
+};
+
 struct zram {
 	struct zram_meta *meta;
 	struct zcomp *comp;
+	/* optional secondary algorithm, for background recompression */
+	struct zcomp *recomp;
+	struct work_struct recomp_work;
+	enum zram_recomp_mode recomp_mode;
+	size_t recomp_threshold;
+	bool recomp_abort;
 	struct gendisk *disk;
 	/* Prevent concurrent execution of device init */
 	struct rw_semaphore init_lock;
@@ -114,9 +145,19 @@ struct zram {
 	 */
 	u64 disksize;	/* bytes */
 	char compressor[10];
+	char recomp_algorithm[10];
 	/*
 	 * zram is claimed so open request will be failed
 	 */
 	bool claim; /* Protected by bdev->bd_mutex */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* backing device for idle and incompressible pages, under init_lock */
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned int old_block_size;
+	/* allocated blocks of backing_dev, block 0 is never used */
+	unsigned long *bitmap;
+	unsigned long nr_pages;
+#endif
 };
 #endif
@@ -57,7 +57,8 @@
  *
  * invalidate_buckets_(lru|fifo)() find buckets that are available to be
  * invalidated, and then invalidate them and stick them on the free_inc list -
- * in either lru or fifo order.
+ * in either lru or fifo order. The lfu policy shares invalidate_buckets_lru();
+ * it only differs in how priorities are bumped on hits and decayed.
  */
 
 #include "bcache.h"
@@ -80,6 +81,20 @@ uint8_t bch_inc_gen(struct cache *ca, struct bucket *b)
 	return ret;
 }
 
+/*
+ * With LFU, what hits added above INITIAL_PRIO decays exponentially, on top of
+ * the usual linear aging, so a bucket that used to be popular doesn't stay
+ * cached forever.
+ */
+static inline unsigned prio_decay(struct cache *ca, struct bucket *b)
+{
+	if (CACHE_REPLACEMENT(&ca->sb) == CACHE_REPLACEMENT_LFU &&
+	    b->prio > INITIAL_PRIO)
+		return 1 + ((b->prio - INITIAL_PRIO) >> LFU_DECAY_SHIFT);
+
+	return 1;
+}
+
 void bch_rescale_priorities(struct cache_set *c, int sectors)
 {
 	struct cache *ca;
@@ -106,7 +121,7 @@ void bch_rescale_priorities(struct cache_set *c, int sectors)
 			if (b->prio &&
 			    b->prio != BTREE_PRIO &&
 			    !atomic_read(&b->pin)) {
-				b->prio--;
+				b->prio -= prio_decay(ca, b);
 				c->min_prio = min(c->min_prio, b->prio);
 			}
 
@@ -265,6 +280,7 @@ static void invalidate_buckets(struct cache *ca)
 
 	switch (CACHE_REPLACEMENT(&ca->sb)) {
 	case CACHE_REPLACEMENT_LRU:
+	case CACHE_REPLACEMENT_LFU:
 		invalidate_buckets_lru(ca);
 		break;
 	case CACHE_REPLACEMENT_FIFO:
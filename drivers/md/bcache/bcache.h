@@ -49,8 +49,9 @@
  *
  * The priority is used to implement an LRU. We reset a bucket's priority when
  * we allocate it or on cache it, and every so often we decrement the priority
- * of each bucket. It could be used to implement something more sophisticated,
- * if anyone ever gets around to it.
+ * of each bucket. With the LFU replacement policy, a cache hit instead adds to
+ * the priority, so frequently read buckets rank above ones that were only read
+ * recently; what hits add decays exponentially on every rescale.
  *
  * The generation is used for invalidating buckets. Each pointer also has an 8
  * bit generation embedded in it; for a pointer to be considered valid, its gen
@@ -331,8 +332,29 @@ struct cached_dev {
 	sector_t		last_read;
 
 	/* Limit number of writeback bios in flight */
-	struct semaphore	in_flight;
+	atomic_t		writeback_in_flight;
+	wait_queue_head_t	writeback_in_flight_wait;
 	struct task_struct	*writeback_thread;
+	struct workqueue_struct	*writeback_write_wq;
+
+	/*
+	 * Writes to the backing device are issued in the order read_dirty()
+	 * started them, regardless of the order the reads complete in.
+	 */
+	atomic_t		writeback_sequence_next;
+	struct closure_waitlist	writeback_ordering_wait;
+
+	/* Rate updates since the last request to this device */
+	atomic_t		backing_idle;
+	bool			writeback_rate_boosted;
+
+	/*
+	 * Read admission filter: blocks that missed recently. A read miss is
+	 * only cached if the block is already in here.
+	 */
+#define ADMIT_FILTER_BITS	(1 << 15)
+	DECLARE_BITMAP(admit_filter, ADMIT_FILTER_BITS);
+	atomic_t		admit_filter_used;
 
 	struct keybuf		writeback_keys;
 
@@ -352,12 +374,16 @@ struct cached_dev {
 
 	unsigned		verify:1;
 	unsigned		bypass_torture_test:1;
+	unsigned		read_admission:1;
 
 	unsigned		partial_stripes_expensive:1;
 	unsigned		writeback_metadata:1;
 	unsigned		writeback_running:1;
+	unsigned		writeback_idle_boost:1;
 	unsigned char		writeback_percent;
 	unsigned		writeback_delay;
+	unsigned		writeback_max_in_flight;
+	unsigned		writeback_threads;
 
 	uint64_t		writeback_rate_target;
 	int64_t			writeback_rate_proportional;
@@ -680,6 +706,11 @@ struct bbio {
 #define BTREE_PRIO		USHRT_MAX
 #define INITIAL_PRIO		32768U
 
+/* LFU: priority added per hit, and how fast that decays (see alloc.c) */
+#define LFU_HIT_PRIO		(INITIAL_PRIO / 8)
+#define LFU_MAX_PRIO		(BTREE_PRIO - 1)
+#define LFU_DECAY_SHIFT		7
+
 #define btree_bytes(c)		((c)->btree_pages * PAGE_SIZE)
 #define btree_blocks(b)							\
 	((unsigned) (KEY_SIZE(&b->key) >> (b)->c->block_bits))
@@ -745,6 +776,16 @@ static inline uint8_t ptr_stale(struct cache_set *c, const struct bkey *k,
 	return gen_after(PTR_BUCKET(c, k, i)->gen, PTR_GEN(k, i));
 }
 
+/* Called on a cache hit, without bucket_lock - racing updates are harmless */
+static inline void bch_bucket_hit(struct cache *ca, struct bucket *b)
+{
+	if (CACHE_REPLACEMENT(&ca->sb) == CACHE_REPLACEMENT_LFU)
+		b->prio = min_t(unsigned, max_t(unsigned, b->prio, INITIAL_PRIO) +
+				LFU_HIT_PRIO, LFU_MAX_PRIO);
+	else
+		b->prio = INITIAL_PRIO;
+}
+
 static inline bool ptr_available(struct cache_set *c, const struct bkey *k,
 				 unsigned i)
 {
@@ -535,7 +535,7 @@ static int cache_lookup_fn(struct btree_op *op, struct btree *b, struct bkey *k)
 	/* XXX: figure out best pointer - for multiple cache devices */
 	ptr = 0;
 
-	PTR_BUCKET(b->c, k, ptr)->prio = INITIAL_PRIO;
+	bch_bucket_hit(PTR_CACHE(b->c, k, ptr), PTR_BUCKET(b->c, k, ptr));
 
 	if (KEY_DIRTY(k))
 		s->read_dirty_data = true;
@@ -775,6 +775,38 @@ static void cached_dev_read_done_bh(struct closure *cl)
 		continue_at_nobarrier(cl, cached_dev_bio_complete, NULL);
 }
 
+/*
+ * Read admission: only cache a read miss if the same block missed recently, so
+ * one-off reads that are too random for the sequential cutoff (backups, scans)
+ * don't push out the working set. Recent misses are remembered in a bloom
+ * filter with two hashes, which is cleared once half of it is set - that's
+ * also what ages entries out.
+ */
+static bool cached_dev_admit_read(struct cached_dev *dc, struct bio *bio)
+{
+	u32 hash = hash_64(bio->bi_iter.bi_sector >> (PAGE_SHIFT - 9), 32);
+	unsigned b1 = hash % ADMIT_FILTER_BITS;
+	unsigned b2 = (hash >> 16) % ADMIT_FILTER_BITS;
+	int set = 0;
+
+	if (!dc->read_admission || (bio->bi_opf & (REQ_META|REQ_PRIO)))
+		return true;
+
+	if (test_bit(b1, dc->admit_filter) && test_bit(b2, dc->admit_filter))
+		return true;
+
+	set += !test_and_set_bit(b1, dc->admit_filter);
+	set += !test_and_set_bit(b2, dc->admit_filter);
+
+	if (atomic_add_return(set, &dc->admit_filter_used) >
+	    ADMIT_FILTER_BITS / 2) {
+		atomic_set(&dc->admit_filter_used, 0);
+		bitmap_zero(dc->admit_filter, ADMIT_FILTER_BITS);
+	}
+
+	return false;
+}
+
 static int cached_dev_cache_miss(struct btree *b, struct search *s,
 				 struct bio *bio, unsigned sectors)
 {
@@ -783,6 +815,10 @@ static int cached_dev_cache_miss(struct btree *b, struct search *s,
 	struct cached_dev *dc = container_of(s->d, struct cached_dev, disk);
 	struct bio *miss, *cache_bio;
 
+	if (!s->cache_miss && !s->iop.bypass &&
+	    !cached_dev_admit_read(dc, bio))
+		s->iop.bypass = true;
+
 	if (s->cache_miss || s->iop.bypass) {
 		miss = bio_next_split(bio, sectors, GFP_NOIO, s->d->bio_split);
 		ret = miss == bio ? MAP_DONE : MAP_CONTINUE;
@@ -961,6 +997,10 @@ static blk_qc_t cached_dev_make_request(struct request_queue *q,
 
 	generic_start_io_acct(rw, bio_sectors(bio), &d->disk->part0);
 
+	/* Only dirty the cacheline when there's something to reset */
+	if (atomic_read(&dc->backing_idle))
+		atomic_set(&dc->backing_idle, 0);
+
 	bio->bi_bdev = dc->bdev;
 	bio->bi_iter.bi_sector += dc->sb.data_offset;
 
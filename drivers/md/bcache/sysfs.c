@@ -18,6 +18,7 @@ static const char * const cache_replacement_policies[] = {
 	"lru",
 	"fifo",
 	"random",
+	"lfu",
 	NULL
 };
 
@@ -82,6 +83,10 @@ rw_attribute(writeback_rate);
 rw_attribute(writeback_rate_update_seconds);
 rw_attribute(writeback_rate_d_term);
 rw_attribute(writeback_rate_p_term_inverse);
+rw_attribute(writeback_max_in_flight);
+rw_attribute(writeback_threads);
+rw_attribute(writeback_idle_boost);
+rw_attribute(read_admission);
 read_attribute(writeback_rate_debug);
 
 read_attribute(stripe_size);
@@ -122,6 +127,7 @@ SHOW(__bch_cached_dev)
 	sysfs_printf(data_csum,		"%i", dc->disk.data_csum);
 	var_printf(verify,		"%i");
 	var_printf(bypass_torture_test,	"%i");
+	var_printf(read_admission,	"%i");
 	var_printf(writeback_metadata,	"%i");
 	var_printf(writeback_running,	"%i");
 	var_print(writeback_delay);
@@ -131,6 +137,9 @@ SHOW(__bch_cached_dev)
 	var_print(writeback_rate_update_seconds);
 	var_print(writeback_rate_d_term);
 	var_print(writeback_rate_p_term_inverse);
+	var_print(writeback_max_in_flight);
+	var_print(writeback_threads);
+	var_printf(writeback_idle_boost,	"%i");
 
 	if (attr == &sysfs_writeback_rate_debug) {
 		char rate[20];
@@ -158,9 +167,13 @@ SHOW(__bch_cached_dev)
 			       "proportional:\t%s\n"
 			       "derivative:\t%s\n"
 			       "change:\t\t%s/sec\n"
-			       "next io:\t%llims\n",
+			       "next io:\t%llims\n"
+			       "in flight:\t%i\n"
+			       "boosted:\t%i\n",
 			       rate, dirty, target, proportional,
-			       derivative, change, next_io);
+			       derivative, change, next_io,
+			       atomic_read(&dc->writeback_in_flight),
+			       dc->writeback_rate_boosted);
 	}
 
 	sysfs_hprint(dirty_data,
@@ -202,6 +215,7 @@ STORE(__cached_dev)
 	sysfs_strtoul(data_csum,	dc->disk.data_csum);
 	d_strtoul(verify);
 	d_strtoul(bypass_torture_test);
+	d_strtoul(read_admission);
 	d_strtoul(writeback_metadata);
 	d_strtoul(writeback_running);
 	d_strtoul(writeback_delay);
@@ -214,6 +228,11 @@ STORE(__cached_dev)
 	d_strtoul_nonzero(writeback_rate_update_seconds);
 	d_strtoul(writeback_rate_d_term);
 	d_strtoul_nonzero(writeback_rate_p_term_inverse);
+	sysfs_strtoul_clamp(writeback_max_in_flight,
+			    dc->writeback_max_in_flight, 1, 1024);
+	sysfs_strtoul_clamp(writeback_threads,
+			    dc->writeback_threads, 1, 64);
+	d_strtoul(writeback_idle_boost);
 
 	d_strtoi_h(sequential_cutoff);
 	d_strtoi_h(readahead);
@@ -300,6 +319,13 @@ STORE(bch_cached_dev)
 		schedule_delayed_work(&dc->writeback_rate_update,
 				      dc->writeback_rate_update_seconds * HZ);
 
+	if (attr == &sysfs_writeback_max_in_flight)
+		wake_up(&dc->writeback_in_flight_wait);
+
+	if (attr == &sysfs_writeback_threads && dc->writeback_write_wq)
+		workqueue_set_max_active(dc->writeback_write_wq,
+					 dc->writeback_threads);
+
 	mutex_unlock(&bch_register_lock);
 	return size;
 }
@@ -320,11 +346,15 @@ static struct attribute *bch_cached_dev_files[] = {
 	&sysfs_writeback_rate_update_seconds,
 	&sysfs_writeback_rate_d_term,
 	&sysfs_writeback_rate_p_term_inverse,
+	&sysfs_writeback_max_in_flight,
+	&sysfs_writeback_threads,
+	&sysfs_writeback_idle_boost,
 	&sysfs_writeback_rate_debug,
 	&sysfs_dirty_data,
 	&sysfs_stripe_size,
 	&sysfs_partial_stripes_expensive,
 	&sysfs_sequential_cutoff,
+	&sysfs_read_admission,
 	&sysfs_clear_stats,
 	&sysfs_running,
 	&sysfs_state,
@@ -798,15 +828,18 @@ SHOW(__bch_cache)
 		       *cached == BTREE_PRIO)
 			cached++, n--;
 
+		/* Buckets LFU ranks above INITIAL_PRIO count as brand new */
 		for (i = 0; i < n; i++)
-			sum += INITIAL_PRIO - cached[i];
+			sum += INITIAL_PRIO - min_t(unsigned, cached[i],
+						    INITIAL_PRIO);
 
 		if (n)
 			do_div(sum, n);
 
 		for (i = 0; i < ARRAY_SIZE(q); i++)
-			q[i] = INITIAL_PRIO - cached[n * (i + 1) /
-				(ARRAY_SIZE(q) + 1)];
+			q[i] = INITIAL_PRIO - min_t(unsigned,
+				cached[n * (i + 1) / (ARRAY_SIZE(q) + 1)],
+				INITIAL_PRIO);
 
 		vfree(p);
 
@@ -80,6 +80,14 @@ static void update_writeback_rate(struct work_struct *work)
 	    dc->writeback_percent)
 		__update_writeback_rate(dc);
 
+	/*
+	 * If no request has hit the backing device for a whole update
+	 * interval, there's nobody to slow down - write back flat out until
+	 * one shows up.
+	 */
+	dc->writeback_rate_boosted = dc->writeback_idle_boost &&
+		atomic_inc_return(&dc->backing_idle) > 1;
+
 	up_read(&dc->writeback_lock);
 
 	schedule_delayed_work(&dc->writeback_rate_update,
@@ -89,15 +97,24 @@ static void update_writeback_rate(struct work_struct *work)
 static unsigned writeback_delay(struct cached_dev *dc, unsigned sectors)
 {
 	if (test_bit(BCACHE_DEV_DETACHING, &dc->disk.flags) ||
-	    !dc->writeback_percent)
+	    !dc->writeback_percent ||
+	    dc->writeback_rate_boosted)
 		return 0;
 
 	return bch_next_delay(&dc->writeback_rate, sectors);
 }
 
+/*
+ * Don't batch up more than this many keys, or this many sectors, in a single
+ * pass of read_dirty()
+ */
+#define WRITEBACK_BATCH_KEYS		16
+#define WRITEBACK_BATCH_SECTORS		4096
+
 struct dirty_io {
 	struct closure		cl;
 	struct cached_dev	*dc;
+	unsigned		sequence;
 	struct bio		bio;
 };
 
@@ -156,7 +173,9 @@ static void write_dirty_finish(struct closure *cl)
 	}
 
 	bch_keybuf_del(&dc->writeback_keys, w);
-	up(&dc->in_flight);
+
+	atomic_dec(&dc->writeback_in_flight);
+	wake_up(&dc->writeback_in_flight_wait);
 
 	closure_return_with_destructor(cl, dirty_io_destructor);
 }
@@ -176,16 +195,40 @@ static void write_dirty(struct closure *cl)
 {
 	struct dirty_io *io = container_of(cl, struct dirty_io, cl);
 	struct keybuf_key *w = io->bio.bi_private;
+	struct cached_dev *dc = io->dc;
+
+	/*
+	 * Reads from the cache complete in whatever order they like; the
+	 * writes go out in the order read_dirty() issued them, which is keybuf
+	 * and thus backing device order, so the backing device sees one
+	 * ascending stream instead of random writes.
+	 */
+	if (atomic_read(&dc->writeback_sequence_next) != io->sequence) {
+		closure_wait(&dc->writeback_ordering_wait, cl);
 
-	dirty_init(w);
-	bio_set_op_attrs(&io->bio, REQ_OP_WRITE, 0);
-	io->bio.bi_iter.bi_sector = KEY_START(&w->key);
-	io->bio.bi_bdev		= io->dc->bdev;
-	io->bio.bi_end_io	= dirty_endio;
+		/* We may have raced with the write before us finishing */
+		if (atomic_read(&dc->writeback_sequence_next) == io->sequence)
+			closure_wake_up(&dc->writeback_ordering_wait);
 
-	closure_bio_submit(&io->bio, cl);
+		continue_at(cl, write_dirty, dc->writeback_write_wq);
+		return;
+	}
 
-	continue_at(cl, write_dirty_finish, system_wq);
+	/* A failed read cleared the dirty bit; don't write back garbage */
+	if (KEY_DIRTY(&w->key)) {
+		dirty_init(w);
+		bio_set_op_attrs(&io->bio, REQ_OP_WRITE, 0);
+		io->bio.bi_iter.bi_sector = KEY_START(&w->key);
+		io->bio.bi_bdev		= dc->bdev;
+		io->bio.bi_end_io	= dirty_endio;
+
+		closure_bio_submit(&io->bio, cl);
+	}
+
+	atomic_set(&dc->writeback_sequence_next, io->sequence + 1);
+	closure_wake_up(&dc->writeback_ordering_wait);
+
+	continue_at(cl, write_dirty_finish, dc->writeback_write_wq);
 }
 
 static void read_dirty_endio(struct bio *bio)
@@ -205,72 +248,123 @@ static void read_dirty_submit(struct closure *cl)
 
 	closure_bio_submit(&io->bio, cl);
 
-	continue_at(cl, write_dirty, system_wq);
+	continue_at(cl, write_dirty, io->dc->writeback_write_wq);
 }
 
 static void read_dirty(struct cached_dev *dc)
 {
-	unsigned delay = 0;
-	struct keybuf_key *w;
+	unsigned delay = 0, sequence = 0;
+	struct keybuf_key *next, *keys[WRITEBACK_BATCH_KEYS], *w;
 	struct dirty_io *io;
+	struct blk_plug plug;
 	struct closure cl;
+	size_t size;
+	int nk, i;
 
 	closure_init_stack(&cl);
+	atomic_set(&dc->writeback_sequence_next, sequence);
 
 	/*
 	 * XXX: if we error, background writeback just spins. Should use some
 	 * mempools.
 	 */
 
-	while (!kthread_should_stop()) {
+	next = bch_keybuf_next(&dc->writeback_keys);
+
+	while (!kthread_should_stop() && next) {
+		size = 0;
+		nk = 0;
+
+		/*
+		 * Gather a run of contiguous keys (the keybuf is sorted by
+		 * offset), so the reads for them go out together and the
+		 * writes reach the backing device back to back.
+		 */
+		do {
+			BUG_ON(ptr_stale(dc->disk.c, &next->key, 0));
 
-		w = bch_keybuf_next(&dc->writeback_keys);
-		if (!w)
-			break;
+			if (nk == WRITEBACK_BATCH_KEYS ||
+			    size >= WRITEBACK_BATCH_SECTORS)
+				break;
 
-		BUG_ON(ptr_stale(dc->disk.c, &w->key, 0));
+			if (nk && bkey_cmp(&keys[nk - 1]->key,
+					   &START_KEY(&next->key)))
+				break;
 
-		if (KEY_START(&w->key) != dc->last_read ||
+			size += KEY_SIZE(&next->key);
+			keys[nk++] = next;
+		} while ((next = bch_keybuf_next(&dc->writeback_keys)));
+
+		if (KEY_START(&keys[0]->key) != dc->last_read ||
 		    jiffies_to_msecs(delay) > 50)
 			while (!kthread_should_stop() && delay)
 				delay = schedule_timeout_interruptible(delay);
 
-		dc->last_read	= KEY_OFFSET(&w->key);
+		dc->last_read	= KEY_OFFSET(&keys[nk - 1]->key);
 
-		io = kzalloc(sizeof(struct dirty_io) + sizeof(struct bio_vec)
-			     * DIV_ROUND_UP(KEY_SIZE(&w->key), PAGE_SECTORS),
-			     GFP_KERNEL);
-		if (!io)
-			goto err;
+		blk_start_plug(&plug);
 
-		w->private	= io;
-		io->dc		= dc;
+		for (i = 0; i < nk; i++) {
+			w = keys[i];
 
-		dirty_init(w);
-		bio_set_op_attrs(&io->bio, REQ_OP_READ, 0);
-		io->bio.bi_iter.bi_sector = PTR_OFFSET(&w->key, 0);
-		io->bio.bi_bdev		= PTR_CACHE(dc->disk.c,
-						    &w->key, 0)->bdev;
-		io->bio.bi_end_io	= read_dirty_endio;
+			io = kzalloc(sizeof(struct dirty_io) +
+				     sizeof(struct bio_vec) *
+				     DIV_ROUND_UP(KEY_SIZE(&w->key),
+						  PAGE_SECTORS),
+				     GFP_KERNEL);
+			if (!io)
+				goto err;
+
+			w->private	= io;
+			io->dc		= dc;
+
+			dirty_init(w);
+			bio_set_op_attrs(&io->bio, REQ_OP_READ, 0);
+			io->bio.bi_iter.bi_sector = PTR_OFFSET(&w->key, 0);
+			io->bio.bi_bdev		= PTR_CACHE(dc->disk.c,
+							    &w->key, 0)->bdev;
+			io->bio.bi_end_io	= read_dirty_endio;
 
-		if (bio_alloc_pages(&io->bio, GFP_KERNEL))
-			goto err_free;
+			if (bio_alloc_pages(&io->bio, GFP_KERNEL))
+				goto err_free;
 
-		trace_bcache_writeback(&w->key);
+			io->sequence	= sequence++;
 
-		down(&dc->in_flight);
-		closure_call(&io->cl, read_dirty_submit, NULL, &cl);
+			trace_bcache_writeback(&w->key);
 
-		delay = writeback_delay(dc, KEY_SIZE(&w->key));
+			/*
+			 * We're the only one taking slots, so nobody can
+			 * sneak in between the check and the increment.
+			 */
+			wait_event(dc->writeback_in_flight_wait,
+				   atomic_read(&dc->writeback_in_flight) <
+				   dc->writeback_max_in_flight);
+			atomic_inc(&dc->writeback_in_flight);
+
+			closure_call(&io->cl, read_dirty_submit, NULL, &cl);
+		}
+
+		blk_finish_plug(&plug);
+
+		delay = writeback_delay(dc, size);
 	}
 
 	if (0) {
 err_free:
 		kfree(w->private);
 err:
+		blk_finish_plug(&plug);
 		bch_keybuf_del(&dc->writeback_keys, w);
+
+		/* The rest of the batch wasn't started; let it be picked up again */
+		while (++i < nk)
+			keys[i]->private = NULL;
 	}
 
+	/* We claimed this one but never got to it */
+	if (next)
+		next->private = NULL;
+
 	/*
 	 * Wait for outstanding writeback IOs to finish (and keybuf slots to be
 	 * freed) before refilling again
@@ -499,7 +593,8 @@ void bch_sectors_dirty_init(struct cached_dev *dc)
 
 void bch_cached_dev_writeback_init(struct cached_dev *dc)
 {
-	sema_init(&dc->in_flight, 64);
+	atomic_set(&dc->writeback_in_flight, 0);
+	init_waitqueue_head(&dc->writeback_in_flight_wait);
 	init_rwsem(&dc->writeback_lock);
 	bch_keybuf_init(&dc->writeback_keys);
 
@@ -508,6 +603,9 @@ void bch_cached_dev_writeback_init(struct cached_dev *dc)
 	dc->writeback_percent		= 10;
 	dc->writeback_delay		= 30;
 	dc->writeback_rate.rate		= 1024;
+	dc->writeback_max_in_flight	= 64;
+	dc->writeback_threads		= 4;
+	dc->writeback_idle_boost	= true;
 
 	dc->writeback_rate_update_seconds = 5;
 	dc->writeback_rate_d_term	= 30;
@@ -518,10 +616,19 @@ void bch_cached_dev_writeback_init(struct cached_dev *dc)
 
 int bch_cached_dev_writeback_start(struct cached_dev *dc)
 {
+	dc->writeback_write_wq = alloc_workqueue("bcache_writeback_wq",
+						 WQ_MEM_RECLAIM | WQ_UNBOUND,
+						 dc->writeback_threads);
+	if (!dc->writeback_write_wq)
+		return -ENOMEM;
+
 	dc->writeback_thread = kthread_create(bch_writeback_thread, dc,
 					      "bcache_writeback");
-	if (IS_ERR(dc->writeback_thread))
+	if (IS_ERR(dc->writeback_thread)) {
+		destroy_workqueue(dc->writeback_write_wq);
+		dc->writeback_write_wq = NULL;
 		return PTR_ERR(dc->writeback_thread);
+	}
 
 	schedule_delayed_work(&dc->writeback_rate_update,
 			      dc->writeback_rate_update_seconds * HZ);
@@ -10,6 +10,7 @@
 
 #include <linux/export.h>
 #include <linux/device-mapper.h>
+#include <linux/sort.h>
 
 #define DM_MSG_PREFIX "btree"
 
@@ -698,9 +699,19 @@ static int btree_split_beneath(struct shadow_spine *s, uint64_t key)
 	return 0;
 }
 
+/*
+ * Lowers *bound to the key following entry i of an internal node, if any.
+ * Keys below the final bound all belong in the leaf we end up in.
+ */
+static void update_bound(struct btree_node *n, int i, uint64_t *bound)
+{
+	if (bound && i + 1 < (int) le32_to_cpu(n->header.nr_entries))
+		*bound = min(*bound, le64_to_cpu(n->keys[i + 1]));
+}
+
 static int btree_insert_raw(struct shadow_spine *s, dm_block_t root,
 			    struct dm_btree_value_type *vt,
-			    uint64_t key, unsigned *index)
+			    uint64_t key, unsigned *index, uint64_t *bound)
 {
 	int r, i = *index, top = 1;
 	struct btree_node *node;
@@ -735,6 +746,10 @@ static int btree_insert_raw(struct shadow_spine *s, dm_block_t root,
 
 			if (r < 0)
 				return r;
+
+			/* the split added a key to the parent */
+			node = dm_block_data(shadow_parent(s));
+			update_bound(node, max(lower_bound(node, key), 0), bound);
 		}
 
 		node = dm_block_data(shadow_current(s));
@@ -750,6 +765,7 @@ static int btree_insert_raw(struct shadow_spine *s, dm_block_t root,
 			i = 0;
 		}
 
+		update_bound(node, i, bound);
 		root = value64(node, i);
 		top = 0;
 	}
@@ -768,89 +784,111 @@ static bool need_insert(struct btree_node *node, uint64_t *keys,
 		(le64_to_cpu(node->keys[index]) != keys[level]));
 }
 
-static int insert(struct dm_btree_info *info, dm_block_t root,
-		  uint64_t *keys, void *value, dm_block_t *new_root,
-		  int *inserted)
-		  __dm_written_to_disk(value)
+/*
+ * Walks down to the bottom level leaf that keys belongs in, shadowing and
+ * splitting nodes on the way and creating any missing subtrees.  Leaves the
+ * leaf locked as the spine's current node, with *index where the key goes.
+ */
+static int insert_path(struct dm_btree_info *info, struct shadow_spine *spine,
+		       dm_block_t root, uint64_t *keys, unsigned *index,
+		       uint64_t *bound)
 {
 	int r;
-	unsigned level, index = -1, last_level = info->levels - 1;
+	unsigned level, last_level = info->levels - 1;
 	dm_block_t block = root;
-	struct shadow_spine spine;
 	struct btree_node *n;
 	struct dm_btree_value_type le64_type;
 
 	init_le64_type(info->tm, &le64_type);
-	init_shadow_spine(&spine, info);
+	*index = -1;
 
-	for (level = 0; level < (info->levels - 1); level++) {
-		r = btree_insert_raw(&spine, block, &le64_type, keys[level], &index);
+	for (level = 0; level < last_level; level++) {
+		r = btree_insert_raw(spine, block, &le64_type, keys[level],
+				     index, NULL);
 		if (r < 0)
-			goto bad;
+			return r;
 
-		n = dm_block_data(shadow_current(&spine));
+		n = dm_block_data(shadow_current(spine));
 
-		if (need_insert(n, keys, level, index)) {
+		if (need_insert(n, keys, level, *index)) {
 			dm_block_t new_tree;
 			__le64 new_le;
 
 			r = dm_btree_empty(info, &new_tree);
 			if (r < 0)
-				goto bad;
+				return r;
 
 			new_le = cpu_to_le64(new_tree);
 			__dm_bless_for_disk(&new_le);
 
-			r = insert_at(sizeof(uint64_t), n, index,
+			r = insert_at(sizeof(uint64_t), n, *index,
 				      keys[level], &new_le);
 			if (r)
-				goto bad;
+				return r;
 		}
 
-		if (level < last_level)
-			block = value64(n, index);
+		block = value64(n, *index);
 	}
 
-	r = btree_insert_raw(&spine, block, &info->value_type,
-			     keys[level], &index);
-	if (r < 0)
-		goto bad;
-
-	n = dm_block_data(shadow_current(&spine));
+	return btree_insert_raw(spine, block, &info->value_type,
+				keys[last_level], index, bound);
+}
 
-	if (need_insert(n, keys, level, index)) {
+/*
+ * Inserts or overwrites the value for key at index in leaf n.
+ */
+static int insert_value(struct dm_btree_info *info, struct btree_node *n,
+			unsigned index, uint64_t key, void *value,
+			int *inserted)
+			__dm_written_to_disk(value)
+{
+	if (need_insert(n, &key, 0, index)) {
 		if (inserted)
 			*inserted = 1;
 
-		r = insert_at(info->value_type.size, n, index,
-			      keys[level], value);
-		if (r)
-			goto bad_unblessed;
-	} else {
-		if (inserted)
-			*inserted = 0;
-
-		if (info->value_type.dec &&
-		    (!info->value_type.equal ||
-		     !info->value_type.equal(
-			     info->value_type.context,
-			     value_ptr(n, index),
-			     value))) {
-			info->value_type.dec(info->value_type.context,
-					     value_ptr(n, index));
-		}
-		memcpy_disk(value_ptr(n, index),
-			    value, info->value_type.size);
+		return insert_at(info->value_type.size, n, index, key, value);
 	}
 
-	*new_root = shadow_root(&spine);
-	exit_shadow_spine(&spine);
+	if (inserted)
+		*inserted = 0;
+
+	if (info->value_type.dec &&
+	    (!info->value_type.equal ||
+	     !info->value_type.equal(
+		     info->value_type.context,
+		     value_ptr(n, index),
+		     value))) {
+		info->value_type.dec(info->value_type.context,
+				     value_ptr(n, index));
+	}
+	memcpy_disk(value_ptr(n, index),
+		    value, info->value_type.size);
 
 	return 0;
+}
+
+static int insert(struct dm_btree_info *info, dm_block_t root,
+		  uint64_t *keys, void *value, dm_block_t *new_root,
+		  int *inserted)
+		  __dm_written_to_disk(value)
+{
+	int r;
+	unsigned index;
+	struct shadow_spine spine;
+
+	init_shadow_spine(&spine, info);
 
-bad:
-	__dm_unbless_for_disk(value);
-bad_unblessed:
+	r = insert_path(info, &spine, root, keys, &index, NULL);
+	if (r < 0) {
+		__dm_unbless_for_disk(value);
+		goto out;
+	}
+
+	r = insert_value(info, dm_block_data(shadow_current(&spine)), index,
+			 keys[info->levels - 1], value, inserted);
+	if (!r)
+		*new_root = shadow_root(&spine);
+out:
 	exit_shadow_spine(&spine);
 	return r;
 }
@@ -872,6 +910,81 @@ int dm_btree_insert_notify(struct dm_btree_info *info, dm_block_t root,
 }
 EXPORT_SYMBOL_GPL(dm_btree_insert_notify);
 
+static int cmp_kv(const void *l, const void *r)
+{
+	uint64_t lk = ((const struct dm_btree_kv *) l)->key;
+	uint64_t rk = ((const struct dm_btree_kv *) r)->key;
+
+	return lk < rk ? -1 : lk > rk;
+}
+
+int dm_btree_insert_many(struct dm_btree_info *info, dm_block_t root,
+			 uint64_t *keys, struct dm_btree_kv *kvs,
+			 unsigned count, dm_block_t *new_root,
+			 unsigned *nr_inserted)
+{
+	int r = 0, inserted, j;
+	unsigned i, index, last_level = info->levels - 1;
+	uint64_t bound;
+	struct shadow_spine spine;
+	struct btree_node *n;
+
+	sort(kvs, count, sizeof(*kvs), cmp_kv, NULL);
+	for (i = 1; i < count; i++)
+		if (kvs[i - 1].key == kvs[i].key)
+			return -EINVAL;
+
+	if (nr_inserted)
+		*nr_inserted = 0;
+	*new_root = root;
+
+	i = 0;
+	while (i < count) {
+		/*
+		 * One walk from the root per leaf: the walk leaves the leaf
+		 * locked, and every following key that falls inside it goes
+		 * straight in, until it's full.
+		 */
+		init_shadow_spine(&spine, info);
+
+		keys[last_level] = kvs[i].key;
+		bound = U64_MAX;
+		r = insert_path(info, &spine, *new_root, keys, &index, &bound);
+		if (r < 0)
+			goto out;
+
+		n = dm_block_data(shadow_current(&spine));
+		for (;;) {
+			r = insert_value(info, n, index, kvs[i].key,
+					 kvs[i].value, &inserted);
+			if (r)
+				goto out;
+
+			if (nr_inserted)
+				*nr_inserted += inserted;
+
+			if (++i == count || kvs[i].key >= bound ||
+			    n->header.nr_entries == n->header.max_entries)
+				break;
+
+			j = lower_bound(n, kvs[i].key);
+			if (j < 0 || le64_to_cpu(n->keys[j]) != kvs[i].key)
+				j++;
+			index = j;
+		}
+
+		*new_root = shadow_root(&spine);
+		exit_shadow_spine(&spine);
+	}
+
+	return 0;
+
+out:
+	exit_shadow_spine(&spine);
+	return r;
+}
+EXPORT_SYMBOL_GPL(dm_btree_insert_many);
+
 /*----------------------------------------------------------------*/
 
 static int find_key(struct ro_spine *s, dm_block_t block, bool find_highest,
@@ -1073,6 +1186,71 @@ static int inc_or_backtrack(struct dm_btree_cursor *c)
 	return 0;
 }
 
+/*
+ * Called on entering a leaf.  Half way through the leaves under the current
+ * node, find the node after it at the same level and prefetch its children,
+ * so the cursor doesn't stall at the boundary.  That node is normally
+ * in core already, as push_node() prefetched it along with its siblings;
+ * if it isn't, only prefetch it and leave it at that.
+ */
+static void prefetch_next_leaves(struct dm_btree_cursor *c)
+{
+	int r, d, parent = c->depth - 2;
+	struct cursor_node *n;
+	struct btree_node *bn;
+	struct dm_block *b;
+	struct dm_block_manager *bm = dm_tm_get_bm(c->info->tm);
+	dm_block_t next;
+
+	if (parent < 0)
+		return;
+
+	n = c->nodes + parent;
+	bn = dm_block_data(n->b);
+	if (n->index != le32_to_cpu(bn->header.nr_entries) / 2)
+		return;
+
+	/* find the closest ancestor with a next child */
+	for (d = parent - 1; d >= 0; d--) {
+		n = c->nodes + d;
+		bn = dm_block_data(n->b);
+		if (n->index + 1 < le32_to_cpu(bn->header.nr_entries))
+			break;
+	}
+	if (d < 0)
+		return;
+
+	next = value64(bn, n->index + 1);
+
+	/* and walk down its left edge to the level of our parent */
+	for (;;) {
+		r = dm_bm_read_try_lock(bm, next, &btree_node_validator, &b);
+		if (r) {
+			if (r == -EWOULDBLOCK)
+				dm_bm_prefetch(bm, next);
+			return;
+		}
+
+		bn = dm_block_data(b);
+		if (!(le32_to_cpu(bn->header.flags) & INTERNAL_NODE) ||
+		    !le32_to_cpu(bn->header.nr_entries)) {
+			dm_bm_unlock(b);
+			return;
+		}
+
+		if (++d == parent)
+			break;
+
+		next = value64(bn, 0);
+		dm_bm_unlock(b);
+	}
+
+	for (d = 0; d < le32_to_cpu(bn->header.nr_entries); d++)
+		dm_bm_prefetch(bm, value64(bn, d));
+
+	dm_bm_unlock(b);
+}
+
 static int find_leaf(struct dm_btree_cursor *c)
 {
 	int r = 0;
@@ -1098,6 +1276,9 @@ static int find_leaf(struct dm_btree_cursor *c)
 	if (!r && (le32_to_cpu(bn->header.nr_entries) == 0))
 		return -ENODATA;
 
+	if (!r && !n->index)
+		prefetch_next_leaves(c);
+
 	return r;
 }
 
@@ -133,6 +133,25 @@ int dm_btree_insert_notify(struct dm_btree_info *info, dm_block_t root,
 			   int *inserted)
 			   __dm_written_to_disk(value);
 
+/*
+ * Inserts (or overwrites) a batch of values in one bottom level tree.
+ * keys[0 .. levels - 2] select the tree, keys[levels - 1] is used as
+ * scratch.  The batch is sorted by key in place, and each leaf is walked to
+ * and shadowed once, rather than once per key, so this is much cheaper than
+ * calling dm_btree_insert() in a loop.  Keys must be unique (-EINVAL
+ * otherwise).  If it fails part way through, some of the values may have
+ * been inserted; the transaction should be aborted.
+ */
+struct dm_btree_kv {
+	uint64_t key;
+	void *value;
+};
+
+int dm_btree_insert_many(struct dm_btree_info *info, dm_block_t root,
+			 uint64_t *keys, struct dm_btree_kv *kvs,
+			 unsigned count, dm_block_t *new_root,
+			 unsigned *nr_inserted);
+
 /*
  * Remove a key if present.  This doesn't remove empty sub trees.  Normally
  * subtrees represent a separate entity, like a snapshot map, so this is
@@ -182,7 +201,9 @@ int dm_btree_walk(struct dm_btree_info *info, dm_block_t root,
 /*
  * Cursor API.  This does not follow the rolling lock convention.  Since we
  * know the order that values are required we can issue prefetches to speed
- * up iteration.  Use on a single level btree only.
+ * up iteration: the children of each internal node are prefetched as it's
+ * entered, and half way through the leaves under one node those under the
+ * next one are prefetched too.  Use on a single level btree only.
  */
 #define DM_BTREE_CURSOR_MAX_DEPTH 16
 
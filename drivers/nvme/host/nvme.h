@@ -143,6 +143,8 @@ struct nvme_ctrl {
 	u32 sgls;
 	u16 kas;
 	unsigned int kato;
+	u32 hmpre;		/* host memory buffer, in 4k units */
+	u32 hmmin;
 	bool subsystem;
 	unsigned long quirks;
 	struct work_struct scan_work;
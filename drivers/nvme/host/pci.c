@@ -64,6 +64,21 @@ static bool use_cmb_sqes = true;
 module_param(use_cmb_sqes, bool, 0644);
 MODULE_PARM_DESC(use_cmb_sqes, "use controller's memory buffer for I/O SQes");
 
+static bool use_cmb_wds = true;
+module_param(use_cmb_wds, bool, 0444);
+MODULE_PARM_DESC(use_cmb_wds,
+	"stage small write data in the controller's memory buffer");
+
+static unsigned int max_host_mem_size_mb = 128;
+module_param(max_host_mem_size_mb, uint, 0444);
+MODULE_PARM_DESC(max_host_mem_size_mb,
+	"Maximum Host Memory Buffer (HMB) size per controller (in MiB)");
+
+static unsigned int poll_queues;
+module_param(poll_queues, uint, 0644);
+MODULE_PARM_DESC(poll_queues,
+	"number of interrupt-less queues for polled I/O, applied on reset");
+
 static struct workqueue_struct *nvme_workq;
 
 struct nvme_dev;
@@ -87,6 +102,7 @@ struct nvme_dev {
 	unsigned queue_count;
 	unsigned online_queues;
 	unsigned max_qid;
+	unsigned nr_poll_queues;	/* the last ones up to max_qid */
 	int q_depth;
 	u32 db_stride;
 	void __iomem *bar;
@@ -100,8 +116,18 @@ struct nvme_dev {
 	u64 cmb_size;
 	u32 cmbsz;
 	u32 cmbloc;
+	u64 cmb_data_offset;	/* write data slots, past the SQes */
+	u32 cmb_data_slots;	/* per I/O queue, each a controller page */
 	struct nvme_ctrl ctrl;
 	struct completion ioq_wait;
+
+	/* host memory buffer, kept across resets */
+	u64 host_mem_size;
+	u32 nr_host_mem_descs;
+	size_t host_mem_descs_size;	/* as allocated, not nr * sizeof */
+	dma_addr_t host_mem_descs_dma;
+	struct nvme_host_mem_buf_desc *host_mem_descs;
+	void **host_mem_desc_bufs;
 };
 
 static inline struct nvme_dev *to_nvme_dev(struct nvme_ctrl *ctrl)
@@ -120,6 +146,9 @@ struct nvme_queue {
 	spinlock_t q_lock;
 	struct nvme_command *sq_cmds;
 	struct nvme_command __iomem *sq_cmds_io;
+	void __iomem *cmb_data;
+	dma_addr_t cmb_data_dma;
+	u32 cmb_data_slots;
 	volatile struct nvme_completion *cqes;
 	struct blk_mq_tags **tags;
 	dma_addr_t sq_dma_addr;
@@ -132,6 +161,7 @@ struct nvme_queue {
 	u16 qid;
 	u8 cq_phase;
 	u8 cqe_seen;
+	bool polled;		/* no interrupt, reaped by nvme_poll() only */
 };
 
 /*
@@ -499,6 +529,42 @@ static bool nvme_setup_prps(struct nvme_dev *dev, struct request *req)
 	return true;
 }
 
+/*
+ * A write that fits a controller page is copied into the CMB slot reserved
+ * for its tag, so the controller finds the data in its own memory rather
+ * than fetching it from the host.  Nothing gets DMA mapped, iod->nents
+ * stays 0 and there is nothing to undo on completion.
+ */
+static bool nvme_cmb_stage_write(struct nvme_dev *dev, struct request *req,
+		struct nvme_command *cmnd)
+{
+	struct nvme_iod *iod = blk_mq_rq_to_pdu(req);
+	struct nvme_queue *nvmeq = iod->nvmeq;
+	struct req_iterator iter;
+	unsigned int offset = 0;
+	struct bio_vec bv;
+	void __iomem *slot;
+
+	if (req->tag >= nvmeq->cmb_data_slots || req_op(req) != REQ_OP_WRITE ||
+	    (req->rq_flags & RQF_SPECIAL_PAYLOAD) || blk_integrity_rq(req) ||
+	    iod->length > dev->ctrl.page_size)
+		return false;
+
+	slot = nvmeq->cmb_data + req->tag * dev->ctrl.page_size;
+	rq_for_each_segment(bv, req, iter) {
+		void *p = kmap_atomic(bv.bv_page);
+
+		memcpy_toio(slot + offset, p + bv.bv_offset, bv.bv_len);
+		kunmap_atomic(p);
+		offset += bv.bv_len;
+	}
+
+	cmnd->rw.dptr.prp1 = cpu_to_le64(nvmeq->cmb_data_dma +
+					 req->tag * dev->ctrl.page_size);
+	cmnd->rw.dptr.prp2 = 0;
+	return true;
+}
+
 static int nvme_map_data(struct nvme_dev *dev, struct request *req,
 		struct nvme_command *cmnd)
 {
@@ -508,6 +574,9 @@ static int nvme_map_data(struct nvme_dev *dev, struct request *req,
 			DMA_TO_DEVICE : DMA_FROM_DEVICE;
 	int ret = BLK_MQ_RQ_QUEUE_ERROR;
 
+	if (nvme_cmb_stage_write(dev, req, cmnd))
+		return BLK_MQ_RQ_QUEUE_OK;
+
 	sg_init_table(iod->sg, blk_rq_nr_phys_segments(req));
 	iod->nents = blk_rq_map_sg(q, req, iod->sg);
 	if (!iod->nents)
@@ -619,7 +688,8 @@ static int nvme_queue_rq(struct blk_mq_hw_ctx *hctx,
 		goto out_cleanup_iod;
 	}
 	__nvme_submit_cmd(nvmeq, &cmnd);
-	nvme_process_cq(nvmeq);
+	if (!nvmeq->polled)
+		nvme_process_cq(nvmeq);
 	spin_unlock_irq(&nvmeq->q_lock);
 	return BLK_MQ_RQ_QUEUE_OK;
 out_cleanup_iod:
@@ -666,7 +736,25 @@ static inline bool nvme_cqe_valid(struct nvme_queue *nvmeq, u16 head,
 	return (le16_to_cpu(nvmeq->cqes[head].status) & 1) == phase;
 }
 
-static void __nvme_process_cq(struct nvme_queue *nvmeq, unsigned int *tag)
+/*
+ * Requests reaped successfully by __nvme_process_cq() are batched, unmap
+ * them and end them together once the queue lock has been dropped.
+ */
+static void nvme_pci_complete_batch(struct nvme_queue *nvmeq,
+				    struct blk_mq_comp_batch *batch)
+{
+	struct request *req;
+
+	if (!batch->nr)
+		return;
+
+	blk_mq_batch_for_each_rq(batch, req)
+		nvme_unmap_data(nvmeq->dev, req);
+	blk_mq_end_request_batch(batch);
+}
+
+static void __nvme_process_cq(struct nvme_queue *nvmeq, unsigned int *tag,
+			      struct blk_mq_comp_batch *batch)
 {
 	u16 head, phase;
 
@@ -676,6 +764,8 @@ static void __nvme_process_cq(struct nvme_queue *nvmeq, unsigned int *tag)
 	while (nvme_cqe_valid(nvmeq, head, phase)) {
 		struct nvme_completion cqe = nvmeq->cqes[head];
 		struct request *req;
+		struct nvme_iod *iod;
+		u16 status;
 
 		if (++head == nvmeq->q_depth) {
 			head = 0;
@@ -707,7 +797,15 @@ static void __nvme_process_cq(struct nvme_queue *nvmeq, unsigned int *tag)
 
 		req = blk_mq_tag_to_rq(*nvmeq->tags, cqe.command_id);
 		nvme_req(req)->result = cqe.result;
-		blk_mq_complete_request(req, le16_to_cpu(cqe.status) >> 1);
+		status = le16_to_cpu(cqe.status) >> 1;
+		/*
+		 * Failed commands aren't batched, and neither are aborted
+		 * ones, nvme_pci_complete_rq() reports those.
+		 */
+		iod = blk_mq_rq_to_pdu(req);
+		if (!batch || unlikely(iod->aborted) ||
+		    !blk_mq_add_to_batch(req, batch, status))
+			blk_mq_complete_request(req, status);
 	}
 
 	if (head == nvmeq->cq_head && phase == nvmeq->cq_phase)
@@ -723,18 +821,22 @@ static void __nvme_process_cq(struct nvme_queue *nvmeq, unsigned int *tag)
 
 static void nvme_process_cq(struct nvme_queue *nvmeq)
 {
-	__nvme_process_cq(nvmeq, NULL);
+	__nvme_process_cq(nvmeq, NULL, NULL);
 }
 
 static irqreturn_t nvme_irq(int irq, void *data)
 {
 	irqreturn_t result;
 	struct nvme_queue *nvmeq = data;
+	DEFINE_BLK_MQ_COMP_BATCH(batch);
+
 	spin_lock(&nvmeq->q_lock);
-	nvme_process_cq(nvmeq);
+	__nvme_process_cq(nvmeq, NULL, &batch);
 	result = nvmeq->cqe_seen ? IRQ_HANDLED : IRQ_NONE;
 	nvmeq->cqe_seen = 0;
 	spin_unlock(&nvmeq->q_lock);
+
+	nvme_pci_complete_batch(nvmeq, &batch);
 	return result;
 }
 
@@ -749,11 +851,23 @@ static irqreturn_t nvme_irq_check(int irq, void *data)
 static int nvme_poll(struct blk_mq_hw_ctx *hctx, unsigned int tag)
 {
 	struct nvme_queue *nvmeq = hctx->driver_data;
+	DEFINE_BLK_MQ_COMP_BATCH(batch);
 
 	if (nvme_cqe_valid(nvmeq, nvmeq->cq_head, nvmeq->cq_phase)) {
-		spin_lock_irq(&nvmeq->q_lock);
-		__nvme_process_cq(nvmeq, &tag);
+		/*
+		 * Whoever holds the lock of a poll queue is either reaping
+		 * it already or about to ring the doorbell, don't spin on
+		 * it, just come back.
+		 */
+		if (nvmeq->polled) {
+			if (!spin_trylock_irq(&nvmeq->q_lock))
+				return 0;
+		} else {
+			spin_lock_irq(&nvmeq->q_lock);
+		}
+		__nvme_process_cq(nvmeq, &tag, &batch);
 		spin_unlock_irq(&nvmeq->q_lock);
+		nvme_pci_complete_batch(nvmeq, &batch);
 
 		if (tag == -1)
 			return 1;
@@ -792,7 +906,10 @@ static int adapter_alloc_cq(struct nvme_dev *dev, u16 qid,
 						struct nvme_queue *nvmeq)
 {
 	struct nvme_command c;
-	int flags = NVME_QUEUE_PHYS_CONTIG | NVME_CQ_IRQ_ENABLED;
+	int flags = NVME_QUEUE_PHYS_CONTIG;
+
+	if (!nvmeq->polled)
+		flags |= NVME_CQ_IRQ_ENABLED;
 
 	/*
 	 * Note: we (ab)use the fact the the prp fields survive if no data
@@ -972,7 +1089,8 @@ static int nvme_suspend_queue(struct nvme_queue *nvmeq)
 	if (!nvmeq->qid && nvmeq->dev->ctrl.admin_q)
 		blk_mq_stop_hw_queues(nvmeq->dev->ctrl.admin_q);
 
-	free_irq(vector, nvmeq);
+	if (!nvmeq->polled)
+		free_irq(vector, nvmeq);
 
 	return 0;
 }
@@ -1098,6 +1216,15 @@ static void nvme_init_queue(struct nvme_queue *nvmeq, u16 qid)
 	nvmeq->cq_phase = 1;
 	nvmeq->q_db = &dev->dbs[qid * 2 * dev->db_stride];
 	memset((void *)nvmeq->cqes, 0, CQ_SIZE(nvmeq->q_depth));
+	nvmeq->cmb_data_slots = 0;
+	if (qid && dev->cmb_data_slots) {
+		u64 offset = dev->cmb_data_offset + (u64)(qid - 1) *
+				dev->cmb_data_slots * dev->ctrl.page_size;
+
+		nvmeq->cmb_data = dev->cmb + offset;
+		nvmeq->cmb_data_dma = dev->cmb_dma_addr + offset;
+		nvmeq->cmb_data_slots = dev->cmb_data_slots;
+	}
 	dev->online_queues++;
 	spin_unlock_irq(&nvmeq->q_lock);
 }
@@ -1107,7 +1234,12 @@ static int nvme_create_queue(struct nvme_queue *nvmeq, int qid)
 	struct nvme_dev *dev = nvmeq->dev;
 	int result;
 
-	nvmeq->cq_vector = qid - 1;
+	/*
+	 * Poll queues come after the interrupt driven ones and have no
+	 * vector, cq_vector only marks them live.
+	 */
+	nvmeq->polled = qid > dev->max_qid - dev->nr_poll_queues;
+	nvmeq->cq_vector = nvmeq->polled ? 0 : qid - 1;
 	result = adapter_alloc_cq(dev, qid, nvmeq);
 	if (result < 0)
 		return result;
@@ -1116,9 +1248,11 @@ static int nvme_create_queue(struct nvme_queue *nvmeq, int qid)
 	if (result < 0)
 		goto release_cq;
 
-	result = queue_request_irq(nvmeq);
-	if (result < 0)
-		goto release_sq;
+	if (!nvmeq->polled) {
+		result = queue_request_irq(nvmeq);
+		if (result < 0)
+			goto release_sq;
+	}
 
 	nvme_init_queue(nvmeq, qid);
 	return result;
@@ -1356,7 +1490,7 @@ static void __iomem *nvme_map_cmb(struct nvme_dev *dev)
 		return NULL;
 	dev->cmbloc = readl(dev->bar + NVME_REG_CMBLOC);
 
-	if (!use_cmb_sqes)
+	if (!use_cmb_sqes && !use_cmb_wds)
 		return NULL;
 
 	szu = (u64)1 << (12 + 4 * NVME_CMB_SZU(dev->cmbsz));
@@ -1393,6 +1527,205 @@ static inline void nvme_release_cmb(struct nvme_dev *dev)
 	}
 }
 
+/*
+ * What the SQes leave of the CMB is split into write data slots, an equal
+ * share for each I/O queue, indexed by tag.  The SQ area is set aside
+ * whenever the controller supports SQes there, as queues created while
+ * use_cmb_sqes was set keep living there.
+ */
+static void nvme_setup_cmb_data(struct nvme_dev *dev)
+{
+	u64 offset = 0, slots;
+
+	dev->cmb_data_slots = 0;
+	if (!dev->cmb || !use_cmb_wds || !NVME_CMB_WDS(dev->cmbsz))
+		return;
+
+	if (NVME_CMB_SQS(dev->cmbsz))
+		offset = (u64)dev->max_qid * roundup(SQ_SIZE(dev->q_depth),
+						     dev->ctrl.page_size);
+	if (offset >= dev->cmb_size)
+		return;
+
+	slots = div_u64(dev->cmb_size - offset,
+			dev->ctrl.page_size * dev->max_qid);
+	dev->cmb_data_offset = offset;
+	dev->cmb_data_slots = min_t(u64, slots, dev->q_depth);
+}
+
+static int nvme_set_host_mem(struct nvme_dev *dev, u32 bits)
+{
+	u64 dma_addr = dev->host_mem_descs_dma;
+	struct nvme_command c;
+	int ret;
+
+	memset(&c, 0, sizeof(c));
+	c.features.opcode = nvme_admin_set_features;
+	c.features.fid = cpu_to_le32(NVME_FEAT_HOST_MEM_BUF);
+	c.features.dword11 = cpu_to_le32(bits);
+	c.features.dword12 = cpu_to_le32(dev->host_mem_size >>
+					 ilog2(dev->ctrl.page_size));
+	c.features.dword13 = cpu_to_le32(lower_32_bits(dma_addr));
+	c.features.dword14 = cpu_to_le32(upper_32_bits(dma_addr));
+	c.features.dword15 = cpu_to_le32(dev->nr_host_mem_descs);
+
+	ret = nvme_submit_sync_cmd(dev->ctrl.admin_q, &c, NULL, 0);
+	if (ret) {
+		dev_warn(dev->ctrl.device,
+			 "failed to set host mem (err %d, flags %#x).\n",
+			 ret, bits);
+	}
+	return ret;
+}
+
+static void nvme_free_host_mem(struct nvme_dev *dev)
+{
+	DEFINE_DMA_ATTRS(attrs);
+	int i;
+
+	if (!dev->host_mem_descs)
+		return;
+
+	dma_set_attr(DMA_ATTR_NO_KERNEL_MAPPING, &attrs);
+	for (i = 0; i < dev->nr_host_mem_descs; i++) {
+		struct nvme_host_mem_buf_desc *desc = &dev->host_mem_descs[i];
+		size_t size = le32_to_cpu(desc->size) * dev->ctrl.page_size;
+
+		dma_free_attrs(dev->dev, size, dev->host_mem_desc_bufs[i],
+			       le64_to_cpu(desc->addr), &attrs);
+	}
+
+	kfree(dev->host_mem_desc_bufs);
+	dev->host_mem_desc_bufs = NULL;
+	dma_free_coherent(dev->dev, dev->host_mem_descs_size,
+			  dev->host_mem_descs, dev->host_mem_descs_dma);
+	dev->host_mem_descs = NULL;
+	dev->host_mem_descs_size = 0;
+	dev->nr_host_mem_descs = 0;
+	dev->host_mem_size = 0;
+}
+
+static int __nvme_alloc_host_mem(struct nvme_dev *dev, u64 preferred,
+		u32 chunk_size)
+{
+	struct nvme_host_mem_buf_desc *descs;
+	u32 max_entries, len;
+	dma_addr_t descs_dma;
+	DEFINE_DMA_ATTRS(attrs);
+	int i = 0;
+	void **bufs;
+	u64 size;
+
+	max_entries = div_u64(preferred + chunk_size - 1, chunk_size);
+	descs = dma_zalloc_coherent(dev->dev, max_entries * sizeof(*descs),
+				    &descs_dma, GFP_KERNEL);
+	if (!descs)
+		goto out;
+
+	bufs = kcalloc(max_entries, sizeof(*bufs), GFP_KERNEL);
+	if (!bufs)
+		goto out_free_descs;
+
+	dma_set_attr(DMA_ATTR_NO_KERNEL_MAPPING, &attrs);
+	for (size = 0; size < preferred; size += len) {
+		dma_addr_t dma_addr;
+
+		len = min_t(u64, chunk_size, preferred - size);
+		bufs[i] = dma_alloc_attrs(dev->dev, len, &dma_addr,
+					  GFP_KERNEL | __GFP_NOWARN, &attrs);
+		if (!bufs[i])
+			break;
+
+		descs[i].addr = cpu_to_le64(dma_addr);
+		descs[i].size = cpu_to_le32(len / dev->ctrl.page_size);
+		i++;
+	}
+
+	if (!size)
+		goto out_free_bufs;
+
+	dev->nr_host_mem_descs = i;
+	dev->host_mem_size = size;
+	dev->host_mem_descs = descs;
+	dev->host_mem_descs_size = max_entries * sizeof(*descs);
+	dev->host_mem_descs_dma = descs_dma;
+	dev->host_mem_desc_bufs = bufs;
+	return 0;
+
+out_free_bufs:
+	kfree(bufs);
+out_free_descs:
+	dma_free_coherent(dev->dev, max_entries * sizeof(*descs), descs,
+			  descs_dma);
+out:
+	return -ENOMEM;
+}
+
+static int nvme_alloc_host_mem(struct nvme_dev *dev, u64 min, u64 preferred)
+{
+	u32 chunk_size;
+
+	/* start big and work our way down */
+	chunk_size = rounddown_pow_of_two(min_t(u64, preferred,
+					PAGE_SIZE << (MAX_ORDER - 1)));
+	for (; chunk_size >= PAGE_SIZE; chunk_size /= 2) {
+		if (__nvme_alloc_host_mem(dev, preferred, chunk_size))
+			continue;
+		if (dev->host_mem_size >= min)
+			return 0;
+		nvme_free_host_mem(dev);
+	}
+
+	return -ENOMEM;
+}
+
+/*
+ * Hand DRAM-less controllers the host memory they ask for.  The buffer is
+ * kept across suspend and reset and, if still big enough, given back with
+ * NVME_HOST_MEM_RETURN so the controller can pick up where it left off.
+ */
+static void nvme_setup_host_mem(struct nvme_dev *dev)
+{
+	u64 max = (u64)max_host_mem_size_mb * SZ_1M;
+	u64 preferred = (u64)dev->ctrl.hmpre * 4096;
+	u64 min = (u64)dev->ctrl.hmmin * 4096;
+	u32 enable_bits = NVME_HOST_MEM_ENABLE;
+
+	preferred = round_down(min(preferred, max), dev->ctrl.page_size);
+	if (min > max) {
+		dev_warn(dev->ctrl.device,
+			"min host memory (%lld MiB) above limit (%d MiB).\n",
+			min >> ilog2(SZ_1M), max_host_mem_size_mb);
+		nvme_free_host_mem(dev);
+		return;
+	}
+	if (!preferred) {
+		nvme_free_host_mem(dev);
+		return;
+	}
+
+	if (dev->host_mem_descs) {
+		if (dev->host_mem_size >= min)
+			enable_bits |= NVME_HOST_MEM_RETURN;
+		else
+			nvme_free_host_mem(dev);
+	}
+
+	if (!dev->host_mem_descs) {
+		if (nvme_alloc_host_mem(dev, min, preferred)) {
+			dev_warn(dev->ctrl.device,
+				"failed to allocate host memory buffer.\n");
+			return;
+		}
+		dev_info(dev->ctrl.device,
+			"allocated %lld MiB host memory buffer.\n",
+			dev->host_mem_size >> ilog2(SZ_1M));
+	}
+
+	if (nvme_set_host_mem(dev, enable_bits))
+		nvme_free_host_mem(dev);
+}
+
 static size_t db_bar_size(struct nvme_dev *dev, unsigned nr_io_queues)
 {
 	return 4096 + ((nr_io_queues + 1) * 8 * dev->db_stride);
@@ -1402,9 +1735,11 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 {
 	struct nvme_queue *adminq = dev->queues[0];
 	struct pci_dev *pdev = to_pci_dev(dev->dev);
+	unsigned int nr_poll_queues = READ_ONCE(poll_queues);
 	int result, nr_io_queues, size;
 
-	nr_io_queues = num_online_cpus();
+	nr_io_queues = min_t(unsigned int, num_online_cpus() + nr_poll_queues,
+			     nr_cpu_ids);
 	result = nvme_set_queue_count(&dev->ctrl, &nr_io_queues);
 	if (result < 0)
 		return result;
@@ -1412,7 +1747,7 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 	if (nr_io_queues == 0)
 		return 0;
 
-	if (dev->cmb && NVME_CMB_SQS(dev->cmbsz)) {
+	if (dev->cmb && use_cmb_sqes && NVME_CMB_SQS(dev->cmbsz)) {
 		result = nvme_cmb_qdepth(dev, nr_io_queues,
 				sizeof(struct nvme_command));
 		if (result > 0)
@@ -1444,11 +1779,19 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 	 * setting up the full range we need.
 	 */
 	pci_free_irq_vectors(pdev);
-	nr_io_queues = pci_alloc_irq_vectors(pdev, 1, nr_io_queues,
+
+	/*
+	 * Poll queues need no vector, but keep at least one queue taking
+	 * interrupts for everything that isn't polled for.
+	 */
+	nr_poll_queues = min_t(unsigned int, nr_poll_queues, nr_io_queues - 1);
+	result = pci_alloc_irq_vectors(pdev, 1, nr_io_queues - nr_poll_queues,
 			PCI_IRQ_ALL_TYPES | PCI_IRQ_AFFINITY);
-	if (nr_io_queues <= 0)
+	if (result <= 0)
 		return -EIO;
-	dev->max_qid = nr_io_queues;
+	dev->nr_poll_queues = nr_poll_queues;
+	dev->max_qid = result + nr_poll_queues;
+	nvme_setup_cmb_data(dev);
 
 	/*
 	 * Should investigate if there's a performance win from allocating
@@ -1544,6 +1887,19 @@ static void nvme_disable_io_queues(struct nvme_dev *dev, int queues)
 	}
 }
 
+/*
+ * Poll queues are created last, so when we came up short of queues they
+ * are the ones missing.
+ */
+static unsigned int nvme_nr_poll_queues(struct nvme_dev *dev)
+{
+	unsigned int nr_irq_queues = dev->max_qid - dev->nr_poll_queues;
+
+	if (dev->online_queues - 1 <= nr_irq_queues)
+		return 0;
+	return dev->online_queues - 1 - nr_irq_queues;
+}
+
 /*
  * Return: error value if an error occurred setting up the queues or calling
  * Identify Device.  0 if these succeeded, even if adding some of the
@@ -1555,6 +1911,7 @@ static int nvme_dev_add(struct nvme_dev *dev)
 	if (!dev->ctrl.tagset) {
 		dev->tagset.ops = &nvme_mq_ops;
 		dev->tagset.nr_hw_queues = dev->online_queues - 1;
+		dev->tagset.nr_poll_queues = nvme_nr_poll_queues(dev);
 		dev->tagset.timeout = NVME_IO_TIMEOUT;
 		dev->tagset.numa_node = dev_to_node(dev->dev);
 		dev->tagset.queue_depth =
@@ -1567,7 +1924,8 @@ static int nvme_dev_add(struct nvme_dev *dev)
 			return 0;
 		dev->ctrl.tagset = &dev->tagset;
 	} else {
-		blk_mq_update_nr_hw_queues(&dev->tagset, dev->online_queues - 1);
+		blk_mq_update_nr_poll_queues(&dev->tagset,
+				dev->online_queues - 1, nvme_nr_poll_queues(dev));
 
 		/* Free previously allocated queues that are no longer usable */
 		nvme_free_queues(dev, dev->online_queues);
@@ -1700,6 +2058,16 @@ static void nvme_dev_disable(struct nvme_dev *dev, bool shutdown)
 		if (dev->queue_count)
 			nvme_suspend_queue(dev->queues[0]);
 	} else {
+		/*
+		 * On an orderly shutdown, have the controller let go of the
+		 * host memory buffer before it is disabled.  Set Features
+		 * waits without a time limit, so it's not sent on resets,
+		 * which also come from the timeout handler.  The reset
+		 * itself makes the controller drop the buffer, and it is
+		 * handed back once the controller is up again.
+		 */
+		if (shutdown && dev->host_mem_descs)
+			nvme_set_host_mem(dev, 0);
 		nvme_disable_io_queues(dev, queues);
 		nvme_disable_admin_queue(dev, shutdown);
 	}
@@ -1791,6 +2159,11 @@ static void nvme_reset_work(struct work_struct *work)
 	if (result)
 		goto out;
 
+	if (dev->ctrl.hmpre)
+		nvme_setup_host_mem(dev);
+	else
+		nvme_free_host_mem(dev);
+
 	result = nvme_setup_io_queues(dev);
 	if (result)
 		goto out;
@@ -2005,6 +2378,7 @@ static void nvme_remove(struct pci_dev *pdev)
 	nvme_uninit_ctrl(&dev->ctrl);
 	nvme_dev_disable(dev, true);
 	flush_work(&dev->reset_work);
+	nvme_free_host_mem(dev);
 	nvme_dev_remove_admin(dev);
 	nvme_free_queues(dev, 0);
 	nvme_release_cmb(dev);
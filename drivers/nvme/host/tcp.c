@@ -0,0 +1,1887 @@
+/*
+ * NVMe over Fabrics TCP host code.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/err.h>
+#include <linux/highmem.h>
+#include <linux/blk-mq.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/scatterlist.h>
+#include <linux/inet.h>
+#include <linux/nvme.h>
+#include <linux/nvme-tcp.h>
+#include <net/sock.h>
+#include <net/tcp.h>
+
+#include "nvme.h"
+#include "fabrics.h"
+
+#define NVME_TCP_CONNECT_TIMEOUT_MS	10000		/* 10 seconds */
+
+#define NVME_TCP_MAX_SEGMENTS		256
+
+/*
+ * We handle AEN commands ourselves and don't even let the
+ * block layer know about them.
+ */
+#define NVME_TCP_NR_AEN_COMMANDS	1
+#define NVME_TCP_AQ_BLKMQ_DEPTH		\
+	(NVMF_AQ_DEPTH - NVME_TCP_NR_AEN_COMMANDS)
+
+enum nvme_tcp_send_state {
+	NVME_TCP_SEND_CMD_PDU = 0,
+	NVME_TCP_SEND_H2C_PDU,
+	NVME_TCP_SEND_DATA,
+	NVME_TCP_SEND_IDLE,	/* not queued, nor being sent */
+};
+
+struct nvme_tcp_queue;
+struct nvme_tcp_request {
+	struct nvme_request	req;
+	struct nvme_tcp_cmd_pdu	pdu;
+	struct nvme_tcp_data_pdu data_pdu;
+	struct nvme_tcp_queue	*queue;
+	struct list_head	entry;
+	enum nvme_tcp_send_state state;
+
+	u32			data_len;	/* total payload */
+	u32			pdu_len;	/* in-capsule payload */
+	u32			offset;		/* header bytes already sent */
+	u32			pdu_left;	/* payload left in this pdu */
+	u32			r2t_left;	/* payload left in this r2t */
+	u32			data_sent;
+	u32			data_rcvd;
+	u16			ttag;
+
+	/* position in the payload for the next send or receive */
+	struct scatterlist	*curr_sg;
+	u32			sg_off;
+
+	struct sg_table		sg_table;
+	struct scatterlist	first_sgl[];
+};
+
+enum nvme_tcp_recv_state {
+	NVME_TCP_RECV_PDU = 0,
+	NVME_TCP_RECV_DATA,
+};
+
+enum nvme_tcp_queue_flags {
+	NVME_TCP_Q_ALLOCATED = (1 << 0),
+	NVME_TCP_Q_CONNECTED = (1 << 1),
+	NVME_TCP_Q_LIVE = (1 << 2),
+};
+
+struct nvme_tcp_queue {
+	struct socket		*sock;
+	struct work_struct	io_work;
+	int			io_cpu;
+
+	spinlock_t		lock;
+	struct list_head	send_list;
+	struct nvme_tcp_request	*request;
+
+	/* receive state, only touched under the socket lock */
+	union {
+		struct nvme_tcp_hdr	hdr;
+		struct nvme_tcp_rsp_pdu	rsp;
+		struct nvme_tcp_r2t_pdu	r2t;
+		struct nvme_tcp_data_pdu data;
+		struct nvme_tcp_term_pdu term;
+	} pdu;
+	size_t			pdu_remaining;
+	size_t			pdu_offset;
+	size_t			data_remaining;
+	struct nvme_tcp_request	*rcv_req;
+	u8			rcv_flags;
+	enum nvme_tcp_recv_state rcv_state;
+	bool			rd_enabled;
+
+	int			queue_size;
+	size_t			cmnd_capsule_len;
+	u32			maxh2cdata;
+	struct nvme_tcp_ctrl	*ctrl;
+	unsigned long		flags;
+
+	void (*state_change)(struct sock *);
+	void (*data_ready)(struct sock *);
+	void (*write_space)(struct sock *);
+};
+
+struct nvme_tcp_ctrl {
+	/* read only in the hot path */
+	struct nvme_tcp_queue	*queues;
+	u32			queue_count;
+
+	/* other member variables */
+	struct blk_mq_tag_set	tag_set;
+	struct work_struct	delete_work;
+	struct work_struct	reset_work;
+	struct work_struct	err_work;
+
+	struct nvme_tcp_request	async_req;
+
+	int			reconnect_delay;
+	struct delayed_work	reconnect_work;
+
+	struct list_head	list;
+
+	struct blk_mq_tag_set	admin_tag_set;
+
+	u64			cap;
+
+	struct sockaddr_storage	addr;
+	struct sockaddr_storage	src_addr;
+
+	struct nvme_ctrl	ctrl;
+};
+
+static inline struct nvme_tcp_ctrl *to_tcp_ctrl(struct nvme_ctrl *ctrl)
+{
+	return container_of(ctrl, struct nvme_tcp_ctrl, ctrl);
+}
+
+static LIST_HEAD(nvme_tcp_ctrl_list);
+static DEFINE_MUTEX(nvme_tcp_ctrl_mutex);
+
+static struct workqueue_struct *nvme_tcp_wq;
+
+static int __nvme_tcp_del_ctrl(struct nvme_tcp_ctrl *ctrl);
+
+static inline int nvme_tcp_queue_idx(struct nvme_tcp_queue *queue)
+{
+	return queue - queue->ctrl->queues;
+}
+
+static inline size_t nvme_tcp_inline_data_size(struct nvme_tcp_queue *queue)
+{
+	return queue->cmnd_capsule_len - sizeof(struct nvme_command);
+}
+
+static struct blk_mq_tags *nvme_tcp_tagset(struct nvme_tcp_queue *queue)
+{
+	u32 queue_idx = nvme_tcp_queue_idx(queue);
+
+	if (queue_idx == 0)
+		return queue->ctrl->admin_tag_set.tags[queue_idx];
+	return queue->ctrl->tag_set.tags[queue_idx - 1];
+}
+
+/*
+ * Payload iterator.  A scatterlist entry built by blk_rq_map_sg() may span
+ * several physically contiguous pages, so hand out one page at a time to
+ * keep kmap_atomic() and sendpage happy on highmem configurations.
+ */
+static void nvme_tcp_seek(struct nvme_tcp_request *req, u32 offset)
+{
+	struct scatterlist *sg = req->sg_table.sgl;
+
+	while (sg && offset >= sg->length) {
+		offset -= sg->length;
+		sg = sg_next(sg);
+	}
+	req->curr_sg = sg;
+	req->sg_off = offset;
+}
+
+static struct page *nvme_tcp_curr_page(struct nvme_tcp_request *req,
+		size_t *poff, size_t *len)
+{
+	struct scatterlist *sg = req->curr_sg;
+	size_t off = sg->offset + req->sg_off;
+
+	*poff = offset_in_page(off);
+	*len = min_t(size_t, sg->length - req->sg_off, PAGE_SIZE - *poff);
+	return nth_page(sg_page(sg), off >> PAGE_SHIFT);
+}
+
+static void nvme_tcp_advance(struct nvme_tcp_request *req, size_t len)
+{
+	req->sg_off += len;
+	if (req->sg_off == req->curr_sg->length) {
+		req->curr_sg = sg_next(req->curr_sg);
+		req->sg_off = 0;
+	}
+}
+
+static void nvme_tcp_error_recovery(struct nvme_tcp_ctrl *ctrl)
+{
+	if (!nvme_change_ctrl_state(&ctrl->ctrl, NVME_CTRL_RECONNECTING))
+		return;
+
+	queue_work(nvme_tcp_wq, &ctrl->err_work);
+}
+
+static void nvme_tcp_queue_request(struct nvme_tcp_request *req)
+{
+	struct nvme_tcp_queue *queue = req->queue;
+
+	spin_lock(&queue->lock);
+	list_add_tail(&req->entry, &queue->send_list);
+	spin_unlock(&queue->lock);
+
+	queue_work_on(queue->io_cpu, nvme_tcp_wq, &queue->io_work);
+}
+
+static struct nvme_tcp_request *
+nvme_tcp_fetch_request(struct nvme_tcp_queue *queue)
+{
+	struct nvme_tcp_request *req;
+
+	spin_lock(&queue->lock);
+	req = list_first_entry_or_null(&queue->send_list,
+			struct nvme_tcp_request, entry);
+	if (req)
+		list_del(&req->entry);
+	spin_unlock(&queue->lock);
+
+	return req;
+}
+
+static void nvme_tcp_init_recv_ctx(struct nvme_tcp_queue *queue)
+{
+	queue->pdu_remaining = sizeof(struct nvme_tcp_rsp_pdu);
+	queue->pdu_offset = 0;
+	queue->data_remaining = 0;
+	queue->rcv_req = NULL;
+	queue->rcv_state = NVME_TCP_RECV_PDU;
+}
+
+static struct nvme_tcp_request *nvme_tcp_find_request(
+		struct nvme_tcp_queue *queue, u16 command_id)
+{
+	struct request *rq;
+
+	rq = blk_mq_tag_to_rq(nvme_tcp_tagset(queue), command_id);
+	if (!rq) {
+		dev_err(queue->ctrl->ctrl.device,
+			"queue %d tag 0x%x not found\n",
+			nvme_tcp_queue_idx(queue), command_id);
+		return NULL;
+	}
+	return blk_mq_rq_to_pdu(rq);
+}
+
+static int nvme_tcp_handle_comp(struct nvme_tcp_queue *queue,
+		struct nvme_completion *cqe)
+{
+	struct nvme_tcp_request *req;
+
+	/*
+	 * AEN requests are special as they don't time out and can
+	 * survive any kind of queue freeze and often don't respond to
+	 * aborts.  We don't even bother to allocate a struct request
+	 * for them but rather special case them here.
+	 */
+	if (unlikely(nvme_tcp_queue_idx(queue) == 0 &&
+			cqe->command_id >= NVME_TCP_AQ_BLKMQ_DEPTH)) {
+		nvme_complete_async_event(&queue->ctrl->ctrl, cqe->status,
+				&cqe->result);
+		return 0;
+	}
+
+	req = nvme_tcp_find_request(queue, cqe->command_id);
+	if (!req)
+		return -EINVAL;
+
+	req->req.result = cqe->result;
+	blk_mq_complete_request(blk_mq_rq_from_pdu(req),
+			le16_to_cpu(cqe->status) >> 1);
+	return 0;
+}
+
+static int nvme_tcp_handle_c2h_data(struct nvme_tcp_queue *queue,
+		struct nvme_tcp_data_pdu *pdu)
+{
+	struct nvme_tcp_request *req;
+	u32 offset = le32_to_cpu(pdu->data_offset);
+	u32 len = le32_to_cpu(pdu->data_length);
+
+	req = nvme_tcp_find_request(queue, pdu->command_id);
+	if (!req)
+		return -EINVAL;
+
+	if (rq_data_dir(blk_mq_rq_from_pdu(req)) != READ) {
+		dev_err(queue->ctrl->ctrl.device,
+			"c2h data for non-read tag 0x%x\n", pdu->command_id);
+		return -EPROTO;
+	}
+
+	/* we asked for no padding, and data has to arrive in order */
+	if (pdu->hdr.pdo != pdu->hdr.hlen ||
+	    le32_to_cpu(pdu->hdr.plen) < pdu->hdr.hlen ||
+	    le32_to_cpu(pdu->hdr.plen) - pdu->hdr.hlen != len) {
+		dev_err(queue->ctrl->ctrl.device,
+			"malformed c2h data pdu for tag 0x%x\n",
+			pdu->command_id);
+		return -EPROTO;
+	}
+	if (offset != req->data_rcvd || len > req->data_len - offset) {
+		dev_err(queue->ctrl->ctrl.device,
+			"c2h data for tag 0x%x at %u+%u, expected %u of %u\n",
+			pdu->command_id, offset, len, req->data_rcvd,
+			req->data_len);
+		return -EPROTO;
+	}
+
+	queue->rcv_req = req;
+	queue->rcv_flags = pdu->hdr.flags;
+	queue->data_remaining = len;
+	queue->rcv_state = NVME_TCP_RECV_DATA;
+	return 0;
+}
+
+static int nvme_tcp_handle_r2t(struct nvme_tcp_queue *queue,
+		struct nvme_tcp_r2t_pdu *pdu)
+{
+	struct nvme_tcp_request *req;
+	u32 offset = le32_to_cpu(pdu->r2t_offset);
+	u32 len = le32_to_cpu(pdu->r2t_length);
+
+	req = nvme_tcp_find_request(queue, pdu->command_id);
+	if (!req)
+		return -EINVAL;
+
+	/*
+	 * Only a write with data outside the capsule gets r2ts, and only
+	 * while none is being served: requeueing a request that is still
+	 * on the send list would corrupt it.
+	 */
+	if (rq_data_dir(blk_mq_rq_from_pdu(req)) != WRITE ||
+	    req->data_len <= req->pdu_len ||
+	    req->state != NVME_TCP_SEND_IDLE) {
+		dev_err(queue->ctrl->ctrl.device,
+			"unexpected r2t for tag 0x%x\n", pdu->command_id);
+		return -EPROTO;
+	}
+
+	if (!len || offset > req->data_len || len > req->data_len - offset) {
+		dev_err(queue->ctrl->ctrl.device,
+			"r2t for tag 0x%x at %u+%u out of range %u\n",
+			pdu->command_id, offset, len, req->data_len);
+		return -EPROTO;
+	}
+
+	req->ttag = pdu->ttag;
+	req->data_sent = offset;
+	req->r2t_left = len;
+	req->offset = 0;
+	req->state = NVME_TCP_SEND_H2C_PDU;
+	nvme_tcp_seek(req, offset);
+	nvme_tcp_queue_request(req);
+	return 0;
+}
+
+static int nvme_tcp_recv_pdu(struct nvme_tcp_queue *queue,
+		struct sk_buff *skb, unsigned int *offset, size_t *len)
+{
+	struct nvme_tcp_hdr *hdr = &queue->pdu.hdr;
+	size_t rcv_len = min_t(size_t, *len, queue->pdu_remaining);
+	int ret;
+
+	ret = skb_copy_bits(skb, *offset, (u8 *)&queue->pdu +
+			queue->pdu_offset, rcv_len);
+	if (unlikely(ret))
+		return ret;
+
+	queue->pdu_remaining -= rcv_len;
+	queue->pdu_offset += rcv_len;
+	*offset += rcv_len;
+	*len -= rcv_len;
+	if (queue->pdu_remaining)
+		return 0;
+
+	if (unlikely(hdr->hlen != sizeof(struct nvme_tcp_rsp_pdu))) {
+		dev_err(queue->ctrl->ctrl.device,
+			"pdu type %d has unexpected header length %d\n",
+			hdr->type, hdr->hlen);
+		return -EPROTO;
+	}
+
+	switch (hdr->type) {
+	case nvme_tcp_c2h_data:
+		return nvme_tcp_handle_c2h_data(queue, &queue->pdu.data);
+	case nvme_tcp_rsp:
+		nvme_tcp_init_recv_ctx(queue);
+		return nvme_tcp_handle_comp(queue, &queue->pdu.rsp.cqe);
+	case nvme_tcp_r2t:
+		nvme_tcp_init_recv_ctx(queue);
+		return nvme_tcp_handle_r2t(queue, &queue->pdu.r2t);
+	case nvme_tcp_c2h_term:
+		dev_err(queue->ctrl->ctrl.device,
+			"controller terminated queue %d, status %#x\n",
+			nvme_tcp_queue_idx(queue),
+			le16_to_cpu(queue->pdu.term.fes));
+		return -ECONNRESET;
+	default:
+		dev_err(queue->ctrl->ctrl.device,
+			"unsupported pdu type (%d)\n", hdr->type);
+		return -EINVAL;
+	}
+}
+
+static int nvme_tcp_recv_data(struct nvme_tcp_queue *queue,
+		struct sk_buff *skb, unsigned int *offset, size_t *len)
+{
+	struct nvme_tcp_request *req = queue->rcv_req;
+
+	while (*len && queue->data_remaining) {
+		struct page *page;
+		size_t poff, plen;
+		void *vaddr;
+		int ret;
+
+		page = nvme_tcp_curr_page(req, &poff, &plen);
+		plen = min3(plen, *len, queue->data_remaining);
+
+		vaddr = kmap_atomic(page);
+		ret = skb_copy_bits(skb, *offset, vaddr + poff, plen);
+		kunmap_atomic(vaddr);
+		if (unlikely(ret))
+			return ret;
+
+		nvme_tcp_advance(req, plen);
+		req->data_rcvd += plen;
+		queue->data_remaining -= plen;
+		*offset += plen;
+		*len -= plen;
+	}
+
+	if (queue->data_remaining)
+		return 0;
+
+	/* the controller may skip the response capsule on success */
+	if (queue->rcv_flags & NVME_TCP_F_DATA_SUCCESS) {
+		if (unlikely(!(queue->rcv_flags & NVME_TCP_F_DATA_LAST)))
+			return -EPROTO;
+		req->req.result.u64 = 0;
+		blk_mq_complete_request(blk_mq_rq_from_pdu(req), 0);
+	}
+
+	nvme_tcp_init_recv_ctx(queue);
+	return 0;
+}
+
+static int nvme_tcp_recv_skb(read_descriptor_t *desc, struct sk_buff *skb,
+		unsigned int offset, size_t len)
+{
+	struct nvme_tcp_queue *queue = desc->arg.data;
+	size_t consumed = len;
+	int result;
+
+	while (len) {
+		switch (queue->rcv_state) {
+		case NVME_TCP_RECV_PDU:
+			result = nvme_tcp_recv_pdu(queue, skb, &offset, &len);
+			break;
+		case NVME_TCP_RECV_DATA:
+			result = nvme_tcp_recv_data(queue, skb, &offset, &len);
+			break;
+		default:
+			result = -EFAULT;
+		}
+		if (unlikely(result)) {
+			dev_err(queue->ctrl->ctrl.device,
+				"receive failed on queue %d: %d\n",
+				nvme_tcp_queue_idx(queue), result);
+			queue->rd_enabled = false;
+			nvme_tcp_error_recovery(queue->ctrl);
+			return result;
+		}
+	}
+
+	return consumed;
+}
+
+static int nvme_tcp_try_recv(struct nvme_tcp_queue *queue)
+{
+	struct sock *sk = queue->sock->sk;
+	read_descriptor_t rd_desc;
+	int consumed;
+
+	if (unlikely(!queue->rd_enabled))
+		return 0;
+
+	rd_desc.arg.data = queue;
+	rd_desc.count = 1;
+	lock_sock(sk);
+	consumed = tcp_read_sock(sk, &rd_desc, nvme_tcp_recv_skb);
+	release_sock(sk);
+	return consumed;
+}
+
+static int nvme_tcp_send_hdr(struct nvme_tcp_queue *queue,
+		struct nvme_tcp_request *req, void *hdr, size_t len, bool more)
+{
+	while (req->offset < len) {
+		struct msghdr msg = {
+			.msg_flags = MSG_DONTWAIT | (more ? MSG_MORE : 0),
+		};
+		struct kvec iov = {
+			.iov_base = hdr + req->offset,
+			.iov_len = len - req->offset,
+		};
+		int ret;
+
+		ret = kernel_sendmsg(queue->sock, &msg, &iov, 1, iov.iov_len);
+		if (ret <= 0)
+			return ret ? ret : -EAGAIN;
+		req->offset += ret;
+	}
+
+	return 0;
+}
+
+static int nvme_tcp_send_data(struct nvme_tcp_queue *queue,
+		struct nvme_tcp_request *req)
+{
+	while (req->pdu_left) {
+		struct page *page;
+		size_t poff, len;
+		int flags = MSG_DONTWAIT;
+		int ret;
+
+		page = nvme_tcp_curr_page(req, &poff, &len);
+		len = min_t(size_t, len, req->pdu_left);
+		if (len < req->pdu_left || req->r2t_left)
+			flags |= MSG_MORE;
+
+		/* slab pages (e.g. the connect data) must not be referenced */
+		if (PageSlab(page))
+			ret = sock_no_sendpage(queue->sock, page, poff, len,
+					flags);
+		else
+			ret = kernel_sendpage(queue->sock, page, poff, len,
+					flags);
+		if (ret <= 0)
+			return ret ? ret : -EAGAIN;
+
+		nvme_tcp_advance(req, ret);
+		req->data_sent += ret;
+		req->pdu_left -= ret;
+	}
+
+	return 0;
+}
+
+static void nvme_tcp_setup_h2c_data_pdu(struct nvme_tcp_queue *queue,
+		struct nvme_tcp_request *req)
+{
+	struct nvme_tcp_data_pdu *pdu = &req->data_pdu;
+	u32 len = min(req->r2t_left, queue->maxh2cdata);
+
+	req->r2t_left -= len;
+	req->pdu_left = len;
+	req->offset = 0;
+
+	memset(pdu, 0, sizeof(*pdu));
+	pdu->hdr.type = nvme_tcp_h2c_data;
+	pdu->hdr.flags = req->r2t_left ? 0 : NVME_TCP_F_DATA_LAST;
+	pdu->hdr.hlen = sizeof(*pdu);
+	pdu->hdr.pdo = sizeof(*pdu);
+	pdu->hdr.plen = cpu_to_le32(sizeof(*pdu) + len);
+	pdu->command_id = req->pdu.cmd.common.command_id;
+	pdu->ttag = req->ttag;
+	pdu->data_offset = cpu_to_le32(req->data_sent);
+	pdu->data_length = cpu_to_le32(len);
+}
+
+/*
+ * Push out as much of the current request as the socket will take.  Returns
+ * a positive value if a request was completely handed to the socket, 0 if
+ * there was nothing to send and a negative errno (-EAGAIN when the socket
+ * is full) otherwise.
+ */
+static int nvme_tcp_try_send(struct nvme_tcp_queue *queue)
+{
+	struct nvme_tcp_request *req;
+	int ret;
+
+	if (!queue->request) {
+		queue->request = nvme_tcp_fetch_request(queue);
+		if (!queue->request)
+			return 0;
+	}
+	req = queue->request;
+
+	if (req->state == NVME_TCP_SEND_CMD_PDU) {
+		ret = nvme_tcp_send_hdr(queue, req, &req->pdu,
+				sizeof(req->pdu), req->pdu_len);
+		if (ret)
+			return ret;
+		if (!req->pdu_len)
+			goto done;
+		req->pdu_left = req->pdu_len;
+		req->state = NVME_TCP_SEND_DATA;
+	}
+
+	for (;;) {
+		if (req->state == NVME_TCP_SEND_H2C_PDU) {
+			if (!req->offset && !req->pdu_left)
+				nvme_tcp_setup_h2c_data_pdu(queue, req);
+			ret = nvme_tcp_send_hdr(queue, req, &req->data_pdu,
+					sizeof(req->data_pdu), true);
+			if (ret)
+				return ret;
+			req->state = NVME_TCP_SEND_DATA;
+		}
+
+		ret = nvme_tcp_send_data(queue, req);
+		if (ret)
+			return ret;
+		if (!req->r2t_left)
+			break;
+		req->offset = 0;
+		req->state = NVME_TCP_SEND_H2C_PDU;
+	}
+
+done:
+	req->state = NVME_TCP_SEND_IDLE;
+	queue->request = NULL;
+	return 1;
+}
+
+static void nvme_tcp_io_work(struct work_struct *w)
+{
+	struct nvme_tcp_queue *queue =
+		container_of(w, struct nvme_tcp_queue, io_work);
+	unsigned long deadline = jiffies + msecs_to_jiffies(1);
+
+	do {
+		bool pending = false;
+		int result;
+
+		result = nvme_tcp_try_send(queue);
+		if (result > 0) {
+			pending = true;
+		} else if (unlikely(result < 0 && result != -EAGAIN)) {
+			dev_err(queue->ctrl->ctrl.device,
+				"failed to send on queue %d: %d\n",
+				nvme_tcp_queue_idx(queue), result);
+			nvme_tcp_error_recovery(queue->ctrl);
+			return;
+		}
+
+		result = nvme_tcp_try_recv(queue);
+		if (result > 0)
+			pending = true;
+		else if (unlikely(result < 0))
+			return;
+
+		if (!pending)
+			return;
+	} while (!time_after(jiffies, deadline));
+
+	/* let others run, we'll be back */
+	queue_work_on(queue->io_cpu, nvme_tcp_wq, &queue->io_work);
+}
+
+static void nvme_tcp_data_ready(struct sock *sk)
+{
+	struct nvme_tcp_queue *queue;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	queue = sk->sk_user_data;
+	if (likely(queue && queue->rd_enabled))
+		queue_work_on(queue->io_cpu, nvme_tcp_wq, &queue->io_work);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void nvme_tcp_write_space(struct sock *sk)
+{
+	struct nvme_tcp_queue *queue;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	queue = sk->sk_user_data;
+	if (likely(queue && sk_stream_is_writeable(sk))) {
+		clear_bit(SOCK_NOSPACE, &sk->sk_socket->flags);
+		queue_work_on(queue->io_cpu, nvme_tcp_wq, &queue->io_work);
+	}
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void nvme_tcp_state_change(struct sock *sk)
+{
+	struct nvme_tcp_queue *queue;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	queue = sk->sk_user_data;
+	if (!queue)
+		goto done;
+
+	switch (sk->sk_state) {
+	case TCP_CLOSE:
+	case TCP_CLOSE_WAIT:
+	case TCP_LAST_ACK:
+	case TCP_FIN_WAIT1:
+	case TCP_FIN_WAIT2:
+		nvme_tcp_error_recovery(queue->ctrl);
+		break;
+	default:
+		break;
+	}
+
+	queue->state_change(sk);
+done:
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void nvme_tcp_set_sock_calls(struct nvme_tcp_queue *queue)
+{
+	struct sock *sk = queue->sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_user_data = queue;
+	queue->state_change = sk->sk_state_change;
+	queue->data_ready = sk->sk_data_ready;
+	queue->write_space = sk->sk_write_space;
+	sk->sk_data_ready = nvme_tcp_data_ready;
+	sk->sk_state_change = nvme_tcp_state_change;
+	sk->sk_write_space = nvme_tcp_write_space;
+	queue->rd_enabled = true;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void nvme_tcp_restore_sock_calls(struct nvme_tcp_queue *queue)
+{
+	struct sock *sk = queue->sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_user_data = NULL;
+	sk->sk_data_ready = queue->data_ready;
+	sk->sk_state_change = queue->state_change;
+	sk->sk_write_space = queue->write_space;
+	queue->rd_enabled = false;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+/*
+ * Spread the queues over the online CPUs the same way blk-mq spreads its
+ * hardware contexts, so that submission and receive processing for an I/O
+ * queue normally happen on the same CPU.  The admin queue shares the CPU
+ * of the first I/O queue.
+ */
+static void nvme_tcp_set_queue_io_cpu(struct nvme_tcp_queue *queue)
+{
+	int qid = nvme_tcp_queue_idx(queue);
+	int n = (qid ? qid - 1 : 0) % num_online_cpus();
+	int cpu;
+
+	queue->io_cpu = WORK_CPU_UNBOUND;
+	for_each_online_cpu(cpu) {
+		if (n-- == 0) {
+			queue->io_cpu = cpu;
+			break;
+		}
+	}
+}
+
+static int nvme_tcp_init_connection(struct nvme_tcp_queue *queue)
+{
+	struct nvme_tcp_icreq_pdu *icreq;
+	struct nvme_tcp_icresp_pdu *icresp;
+	struct msghdr msg = {};
+	struct kvec iov;
+	int ret;
+
+	icreq = kzalloc(sizeof(*icreq), GFP_KERNEL);
+	if (!icreq)
+		return -ENOMEM;
+
+	icresp = kzalloc(sizeof(*icresp), GFP_KERNEL);
+	if (!icresp) {
+		ret = -ENOMEM;
+		goto free_icreq;
+	}
+
+	icreq->hdr.type = nvme_tcp_icreq;
+	icreq->hdr.hlen = sizeof(*icreq);
+	icreq->hdr.pdo = 0;
+	icreq->hdr.plen = cpu_to_le32(icreq->hdr.hlen);
+	icreq->pfv = cpu_to_le16(NVME_TCP_PFV_1_0);
+	icreq->maxr2t = 0; /* single inflight r2t supported */
+	icreq->hpda = 0; /* no alignment constraint */
+	icreq->digest = 0; /* no header or data digests */
+
+	iov.iov_base = icreq;
+	iov.iov_len = sizeof(*icreq);
+	ret = kernel_sendmsg(queue->sock, &msg, &iov, 1, iov.iov_len);
+	if (ret < 0)
+		goto free_icresp;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = icresp;
+	iov.iov_len = sizeof(*icresp);
+	ret = kernel_recvmsg(queue->sock, &msg, &iov, 1,
+			iov.iov_len, MSG_WAITALL);
+	if (ret < 0)
+		goto free_icresp;
+
+	ret = -EINVAL;
+	if (icresp->hdr.type != nvme_tcp_icresp ||
+	    icresp->hdr.hlen != sizeof(*icresp) ||
+	    le32_to_cpu(icresp->hdr.plen) != sizeof(*icresp)) {
+		pr_err("queue %d: bad icresp pdu\n", nvme_tcp_queue_idx(queue));
+		goto free_icresp;
+	}
+
+	if (icresp->pfv != cpu_to_le16(NVME_TCP_PFV_1_0)) {
+		pr_err("queue %d: bad pfv %d\n", nvme_tcp_queue_idx(queue),
+			le16_to_cpu(icresp->pfv));
+		goto free_icresp;
+	}
+
+	if (icresp->digest || icresp->cpda) {
+		pr_err("queue %d: digests (%#x) or cpda (%d) not supported\n",
+			nvme_tcp_queue_idx(queue), icresp->digest,
+			icresp->cpda);
+		goto free_icresp;
+	}
+
+	queue->maxh2cdata = le32_to_cpu(icresp->maxdata);
+	if (queue->maxh2cdata < 4096 || queue->maxh2cdata % 4) {
+		pr_err("queue %d: invalid maxdata %u\n",
+			nvme_tcp_queue_idx(queue), queue->maxh2cdata);
+		goto free_icresp;
+	}
+
+	ret = 0;
+free_icresp:
+	kfree(icresp);
+free_icreq:
+	kfree(icreq);
+	return ret;
+}
+
+static int nvme_tcp_init_queue(struct nvme_tcp_ctrl *ctrl,
+		int idx, size_t queue_size)
+{
+	struct nvme_tcp_queue *queue = &ctrl->queues[idx];
+	long timeo = msecs_to_jiffies(NVME_TCP_CONNECT_TIMEOUT_MS);
+	int opt = 1;
+	int ret;
+
+	queue->ctrl = ctrl;
+	queue->flags = 0;
+	queue->request = NULL;
+	INIT_LIST_HEAD(&queue->send_list);
+	spin_lock_init(&queue->lock);
+	INIT_WORK(&queue->io_work, nvme_tcp_io_work);
+	queue->queue_size = queue_size;
+
+	if (idx > 0)
+		queue->cmnd_capsule_len = ctrl->ctrl.ioccsz * 16;
+	else
+		queue->cmnd_capsule_len = sizeof(struct nvme_command);
+
+	ret = sock_create_kern(&init_net, ctrl->addr.ss_family,
+			SOCK_STREAM, IPPROTO_TCP, &queue->sock);
+	if (ret) {
+		dev_err(ctrl->ctrl.device,
+			"failed to create socket: %d\n", ret);
+		return ret;
+	}
+
+	ret = kernel_setsockopt(queue->sock, IPPROTO_TCP, TCP_NODELAY,
+			(char *)&opt, sizeof(opt));
+	if (ret)
+		goto err_sock;
+
+	/* the blocking connection setup must not hang forever */
+	queue->sock->sk->sk_rcvtimeo = timeo;
+	queue->sock->sk->sk_sndtimeo = timeo;
+	queue->sock->sk->sk_allocation = GFP_NOIO;
+
+	nvme_tcp_set_queue_io_cpu(queue);
+	nvme_tcp_init_recv_ctx(queue);
+
+	if (ctrl->ctrl.opts->mask & NVMF_OPT_HOST_TRADDR) {
+		ret = kernel_bind(queue->sock, (struct sockaddr *)&ctrl->src_addr,
+				sizeof(ctrl->src_addr));
+		if (ret) {
+			dev_err(ctrl->ctrl.device,
+				"failed to bind queue %d socket %d\n",
+				idx, ret);
+			goto err_sock;
+		}
+	}
+
+	ret = kernel_connect(queue->sock, (struct sockaddr *)&ctrl->addr,
+			sizeof(ctrl->addr), 0);
+	if (ret) {
+		dev_err(ctrl->ctrl.device,
+			"failed to connect socket: %d\n", ret);
+		goto err_sock;
+	}
+
+	ret = nvme_tcp_init_connection(queue);
+	if (ret)
+		goto err_shutdown;
+
+	set_bit(NVME_TCP_Q_ALLOCATED, &queue->flags);
+	nvme_tcp_set_sock_calls(queue);
+	set_bit(NVME_TCP_Q_CONNECTED, &queue->flags);
+
+	return 0;
+
+err_shutdown:
+	kernel_sock_shutdown(queue->sock, SHUT_RDWR);
+err_sock:
+	sock_release(queue->sock);
+	queue->sock = NULL;
+	return ret;
+}
+
+static void nvme_tcp_stop_queue(struct nvme_tcp_queue *queue)
+{
+	clear_bit(NVME_TCP_Q_LIVE, &queue->flags);
+	if (!test_and_clear_bit(NVME_TCP_Q_CONNECTED, &queue->flags))
+		return;
+
+	kernel_sock_shutdown(queue->sock, SHUT_RDWR);
+	nvme_tcp_restore_sock_calls(queue);
+	cancel_work_sync(&queue->io_work);
+}
+
+static void nvme_tcp_free_queue(struct nvme_tcp_queue *queue)
+{
+	if (!test_and_clear_bit(NVME_TCP_Q_ALLOCATED, &queue->flags))
+		return;
+
+	sock_release(queue->sock);
+	queue->sock = NULL;
+}
+
+static void nvme_tcp_stop_and_free_queue(struct nvme_tcp_queue *queue)
+{
+	nvme_tcp_stop_queue(queue);
+	nvme_tcp_free_queue(queue);
+}
+
+static void nvme_tcp_free_io_queues(struct nvme_tcp_ctrl *ctrl)
+{
+	int i;
+
+	for (i = 1; i < ctrl->queue_count; i++)
+		nvme_tcp_stop_and_free_queue(&ctrl->queues[i]);
+}
+
+static int nvme_tcp_connect_io_queues(struct nvme_tcp_ctrl *ctrl)
+{
+	int i, ret = 0;
+
+	for (i = 1; i < ctrl->queue_count; i++) {
+		ret = nvmf_connect_io_queue(&ctrl->ctrl, i);
+		if (ret) {
+			dev_info(ctrl->ctrl.device,
+				"failed to connect i/o queue: %d\n", ret);
+			goto out_free_queues;
+		}
+		set_bit(NVME_TCP_Q_LIVE, &ctrl->queues[i].flags);
+	}
+
+	return 0;
+
+out_free_queues:
+	nvme_tcp_free_io_queues(ctrl);
+	return ret;
+}
+
+static int nvme_tcp_init_io_queues(struct nvme_tcp_ctrl *ctrl)
+{
+	int i, ret;
+
+	for (i = 1; i < ctrl->queue_count; i++) {
+		ret = nvme_tcp_init_queue(ctrl, i,
+					  ctrl->ctrl.opts->queue_size);
+		if (ret) {
+			dev_info(ctrl->ctrl.device,
+				"failed to initialize i/o queue: %d\n", ret);
+			goto out_free_queues;
+		}
+	}
+
+	return 0;
+
+out_free_queues:
+	for (i--; i >= 1; i--)
+		nvme_tcp_stop_and_free_queue(&ctrl->queues[i]);
+
+	return ret;
+}
+
+static void nvme_tcp_destroy_admin_queue(struct nvme_tcp_ctrl *ctrl)
+{
+	nvme_tcp_stop_and_free_queue(&ctrl->queues[0]);
+	blk_cleanup_queue(ctrl->ctrl.admin_q);
+	blk_mq_free_tag_set(&ctrl->admin_tag_set);
+}
+
+static void nvme_tcp_free_ctrl(struct nvme_ctrl *nctrl)
+{
+	struct nvme_tcp_ctrl *ctrl = to_tcp_ctrl(nctrl);
+
+	if (list_empty(&ctrl->list))
+		goto free_ctrl;
+
+	mutex_lock(&nvme_tcp_ctrl_mutex);
+	list_del(&ctrl->list);
+	mutex_unlock(&nvme_tcp_ctrl_mutex);
+
+	if (ctrl->ctrl.tagset) {
+		blk_cleanup_queue(ctrl->ctrl.connect_q);
+		blk_mq_free_tag_set(&ctrl->tag_set);
+	}
+	kfree(ctrl->queues);
+	nvmf_free_options(nctrl->opts);
+free_ctrl:
+	kfree(ctrl);
+}
+
+static void nvme_tcp_reconnect_ctrl_work(struct work_struct *work)
+{
+	struct nvme_tcp_ctrl *ctrl = container_of(to_delayed_work(work),
+			struct nvme_tcp_ctrl, reconnect_work);
+	bool changed;
+	int ret;
+
+	if (ctrl->queue_count > 1)
+		nvme_tcp_free_io_queues(ctrl);
+
+	nvme_tcp_stop_and_free_queue(&ctrl->queues[0]);
+
+	ret = nvme_tcp_init_queue(ctrl, 0, NVMF_AQ_DEPTH);
+	if (ret)
+		goto requeue;
+
+	blk_mq_start_stopped_hw_queues(ctrl->ctrl.admin_q, true);
+
+	ret = nvmf_connect_admin_queue(&ctrl->ctrl);
+	if (ret)
+		goto stop_admin_q;
+
+	set_bit(NVME_TCP_Q_LIVE, &ctrl->queues[0].flags);
+
+	ret = nvme_enable_ctrl(&ctrl->ctrl, ctrl->cap);
+	if (ret)
+		goto stop_admin_q;
+
+	nvme_start_keep_alive(&ctrl->ctrl);
+
+	if (ctrl->queue_count > 1) {
+		ret = nvme_tcp_init_io_queues(ctrl);
+		if (ret)
+			goto stop_admin_q;
+
+		ret = nvme_tcp_connect_io_queues(ctrl);
+		if (ret)
+			goto stop_admin_q;
+	}
+
+	changed = nvme_change_ctrl_state(&ctrl->ctrl, NVME_CTRL_LIVE);
+	WARN_ON_ONCE(!changed);
+
+	if (ctrl->queue_count > 1) {
+		nvme_start_queues(&ctrl->ctrl);
+		nvme_queue_scan(&ctrl->ctrl);
+		nvme_queue_async_events(&ctrl->ctrl);
+	}
+
+	dev_info(ctrl->ctrl.device, "Successfully reconnected\n");
+
+	return;
+
+stop_admin_q:
+	blk_mq_stop_hw_queues(ctrl->ctrl.admin_q);
+requeue:
+	/* Make sure we are not resetting/deleting */
+	if (ctrl->ctrl.state == NVME_CTRL_RECONNECTING) {
+		dev_info(ctrl->ctrl.device,
+			"Failed reconnect attempt, requeueing...\n");
+		queue_delayed_work(nvme_tcp_wq, &ctrl->reconnect_work,
+					ctrl->reconnect_delay * HZ);
+	}
+}
+
+static void nvme_tcp_error_recovery_work(struct work_struct *work)
+{
+	struct nvme_tcp_ctrl *ctrl = container_of(work,
+			struct nvme_tcp_ctrl, err_work);
+	int i;
+
+	nvme_stop_keep_alive(&ctrl->ctrl);
+
+	if (ctrl->queue_count > 1)
+		nvme_stop_queues(&ctrl->ctrl);
+	blk_mq_stop_hw_queues(ctrl->ctrl.admin_q);
+
+	/*
+	 * Unlike RDMA there is nothing to flush in hardware, but io_work
+	 * must be gone before the requests it may still reference are
+	 * failed below.
+	 */
+	for (i = 0; i < ctrl->queue_count; i++)
+		nvme_tcp_stop_queue(&ctrl->queues[i]);
+
+	/* We must take care of fastfail/requeue all our inflight requests */
+	if (ctrl->queue_count > 1)
+		blk_mq_tagset_busy_iter(&ctrl->tag_set,
+					nvme_cancel_request, &ctrl->ctrl);
+	blk_mq_tagset_busy_iter(&ctrl->admin_tag_set,
+				nvme_cancel_request, &ctrl->ctrl);
+
+	dev_info(ctrl->ctrl.device, "reconnecting in %d seconds\n",
+		ctrl->reconnect_delay);
+
+	queue_delayed_work(nvme_tcp_wq, &ctrl->reconnect_work,
+				ctrl->reconnect_delay * HZ);
+}
+
+static int nvme_tcp_init_request(void *data, struct request *rq,
+				unsigned int hctx_idx, unsigned int rq_idx,
+				unsigned int numa_node)
+{
+	struct nvme_tcp_ctrl *ctrl = data;
+	struct nvme_tcp_request *req = blk_mq_rq_to_pdu(rq);
+
+	BUG_ON(hctx_idx + 1 >= ctrl->queue_count);
+
+	req->queue = &ctrl->queues[hctx_idx + 1];
+	return 0;
+}
+
+static int nvme_tcp_init_admin_request(void *data, struct request *rq,
+				unsigned int hctx_idx, unsigned int rq_idx,
+				unsigned int numa_node)
+{
+	struct nvme_tcp_ctrl *ctrl = data;
+	struct nvme_tcp_request *req = blk_mq_rq_to_pdu(rq);
+
+	req->queue = &ctrl->queues[0];
+	return 0;
+}
+
+static int nvme_tcp_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+		unsigned int hctx_idx)
+{
+	struct nvme_tcp_ctrl *ctrl = data;
+	struct nvme_tcp_queue *queue = &ctrl->queues[hctx_idx + 1];
+
+	BUG_ON(hctx_idx >= ctrl->queue_count);
+
+	hctx->driver_data = queue;
+	return 0;
+}
+
+static int nvme_tcp_init_admin_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+		unsigned int hctx_idx)
+{
+	struct nvme_tcp_ctrl *ctrl = data;
+	struct nvme_tcp_queue *queue = &ctrl->queues[0];
+
+	BUG_ON(hctx_idx != 0);
+
+	hctx->driver_data = queue;
+	return 0;
+}
+
+static void nvme_tcp_set_sg_null(struct nvme_command *c)
+{
+	struct nvme_sgl_desc *sg = &c->common.dptr.sgl;
+
+	sg->addr = 0;
+	sg->length = 0;
+	sg->type = (NVME_TRANSPORT_SGL_DATA_DESC << 4) |
+			NVME_SGL_FMT_TRANSPORT_A;
+}
+
+static void nvme_tcp_set_sg_inline(struct nvme_tcp_queue *queue,
+		struct nvme_command *c, u32 data_len)
+{
+	struct nvme_sgl_desc *sg = &c->common.dptr.sgl;
+
+	sg->addr = cpu_to_le64(queue->ctrl->ctrl.icdoff);
+	sg->length = cpu_to_le32(data_len);
+	sg->type = (NVME_SGL_FMT_DATA_DESC << 4) | NVME_SGL_FMT_OFFSET;
+}
+
+static void nvme_tcp_set_sg_host_data(struct nvme_command *c, u32 data_len)
+{
+	struct nvme_sgl_desc *sg = &c->common.dptr.sgl;
+
+	sg->addr = 0;
+	sg->length = cpu_to_le32(data_len);
+	sg->type = (NVME_TRANSPORT_SGL_DATA_DESC << 4) |
+			NVME_SGL_FMT_TRANSPORT_A;
+}
+
+static void nvme_tcp_unmap_data(struct nvme_tcp_queue *queue,
+		struct request *rq)
+{
+	struct nvme_tcp_request *req = blk_mq_rq_to_pdu(rq);
+
+	if (!req->data_len)
+		return;
+
+	nvme_cleanup_cmd(rq);
+	sg_free_table_chained(&req->sg_table, true);
+}
+
+static int nvme_tcp_map_data(struct nvme_tcp_queue *queue,
+		struct request *rq)
+{
+	struct nvme_tcp_request *req = blk_mq_rq_to_pdu(rq);
+	struct nvme_tcp_cmd_pdu *pdu = &req->pdu;
+	struct nvme_command *c = &pdu->cmd;
+	int ret;
+
+	req->state = NVME_TCP_SEND_CMD_PDU;
+	req->offset = 0;
+	req->pdu_len = 0;
+	req->pdu_left = 0;
+	req->r2t_left = 0;
+	req->data_sent = 0;
+	req->data_rcvd = 0;
+	req->data_len = blk_rq_bytes(rq) ? blk_rq_payload_bytes(rq) : 0;
+
+	c->common.flags |= NVME_CMD_SGL_METABUF;
+
+	if (!req->data_len) {
+		nvme_tcp_set_sg_null(c);
+		goto out;
+	}
+
+	req->sg_table.sgl = req->first_sgl;
+	ret = sg_alloc_table_chained(&req->sg_table,
+			blk_rq_nr_phys_segments(rq), req->sg_table.sgl);
+	if (ret)
+		return -ENOMEM;
+
+	blk_rq_map_sg(rq->q, rq, req->sg_table.sgl);
+	nvme_tcp_seek(req, 0);
+
+	if (rq_data_dir(rq) == WRITE && nvme_tcp_queue_idx(queue) &&
+	    req->data_len <= nvme_tcp_inline_data_size(queue)) {
+		req->pdu_len = req->data_len;
+		nvme_tcp_set_sg_inline(queue, c, req->data_len);
+	} else {
+		nvme_tcp_set_sg_host_data(c, req->data_len);
+	}
+
+out:
+	pdu->hdr.type = nvme_tcp_cmd;
+	pdu->hdr.flags = 0;
+	pdu->hdr.hlen = sizeof(*pdu);
+	pdu->hdr.pdo = req->pdu_len ? pdu->hdr.hlen : 0;
+	pdu->hdr.plen = cpu_to_le32(pdu->hdr.hlen + req->pdu_len);
+	return 0;
+}
+
+static void nvme_tcp_submit_async_event(struct nvme_ctrl *arg, int aer_idx)
+{
+	struct nvme_tcp_ctrl *ctrl = to_tcp_ctrl(arg);
+	struct nvme_tcp_request *req = &ctrl->async_req;
+	struct nvme_tcp_cmd_pdu *pdu = &req->pdu;
+
+	if (WARN_ON_ONCE(aer_idx != 0))
+		return;
+
+	memset(pdu, 0, sizeof(*pdu));
+	pdu->hdr.type = nvme_tcp_cmd;
+	pdu->hdr.hlen = sizeof(*pdu);
+	pdu->hdr.plen = cpu_to_le32(pdu->hdr.hlen);
+
+	pdu->cmd.common.opcode = nvme_admin_async_event;
+	pdu->cmd.common.command_id = NVME_TCP_AQ_BLKMQ_DEPTH;
+	pdu->cmd.common.flags |= NVME_CMD_SGL_METABUF;
+	nvme_tcp_set_sg_null(&pdu->cmd);
+
+	req->queue = &ctrl->queues[0];
+	req->state = NVME_TCP_SEND_CMD_PDU;
+	req->offset = 0;
+	req->data_len = 0;
+	req->pdu_len = 0;
+	req->r2t_left = 0;
+
+	nvme_tcp_queue_request(req);
+}
+
+static enum blk_eh_timer_return
+nvme_tcp_timeout(struct request *rq, bool reserved)
+{
+	struct nvme_tcp_request *req = blk_mq_rq_to_pdu(rq);
+
+	/* queue error recovery */
+	nvme_tcp_error_recovery(req->queue->ctrl);
+
+	/* fail with DNR on cmd timeout */
+	rq->errors = NVME_SC_ABORT_REQ | NVME_SC_DNR;
+
+	return BLK_EH_HANDLED;
+}
+
+/*
+ * We cannot accept any other command until the Connect command has completed.
+ */
+static inline bool nvme_tcp_queue_is_ready(struct nvme_tcp_queue *queue,
+		struct request *rq)
+{
+	if (unlikely(!test_bit(NVME_TCP_Q_LIVE, &queue->flags))) {
+		struct nvme_command *cmd = nvme_req(rq)->cmd;
+
+		if (!test_bit(NVME_TCP_Q_CONNECTED, &queue->flags))
+			return false;
+
+		if (rq->cmd_type != REQ_TYPE_DRV_PRIV ||
+		    cmd->common.opcode != nvme_fabrics_command ||
+		    cmd->fabrics.fctype != nvme_fabrics_type_connect)
+			return false;
+	}
+
+	return true;
+}
+
+static int nvme_tcp_queue_rq(struct blk_mq_hw_ctx *hctx,
+		const struct blk_mq_queue_data *bd)
+{
+	struct nvme_ns *ns = hctx->queue->queuedata;
+	struct nvme_tcp_queue *queue = hctx->driver_data;
+	struct request *rq = bd->rq;
+	struct nvme_tcp_request *req = blk_mq_rq_to_pdu(rq);
+	int ret;
+
+	WARN_ON_ONCE(rq->tag < 0);
+
+	if (!nvme_tcp_queue_is_ready(queue, rq))
+		return BLK_MQ_RQ_QUEUE_BUSY;
+
+	ret = nvme_setup_cmd(ns, rq, &req->pdu.cmd);
+	if (ret != BLK_MQ_RQ_QUEUE_OK)
+		return ret;
+
+	blk_mq_start_request(rq);
+
+	ret = nvme_tcp_map_data(queue, rq);
+	if (ret < 0) {
+		dev_err(queue->ctrl->ctrl.device,
+			     "Failed to map data (%d)\n", ret);
+		nvme_cleanup_cmd(rq);
+		return ret == -ENOMEM ?
+			BLK_MQ_RQ_QUEUE_BUSY : BLK_MQ_RQ_QUEUE_ERROR;
+	}
+
+	nvme_tcp_queue_request(req);
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+static void nvme_tcp_complete_rq(struct request *rq)
+{
+	struct nvme_tcp_request *req = blk_mq_rq_to_pdu(rq);
+	struct nvme_tcp_queue *queue = req->queue;
+	int error = 0;
+
+	nvme_tcp_unmap_data(queue, rq);
+
+	if (unlikely(rq->errors)) {
+		if (nvme_req_needs_retry(rq, rq->errors)) {
+			nvme_requeue_req(rq);
+			return;
+		}
+
+		if (rq->cmd_type == REQ_TYPE_DRV_PRIV)
+			error = rq->errors;
+		else
+			error = nvme_error_status(rq->errors);
+	}
+
+	blk_mq_end_request(rq, error);
+}
+
+static struct blk_mq_ops nvme_tcp_mq_ops = {
+	.queue_rq	= nvme_tcp_queue_rq,
+	.complete	= nvme_tcp_complete_rq,
+	.init_request	= nvme_tcp_init_request,
+	.init_hctx	= nvme_tcp_init_hctx,
+	.timeout	= nvme_tcp_timeout,
+};
+
+static struct blk_mq_ops nvme_tcp_admin_mq_ops = {
+	.queue_rq	= nvme_tcp_queue_rq,
+	.complete	= nvme_tcp_complete_rq,
+	.init_request	= nvme_tcp_init_admin_request,
+	.init_hctx	= nvme_tcp_init_admin_hctx,
+	.timeout	= nvme_tcp_timeout,
+};
+
+static int nvme_tcp_configure_admin_queue(struct nvme_tcp_ctrl *ctrl)
+{
+	int error;
+
+	error = nvme_tcp_init_queue(ctrl, 0, NVMF_AQ_DEPTH);
+	if (error)
+		return error;
+
+	memset(&ctrl->admin_tag_set, 0, sizeof(ctrl->admin_tag_set));
+	ctrl->admin_tag_set.ops = &nvme_tcp_admin_mq_ops;
+	ctrl->admin_tag_set.queue_depth = NVME_TCP_AQ_BLKMQ_DEPTH;
+	ctrl->admin_tag_set.reserved_tags = 2; /* connect + keep-alive */
+	ctrl->admin_tag_set.numa_node = NUMA_NO_NODE;
+	ctrl->admin_tag_set.cmd_size = sizeof(struct nvme_tcp_request) +
+		SG_CHUNK_SIZE * sizeof(struct scatterlist);
+	ctrl->admin_tag_set.driver_data = ctrl;
+	ctrl->admin_tag_set.nr_hw_queues = 1;
+	ctrl->admin_tag_set.timeout = ADMIN_TIMEOUT;
+
+	error = blk_mq_alloc_tag_set(&ctrl->admin_tag_set);
+	if (error)
+		goto out_free_queue;
+
+	ctrl->ctrl.admin_q = blk_mq_init_queue(&ctrl->admin_tag_set);
+	if (IS_ERR(ctrl->ctrl.admin_q)) {
+		error = PTR_ERR(ctrl->ctrl.admin_q);
+		goto out_free_tagset;
+	}
+
+	error = nvmf_connect_admin_queue(&ctrl->ctrl);
+	if (error)
+		goto out_cleanup_queue;
+
+	set_bit(NVME_TCP_Q_LIVE, &ctrl->queues[0].flags);
+
+	error = nvmf_reg_read64(&ctrl->ctrl, NVME_REG_CAP, &ctrl->cap);
+	if (error) {
+		dev_err(ctrl->ctrl.device,
+			"prop_get NVME_REG_CAP failed\n");
+		goto out_cleanup_queue;
+	}
+
+	ctrl->ctrl.sqsize =
+		min_t(int, NVME_CAP_MQES(ctrl->cap) + 1, ctrl->ctrl.sqsize);
+
+	error = nvme_enable_ctrl(&ctrl->ctrl, ctrl->cap);
+	if (error)
+		goto out_cleanup_queue;
+
+	ctrl->ctrl.max_hw_sectors =
+		(NVME_TCP_MAX_SEGMENTS - 1) << (PAGE_SHIFT - 9);
+
+	error = nvme_init_identify(&ctrl->ctrl);
+	if (error)
+		goto out_cleanup_queue;
+
+	nvme_start_keep_alive(&ctrl->ctrl);
+
+	return 0;
+
+out_cleanup_queue:
+	blk_cleanup_queue(ctrl->ctrl.admin_q);
+out_free_tagset:
+	/* stop io_work before freeing the requests it may look at */
+	nvme_tcp_stop_queue(&ctrl->queues[0]);
+	blk_mq_free_tag_set(&ctrl->admin_tag_set);
+out_free_queue:
+	nvme_tcp_stop_and_free_queue(&ctrl->queues[0]);
+	return error;
+}
+
+static void nvme_tcp_shutdown_ctrl(struct nvme_tcp_ctrl *ctrl)
+{
+	nvme_stop_keep_alive(&ctrl->ctrl);
+	cancel_work_sync(&ctrl->err_work);
+	cancel_delayed_work_sync(&ctrl->reconnect_work);
+
+	if (ctrl->queue_count > 1) {
+		nvme_stop_queues(&ctrl->ctrl);
+		nvme_tcp_free_io_queues(ctrl);
+		blk_mq_tagset_busy_iter(&ctrl->tag_set,
+					nvme_cancel_request, &ctrl->ctrl);
+	}
+
+	if (ctrl->ctrl.state == NVME_CTRL_LIVE)
+		nvme_shutdown_ctrl(&ctrl->ctrl);
+
+	blk_mq_stop_hw_queues(ctrl->ctrl.admin_q);
+	nvme_tcp_stop_queue(&ctrl->queues[0]);
+	blk_mq_tagset_busy_iter(&ctrl->admin_tag_set,
+				nvme_cancel_request, &ctrl->ctrl);
+	nvme_tcp_destroy_admin_queue(ctrl);
+}
+
+static void nvme_tcp_del_ctrl_work(struct work_struct *work)
+{
+	struct nvme_tcp_ctrl *ctrl = container_of(work,
+				struct nvme_tcp_ctrl, delete_work);
+
+	nvme_remove_namespaces(&ctrl->ctrl);
+	nvme_tcp_shutdown_ctrl(ctrl);
+	nvme_uninit_ctrl(&ctrl->ctrl);
+	nvme_put_ctrl(&ctrl->ctrl);
+}
+
+static int __nvme_tcp_del_ctrl(struct nvme_tcp_ctrl *ctrl)
+{
+	if (!nvme_change_ctrl_state(&ctrl->ctrl, NVME_CTRL_DELETING))
+		return -EBUSY;
+
+	if (!queue_work(nvme_tcp_wq, &ctrl->delete_work))
+		return -EBUSY;
+
+	return 0;
+}
+
+static int nvme_tcp_del_ctrl(struct nvme_ctrl *nctrl)
+{
+	struct nvme_tcp_ctrl *ctrl = to_tcp_ctrl(nctrl);
+	int ret = 0;
+
+	/*
+	 * Keep a reference until all work is flushed since
+	 * __nvme_tcp_del_ctrl can free the ctrl mem
+	 */
+	if (!kref_get_unless_zero(&ctrl->ctrl.kref))
+		return -EBUSY;
+	ret = __nvme_tcp_del_ctrl(ctrl);
+	if (!ret)
+		flush_work(&ctrl->delete_work);
+	nvme_put_ctrl(&ctrl->ctrl);
+	return ret;
+}
+
+static void nvme_tcp_remove_ctrl_work(struct work_struct *work)
+{
+	struct nvme_tcp_ctrl *ctrl = container_of(work,
+				struct nvme_tcp_ctrl, delete_work);
+
+	nvme_remove_namespaces(&ctrl->ctrl);
+	nvme_uninit_ctrl(&ctrl->ctrl);
+	nvme_put_ctrl(&ctrl->ctrl);
+}
+
+static void nvme_tcp_reset_ctrl_work(struct work_struct *work)
+{
+	struct nvme_tcp_ctrl *ctrl = container_of(work,
+					struct nvme_tcp_ctrl, reset_work);
+	int ret;
+	bool changed;
+
+	nvme_tcp_shutdown_ctrl(ctrl);
+
+	ret = nvme_tcp_configure_admin_queue(ctrl);
+	if (ret) {
+		/* ctrl is already shutdown, just remove the ctrl */
+		INIT_WORK(&ctrl->delete_work, nvme_tcp_remove_ctrl_work);
+		goto del_dead_ctrl;
+	}
+
+	if (ctrl->queue_count > 1) {
+		ret = nvme_tcp_init_io_queues(ctrl);
+		if (ret)
+			goto del_dead_ctrl;
+
+		ret = nvme_tcp_connect_io_queues(ctrl);
+		if (ret)
+			goto del_dead_ctrl;
+	}
+
+	changed = nvme_change_ctrl_state(&ctrl->ctrl, NVME_CTRL_LIVE);
+	WARN_ON_ONCE(!changed);
+
+	if (ctrl->queue_count > 1) {
+		nvme_start_queues(&ctrl->ctrl);
+		nvme_queue_scan(&ctrl->ctrl);
+		nvme_queue_async_events(&ctrl->ctrl);
+	}
+
+	return;
+
+del_dead_ctrl:
+	/* Deleting this dead controller... */
+	dev_warn(ctrl->ctrl.device, "Removing after reset failure\n");
+	WARN_ON(!queue_work(nvme_tcp_wq, &ctrl->delete_work));
+}
+
+static int nvme_tcp_reset_ctrl(struct nvme_ctrl *nctrl)
+{
+	struct nvme_tcp_ctrl *ctrl = to_tcp_ctrl(nctrl);
+
+	if (!nvme_change_ctrl_state(&ctrl->ctrl, NVME_CTRL_RESETTING))
+		return -EBUSY;
+
+	if (!queue_work(nvme_tcp_wq, &ctrl->reset_work))
+		return -EBUSY;
+
+	flush_work(&ctrl->reset_work);
+
+	return 0;
+}
+
+static const struct nvme_ctrl_ops nvme_tcp_ctrl_ops = {
+	.name			= "tcp",
+	.module			= THIS_MODULE,
+	.is_fabrics		= true,
+	.reg_read32		= nvmf_reg_read32,
+	.reg_read64		= nvmf_reg_read64,
+	.reg_write32		= nvmf_reg_write32,
+	.reset_ctrl		= nvme_tcp_reset_ctrl,
+	.free_ctrl		= nvme_tcp_free_ctrl,
+	.submit_async_event	= nvme_tcp_submit_async_event,
+	.delete_ctrl		= nvme_tcp_del_ctrl,
+	.get_subsysnqn		= nvmf_get_subsysnqn,
+	.get_address		= nvmf_get_address,
+};
+
+static int nvme_tcp_create_io_queues(struct nvme_tcp_ctrl *ctrl)
+{
+	struct nvmf_ctrl_options *opts = ctrl->ctrl.opts;
+	int ret;
+
+	ret = nvme_set_queue_count(&ctrl->ctrl, &opts->nr_io_queues);
+	if (ret)
+		return ret;
+
+	ctrl->queue_count = opts->nr_io_queues + 1;
+	if (ctrl->queue_count < 2)
+		return 0;
+
+	dev_info(ctrl->ctrl.device,
+		"creating %d I/O queues.\n", opts->nr_io_queues);
+
+	ret = nvme_tcp_init_io_queues(ctrl);
+	if (ret)
+		return ret;
+
+	memset(&ctrl->tag_set, 0, sizeof(ctrl->tag_set));
+	ctrl->tag_set.ops = &nvme_tcp_mq_ops;
+	ctrl->tag_set.queue_depth = ctrl->ctrl.opts->queue_size;
+	ctrl->tag_set.reserved_tags = 1; /* fabric connect */
+	ctrl->tag_set.numa_node = NUMA_NO_NODE;
+	ctrl->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+	ctrl->tag_set.cmd_size = sizeof(struct nvme_tcp_request) +
+		SG_CHUNK_SIZE * sizeof(struct scatterlist);
+	ctrl->tag_set.driver_data = ctrl;
+	ctrl->tag_set.nr_hw_queues = ctrl->queue_count - 1;
+	ctrl->tag_set.timeout = NVME_IO_TIMEOUT;
+
+	ret = blk_mq_alloc_tag_set(&ctrl->tag_set);
+	if (ret)
+		goto out_free_io_queues;
+	ctrl->ctrl.tagset = &ctrl->tag_set;
+
+	ctrl->ctrl.connect_q = blk_mq_init_queue(&ctrl->tag_set);
+	if (IS_ERR(ctrl->ctrl.connect_q)) {
+		ret = PTR_ERR(ctrl->ctrl.connect_q);
+		goto out_free_tag_set;
+	}
+
+	ret = nvme_tcp_connect_io_queues(ctrl);
+	if (ret)
+		goto out_cleanup_connect_q;
+
+	return 0;
+
+out_cleanup_connect_q:
+	blk_cleanup_queue(ctrl->ctrl.connect_q);
+out_free_tag_set:
+	blk_mq_free_tag_set(&ctrl->tag_set);
+out_free_io_queues:
+	nvme_tcp_free_io_queues(ctrl);
+	return ret;
+}
+
+static int nvme_tcp_parse_addr(struct sockaddr_storage *addr, const char *p,
+		u16 port)
+{
+	struct sockaddr_in *in4 = (struct sockaddr_in *)addr;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+
+	memset(addr, 0, sizeof(*addr));
+	if (in4_pton(p, -1, (u8 *)&in4->sin_addr.s_addr, '\0', NULL)) {
+		in4->sin_family = AF_INET;
+		in4->sin_port = cpu_to_be16(port);
+		return 0;
+	}
+	if (in6_pton(p, -1, (u8 *)&in6->sin6_addr.s6_addr, '\0', NULL)) {
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = cpu_to_be16(port);
+		return 0;
+	}
+	return -EINVAL;
+}
+
+static struct nvme_ctrl *nvme_tcp_create_ctrl(struct device *dev,
+		struct nvmf_ctrl_options *opts)
+{
+	struct nvme_tcp_ctrl *ctrl;
+	u16 port = NVME_RDMA_IP_PORT;
+	int ret;
+	bool changed;
+
+	ctrl = kzalloc(sizeof(*ctrl), GFP_KERNEL);
+	if (!ctrl)
+		return ERR_PTR(-ENOMEM);
+	ctrl->ctrl.opts = opts;
+	INIT_LIST_HEAD(&ctrl->list);
+
+	if (opts->mask & NVMF_OPT_TRSVCID) {
+		ret = kstrtou16(opts->trsvcid, 0, &port);
+		if (ret)
+			goto out_free_ctrl;
+	}
+
+	ret = nvme_tcp_parse_addr(&ctrl->addr, opts->traddr, port);
+	if (ret) {
+		pr_err("malformed address passed: %s:%d\n",
+			opts->traddr, port);
+		goto out_free_ctrl;
+	}
+
+	if (opts->mask & NVMF_OPT_HOST_TRADDR) {
+		ret = nvme_tcp_parse_addr(&ctrl->src_addr,
+				opts->host_traddr, 0);
+		if (ret) {
+			pr_err("malformed src address passed: %s\n",
+			       opts->host_traddr);
+			goto out_free_ctrl;
+		}
+	}
+
+	ret = nvme_init_ctrl(&ctrl->ctrl, dev, &nvme_tcp_ctrl_ops, 0);
+	if (ret)
+		goto out_free_ctrl;
+
+	ctrl->reconnect_delay = opts->reconnect_delay;
+	INIT_DELAYED_WORK(&ctrl->reconnect_work,
+			nvme_tcp_reconnect_ctrl_work);
+	INIT_WORK(&ctrl->err_work, nvme_tcp_error_recovery_work);
+	INIT_WORK(&ctrl->delete_work, nvme_tcp_del_ctrl_work);
+	INIT_WORK(&ctrl->reset_work, nvme_tcp_reset_ctrl_work);
+
+	ctrl->queue_count = opts->nr_io_queues + 1; /* +1 for admin queue */
+	ctrl->ctrl.sqsize = opts->queue_size - 1;
+	ctrl->ctrl.kato = opts->kato;
+
+	ret = -ENOMEM;
+	ctrl->queues = kcalloc(ctrl->queue_count, sizeof(*ctrl->queues),
+				GFP_KERNEL);
+	if (!ctrl->queues)
+		goto out_uninit_ctrl;
+
+	ret = nvme_tcp_configure_admin_queue(ctrl);
+	if (ret)
+		goto out_kfree_queues;
+
+	/* sanity check icdoff */
+	if (ctrl->ctrl.icdoff) {
+		dev_err(ctrl->ctrl.device, "icdoff is not supported!\n");
+		ret = -EINVAL;
+		goto out_remove_admin_queue;
+	}
+
+	if (opts->queue_size > ctrl->ctrl.maxcmd) {
+		/* warn if maxcmd is lower than queue_size */
+		dev_warn(ctrl->ctrl.device,
+			"queue_size %zu > ctrl maxcmd %u, clamping down\n",
+			opts->queue_size, ctrl->ctrl.maxcmd);
+		opts->queue_size = ctrl->ctrl.maxcmd;
+	}
+
+	if (opts->queue_size > ctrl->ctrl.sqsize + 1) {
+		/* warn if sqsize is lower than queue_size */
+		dev_warn(ctrl->ctrl.device,
+			"queue_size %zu > ctrl sqsize %u, clamping down\n",
+			opts->queue_size, ctrl->ctrl.sqsize + 1);
+		opts->queue_size = ctrl->ctrl.sqsize + 1;
+	}
+
+	if (opts->nr_io_queues) {
+		ret = nvme_tcp_create_io_queues(ctrl);
+		if (ret)
+			goto out_remove_admin_queue;
+	}
+
+	changed = nvme_change_ctrl_state(&ctrl->ctrl, NVME_CTRL_LIVE);
+	WARN_ON_ONCE(!changed);
+
+	dev_info(ctrl->ctrl.device, "new ctrl: NQN \"%s\", addr %pISp\n",
+		ctrl->ctrl.opts->subsysnqn, &ctrl->addr);
+
+	kref_get(&ctrl->ctrl.kref);
+
+	mutex_lock(&nvme_tcp_ctrl_mutex);
+	list_add_tail(&ctrl->list, &nvme_tcp_ctrl_list);
+	mutex_unlock(&nvme_tcp_ctrl_mutex);
+
+	if (opts->nr_io_queues) {
+		nvme_queue_scan(&ctrl->ctrl);
+		nvme_queue_async_events(&ctrl->ctrl);
+	}
+
+	return &ctrl->ctrl;
+
+out_remove_admin_queue:
+	nvme_stop_keep_alive(&ctrl->ctrl);
+	nvme_tcp_destroy_admin_queue(ctrl);
+out_kfree_queues:
+	kfree(ctrl->queues);
+out_uninit_ctrl:
+	nvme_uninit_ctrl(&ctrl->ctrl);
+	nvme_put_ctrl(&ctrl->ctrl);
+	if (ret > 0)
+		ret = -EIO;
+	return ERR_PTR(ret);
+out_free_ctrl:
+	kfree(ctrl);
+	return ERR_PTR(ret);
+}
+
+static struct nvmf_transport_ops nvme_tcp_transport = {
+	.name		= "tcp",
+	.required_opts	= NVMF_OPT_TRADDR,
+	.allowed_opts	= NVMF_OPT_TRSVCID | NVMF_OPT_RECONNECT_DELAY |
+			  NVMF_OPT_HOST_TRADDR,
+	.create_ctrl	= nvme_tcp_create_ctrl,
+};
+
+static int __init nvme_tcp_init_module(void)
+{
+	nvme_tcp_wq = alloc_workqueue("nvme_tcp_wq",
+			WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+	if (!nvme_tcp_wq)
+		return -ENOMEM;
+
+	nvmf_register_transport(&nvme_tcp_transport);
+	return 0;
+}
+
+static void __exit nvme_tcp_cleanup_module(void)
+{
+	struct nvme_tcp_ctrl *ctrl;
+
+	nvmf_unregister_transport(&nvme_tcp_transport);
+
+	mutex_lock(&nvme_tcp_ctrl_mutex);
+	list_for_each_entry(ctrl, &nvme_tcp_ctrl_list, list)
+		__nvme_tcp_del_ctrl(ctrl);
+	mutex_unlock(&nvme_tcp_ctrl_mutex);
+
+	flush_workqueue(nvme_tcp_wq);
+	destroy_workqueue(nvme_tcp_wq);
+}
+
+module_init(nvme_tcp_init_module);
+module_exit(nvme_tcp_cleanup_module);
+
+MODULE_LICENSE("GPL v2");
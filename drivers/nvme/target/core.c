@@ -257,6 +257,15 @@ void nvmet_put_namespace(struct nvmet_ns *ns)
 	percpu_ref_put(&ns->ref);
 }
 
+static void nvmet_ns_dev_put(struct nvmet_ns *ns)
+{
+	if (ns->bdev) {
+		blkdev_put(ns->bdev, FMODE_WRITE|FMODE_READ);
+		ns->bdev = NULL;
+	}
+	nvmet_file_ns_disable(ns);
+}
+
 int nvmet_ns_enable(struct nvmet_ns *ns)
 {
 	struct nvmet_subsys *subsys = ns->subsys;
@@ -270,20 +279,27 @@ int nvmet_ns_enable(struct nvmet_ns *ns)
 	ns->bdev = blkdev_get_by_path(ns->device_path, FMODE_READ | FMODE_WRITE,
 			NULL);
 	if (IS_ERR(ns->bdev)) {
-		pr_err("nvmet: failed to open block device %s: (%ld)\n",
-			ns->device_path, PTR_ERR(ns->bdev));
 		ret = PTR_ERR(ns->bdev);
 		ns->bdev = NULL;
-		goto out_unlock;
-	}
+		if (ret != -ENOTBLK) {
+			pr_err("nvmet: failed to open block device %s: (%d)\n",
+				ns->device_path, ret);
+			goto out_unlock;
+		}
 
-	ns->size = i_size_read(ns->bdev->bd_inode);
-	ns->blksize_shift = blksize_bits(bdev_logical_block_size(ns->bdev));
+		ret = nvmet_file_ns_enable(ns);
+		if (ret)
+			goto out_unlock;
+	} else {
+		ns->size = i_size_read(ns->bdev->bd_inode);
+		ns->blksize_shift =
+			blksize_bits(bdev_logical_block_size(ns->bdev));
+	}
 
 	ret = percpu_ref_init(&ns->ref, nvmet_destroy_namespace,
 				0, GFP_KERNEL);
 	if (ret)
-		goto out_blkdev_put;
+		goto out_dev_put;
 
 	if (ns->nsid > subsys->max_nsid)
 		subsys->max_nsid = ns->nsid;
@@ -314,9 +330,8 @@ int nvmet_ns_enable(struct nvmet_ns *ns)
 out_unlock:
 	mutex_unlock(&subsys->lock);
 	return ret;
-out_blkdev_put:
-	blkdev_put(ns->bdev, FMODE_WRITE|FMODE_READ);
-	ns->bdev = NULL;
+out_dev_put:
+	nvmet_ns_dev_put(ns);
 	goto out_unlock;
 }
 
@@ -350,8 +365,7 @@ void nvmet_ns_disable(struct nvmet_ns *ns)
 	list_for_each_entry(ctrl, &subsys->ctrls, subsys_entry)
 		nvmet_add_async_event(ctrl, NVME_AER_TYPE_NOTICE, 0, 0);
 
-	if (ns->bdev)
-		blkdev_put(ns->bdev, FMODE_WRITE|FMODE_READ);
+	nvmet_ns_dev_put(ns);
 out_unlock:
 	mutex_unlock(&subsys->lock);
 }
@@ -957,9 +971,13 @@ static int __init nvmet_init(void)
 {
 	int error;
 
+	nvmet_file_wq = alloc_workqueue("nvmet-file-wq", WQ_MEM_RECLAIM, 0);
+	if (!nvmet_file_wq)
+		return -ENOMEM;
+
 	error = nvmet_init_discovery();
 	if (error)
-		goto out;
+		goto out_free_file_wq;
 
 	error = nvmet_init_configfs();
 	if (error)
@@ -968,7 +986,8 @@ static int __init nvmet_init(void)
 
 out_exit_discovery:
 	nvmet_exit_discovery();
-out:
+out_free_file_wq:
+	destroy_workqueue(nvmet_file_wq);
 	return error;
 }
 
@@ -976,6 +995,7 @@ static void __exit nvmet_exit(void)
 {
 	nvmet_exit_configfs();
 	nvmet_exit_discovery();
+	destroy_workqueue(nvmet_file_wq);
 
 	BUILD_BUG_ON(sizeof(struct nvmf_disc_rsp_page_entry) != 1024);
 	BUILD_BUG_ON(sizeof(struct nvmf_disc_rsp_page_hdr) != 1024);
@@ -0,0 +1,296 @@
+/*
+ * NVMe I/O command implementation for namespaces backed by a regular file.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/falloc.h>
+#include <linux/uio.h>
+#include "nvmet.h"
+
+struct workqueue_struct *nvmet_file_wq;
+
+int nvmet_file_ns_enable(struct nvmet_ns *ns)
+{
+	struct inode *inode;
+	struct kstat stat;
+	int ret;
+
+	ns->file = filp_open(ns->device_path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(ns->file)) {
+		pr_err("failed to open file %s: (%ld)\n",
+			ns->device_path, PTR_ERR(ns->file));
+		ret = PTR_ERR(ns->file);
+		ns->file = NULL;
+		return ret;
+	}
+
+	inode = file_inode(ns->file);
+	if (!S_ISREG(inode->i_mode)) {
+		pr_err("%s is neither a block device nor a regular file\n",
+			ns->device_path);
+		ret = -EINVAL;
+		goto out_fput;
+	}
+
+	ret = vfs_getattr(&ns->file->f_path, &stat);
+	if (ret)
+		goto out_fput;
+
+	ns->size = stat.size;
+	/* the namespace is carved out in units no larger than a page */
+	ns->blksize_shift = min_t(u32, inode->i_blkbits, PAGE_SHIFT);
+
+	/*
+	 * Direct I/O needs every segment aligned to the logical block size
+	 * of the device below the file system.  Without one (or without
+	 * ->direct_IO) everything goes through the page cache.
+	 */
+	if (inode->i_sb->s_bdev && ns->file->f_mapping->a_ops->direct_IO)
+		ns->file_dio_mask =
+			bdev_logical_block_size(inode->i_sb->s_bdev) - 1;
+	else
+		ns->file_dio_mask = ~0U;
+
+	return 0;
+
+out_fput:
+	fput(ns->file);
+	ns->file = NULL;
+	return ret;
+}
+
+void nvmet_file_ns_disable(struct nvmet_ns *ns)
+{
+	if (ns->file) {
+		flush_workqueue(nvmet_file_wq);
+		fput(ns->file);
+		ns->file = NULL;
+	}
+}
+
+static void nvmet_file_io_done(struct kiocb *iocb, long ret, long ret2)
+{
+	struct nvmet_req *req = container_of(iocb, struct nvmet_req, f.iocb);
+
+	if (req->f.bvec != req->inline_bvec)
+		kfree(req->f.bvec);
+
+	nvmet_req_complete(req, ret == req->data_len ?
+			0 : NVME_SC_INTERNAL | NVME_SC_DNR);
+}
+
+static ssize_t nvmet_file_submit_bvec(struct nvmet_req *req, loff_t pos,
+		int ki_flags)
+{
+	struct file *file = req->ns->file;
+	struct kiocb *iocb = &req->f.iocb;
+	struct iov_iter iter;
+	ssize_t ret;
+	int rw;
+
+	if (req->cmd->rw.opcode == nvme_cmd_write) {
+		rw = WRITE;
+		if (req->cmd->rw.control & cpu_to_le16(NVME_RW_FUA))
+			ki_flags |= IOCB_DSYNC;
+	} else {
+		rw = READ;
+	}
+
+	iov_iter_bvec(&iter, ITER_BVEC | rw, req->f.bvec, req->sg_cnt,
+			req->data_len);
+
+	/* f.iocb shares storage with the bio, start from a clean one */
+	init_sync_kiocb(iocb, file);
+	iocb->ki_pos = pos;
+	iocb->ki_flags |= ki_flags;
+	if (ki_flags & IOCB_DIRECT)
+		iocb->ki_complete = nvmet_file_io_done;
+
+	if (rw == WRITE) {
+		file_start_write(file);
+		ret = file->f_op->write_iter(iocb, &iter);
+		file_end_write(file);
+	} else {
+		ret = file->f_op->read_iter(iocb, &iter);
+	}
+
+	return ret;
+}
+
+static void nvmet_file_buffered_io_work(struct work_struct *w)
+{
+	struct nvmet_req *req = container_of(w, struct nvmet_req, f.work);
+	loff_t pos = le64_to_cpu(req->cmd->rw.slba) << req->ns->blksize_shift;
+
+	nvmet_file_io_done(&req->f.iocb,
+			nvmet_file_submit_bvec(req, pos, 0), 0);
+}
+
+static void nvmet_file_execute_rw(struct nvmet_req *req)
+{
+	struct nvmet_ns *ns = req->ns;
+	u32 dio_mask = ns->file_dio_mask;
+	struct scatterlist *sg;
+	size_t sg_len = 0;
+	bool aligned;
+	ssize_t ret;
+	loff_t pos;
+	int i;
+
+	if (!req->sg_cnt) {
+		nvmet_req_complete(req, 0);
+		return;
+	}
+
+	pos = le64_to_cpu(req->cmd->rw.slba) << ns->blksize_shift;
+	if (unlikely(pos + req->data_len > ns->size)) {
+		nvmet_req_complete(req, NVME_SC_LBA_RANGE | NVME_SC_DNR);
+		return;
+	}
+
+	if (req->sg_cnt > NVMET_MAX_INLINE_BIOVEC) {
+		req->f.bvec = kmalloc_array(req->sg_cnt, sizeof(struct bio_vec),
+				GFP_KERNEL);
+		if (!req->f.bvec) {
+			nvmet_req_complete(req, NVME_SC_INTERNAL | NVME_SC_DNR);
+			return;
+		}
+	} else {
+		req->f.bvec = req->inline_bvec;
+	}
+
+	aligned = !(pos & dio_mask);
+	for_each_sg(req->sg, sg, req->sg_cnt, i) {
+		req->f.bvec[i].bv_page = sg_page(sg);
+		req->f.bvec[i].bv_len = sg->length;
+		req->f.bvec[i].bv_offset = sg->offset;
+		if ((sg->offset | sg->length) & dio_mask)
+			aligned = false;
+		sg_len += sg->length;
+	}
+
+	/* the iterator below walks data_len bytes, the SGL must cover them */
+	if (unlikely(sg_len < req->data_len)) {
+		if (req->f.bvec != req->inline_bvec)
+			kfree(req->f.bvec);
+		nvmet_req_complete(req, NVME_SC_SGL_INVALID_DATA | NVME_SC_DNR);
+		return;
+	}
+
+	/*
+	 * Buffered I/O completes synchronously and may block on page cache
+	 * allocation or writeback, which the transports can't afford in
+	 * their submission context, so it is punted to a workqueue.
+	 */
+	if (!aligned) {
+		INIT_WORK(&req->f.work, nvmet_file_buffered_io_work);
+		queue_work(nvmet_file_wq, &req->f.work);
+		return;
+	}
+
+	ret = nvmet_file_submit_bvec(req, pos, IOCB_DIRECT);
+	if (ret != -EIOCBQUEUED)
+		nvmet_file_io_done(&req->f.iocb, ret, 0);
+}
+
+static void nvmet_file_flush_work(struct work_struct *w)
+{
+	struct nvmet_req *req = container_of(w, struct nvmet_req, f.work);
+	int ret;
+
+	ret = vfs_fsync(req->ns->file, 1);
+	nvmet_req_complete(req, ret < 0 ? NVME_SC_INTERNAL | NVME_SC_DNR : 0);
+}
+
+static void nvmet_file_execute_flush(struct nvmet_req *req)
+{
+	INIT_WORK(&req->f.work, nvmet_file_flush_work);
+	queue_work(nvmet_file_wq, &req->f.work);
+}
+
+static u16 nvmet_file_discard_range(struct nvmet_ns *ns,
+		struct nvme_dsm_range *range)
+{
+	loff_t offset = le64_to_cpu(range->slba) << ns->blksize_shift;
+	loff_t len = (loff_t)le32_to_cpu(range->nlb) << ns->blksize_shift;
+
+	if (offset + len > ns->size)
+		return NVME_SC_LBA_RANGE | NVME_SC_DNR;
+
+	if (vfs_fallocate(ns->file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			offset, len))
+		return NVME_SC_INTERNAL | NVME_SC_DNR;
+	return 0;
+}
+
+static void nvmet_file_dsm_work(struct work_struct *w)
+{
+	struct nvmet_req *req = container_of(w, struct nvmet_req, f.work);
+	struct nvme_dsm_range range;
+	u16 status = 0;
+	int i;
+
+	for (i = 0; i <= le32_to_cpu(req->cmd->dsm.nr); i++) {
+		status = nvmet_copy_from_sgl(req, i * sizeof(range), &range,
+				sizeof(range));
+		if (status)
+			break;
+
+		status = nvmet_file_discard_range(req->ns, &range);
+		if (status)
+			break;
+	}
+
+	nvmet_req_complete(req, status);
+}
+
+static void nvmet_file_execute_dsm(struct nvmet_req *req)
+{
+	switch (le32_to_cpu(req->cmd->dsm.attributes)) {
+	case NVME_DSMGMT_AD:
+		INIT_WORK(&req->f.work, nvmet_file_dsm_work);
+		queue_work(nvmet_file_wq, &req->f.work);
+		return;
+	case NVME_DSMGMT_IDR:
+	case NVME_DSMGMT_IDW:
+	default:
+		/* Not supported yet */
+		nvmet_req_complete(req, 0);
+		return;
+	}
+}
+
+int nvmet_file_parse_io_cmd(struct nvmet_req *req)
+{
+	struct nvme_command *cmd = req->cmd;
+
+	switch (cmd->common.opcode) {
+	case nvme_cmd_read:
+	case nvme_cmd_write:
+		req->execute = nvmet_file_execute_rw;
+		req->data_len = nvmet_rw_len(req);
+		return 0;
+	case nvme_cmd_flush:
+		req->execute = nvmet_file_execute_flush;
+		req->data_len = 0;
+		return 0;
+	case nvme_cmd_dsm:
+		req->execute = nvmet_file_execute_dsm;
+		req->data_len = le32_to_cpu(cmd->dsm.nr + 1) *
+			sizeof(struct nvme_dsm_range);
+		return 0;
+	default:
+		pr_err("nvmet: unhandled cmd %d\n", cmd->common.opcode);
+		return NVME_SC_INVALID_OPCODE | NVME_SC_DNR;
+	}
+}
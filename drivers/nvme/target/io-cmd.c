@@ -27,12 +27,6 @@ static void nvmet_bio_done(struct bio *bio)
 		bio_put(bio);
 }
 
-static inline u32 nvmet_rw_len(struct nvmet_req *req)
-{
-	return ((u32)le16_to_cpu(req->cmd->rw.length) + 1) <<
-			req->ns->blksize_shift;
-}
-
 static void nvmet_inline_bio_init(struct nvmet_req *req)
 {
 	struct bio *bio = &req->inline_bio;
@@ -192,6 +186,9 @@ int nvmet_parse_io_cmd(struct nvmet_req *req)
 	if (!req->ns)
 		return NVME_SC_INVALID_NS | NVME_SC_DNR;
 
+	if (req->ns->file)
+		return nvmet_file_parse_io_cmd(req);
+
 	switch (cmd->common.opcode) {
 	case nvme_cmd_read:
 	case nvme_cmd_write:
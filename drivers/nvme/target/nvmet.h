@@ -42,6 +42,8 @@ struct nvmet_ns {
 	struct list_head	dev_link;
 	struct percpu_ref	ref;
 	struct block_device	*bdev;
+	struct file		*file;
+	u32			file_dio_mask;
 	u32			nsid;
 	u32			blksize_shift;
 	loff_t			size;
@@ -216,7 +218,14 @@ struct nvmet_req {
 	struct nvmet_cq		*cq;
 	struct nvmet_ns		*ns;
 	struct scatterlist	*sg;
-	struct bio		inline_bio;
+	union {
+		struct bio	inline_bio;
+		struct {
+			struct kiocb		iocb;
+			struct bio_vec		*bvec;
+			struct work_struct	work;
+		} f;
+	};
 	struct bio_vec		inline_bvec[NVMET_MAX_INLINE_BIOVEC];
 	int			sg_cnt;
 	size_t			data_len;
@@ -237,6 +246,12 @@ static inline void nvmet_set_result(struct nvmet_req *req, u32 result)
 	req->rsp->result.u32 = cpu_to_le32(result);
 }
 
+static inline u32 nvmet_rw_len(struct nvmet_req *req)
+{
+	return ((u32)le16_to_cpu(req->cmd->rw.length) + 1) <<
+			req->ns->blksize_shift;
+}
+
 /*
  * NVMe command writes actually are DMA reads for us on the target side.
  */
@@ -255,6 +270,7 @@ struct nvmet_async_event {
 
 int nvmet_parse_connect_cmd(struct nvmet_req *req);
 int nvmet_parse_io_cmd(struct nvmet_req *req);
+int nvmet_file_parse_io_cmd(struct nvmet_req *req);
 int nvmet_parse_admin_cmd(struct nvmet_req *req);
 int nvmet_parse_discovery_cmd(struct nvmet_req *req);
 int nvmet_parse_fabrics_cmd(struct nvmet_req *req);
@@ -290,6 +306,8 @@ int nvmet_ns_enable(struct nvmet_ns *ns);
 void nvmet_ns_disable(struct nvmet_ns *ns);
 struct nvmet_ns *nvmet_ns_alloc(struct nvmet_subsys *subsys, u32 nsid);
 void nvmet_ns_free(struct nvmet_ns *ns);
+int nvmet_file_ns_enable(struct nvmet_ns *ns);
+void nvmet_file_ns_disable(struct nvmet_ns *ns);
 
 int nvmet_register_transport(struct nvmet_fabrics_ops *ops);
 void nvmet_unregister_transport(struct nvmet_fabrics_ops *ops);
@@ -313,6 +331,8 @@ u32 nvmet_get_log_page_len(struct nvme_command *cmd);
 #define NVMET_KAS		10
 #define NVMET_DISC_KATO		120
 
+extern struct workqueue_struct *nvmet_file_wq;
+
 int __init nvmet_init_configfs(void);
 void __exit nvmet_exit_configfs(void);
 
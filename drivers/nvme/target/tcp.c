@@ -0,0 +1,1285 @@
+/*
+ * NVMe over Fabrics TCP target.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#include <linux/err.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/nvme.h>
+#include <linux/slab.h>
+#include <linux/inet.h>
+#include <linux/nvme-tcp.h>
+#include <net/sock.h>
+#include <net/tcp.h>
+
+#include "nvmet.h"
+
+/*
+ * In-capsule data is received straight into freshly allocated pages, so
+ * allowing a fair amount of it costs us nothing and saves the host an R2T
+ * round trip for small writes.
+ */
+#define NVMET_TCP_INLINE_DATA_SIZE	(8 * PAGE_SIZE)
+
+/* largest H2C data pdu we accept, the host splits its writes accordingly */
+#define NVMET_TCP_MAXH2CDATA		0x400000
+
+#define NVMET_TCP_RECV_BUDGET		8
+#define NVMET_TCP_SEND_BUDGET		8
+
+enum nvmet_tcp_cmd_state {
+	NVMET_TCP_CMD_FREE = 0,
+	NVMET_TCP_CMD_RECV_DATA,	/* waiting for in-capsule or h2c data */
+	NVMET_TCP_CMD_EXEC,		/* owned by the nvmet core */
+	NVMET_TCP_CMD_SEND,		/* response queued or being sent */
+};
+
+enum nvmet_tcp_send_state {
+	NVMET_TCP_SEND_DATA_PDU = 0,
+	NVMET_TCP_SEND_DATA,
+	NVMET_TCP_SEND_R2T,
+	NVMET_TCP_SEND_RESPONSE,
+};
+
+struct nvmet_tcp_cmd {
+	struct nvmet_tcp_queue		*queue;
+	struct nvmet_req		req;
+	struct nvme_command		cmd;
+	struct nvme_tcp_rsp_pdu		rsp_pdu;
+	union {
+		struct nvme_tcp_data_pdu data_pdu;
+		struct nvme_tcp_r2t_pdu	r2t_pdu;
+	};
+
+	u16				ttag;
+	enum nvmet_tcp_cmd_state	state;
+	enum nvmet_tcp_send_state	snd_state;
+	u32				offset;	/* header bytes sent */
+	u32				data_len;
+	u32				rbytes_done;
+	u32				wbytes_done;
+
+	/* position in req.sg for the next data byte */
+	struct scatterlist		*cur_sg;
+	u32				sg_off;
+
+	struct list_head		entry;
+};
+
+enum nvmet_tcp_recv_state {
+	NVMET_TCP_RECV_PDU = 0,
+	NVMET_TCP_RECV_DATA,
+};
+
+enum nvmet_tcp_queue_state {
+	NVMET_TCP_Q_CONNECTING,
+	NVMET_TCP_Q_LIVE,
+	NVMET_TCP_Q_DISCONNECTING,
+};
+
+struct nvmet_tcp_queue {
+	struct socket		*sock;
+	struct nvmet_port	*port;
+	struct work_struct	io_work;
+	int			io_cpu;
+	struct nvmet_cq		nvme_cq;
+	struct nvmet_sq		nvme_sq;
+
+	/* command slots, the index doubles as the r2t transfer tag */
+	struct nvmet_tcp_cmd	**cmds;
+	unsigned int		nr_cmds;
+
+	/* protects state, free_list and resp_list */
+	spinlock_t		lock;
+	enum nvmet_tcp_queue_state state;
+	struct list_head	free_list;
+	struct list_head	resp_list;
+
+	/* only touched from io_work */
+	struct list_head	send_list;
+	struct nvmet_tcp_cmd	*snd_cmd;
+
+	union {
+		struct nvme_tcp_hdr		hdr;
+		struct nvme_tcp_icreq_pdu	icreq;
+		struct nvme_tcp_cmd_pdu		cmd;
+		struct nvme_tcp_data_pdu	data;
+		struct nvme_tcp_term_pdu	term;
+	} pdu;
+	u32			pdu_offset;
+	u32			pdu_remaining;
+	u32			data_remaining;
+	struct nvmet_tcp_cmd	*rcv_cmd;	/* NULL: discard the data */
+	enum nvmet_tcp_recv_state rcv_state;
+
+	int			idx;
+	struct work_struct	release_work;
+	struct list_head	queue_list;
+
+	void (*data_ready)(struct sock *);
+	void (*state_change)(struct sock *);
+	void (*write_space)(struct sock *);
+};
+
+struct nvmet_tcp_port {
+	struct socket		*sock;
+	struct work_struct	accept_work;
+	struct nvmet_port	*nport;
+	struct sockaddr_storage	addr;
+	void (*data_ready)(struct sock *);
+};
+
+static DEFINE_IDA(nvmet_tcp_queue_ida);
+static LIST_HEAD(nvmet_tcp_queue_list);
+static DEFINE_MUTEX(nvmet_tcp_queue_mutex);
+static atomic_t nvmet_tcp_next_cpu = ATOMIC_INIT(0);
+
+static struct workqueue_struct *nvmet_tcp_wq;
+static struct nvmet_fabrics_ops nvmet_tcp_ops;
+
+static void nvmet_tcp_free_sgl(struct scatterlist *sgl, unsigned int nents)
+{
+	struct scatterlist *sg;
+	int count;
+
+	if (!sgl || !nents)
+		return;
+
+	for_each_sg(sgl, sg, nents, count)
+		__free_page(sg_page(sg));
+	kfree(sgl);
+}
+
+static u16 nvmet_tcp_alloc_sgl(struct nvmet_tcp_cmd *cmd, u32 length)
+{
+	struct scatterlist *sg;
+	struct page *page;
+	unsigned int nent;
+	int i = 0;
+
+	nent = DIV_ROUND_UP(length, PAGE_SIZE);
+	sg = kmalloc_array(nent, sizeof(struct scatterlist), GFP_KERNEL);
+	if (!sg)
+		goto out;
+
+	sg_init_table(sg, nent);
+
+	while (length) {
+		u32 page_len = min_t(u32, length, PAGE_SIZE);
+
+		page = alloc_page(GFP_KERNEL);
+		if (!page)
+			goto out_free_pages;
+
+		sg_set_page(&sg[i], page, page_len, 0);
+		length -= page_len;
+		i++;
+	}
+	cmd->req.sg = sg;
+	cmd->req.sg_cnt = nent;
+	cmd->cur_sg = sg;
+	cmd->sg_off = 0;
+	return 0;
+
+out_free_pages:
+	while (i > 0) {
+		i--;
+		__free_page(sg_page(&sg[i]));
+	}
+	kfree(sg);
+out:
+	return NVME_SC_INTERNAL;
+}
+
+static void nvmet_tcp_advance(struct nvmet_tcp_cmd *cmd, u32 len)
+{
+	cmd->sg_off += len;
+	if (cmd->sg_off == cmd->cur_sg->length) {
+		cmd->cur_sg = sg_next(cmd->cur_sg);
+		cmd->sg_off = 0;
+	}
+}
+
+static inline bool nvmet_tcp_need_data_out(struct nvmet_tcp_cmd *cmd)
+{
+	return !nvme_is_write(cmd->req.cmd) &&
+		cmd->data_len &&
+		!cmd->req.rsp->status;
+}
+
+/* must be called with queue->lock held */
+static void __nvmet_tcp_release_cmd(struct nvmet_tcp_cmd *cmd)
+{
+	nvmet_tcp_free_sgl(cmd->req.sg, cmd->req.sg_cnt);
+	cmd->req.sg = NULL;
+	cmd->req.sg_cnt = 0;
+	cmd->state = NVMET_TCP_CMD_FREE;
+	list_add(&cmd->entry, &cmd->queue->free_list);
+}
+
+static void nvmet_tcp_release_cmd(struct nvmet_tcp_cmd *cmd)
+{
+	struct nvmet_tcp_queue *queue = cmd->queue;
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->lock, flags);
+	__nvmet_tcp_release_cmd(cmd);
+	spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+static struct nvmet_tcp_cmd *nvmet_tcp_get_cmd(struct nvmet_tcp_queue *queue)
+{
+	struct nvmet_tcp_cmd *cmd;
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->lock, flags);
+	cmd = list_first_entry_or_null(&queue->free_list,
+			struct nvmet_tcp_cmd, entry);
+	if (cmd)
+		list_del_init(&cmd->entry);
+	spin_unlock_irqrestore(&queue->lock, flags);
+	if (cmd)
+		return cmd;
+
+	/* the host may not have more commands outstanding than it asked for */
+	if (queue->nr_cmds >= NVMET_QUEUE_SIZE)
+		return NULL;
+
+	cmd = kzalloc(sizeof(*cmd), GFP_KERNEL);
+	if (!cmd)
+		return NULL;
+	cmd->queue = queue;
+	cmd->ttag = queue->nr_cmds;
+	INIT_LIST_HEAD(&cmd->entry);
+	queue->cmds[queue->nr_cmds++] = cmd;
+	return cmd;
+}
+
+static void nvmet_tcp_schedule_release_queue(struct nvmet_tcp_queue *queue)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->lock, flags);
+	if (queue->state != NVMET_TCP_Q_DISCONNECTING) {
+		queue->state = NVMET_TCP_Q_DISCONNECTING;
+		schedule_work(&queue->release_work);
+	}
+	spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+static void nvmet_tcp_fatal_error(struct nvmet_tcp_queue *queue)
+{
+	if (queue->nvme_sq.ctrl)
+		nvmet_ctrl_fatal_error(queue->nvme_sq.ctrl);
+	nvmet_tcp_schedule_release_queue(queue);
+}
+
+static void nvmet_tcp_setup_c2h_data_pdu(struct nvmet_tcp_cmd *cmd)
+{
+	struct nvme_tcp_data_pdu *pdu = &cmd->data_pdu;
+
+	memset(pdu, 0, sizeof(*pdu));
+	pdu->hdr.type = nvme_tcp_c2h_data;
+	pdu->hdr.flags = NVME_TCP_F_DATA_LAST;
+	pdu->hdr.hlen = sizeof(*pdu);
+	pdu->hdr.pdo = sizeof(*pdu);
+	pdu->hdr.plen = cpu_to_le32(sizeof(*pdu) + cmd->data_len);
+	pdu->command_id = cmd->req.cmd->common.command_id;
+	pdu->data_offset = 0;
+	pdu->data_length = cpu_to_le32(cmd->data_len);
+
+	cmd->cur_sg = cmd->req.sg;
+	cmd->sg_off = 0;
+	cmd->wbytes_done = 0;
+}
+
+static void nvmet_tcp_setup_r2t_pdu(struct nvmet_tcp_cmd *cmd)
+{
+	struct nvme_tcp_r2t_pdu *pdu = &cmd->r2t_pdu;
+
+	memset(pdu, 0, sizeof(*pdu));
+	pdu->hdr.type = nvme_tcp_r2t;
+	pdu->hdr.hlen = sizeof(*pdu);
+	pdu->hdr.plen = cpu_to_le32(sizeof(*pdu));
+	pdu->command_id = cmd->req.cmd->common.command_id;
+	pdu->ttag = cmd->ttag;
+	pdu->r2t_offset = cpu_to_le32(cmd->rbytes_done);
+	pdu->r2t_length = cpu_to_le32(cmd->data_len - cmd->rbytes_done);
+}
+
+static void nvmet_tcp_setup_response_pdu(struct nvmet_tcp_cmd *cmd)
+{
+	struct nvme_tcp_rsp_pdu *pdu = &cmd->rsp_pdu;
+
+	pdu->hdr.type = nvme_tcp_rsp;
+	pdu->hdr.flags = 0;
+	pdu->hdr.hlen = sizeof(*pdu);
+	pdu->hdr.pdo = 0;
+	pdu->hdr.plen = cpu_to_le32(sizeof(*pdu));
+}
+
+/*
+ * May be called from any context, including the block layer completion
+ * interrupt, so just queue the command and let io_work do the sending.
+ */
+static void nvmet_tcp_queue_response(struct nvmet_req *req)
+{
+	struct nvmet_tcp_cmd *cmd =
+		container_of(req, struct nvmet_tcp_cmd, req);
+	struct nvmet_tcp_queue *queue = cmd->queue;
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->lock, flags);
+	if (unlikely(queue->state == NVMET_TCP_Q_DISCONNECTING)) {
+		__nvmet_tcp_release_cmd(cmd);
+		spin_unlock_irqrestore(&queue->lock, flags);
+		return;
+	}
+
+	cmd->state = NVMET_TCP_CMD_SEND;
+	cmd->offset = 0;
+	nvmet_tcp_setup_response_pdu(cmd);
+	if (nvmet_tcp_need_data_out(cmd)) {
+		nvmet_tcp_setup_c2h_data_pdu(cmd);
+		cmd->snd_state = NVMET_TCP_SEND_DATA_PDU;
+	} else {
+		cmd->snd_state = NVMET_TCP_SEND_RESPONSE;
+	}
+	list_add_tail(&cmd->entry, &queue->resp_list);
+	spin_unlock_irqrestore(&queue->lock, flags);
+
+	queue_work_on(queue->io_cpu, nvmet_tcp_wq, &queue->io_work);
+}
+
+static struct nvmet_tcp_cmd *nvmet_tcp_fetch_cmd(struct nvmet_tcp_queue *queue)
+{
+	struct nvmet_tcp_cmd *cmd;
+	unsigned long flags;
+
+	if (list_empty(&queue->send_list)) {
+		spin_lock_irqsave(&queue->lock, flags);
+		list_splice_init(&queue->resp_list, &queue->send_list);
+		spin_unlock_irqrestore(&queue->lock, flags);
+	}
+
+	cmd = list_first_entry_or_null(&queue->send_list,
+			struct nvmet_tcp_cmd, entry);
+	if (cmd)
+		list_del_init(&cmd->entry);
+	return cmd;
+}
+
+static int nvmet_tcp_send_hdr(struct nvmet_tcp_queue *queue,
+		struct nvmet_tcp_cmd *cmd, void *hdr, size_t len, bool more)
+{
+	while (cmd->offset < len) {
+		struct msghdr msg = {
+			.msg_flags = MSG_DONTWAIT | (more ? MSG_MORE : 0),
+		};
+		struct kvec iov = {
+			.iov_base = hdr + cmd->offset,
+			.iov_len = len - cmd->offset,
+		};
+		int ret;
+
+		ret = kernel_sendmsg(queue->sock, &msg, &iov, 1, iov.iov_len);
+		if (ret <= 0)
+			return ret ? ret : -EAGAIN;
+		cmd->offset += ret;
+	}
+
+	return 0;
+}
+
+static int nvmet_tcp_send_data(struct nvmet_tcp_queue *queue,
+		struct nvmet_tcp_cmd *cmd)
+{
+	while (cmd->wbytes_done < cmd->data_len) {
+		struct scatterlist *sg = cmd->cur_sg;
+		u32 len = sg->length - cmd->sg_off;
+		int ret;
+
+		/* the response pdu always follows */
+		ret = kernel_sendpage(queue->sock, sg_page(sg),
+				sg->offset + cmd->sg_off, len,
+				MSG_DONTWAIT | MSG_MORE);
+		if (ret <= 0)
+			return ret ? ret : -EAGAIN;
+
+		nvmet_tcp_advance(cmd, ret);
+		cmd->wbytes_done += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns 1 if a pdu sequence was completely handed to the socket, 0 if
+ * there is nothing to send and a negative errno (-EAGAIN if the socket is
+ * full) otherwise.
+ */
+static int nvmet_tcp_try_send_one(struct nvmet_tcp_queue *queue)
+{
+	struct nvmet_tcp_cmd *cmd;
+	int ret;
+
+	if (!queue->snd_cmd) {
+		queue->snd_cmd = nvmet_tcp_fetch_cmd(queue);
+		if (!queue->snd_cmd)
+			return 0;
+	}
+	cmd = queue->snd_cmd;
+
+	if (cmd->snd_state == NVMET_TCP_SEND_R2T) {
+		ret = nvmet_tcp_send_hdr(queue, cmd, &cmd->r2t_pdu,
+				sizeof(cmd->r2t_pdu), false);
+		if (ret)
+			return ret;
+		/* the command stays around until the data arrives */
+		queue->snd_cmd = NULL;
+		return 1;
+	}
+
+	if (cmd->snd_state == NVMET_TCP_SEND_DATA_PDU) {
+		ret = nvmet_tcp_send_hdr(queue, cmd, &cmd->data_pdu,
+				sizeof(cmd->data_pdu), true);
+		if (ret)
+			return ret;
+		cmd->snd_state = NVMET_TCP_SEND_DATA;
+	}
+
+	if (cmd->snd_state == NVMET_TCP_SEND_DATA) {
+		ret = nvmet_tcp_send_data(queue, cmd);
+		if (ret)
+			return ret;
+		cmd->offset = 0;
+		cmd->snd_state = NVMET_TCP_SEND_RESPONSE;
+	}
+
+	ret = nvmet_tcp_send_hdr(queue, cmd, &cmd->rsp_pdu,
+			sizeof(cmd->rsp_pdu), false);
+	if (ret)
+		return ret;
+
+	queue->snd_cmd = NULL;
+	nvmet_tcp_release_cmd(cmd);
+	return 1;
+}
+
+static int nvmet_tcp_try_send(struct nvmet_tcp_queue *queue)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < NVMET_TCP_SEND_BUDGET; i++) {
+		ret = nvmet_tcp_try_send_one(queue);
+		if (ret <= 0)
+			break;
+	}
+
+	if (ret == -EAGAIN)
+		ret = 0;
+	return ret < 0 ? ret : i;
+}
+
+static void nvmet_tcp_prep_recv_pdu(struct nvmet_tcp_queue *queue)
+{
+	queue->pdu_offset = 0;
+	queue->pdu_remaining = sizeof(struct nvme_tcp_hdr);
+	queue->data_remaining = 0;
+	queue->rcv_cmd = NULL;
+	queue->rcv_state = NVMET_TCP_RECV_PDU;
+}
+
+static void nvmet_tcp_execute(struct nvmet_tcp_cmd *cmd)
+{
+	cmd->state = NVMET_TCP_CMD_EXEC;
+	cmd->req.execute(&cmd->req);
+}
+
+static int nvmet_tcp_handle_icreq(struct nvmet_tcp_queue *queue)
+{
+	struct nvme_tcp_icreq_pdu *icreq = &queue->pdu.icreq;
+	struct nvme_tcp_icresp_pdu *icresp;
+	struct msghdr msg = {};
+	struct kvec iov;
+	int ret;
+
+	if (le32_to_cpu(icreq->hdr.plen) != sizeof(*icreq)) {
+		pr_err("bad icreq length %d\n", le32_to_cpu(icreq->hdr.plen));
+		return -EPROTO;
+	}
+
+	if (icreq->pfv != cpu_to_le16(NVME_TCP_PFV_1_0)) {
+		pr_err("queue %d: bad pfv %d\n", queue->idx,
+			le16_to_cpu(icreq->pfv));
+		return -EPROTO;
+	}
+
+	if (icreq->hpda != 0) {
+		pr_err("queue %d: unsupported hpda %d\n", queue->idx,
+			icreq->hpda);
+		return -EPROTO;
+	}
+
+	icresp = kzalloc(sizeof(*icresp), GFP_KERNEL);
+	if (!icresp)
+		return -ENOMEM;
+
+	/* digests are never enabled, whatever the host asked for */
+	icresp->hdr.type = nvme_tcp_icresp;
+	icresp->hdr.hlen = sizeof(*icresp);
+	icresp->hdr.pdo = 0;
+	icresp->hdr.plen = cpu_to_le32(icresp->hdr.hlen);
+	icresp->pfv = cpu_to_le16(NVME_TCP_PFV_1_0);
+	icresp->maxdata = cpu_to_le32(NVMET_TCP_MAXH2CDATA);
+	icresp->cpda = 0;
+	icresp->digest = 0;
+
+	iov.iov_base = icresp;
+	iov.iov_len = sizeof(*icresp);
+	ret = kernel_sendmsg(queue->sock, &msg, &iov, 1, iov.iov_len);
+	kfree(icresp);
+	if (ret < 0)
+		return ret;
+
+	queue->state = NVMET_TCP_Q_LIVE;
+	nvmet_tcp_prep_recv_pdu(queue);
+	return 0;
+}
+
+static u16 nvmet_tcp_map_data(struct nvmet_tcp_cmd *cmd, u32 inline_len)
+{
+	struct nvme_sgl_desc *sgl = &cmd->cmd.common.dptr.sgl;
+	u32 len = le32_to_cpu(sgl->length);
+
+	switch (sgl->type) {
+	case (NVME_SGL_FMT_DATA_DESC << 4) | NVME_SGL_FMT_OFFSET:
+		if (!nvme_is_write(cmd->req.cmd) || !cmd->queue->nvme_sq.qid)
+			return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+		if (le64_to_cpu(sgl->addr) || len != inline_len ||
+		    len > NVMET_TCP_INLINE_DATA_SIZE) {
+			pr_err("invalid inline data offset or length!\n");
+			return NVME_SC_SGL_INVALID_OFFSET | NVME_SC_DNR;
+		}
+		break;
+	case (NVME_TRANSPORT_SGL_DATA_DESC << 4) | NVME_SGL_FMT_TRANSPORT_A:
+		if (inline_len)
+			return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+		break;
+	default:
+		pr_err("invalid SGL type: %#x\n", sgl->type);
+		return NVME_SC_SGL_INVALID_TYPE | NVME_SC_DNR;
+	}
+
+	/* no data command? */
+	if (!len)
+		return 0;
+
+	cmd->data_len = len;
+	return nvmet_tcp_alloc_sgl(cmd, len);
+}
+
+static int nvmet_tcp_handle_cmd_pdu(struct nvmet_tcp_queue *queue)
+{
+	struct nvme_tcp_cmd_pdu *pdu = &queue->pdu.cmd;
+	u32 inline_len = le32_to_cpu(pdu->hdr.plen) - pdu->hdr.hlen;
+	struct nvmet_tcp_cmd *cmd;
+	u16 status;
+
+	if (le32_to_cpu(pdu->hdr.plen) < pdu->hdr.hlen ||
+	    (inline_len && pdu->hdr.pdo != pdu->hdr.hlen)) {
+		pr_err("queue %d: malformed command pdu\n", queue->idx);
+		return -EPROTO;
+	}
+
+	cmd = nvmet_tcp_get_cmd(queue);
+	if (unlikely(!cmd)) {
+		pr_err("queue %d: out of commands (%d)\n",
+			queue->idx, queue->nr_cmds);
+		return -ENOMEM;
+	}
+
+	memcpy(&cmd->cmd, &pdu->cmd, sizeof(cmd->cmd));
+	cmd->req.cmd = &cmd->cmd;
+	cmd->req.rsp = &cmd->rsp_pdu.cqe;
+	cmd->req.port = queue->port;
+	cmd->req.ns = NULL;
+	cmd->data_len = 0;
+	cmd->rbytes_done = 0;
+	cmd->wbytes_done = 0;
+	cmd->state = NVMET_TCP_CMD_EXEC;
+
+	nvmet_tcp_prep_recv_pdu(queue);
+
+	if (!nvmet_req_init(&cmd->req, &queue->nvme_cq,
+			&queue->nvme_sq, &nvmet_tcp_ops))
+		goto drain;
+
+	status = nvmet_tcp_map_data(cmd, inline_len);
+	if (status) {
+		nvmet_req_complete(&cmd->req, status);
+		goto drain;
+	}
+
+	if (!nvme_is_write(cmd->req.cmd) || !cmd->data_len) {
+		nvmet_tcp_execute(cmd);
+		return 0;
+	}
+
+	cmd->state = NVMET_TCP_CMD_RECV_DATA;
+	if (inline_len) {
+		queue->rcv_cmd = cmd;
+		queue->data_remaining = inline_len;
+		queue->rcv_state = NVMET_TCP_RECV_DATA;
+	} else {
+		nvmet_tcp_setup_r2t_pdu(cmd);
+		cmd->offset = 0;
+		cmd->snd_state = NVMET_TCP_SEND_R2T;
+		list_add_tail(&cmd->entry, &queue->send_list);
+	}
+	return 0;
+
+drain:
+	/* the response is on its way, but the capsule data is still inbound */
+	if (inline_len) {
+		queue->data_remaining = inline_len;
+		queue->rcv_state = NVMET_TCP_RECV_DATA;
+	}
+	return 0;
+}
+
+static int nvmet_tcp_handle_h2c_data_pdu(struct nvmet_tcp_queue *queue)
+{
+	struct nvme_tcp_data_pdu *pdu = &queue->pdu.data;
+	u32 offset = le32_to_cpu(pdu->data_offset);
+	u32 len = le32_to_cpu(pdu->data_length);
+	struct nvmet_tcp_cmd *cmd;
+
+	if (pdu->ttag >= queue->nr_cmds) {
+		pr_err("queue %d: ttag %u out of range\n",
+			queue->idx, pdu->ttag);
+		return -EPROTO;
+	}
+
+	cmd = queue->cmds[pdu->ttag];
+	if (cmd->state != NVMET_TCP_CMD_RECV_DATA ||
+	    pdu->command_id != cmd->cmd.common.command_id ||
+	    pdu->hdr.pdo != pdu->hdr.hlen ||
+	    !len || len > NVMET_TCP_MAXH2CDATA ||
+	    le32_to_cpu(pdu->hdr.plen) != pdu->hdr.hlen + len ||
+	    offset != cmd->rbytes_done ||
+	    len > cmd->data_len - offset) {
+		pr_err("queue %d: unexpected h2c data for ttag %u (%u+%u)\n",
+			queue->idx, pdu->ttag, offset, len);
+		return -EPROTO;
+	}
+
+	queue->rcv_cmd = cmd;
+	queue->data_remaining = len;
+	queue->rcv_state = NVMET_TCP_RECV_DATA;
+	return 0;
+}
+
+static int nvmet_tcp_done_recv_pdu(struct nvmet_tcp_queue *queue)
+{
+	struct nvme_tcp_hdr *hdr = &queue->pdu.hdr;
+
+	if (unlikely(queue->state == NVMET_TCP_Q_CONNECTING)) {
+		if (hdr->type != nvme_tcp_icreq) {
+			pr_err("queue %d: unexpected pdu type %d before icreq\n",
+				queue->idx, hdr->type);
+			return -EPROTO;
+		}
+		return nvmet_tcp_handle_icreq(queue);
+	}
+
+	switch (hdr->type) {
+	case nvme_tcp_cmd:
+		return nvmet_tcp_handle_cmd_pdu(queue);
+	case nvme_tcp_h2c_data:
+		return nvmet_tcp_handle_h2c_data_pdu(queue);
+	case nvme_tcp_h2c_term:
+		pr_info("queue %d: host terminated connection, status %#x\n",
+			queue->idx, le16_to_cpu(queue->pdu.term.fes));
+		return -ECONNRESET;
+	default:
+		pr_err("queue %d: unexpected pdu type %d\n",
+			queue->idx, hdr->type);
+		return -EPROTO;
+	}
+}
+
+static u8 nvmet_tcp_pdu_hlen(u8 type)
+{
+	switch (type) {
+	case nvme_tcp_icreq:
+		return sizeof(struct nvme_tcp_icreq_pdu);
+	case nvme_tcp_cmd:
+		return sizeof(struct nvme_tcp_cmd_pdu);
+	case nvme_tcp_h2c_data:
+		return sizeof(struct nvme_tcp_data_pdu);
+	case nvme_tcp_h2c_term:
+		return sizeof(struct nvme_tcp_term_pdu);
+	default:
+		return 0;
+	}
+}
+
+static int nvmet_tcp_try_recv_pdu(struct nvmet_tcp_queue *queue)
+{
+	struct nvme_tcp_hdr *hdr = &queue->pdu.hdr;
+	struct msghdr msg = { .msg_flags = MSG_DONTWAIT };
+	struct kvec iov;
+	int len;
+
+recv:
+	iov.iov_base = (void *)&queue->pdu + queue->pdu_offset;
+	iov.iov_len = queue->pdu_remaining;
+	len = kernel_recvmsg(queue->sock, &msg, &iov, 1,
+			iov.iov_len, msg.msg_flags);
+	if (unlikely(len <= 0))
+		return len ? len : -ECONNRESET;
+
+	queue->pdu_offset += len;
+	queue->pdu_remaining -= len;
+	if (queue->pdu_remaining)
+		return -EAGAIN;
+
+	if (queue->pdu_offset == sizeof(struct nvme_tcp_hdr)) {
+		u8 hlen = nvmet_tcp_pdu_hlen(hdr->type);
+
+		if (unlikely(!hlen || hdr->hlen != hlen)) {
+			pr_err("queue %d: pdu type %d has bad header length %d\n",
+				queue->idx, hdr->type, hdr->hlen);
+			return -EPROTO;
+		}
+
+		queue->pdu_remaining = hlen - sizeof(struct nvme_tcp_hdr);
+		goto recv;
+	}
+
+	return nvmet_tcp_done_recv_pdu(queue);
+}
+
+static int nvmet_tcp_try_recv_data(struct nvmet_tcp_queue *queue)
+{
+	struct nvmet_tcp_cmd *cmd = queue->rcv_cmd;
+	struct msghdr msg = { .msg_flags = MSG_DONTWAIT };
+	struct kvec iov;
+	int len;
+
+	while (queue->data_remaining) {
+		struct page *page = NULL;
+		u32 chunk;
+
+		if (cmd) {
+			struct scatterlist *sg = cmd->cur_sg;
+
+			page = sg_page(sg);
+			chunk = min(sg->length - cmd->sg_off,
+					queue->data_remaining);
+			iov.iov_base = kmap(page) + sg->offset + cmd->sg_off;
+		} else {
+			/* a failed command, throw its data away */
+			chunk = min_t(u32, queue->data_remaining,
+					sizeof(queue->pdu));
+			iov.iov_base = &queue->pdu;
+		}
+		iov.iov_len = chunk;
+
+		len = kernel_recvmsg(queue->sock, &msg, &iov, 1, chunk,
+				msg.msg_flags);
+		if (page)
+			kunmap(page);
+		if (unlikely(len <= 0))
+			return len ? len : -ECONNRESET;
+
+		queue->data_remaining -= len;
+		if (cmd) {
+			nvmet_tcp_advance(cmd, len);
+			cmd->rbytes_done += len;
+		}
+	}
+
+	nvmet_tcp_prep_recv_pdu(queue);
+	if (cmd && cmd->rbytes_done == cmd->data_len)
+		nvmet_tcp_execute(cmd);
+	return 0;
+}
+
+static int nvmet_tcp_try_recv(struct nvmet_tcp_queue *queue)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < NVMET_TCP_RECV_BUDGET; i++) {
+		if (queue->rcv_state == NVMET_TCP_RECV_PDU)
+			ret = nvmet_tcp_try_recv_pdu(queue);
+		else
+			ret = nvmet_tcp_try_recv_data(queue);
+		if (ret < 0)
+			break;
+	}
+
+	if (ret == -EAGAIN)
+		ret = 0;
+	return ret < 0 ? ret : i;
+}
+
+static void nvmet_tcp_io_work(struct work_struct *w)
+{
+	struct nvmet_tcp_queue *queue =
+		container_of(w, struct nvmet_tcp_queue, io_work);
+	unsigned long deadline = jiffies + msecs_to_jiffies(1);
+	bool pending;
+	int ret;
+
+	do {
+		pending = false;
+
+		ret = nvmet_tcp_try_recv(queue);
+		if (ret > 0)
+			pending = true;
+		else if (ret < 0)
+			goto fatal;
+
+		ret = nvmet_tcp_try_send(queue);
+		if (ret > 0)
+			pending = true;
+		else if (ret < 0)
+			goto fatal;
+	} while (pending && !time_after(jiffies, deadline));
+
+	/* let others run, we'll be back */
+	if (pending)
+		queue_work_on(queue->io_cpu, nvmet_tcp_wq, &queue->io_work);
+	return;
+
+fatal:
+	if (ret != -ECONNRESET && ret != -EPIPE)
+		pr_err("queue %d: fatal error %d\n", queue->idx, ret);
+	nvmet_tcp_fatal_error(queue);
+}
+
+static void nvmet_tcp_data_ready(struct sock *sk)
+{
+	struct nvmet_tcp_queue *queue;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	queue = sk->sk_user_data;
+	if (likely(queue))
+		queue_work_on(queue->io_cpu, nvmet_tcp_wq, &queue->io_work);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void nvmet_tcp_write_space(struct sock *sk)
+{
+	struct nvmet_tcp_queue *queue;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	queue = sk->sk_user_data;
+	if (likely(queue && sk_stream_is_writeable(sk))) {
+		clear_bit(SOCK_NOSPACE, &sk->sk_socket->flags);
+		queue_work_on(queue->io_cpu, nvmet_tcp_wq, &queue->io_work);
+	}
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void nvmet_tcp_state_change(struct sock *sk)
+{
+	struct nvmet_tcp_queue *queue;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	queue = sk->sk_user_data;
+	if (!queue)
+		goto done;
+
+	switch (sk->sk_state) {
+	case TCP_FIN_WAIT1:
+	case TCP_CLOSE_WAIT:
+	case TCP_CLOSE:
+		nvmet_tcp_schedule_release_queue(queue);
+		break;
+	default:
+		break;
+	}
+	queue->state_change(sk);
+done:
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void nvmet_tcp_restore_socket_callbacks(struct nvmet_tcp_queue *queue)
+{
+	struct sock *sk = queue->sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_data_ready = queue->data_ready;
+	sk->sk_state_change = queue->state_change;
+	sk->sk_write_space = queue->write_space;
+	sk->sk_user_data = NULL;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void nvmet_tcp_uninit_cmds(struct nvmet_tcp_queue *queue)
+{
+	unsigned long flags;
+	int i;
+
+	/*
+	 * io_work is gone, so nothing else looks at commands that wait for
+	 * data or sit on the send lists.  Commands still executing free
+	 * themselves from queue_response now that we are disconnecting.
+	 */
+	for (i = 0; i < queue->nr_cmds; i++) {
+		struct nvmet_tcp_cmd *cmd = queue->cmds[i];
+
+		if (cmd->state == NVMET_TCP_CMD_RECV_DATA) {
+			/* may still sit on send_list waiting for its r2t */
+			list_del_init(&cmd->entry);
+			nvmet_req_complete(&cmd->req,
+					NVME_SC_DATA_XFER_ERROR);
+		} else if (cmd->state == NVMET_TCP_CMD_SEND) {
+			spin_lock_irqsave(&queue->lock, flags);
+			list_del_init(&cmd->entry);
+			__nvmet_tcp_release_cmd(cmd);
+			spin_unlock_irqrestore(&queue->lock, flags);
+		}
+	}
+	queue->snd_cmd = NULL;
+}
+
+static void nvmet_tcp_release_queue_work(struct work_struct *w)
+{
+	struct nvmet_tcp_queue *queue =
+		container_of(w, struct nvmet_tcp_queue, release_work);
+	int i;
+
+	pr_info("freeing queue %d\n", queue->idx);
+
+	mutex_lock(&nvmet_tcp_queue_mutex);
+	list_del_init(&queue->queue_list);
+	mutex_unlock(&nvmet_tcp_queue_mutex);
+
+	nvmet_tcp_restore_socket_callbacks(queue);
+	kernel_sock_shutdown(queue->sock, SHUT_RDWR);
+	cancel_work_sync(&queue->io_work);
+
+	nvmet_tcp_uninit_cmds(queue);
+	nvmet_sq_destroy(&queue->nvme_sq);
+	/* commands completing in nvmet_sq_destroy() may have requeued it */
+	cancel_work_sync(&queue->io_work);
+
+	sock_release(queue->sock);
+	for (i = 0; i < queue->nr_cmds; i++)
+		kfree(queue->cmds[i]);
+	kfree(queue->cmds);
+	ida_simple_remove(&nvmet_tcp_queue_ida, queue->idx);
+	kfree(queue);
+}
+
+/*
+ * Spread the connections over the online CPUs.  The host pins each of its
+ * queues to a CPU as well, so with a matching number of queues every
+ * connection ends up with a CPU of its own on both ends.
+ */
+static int nvmet_tcp_pick_io_cpu(void)
+{
+	int n = (unsigned int)atomic_inc_return(&nvmet_tcp_next_cpu) %
+		num_online_cpus();
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		if (n-- == 0)
+			return cpu;
+	}
+	return WORK_CPU_UNBOUND;
+}
+
+static int nvmet_tcp_alloc_queue(struct nvmet_tcp_port *port,
+		struct socket *newsock)
+{
+	struct nvmet_tcp_queue *queue;
+	struct sock *sk = newsock->sk;
+	int opt = 1;
+	int ret;
+
+	queue = kzalloc(sizeof(*queue), GFP_KERNEL);
+	if (!queue)
+		return -ENOMEM;
+
+	INIT_WORK(&queue->release_work, nvmet_tcp_release_queue_work);
+	INIT_WORK(&queue->io_work, nvmet_tcp_io_work);
+	spin_lock_init(&queue->lock);
+	INIT_LIST_HEAD(&queue->free_list);
+	INIT_LIST_HEAD(&queue->resp_list);
+	INIT_LIST_HEAD(&queue->send_list);
+	INIT_LIST_HEAD(&queue->queue_list);
+	queue->sock = newsock;
+	queue->port = port->nport;
+	queue->state = NVMET_TCP_Q_CONNECTING;
+	queue->io_cpu = nvmet_tcp_pick_io_cpu();
+	nvmet_tcp_prep_recv_pdu(queue);
+
+	ret = kernel_setsockopt(newsock, IPPROTO_TCP, TCP_NODELAY,
+			(char *)&opt, sizeof(opt));
+	if (ret)
+		goto out_free_queue;
+
+	queue->cmds = kcalloc(NVMET_QUEUE_SIZE, sizeof(*queue->cmds),
+			GFP_KERNEL);
+	if (!queue->cmds) {
+		ret = -ENOMEM;
+		goto out_free_queue;
+	}
+
+	queue->idx = ida_simple_get(&nvmet_tcp_queue_ida, 0, 0, GFP_KERNEL);
+	if (queue->idx < 0) {
+		ret = queue->idx;
+		goto out_free_cmds;
+	}
+
+	ret = nvmet_sq_init(&queue->nvme_sq);
+	if (ret)
+		goto out_ida_remove;
+
+	mutex_lock(&nvmet_tcp_queue_mutex);
+	list_add_tail(&queue->queue_list, &nvmet_tcp_queue_list);
+	mutex_unlock(&nvmet_tcp_queue_mutex);
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_user_data = queue;
+	queue->data_ready = sk->sk_data_ready;
+	sk->sk_data_ready = nvmet_tcp_data_ready;
+	queue->state_change = sk->sk_state_change;
+	sk->sk_state_change = nvmet_tcp_state_change;
+	queue->write_space = sk->sk_write_space;
+	sk->sk_write_space = nvmet_tcp_write_space;
+	write_unlock_bh(&sk->sk_callback_lock);
+
+	/* the icreq may have arrived before our callbacks were installed */
+	queue_work_on(queue->io_cpu, nvmet_tcp_wq, &queue->io_work);
+	return 0;
+
+out_ida_remove:
+	ida_simple_remove(&nvmet_tcp_queue_ida, queue->idx);
+out_free_cmds:
+	kfree(queue->cmds);
+out_free_queue:
+	kfree(queue);
+	return ret;
+}
+
+static void nvmet_tcp_accept_work(struct work_struct *w)
+{
+	struct nvmet_tcp_port *port =
+		container_of(w, struct nvmet_tcp_port, accept_work);
+	struct socket *newsock;
+	int ret;
+
+	for (;;) {
+		ret = kernel_accept(port->sock, &newsock, O_NONBLOCK);
+		if (ret < 0) {
+			if (ret != -EAGAIN)
+				pr_warn("failed to accept err=%d\n", ret);
+			return;
+		}
+
+		ret = nvmet_tcp_alloc_queue(port, newsock);
+		if (ret) {
+			pr_err("failed to allocate queue\n");
+			sock_release(newsock);
+		}
+	}
+}
+
+static void nvmet_tcp_listen_data_ready(struct sock *sk)
+{
+	struct nvmet_tcp_port *port;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	port = sk->sk_user_data;
+	if (port && sk->sk_state == TCP_LISTEN)
+		schedule_work(&port->accept_work);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void nvmet_tcp_delete_ctrl(struct nvmet_ctrl *ctrl)
+{
+	struct nvmet_tcp_queue *queue;
+
+	mutex_lock(&nvmet_tcp_queue_mutex);
+	list_for_each_entry(queue, &nvmet_tcp_queue_list, queue_list)
+		if (queue->nvme_sq.ctrl == ctrl)
+			nvmet_tcp_schedule_release_queue(queue);
+	mutex_unlock(&nvmet_tcp_queue_mutex);
+}
+
+static int nvmet_tcp_parse_addr(struct nvmet_port *nport,
+		struct sockaddr_storage *addr)
+{
+	struct sockaddr_in *in4 = (struct sockaddr_in *)addr;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+	u16 port;
+	int ret;
+
+	ret = kstrtou16(nport->disc_addr.trsvcid, 0, &port);
+	if (ret)
+		return ret;
+
+	memset(addr, 0, sizeof(*addr));
+	switch (nport->disc_addr.adrfam) {
+	case NVMF_ADDR_FAMILY_IP4:
+		if (!in4_pton(nport->disc_addr.traddr, -1,
+				(u8 *)&in4->sin_addr.s_addr, '\0', NULL))
+			return -EINVAL;
+		in4->sin_family = AF_INET;
+		in4->sin_port = htons(port);
+		return 0;
+	case NVMF_ADDR_FAMILY_IP6:
+		if (!in6_pton(nport->disc_addr.traddr, -1,
+				(u8 *)&in6->sin6_addr.s6_addr, '\0', NULL))
+			return -EINVAL;
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(port);
+		return 0;
+	default:
+		pr_err("address family %d not supported\n",
+				nport->disc_addr.adrfam);
+		return -EINVAL;
+	}
+}
+
+static int nvmet_tcp_add_port(struct nvmet_port *nport)
+{
+	struct nvmet_tcp_port *port;
+	int opt = 1;
+	int ret;
+
+	port = kzalloc(sizeof(*port), GFP_KERNEL);
+	if (!port)
+		return -ENOMEM;
+
+	ret = nvmet_tcp_parse_addr(nport, &port->addr);
+	if (ret)
+		goto out_free_port;
+
+	port->nport = nport;
+	INIT_WORK(&port->accept_work, nvmet_tcp_accept_work);
+
+	ret = sock_create_kern(&init_net, port->addr.ss_family, SOCK_STREAM,
+			IPPROTO_TCP, &port->sock);
+	if (ret) {
+		pr_err("failed to create a socket\n");
+		goto out_free_port;
+	}
+
+	port->sock->sk->sk_user_data = port;
+	port->data_ready = port->sock->sk->sk_data_ready;
+	port->sock->sk->sk_data_ready = nvmet_tcp_listen_data_ready;
+
+	ret = kernel_setsockopt(port->sock, SOL_SOCKET, SO_REUSEADDR,
+			(char *)&opt, sizeof(opt));
+	if (ret)
+		goto err_sock;
+
+	ret = kernel_bind(port->sock, (struct sockaddr *)&port->addr,
+			sizeof(port->addr));
+	if (ret) {
+		pr_err("binding to %pISpc failed (%d)\n", &port->addr, ret);
+		goto err_sock;
+	}
+
+	ret = kernel_listen(port->sock, 128);
+	if (ret) {
+		pr_err("listening to %pISpc failed (%d)\n", &port->addr, ret);
+		goto err_sock;
+	}
+
+	nport->priv = port;
+	pr_info("enabling port %d (%pISpc)\n",
+		le16_to_cpu(nport->disc_addr.portid), &port->addr);
+	return 0;
+
+err_sock:
+	sock_release(port->sock);
+out_free_port:
+	kfree(port);
+	return ret;
+}
+
+static void nvmet_tcp_remove_port(struct nvmet_port *nport)
+{
+	struct nvmet_tcp_port *port = xchg(&nport->priv, NULL);
+
+	if (!port)
+		return;
+
+	write_lock_bh(&port->sock->sk->sk_callback_lock);
+	port->sock->sk->sk_data_ready = port->data_ready;
+	port->sock->sk->sk_user_data = NULL;
+	write_unlock_bh(&port->sock->sk->sk_callback_lock);
+	cancel_work_sync(&port->accept_work);
+
+	sock_release(port->sock);
+	kfree(port);
+}
+
+static struct nvmet_fabrics_ops nvmet_tcp_ops = {
+	.owner			= THIS_MODULE,
+	.type			= NVMF_TRTYPE_TCP,
+	.sqe_inline_size	= NVMET_TCP_INLINE_DATA_SIZE,
+	.msdbd			= 1,
+	.has_keyed_sgls		= 0,
+	.add_port		= nvmet_tcp_add_port,
+	.remove_port		= nvmet_tcp_remove_port,
+	.queue_response		= nvmet_tcp_queue_response,
+	.delete_ctrl		= nvmet_tcp_delete_ctrl,
+};
+
+static int __init nvmet_tcp_init(void)
+{
+	int ret;
+
+	nvmet_tcp_wq = alloc_workqueue("nvmet_tcp_wq", WQ_HIGHPRI, 0);
+	if (!nvmet_tcp_wq)
+		return -ENOMEM;
+
+	ret = nvmet_register_transport(&nvmet_tcp_ops);
+	if (ret)
+		destroy_workqueue(nvmet_tcp_wq);
+	return ret;
+}
+
+static void __exit nvmet_tcp_exit(void)
+{
+	struct nvmet_tcp_queue *queue;
+
+	nvmet_unregister_transport(&nvmet_tcp_ops);
+
+	flush_scheduled_work();
+
+	mutex_lock(&nvmet_tcp_queue_mutex);
+	list_for_each_entry(queue, &nvmet_tcp_queue_list, queue_list)
+		kernel_sock_shutdown(queue->sock, SHUT_RDWR);
+	mutex_unlock(&nvmet_tcp_queue_mutex);
+
+	flush_scheduled_work();
+	flush_workqueue(nvmet_tcp_wq);
+	ida_destroy(&nvmet_tcp_queue_ida);
+	destroy_workqueue(nvmet_tcp_wq);
+}
+
+module_init(nvmet_tcp_init);
+module_exit(nvmet_tcp_exit);
+
+MODULE_LICENSE("GPL v2");
+MODULE_ALIAS("nvmet-transport-3"); /* 3 == NVMF_TRTYPE_TCP */
@@ -27,6 +27,9 @@
 #include <linux/uio_driver.h>
 #include <linux/stringify.h>
 #include <linux/bitops.h>
+#include <linux/highmem.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
 #include <net/genetlink.h>
 #include <scsi/scsi_common.h>
 #include <scsi/scsi_proto.h>
@@ -52,6 +55,15 @@
  * moving buffer allocations, or even page flipping or other
  * allocation techniques, without altering the command ring layout.
  *
+ * The data area is split into page sized blocks. Only the mailbox and
+ * command ring are allocated up front; a block gets its page the first
+ * time a command (or a userspace fault) needs it, so the data area
+ * grows on demand up to max_data_area_mb. With zero_copy enabled, large
+ * commands whose buffers were allocated by target core are not copied
+ * at all: their pages are mapped in place of the blocks' own pages for
+ * the lifetime of the command and unmapped from userspace again before
+ * the command is completed.
+ *
  * SECURITY:
  * The user process must be assumed to be malicious. There's no way to
  * prevent it breaking the command ring protocol if it wants, but in
@@ -64,13 +76,16 @@
 
 #define TCMU_TIME_OUT (30 * MSEC_PER_SEC)
 
-#define DATA_BLOCK_BITS 256
-#define DATA_BLOCK_SIZE 4096
+#define DATA_BLOCK_SIZE PAGE_SIZE
 
 #define CMDR_SIZE (16 * 4096)
-#define DATA_SIZE (DATA_BLOCK_BITS * DATA_BLOCK_SIZE)
 
-#define TCMU_RING_SIZE (CMDR_SIZE + DATA_SIZE)
+/* Limits of the data area, in MB */
+#define TCMU_DEF_MAX_DATA_AREA_MB 8
+#define TCMU_MAX_DATA_AREA_MB 1024
+
+/* Commands smaller than this are always copied */
+#define TCMU_ZC_MIN_BLOCKS 4
 
 static struct device *tcmu_root_device;
 
@@ -100,17 +115,28 @@ struct tcmu_dev {
 	/* Must add data_off and mb_addr to get the address */
 	size_t data_off;
 	size_t data_size;
+	size_t ring_size;
+
+	/* Data area blocks, their pages and the pages of zero-copy cmds */
+	u32 max_data_area_mb;
+	u32 max_blocks;
+	u32 used_blocks;
+	u32 nr_data_pages;
+	unsigned long *data_bitmap;
+	struct page **data_pages;
+	struct page **zc_pages;
+	bool zero_copy;
 
-	DECLARE_BITMAP(data_bitmap, DATA_BLOCK_BITS);
+	struct inode *inode;
 
 	wait_queue_head_t wait_cmdr;
-	/* TODO should this be a mutex? */
-	spinlock_t cmdr_lock;
+	struct mutex cmdr_lock;
 
 	struct idr commands;
 	spinlock_t commands_lock;
 
 	struct timer_list timeout;
+	struct work_struct timeout_work;
 
 	char dev_config[TCMU_CONFIG_LEN];
 };
@@ -127,11 +153,15 @@ struct tcmu_cmd {
 
 	/* Can't use se_cmd when cleaning up expired cmds, because if
 	   cmd has been completed then accessing se_cmd is off limits */
-	DECLARE_BITMAP(data_bitmap, DATA_BLOCK_BITS);
+	uint32_t dbi_cnt;
+	uint32_t dbi_cur;
+	uint32_t *dbi;
 
 	unsigned long deadline;
+	struct list_head expired_entry;
 
 #define TCMU_CMD_BIT_EXPIRED 0
+#define TCMU_CMD_BIT_ZERO_COPY 1
 	unsigned long flags;
 };
 
@@ -158,6 +188,24 @@ static struct genl_family tcmu_genl_family = {
 	.netnsok = true,
 };
 
+static uint32_t tcmu_sgl_blocks(struct scatterlist *sgl, unsigned int nents)
+{
+	struct scatterlist *sg;
+	size_t length = 0;
+	int i;
+
+	for_each_sg(sgl, sg, nents, i)
+		length += sg->length;
+
+	return DIV_ROUND_UP(length, DATA_BLOCK_SIZE);
+}
+
+static void tcmu_free_cmd(struct tcmu_cmd *tcmu_cmd)
+{
+	kfree(tcmu_cmd->dbi);
+	kmem_cache_free(tcmu_cmd_cache, tcmu_cmd);
+}
+
 static struct tcmu_cmd *tcmu_alloc_cmd(struct se_cmd *se_cmd)
 {
 	struct se_device *se_dev = se_cmd->se_dev;
@@ -173,6 +221,19 @@ static struct tcmu_cmd *tcmu_alloc_cmd(struct se_cmd *se_cmd)
 	tcmu_cmd->tcmu_dev = udev;
 	tcmu_cmd->deadline = jiffies + msecs_to_jiffies(TCMU_TIME_OUT);
 
+	tcmu_cmd->dbi_cnt = tcmu_sgl_blocks(se_cmd->t_data_sg,
+					    se_cmd->t_data_nents) +
+			    tcmu_sgl_blocks(se_cmd->t_bidi_data_sg,
+					    se_cmd->t_bidi_data_nents);
+	if (tcmu_cmd->dbi_cnt) {
+		tcmu_cmd->dbi = kcalloc(tcmu_cmd->dbi_cnt, sizeof(uint32_t),
+					GFP_KERNEL);
+		if (!tcmu_cmd->dbi) {
+			kmem_cache_free(tcmu_cmd_cache, tcmu_cmd);
+			return NULL;
+		}
+	}
+
 	idr_preload(GFP_KERNEL);
 	spin_lock_irq(&udev->commands_lock);
 	cmd_id = idr_alloc(&udev->commands, tcmu_cmd, 0,
@@ -181,7 +242,7 @@ static struct tcmu_cmd *tcmu_alloc_cmd(struct se_cmd *se_cmd)
 	idr_preload_end();
 
 	if (cmd_id < 0) {
-		kmem_cache_free(tcmu_cmd_cache, tcmu_cmd);
+		tcmu_free_cmd(tcmu_cmd);
 		return NULL;
 	}
 	tcmu_cmd->cmd_id = cmd_id;
@@ -255,43 +316,133 @@ static inline size_t iov_tail(struct tcmu_dev *udev, struct iovec *iov)
 	return (size_t)iov->iov_base + iov->iov_len;
 }
 
-static void alloc_and_scatter_data_area(struct tcmu_dev *udev,
+static void add_to_iov(struct iovec **iov, int *iov_cnt,
+		       struct tcmu_dev *udev, size_t offset, size_t len)
+{
+	if (*iov_cnt != 0 && offset == iov_tail(udev, *iov)) {
+		(*iov)->iov_len += len;
+	} else {
+		new_iov(iov, iov_cnt, udev);
+		(*iov)->iov_base = (void __user *) offset;
+		(*iov)->iov_len = len;
+	}
+}
+
+/*
+ * Return the page backing data block @dbi, allocating it if the block
+ * has never been used. Called with cmdr_lock held.
+ */
+static struct page *tcmu_get_block_page(struct tcmu_dev *udev, uint32_t dbi)
+{
+	struct page *page = udev->data_pages[dbi];
+
+	if (page)
+		return page;
+
+	/* we may be on the I/O path of a device backed by this ring */
+	page = alloc_page(GFP_NOIO | __GFP_ZERO);
+	if (!page)
+		return NULL;
+
+	udev->data_pages[dbi] = page;
+	udev->nr_data_pages++;
+	return page;
+}
+
+static void tcmu_release_blocks(struct tcmu_dev *udev, uint32_t *dbi,
+				uint32_t cnt)
+{
+	uint32_t i;
+
+	for (i = 0; i < cnt; i++)
+		clear_bit(dbi[i], udev->data_bitmap);
+	udev->used_blocks -= cnt;
+}
+
+static void free_data_area(struct tcmu_dev *udev, struct tcmu_cmd *cmd)
+{
+	tcmu_release_blocks(udev, cmd->dbi, cmd->dbi_cnt);
+}
+
+/*
+ * Reserve the lowest free blocks for @cmd so the data area stays compact,
+ * giving each one a page unless the cmd's own pages will be mapped there.
+ */
+static int tcmu_get_empty_blocks(struct tcmu_dev *udev, struct tcmu_cmd *cmd,
+				 bool zero_copy)
+{
+	uint32_t dbi = 0;
+
+	for (cmd->dbi_cur = 0; cmd->dbi_cur < cmd->dbi_cnt; cmd->dbi_cur++) {
+		dbi = find_next_zero_bit(udev->data_bitmap, udev->max_blocks,
+					 dbi);
+		if (WARN_ON(dbi >= udev->max_blocks) ||
+		    (!zero_copy && !tcmu_get_block_page(udev, dbi))) {
+			tcmu_release_blocks(udev, cmd->dbi, cmd->dbi_cur);
+			return -ENOMEM;
+		}
+		set_bit(dbi, udev->data_bitmap);
+		udev->used_blocks++;
+		cmd->dbi[cmd->dbi_cur] = dbi;
+	}
+
+	/* consumed again, in order, by scatter_data_area()/tcmu_map_zc_data() */
+	cmd->dbi_cur = 0;
+	return 0;
+}
+
+/* Drop any userspace mapping of the blocks of @cmd. */
+static void tcmu_unmap_blocks(struct tcmu_dev *udev, struct tcmu_cmd *cmd)
+{
+	uint32_t i, j;
+
+	if (!udev->inode)
+		return;
+
+	for (i = 0; i < cmd->dbi_cnt; i = j) {
+		for (j = i + 1; j < cmd->dbi_cnt; j++)
+			if (cmd->dbi[j] != cmd->dbi[j - 1] + 1)
+				break;
+		unmap_mapping_range(udev->inode->i_mapping,
+				    get_block_offset(udev, cmd->dbi[i],
+						     DATA_BLOCK_SIZE),
+				    (j - i) * DATA_BLOCK_SIZE, 1);
+	}
+}
+
+static void scatter_data_area(struct tcmu_dev *udev, struct tcmu_cmd *cmd,
 	struct scatterlist *data_sg, unsigned int data_nents,
 	struct iovec **iov, int *iov_cnt, bool copy_data)
 {
-	int i, block;
+	int i;
+	uint32_t dbi = 0;
 	int block_remaining = 0;
 	void *from, *to;
 	size_t copy_bytes, to_offset;
 	struct scatterlist *sg;
+	struct page *page = NULL;
 
 	for_each_sg(data_sg, sg, data_nents, i) {
 		int sg_remaining = sg->length;
 		from = kmap_atomic(sg_page(sg)) + sg->offset;
 		while (sg_remaining > 0) {
 			if (block_remaining == 0) {
-				block = find_first_zero_bit(udev->data_bitmap,
-						DATA_BLOCK_BITS);
+				dbi = cmd->dbi[cmd->dbi_cur++];
+				page = udev->data_pages[dbi];
 				block_remaining = DATA_BLOCK_SIZE;
-				set_bit(block, udev->data_bitmap);
 			}
 			copy_bytes = min_t(size_t, sg_remaining,
 					block_remaining);
-			to_offset = get_block_offset(udev, block,
+			to_offset = get_block_offset(udev, dbi,
 					block_remaining);
-			to = (void *)udev->mb_addr + to_offset;
-			if (*iov_cnt != 0 &&
-			    to_offset == iov_tail(udev, *iov)) {
-				(*iov)->iov_len += copy_bytes;
-			} else {
-				new_iov(iov, iov_cnt, udev);
-				(*iov)->iov_base = (void __user *) to_offset;
-				(*iov)->iov_len = copy_bytes;
-			}
+			add_to_iov(iov, iov_cnt, udev, to_offset, copy_bytes);
 			if (copy_data) {
-				memcpy(to, from + sg->length - sg_remaining,
+				to = kmap_atomic(page);
+				memcpy(to + DATA_BLOCK_SIZE - block_remaining,
+					from + sg->length - sg_remaining,
 					copy_bytes);
-				tcmu_flush_dcache_range(to, copy_bytes);
+				flush_dcache_page(page);
+				kunmap_atomic(to);
 			}
 			sg_remaining -= copy_bytes;
 			block_remaining -= copy_bytes;
@@ -300,39 +451,34 @@ static void alloc_and_scatter_data_area(struct tcmu_dev *udev,
 	}
 }
 
-static void free_data_area(struct tcmu_dev *udev, struct tcmu_cmd *cmd)
-{
-	bitmap_xor(udev->data_bitmap, udev->data_bitmap, cmd->data_bitmap,
-		   DATA_BLOCK_BITS);
-}
-
-static void gather_data_area(struct tcmu_dev *udev, unsigned long *cmd_bitmap,
+static void gather_data_area(struct tcmu_dev *udev, struct tcmu_cmd *cmd,
 		struct scatterlist *data_sg, unsigned int data_nents)
 {
-	int i, block;
+	int i;
+	uint32_t dbi = 0;
 	int block_remaining = 0;
 	void *from, *to;
-	size_t copy_bytes, from_offset;
+	size_t copy_bytes;
 	struct scatterlist *sg;
+	struct page *page = NULL;
 
 	for_each_sg(data_sg, sg, data_nents, i) {
 		int sg_remaining = sg->length;
 		to = kmap_atomic(sg_page(sg)) + sg->offset;
 		while (sg_remaining > 0) {
 			if (block_remaining == 0) {
-				block = find_first_bit(cmd_bitmap,
-						DATA_BLOCK_BITS);
+				dbi = cmd->dbi[cmd->dbi_cur++];
+				page = udev->data_pages[dbi];
 				block_remaining = DATA_BLOCK_SIZE;
-				clear_bit(block, cmd_bitmap);
 			}
 			copy_bytes = min_t(size_t, sg_remaining,
 					block_remaining);
-			from_offset = get_block_offset(udev, block,
-					block_remaining);
-			from = (void *) udev->mb_addr + from_offset;
-			tcmu_flush_dcache_range(from, copy_bytes);
-			memcpy(to + sg->length - sg_remaining, from,
-					copy_bytes);
+			from = kmap_atomic(page);
+			flush_dcache_page(page);
+			memcpy(to + sg->length - sg_remaining,
+				from + DATA_BLOCK_SIZE - block_remaining,
+				copy_bytes);
+			kunmap_atomic(from);
 
 			sg_remaining -= copy_bytes;
 			block_remaining -= copy_bytes;
@@ -341,10 +487,81 @@ static void gather_data_area(struct tcmu_dev *udev, unsigned long *cmd_bitmap,
 	}
 }
 
-static inline size_t spc_bitmap_free(unsigned long *bitmap)
+/*
+ * Zero copy needs one whole page per block, which target core's own
+ * allocations provide. Fabric supplied buffers (and their neighbours in
+ * the same pages) must never be exposed to userspace, and BIDI commands
+ * keep using the copy path.
+ */
+static bool tcmu_can_zero_copy(struct tcmu_dev *udev, struct tcmu_cmd *cmd)
 {
-	return DATA_BLOCK_SIZE * (DATA_BLOCK_BITS -
-			bitmap_weight(bitmap, DATA_BLOCK_BITS));
+	struct se_cmd *se_cmd = cmd->se_cmd;
+	struct scatterlist *sg;
+	int i;
+
+	if (!udev->zero_copy || cmd->dbi_cnt < TCMU_ZC_MIN_BLOCKS)
+		return false;
+	if (se_cmd->se_cmd_flags & (SCF_BIDI | SCF_PASSTHROUGH_SG_TO_MEM_NOALLOC))
+		return false;
+	if (se_cmd->data_direction != DMA_TO_DEVICE &&
+	    se_cmd->data_direction != DMA_FROM_DEVICE)
+		return false;
+
+	for_each_sg(se_cmd->t_data_sg, sg, se_cmd->t_data_nents, i) {
+		if (sg->offset ||
+		    (sg->length != PAGE_SIZE && !sg_is_last(sg)))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Put the pages of @cmd in place of its blocks' own pages. Stale mappings
+ * of the blocks are zapped so that the next userspace access faults in
+ * the cmd's page.
+ */
+static void tcmu_map_zc_data(struct tcmu_dev *udev, struct tcmu_cmd *cmd,
+	struct iovec **iov, int *iov_cnt)
+{
+	struct se_cmd *se_cmd = cmd->se_cmd;
+	struct scatterlist *sg;
+	uint32_t dbi;
+	int i;
+
+	for_each_sg(se_cmd->t_data_sg, sg, se_cmd->t_data_nents, i) {
+		/*
+		 * target core does not zero data buffers, don't leak them:
+		 * userspace sees the whole page, also past a short last sg.
+		 */
+		if (se_cmd->data_direction == DMA_FROM_DEVICE)
+			clear_highpage(sg_page(sg));
+		else if (sg->length < PAGE_SIZE)
+			zero_user_segment(sg_page(sg), sg->length, PAGE_SIZE);
+		dbi = cmd->dbi[cmd->dbi_cur++];
+		udev->zc_pages[dbi] = sg_page(sg);
+		add_to_iov(iov, iov_cnt, udev,
+			   get_block_offset(udev, dbi, DATA_BLOCK_SIZE),
+			   sg->length);
+	}
+
+	tcmu_unmap_blocks(udev, cmd);
+	set_bit(TCMU_CMD_BIT_ZERO_COPY, &cmd->flags);
+}
+
+/*
+ * The cmd's pages go back to target core once it completes, so userspace
+ * must lose access to them first.
+ */
+static void tcmu_unmap_zc_data(struct tcmu_dev *udev, struct tcmu_cmd *cmd)
+{
+	uint32_t i;
+
+	if (!test_and_clear_bit(TCMU_CMD_BIT_ZERO_COPY, &cmd->flags))
+		return;
+
+	for (i = 0; i < cmd->dbi_cnt; i++)
+		udev->zc_pages[cmd->dbi[i]] = NULL;
+	tcmu_unmap_blocks(udev, cmd);
 }
 
 /*
@@ -353,7 +570,7 @@ static inline size_t spc_bitmap_free(unsigned long *bitmap)
  *
  * Called with ring lock held.
  */
-static bool is_ring_space_avail(struct tcmu_dev *udev, size_t cmd_size, size_t data_needed)
+static bool is_ring_space_avail(struct tcmu_dev *udev, size_t cmd_size, uint32_t blocks_needed)
 {
 	struct tcmu_mailbox *mb = udev->mb_addr;
 	size_t space, cmd_needed;
@@ -379,10 +596,10 @@ static bool is_ring_space_avail(struct tcmu_dev *udev, size_t cmd_size, size_t d
 		return false;
 	}
 
-	space = spc_bitmap_free(udev->data_bitmap);
-	if (space < data_needed) {
-		pr_debug("no data space: only %zu available, but ask for %zu\n",
-				space, data_needed);
+	if (udev->max_blocks - udev->used_blocks < blocks_needed) {
+		pr_debug("no data space: only %u blocks available, but ask for %u\n",
+				udev->max_blocks - udev->used_blocks,
+				blocks_needed);
 		return false;
 	}
 
@@ -401,8 +618,8 @@ static int tcmu_queue_cmd_ring(struct tcmu_cmd *tcmu_cmd)
 	uint32_t cmd_head;
 	uint64_t cdb_off;
 	bool copy_to_data_area;
-	size_t data_length;
-	DECLARE_BITMAP(old_bitmap, DATA_BLOCK_BITS);
+	bool zero_copy;
+	int ret;
 
 	if (test_bit(TCMU_DEV_BIT_BROKEN, &udev->flags))
 		return -EINVAL;
@@ -411,41 +628,35 @@ static int tcmu_queue_cmd_ring(struct tcmu_cmd *tcmu_cmd)
 	 * Must be a certain minimum size for response sense info, but
 	 * also may be larger if the iov array is large.
 	 *
-	 * We prepare way too many iovs for potential uses here, because it's
-	 * expensive to tell how many regions are freed in the bitmap
+	 * Every iov covers at least one data block, so one iov per block is
+	 * always enough, even if the blocks we get turn out to be scattered.
 	*/
 	base_command_size = max(offsetof(struct tcmu_cmd_entry,
-				req.iov[se_cmd->t_bidi_data_nents +
-					se_cmd->t_data_nents]),
+				req.iov[tcmu_cmd->dbi_cnt]),
 				sizeof(struct tcmu_cmd_entry));
 	command_size = base_command_size
 		+ round_up(scsi_command_size(se_cmd->t_task_cdb), TCMU_OP_ALIGN_SIZE);
 
 	WARN_ON(command_size & (TCMU_OP_ALIGN_SIZE-1));
 
-	spin_lock_irq(&udev->cmdr_lock);
+	mutex_lock(&udev->cmdr_lock);
 
 	mb = udev->mb_addr;
 	cmd_head = mb->cmd_head % udev->cmdr_size; /* UAM */
-	data_length = se_cmd->data_length;
-	if (se_cmd->se_cmd_flags & SCF_BIDI) {
-		BUG_ON(!(se_cmd->t_bidi_data_sg && se_cmd->t_bidi_data_nents));
-		data_length += se_cmd->t_bidi_data_sg->length;
-	}
 	if ((command_size > (udev->cmdr_size / 2))
-	    || data_length > udev->data_size)
+	    || tcmu_cmd->dbi_cnt > udev->max_blocks)
 		pr_warn("TCMU: Request of size %zu/%zu may be too big for %u/%zu "
-			"cmd/data ring buffers\n", command_size, data_length,
+			"cmd/data ring buffers\n", command_size,
+			(size_t)tcmu_cmd->dbi_cnt * DATA_BLOCK_SIZE,
 			udev->cmdr_size, udev->data_size);
 
-	while (!is_ring_space_avail(udev, command_size, data_length)) {
-		int ret;
+	while (!is_ring_space_avail(udev, command_size, tcmu_cmd->dbi_cnt)) {
 		DEFINE_WAIT(__wait);
 
 		prepare_to_wait(&udev->wait_cmdr, &__wait, TASK_INTERRUPTIBLE);
 
 		pr_debug("sleeping for ring space\n");
-		spin_unlock_irq(&udev->cmdr_lock);
+		mutex_unlock(&udev->cmdr_lock);
 		ret = schedule_timeout(msecs_to_jiffies(TCMU_TIME_OUT));
 		finish_wait(&udev->wait_cmdr, &__wait);
 		if (!ret) {
@@ -453,12 +664,19 @@ static int tcmu_queue_cmd_ring(struct tcmu_cmd *tcmu_cmd)
 			return -ETIMEDOUT;
 		}
 
-		spin_lock_irq(&udev->cmdr_lock);
+		mutex_lock(&udev->cmdr_lock);
 
 		/* We dropped cmdr_lock, cmd_head is stale */
 		cmd_head = mb->cmd_head % udev->cmdr_size; /* UAM */
 	}
 
+	zero_copy = tcmu_can_zero_copy(udev, tcmu_cmd);
+	ret = tcmu_get_empty_blocks(udev, tcmu_cmd, zero_copy);
+	if (ret) {
+		mutex_unlock(&udev->cmdr_lock);
+		return ret;
+	}
+
 	/* Insert a PAD if end-of-ring space is too small */
 	if (head_to_end(cmd_head, udev->cmdr_size) < command_size) {
 		size_t pad_size = head_to_end(cmd_head, udev->cmdr_size);
@@ -485,30 +703,29 @@ static int tcmu_queue_cmd_ring(struct tcmu_cmd *tcmu_cmd)
 	entry->hdr.kflags = 0;
 	entry->hdr.uflags = 0;
 
-	bitmap_copy(old_bitmap, udev->data_bitmap, DATA_BLOCK_BITS);
-
 	/*
 	 * Fix up iovecs, and handle if allocation in data ring wrapped.
 	 */
 	iov = &entry->req.iov[0];
 	iov_cnt = 0;
-	copy_to_data_area = (se_cmd->data_direction == DMA_TO_DEVICE
-		|| se_cmd->se_cmd_flags & SCF_BIDI);
-	alloc_and_scatter_data_area(udev, se_cmd->t_data_sg,
-		se_cmd->t_data_nents, &iov, &iov_cnt, copy_to_data_area);
+	if (zero_copy) {
+		tcmu_map_zc_data(udev, tcmu_cmd, &iov, &iov_cnt);
+	} else {
+		copy_to_data_area = (se_cmd->data_direction == DMA_TO_DEVICE
+			|| se_cmd->se_cmd_flags & SCF_BIDI);
+		scatter_data_area(udev, tcmu_cmd, se_cmd->t_data_sg,
+			se_cmd->t_data_nents, &iov, &iov_cnt,
+			copy_to_data_area);
+	}
 	entry->req.iov_cnt = iov_cnt;
 	entry->req.iov_dif_cnt = 0;
 
 	/* Handle BIDI commands */
 	iov_cnt = 0;
-	alloc_and_scatter_data_area(udev, se_cmd->t_bidi_data_sg,
+	scatter_data_area(udev, tcmu_cmd, se_cmd->t_bidi_data_sg,
 		se_cmd->t_bidi_data_nents, &iov, &iov_cnt, false);
 	entry->req.iov_bidi_cnt = iov_cnt;
 
-	/* cmd's data_bitmap is what changed in process */
-	bitmap_xor(tcmu_cmd->data_bitmap, old_bitmap, udev->data_bitmap,
-			DATA_BLOCK_BITS);
-
 	/* All offsets relative to mb_addr, not start of entry! */
 	cdb_off = CMDR_OFF + cmd_head + base_command_size;
 	memcpy((void *) mb + cdb_off, se_cmd->t_task_cdb, scsi_command_size(se_cmd->t_task_cdb));
@@ -518,7 +735,7 @@ static int tcmu_queue_cmd_ring(struct tcmu_cmd *tcmu_cmd)
 	UPDATE_HEAD(mb->cmd_head, command_size, udev->cmdr_size);
 	tcmu_flush_dcache_range(mb, sizeof(*mb));
 
-	spin_unlock_irq(&udev->cmdr_lock);
+	mutex_unlock(&udev->cmdr_lock);
 
 	/* TODO: only if FLUSH and FUA? */
 	uio_event_notify(&udev->uio_info);
@@ -547,7 +764,7 @@ static int tcmu_queue_cmd(struct se_cmd *se_cmd)
 		idr_remove(&udev->commands, tcmu_cmd->cmd_id);
 		spin_unlock_irq(&udev->commands_lock);
 
-		kmem_cache_free(tcmu_cmd_cache, tcmu_cmd);
+		tcmu_free_cmd(tcmu_cmd);
 	}
 
 	return ret;
@@ -557,6 +774,7 @@ static void tcmu_handle_completion(struct tcmu_cmd *cmd, struct tcmu_cmd_entry *
 {
 	struct se_cmd *se_cmd = cmd->se_cmd;
 	struct tcmu_dev *udev = cmd->tcmu_dev;
+	bool zero_copy;
 
 	if (test_bit(TCMU_CMD_BIT_EXPIRED, &cmd->flags)) {
 		/*
@@ -565,51 +783,48 @@ static void tcmu_handle_completion(struct tcmu_cmd *cmd, struct tcmu_cmd_entry *
 		 */
 		free_data_area(udev, cmd);
 
-		kmem_cache_free(tcmu_cmd_cache, cmd);
+		tcmu_free_cmd(cmd);
 		return;
 	}
 
+	/* Data-In of a zero-copy cmd is already in place */
+	zero_copy = test_bit(TCMU_CMD_BIT_ZERO_COPY, &cmd->flags);
+	tcmu_unmap_zc_data(udev, cmd);
+
+	cmd->dbi_cur = 0;
 	if (entry->hdr.uflags & TCMU_UFLAG_UNKNOWN_OP) {
-		free_data_area(udev, cmd);
 		pr_warn("TCMU: Userspace set UNKNOWN_OP flag on se_cmd %p\n",
 			cmd->se_cmd);
 		entry->rsp.scsi_status = SAM_STAT_CHECK_CONDITION;
 	} else if (entry->rsp.scsi_status == SAM_STAT_CHECK_CONDITION) {
 		memcpy(se_cmd->sense_buffer, entry->rsp.sense_buffer,
 			       se_cmd->scsi_sense_length);
-		free_data_area(udev, cmd);
 	} else if (se_cmd->se_cmd_flags & SCF_BIDI) {
-		DECLARE_BITMAP(bitmap, DATA_BLOCK_BITS);
-
-		/* Get Data-In buffer before clean up */
-		bitmap_copy(bitmap, cmd->data_bitmap, DATA_BLOCK_BITS);
-		gather_data_area(udev, bitmap,
+		/* Get Data-In buffer before clean up, it follows Data-Out */
+		cmd->dbi_cur = tcmu_sgl_blocks(se_cmd->t_data_sg,
+					       se_cmd->t_data_nents);
+		gather_data_area(udev, cmd,
 			se_cmd->t_bidi_data_sg, se_cmd->t_bidi_data_nents);
-		free_data_area(udev, cmd);
 	} else if (se_cmd->data_direction == DMA_FROM_DEVICE) {
-		DECLARE_BITMAP(bitmap, DATA_BLOCK_BITS);
-
-		bitmap_copy(bitmap, cmd->data_bitmap, DATA_BLOCK_BITS);
-		gather_data_area(udev, bitmap,
-			se_cmd->t_data_sg, se_cmd->t_data_nents);
-		free_data_area(udev, cmd);
-	} else if (se_cmd->data_direction == DMA_TO_DEVICE) {
-		free_data_area(udev, cmd);
-	} else if (se_cmd->data_direction != DMA_NONE) {
+		if (!zero_copy)
+			gather_data_area(udev, cmd,
+				se_cmd->t_data_sg, se_cmd->t_data_nents);
+	} else if (se_cmd->data_direction != DMA_TO_DEVICE &&
+		   se_cmd->data_direction != DMA_NONE) {
 		pr_warn("TCMU: data direction was %d!\n",
 			se_cmd->data_direction);
 	}
+	free_data_area(udev, cmd);
 
 	target_complete_cmd(cmd->se_cmd, entry->rsp.scsi_status);
 	cmd->se_cmd = NULL;
 
-	kmem_cache_free(tcmu_cmd_cache, cmd);
+	tcmu_free_cmd(cmd);
 }
 
 static unsigned int tcmu_handle_completions(struct tcmu_dev *udev)
 {
 	struct tcmu_mailbox *mb;
-	unsigned long flags;
 	int handled = 0;
 
 	if (test_bit(TCMU_DEV_BIT_BROKEN, &udev->flags)) {
@@ -617,7 +832,7 @@ static unsigned int tcmu_handle_completions(struct tcmu_dev *udev)
 		return 0;
 	}
 
-	spin_lock_irqsave(&udev->cmdr_lock, flags);
+	mutex_lock(&udev->cmdr_lock);
 
 	mb = udev->mb_addr;
 	tcmu_flush_dcache_range(mb, sizeof(*mb));
@@ -637,11 +852,11 @@ static unsigned int tcmu_handle_completions(struct tcmu_dev *udev)
 		}
 		WARN_ON(tcmu_hdr_get_op(entry->hdr.len_op) != TCMU_OP_CMD);
 
-		spin_lock(&udev->commands_lock);
+		spin_lock_irq(&udev->commands_lock);
 		cmd = idr_find(&udev->commands, entry->hdr.cmd_id);
 		if (cmd)
 			idr_remove(&udev->commands, cmd->cmd_id);
-		spin_unlock(&udev->commands_lock);
+		spin_unlock_irq(&udev->commands_lock);
 
 		if (!cmd) {
 			pr_err("cmd_id not found, ring is broken\n");
@@ -661,7 +876,7 @@ static unsigned int tcmu_handle_completions(struct tcmu_dev *udev)
 	if (mb->cmd_tail == mb->cmd_head)
 		del_timer(&udev->timeout); /* no more pending cmds */
 
-	spin_unlock_irqrestore(&udev->cmdr_lock, flags);
+	mutex_unlock(&udev->cmdr_lock);
 
 	wake_up(&udev->wait_cmdr);
 
@@ -671,6 +886,7 @@ static unsigned int tcmu_handle_completions(struct tcmu_dev *udev)
 static int tcmu_check_expired_cmd(int id, void *p, void *data)
 {
 	struct tcmu_cmd *cmd = p;
+	struct list_head *expired = data;
 
 	if (test_bit(TCMU_CMD_BIT_EXPIRED, &cmd->flags))
 		return 0;
@@ -679,25 +895,42 @@ static int tcmu_check_expired_cmd(int id, void *p, void *data)
 		return 0;
 
 	set_bit(TCMU_CMD_BIT_EXPIRED, &cmd->flags);
-	target_complete_cmd(cmd->se_cmd, SAM_STAT_CHECK_CONDITION);
-	cmd->se_cmd = NULL;
+	list_add_tail(&cmd->expired_entry, expired);
 
 	return 0;
 }
 
-static void tcmu_device_timedout(unsigned long data)
+static void tcmu_timeout_work(struct work_struct *work)
 {
-	struct tcmu_dev *udev = (struct tcmu_dev *)data;
-	unsigned long flags;
+	struct tcmu_dev *udev = container_of(work, struct tcmu_dev,
+					     timeout_work);
+	struct tcmu_cmd *cmd, *tmp;
+	LIST_HEAD(expired);
 	int handled;
 
 	handled = tcmu_handle_completions(udev);
 
 	pr_warn("%d completions handled from timeout\n", handled);
 
-	spin_lock_irqsave(&udev->commands_lock, flags);
-	idr_for_each(&udev->commands, tcmu_check_expired_cmd, NULL);
-	spin_unlock_irqrestore(&udev->commands_lock, flags);
+	/*
+	 * Holding cmdr_lock keeps userspace from completing the expired cmds
+	 * under us. Zero-copy pages can only be unmapped from process
+	 * context, which is why this runs from a work item.
+	 */
+	mutex_lock(&udev->cmdr_lock);
+
+	spin_lock_irq(&udev->commands_lock);
+	idr_for_each(&udev->commands, tcmu_check_expired_cmd, &expired);
+	spin_unlock_irq(&udev->commands_lock);
+
+	list_for_each_entry_safe(cmd, tmp, &expired, expired_entry) {
+		list_del_init(&cmd->expired_entry);
+		tcmu_unmap_zc_data(udev, cmd);
+		target_complete_cmd(cmd->se_cmd, SAM_STAT_CHECK_CONDITION);
+		cmd->se_cmd = NULL;
+	}
+
+	mutex_unlock(&udev->cmdr_lock);
 
 	/*
 	 * We don't need to wakeup threads on wait_cmdr since they have their
@@ -705,6 +938,13 @@ static void tcmu_device_timedout(unsigned long data)
 	 */
 }
 
+static void tcmu_device_timedout(unsigned long data)
+{
+	struct tcmu_dev *udev = (struct tcmu_dev *)data;
+
+	schedule_work(&udev->timeout_work);
+}
+
 static int tcmu_attach_hba(struct se_hba *hba, u32 host_id)
 {
 	struct tcmu_hba *tcmu_hba;
@@ -741,14 +981,17 @@ static struct se_device *tcmu_alloc_device(struct se_hba *hba, const char *name)
 
 	udev->hba = hba;
 
+	udev->max_data_area_mb = TCMU_DEF_MAX_DATA_AREA_MB;
+
 	init_waitqueue_head(&udev->wait_cmdr);
-	spin_lock_init(&udev->cmdr_lock);
+	mutex_init(&udev->cmdr_lock);
 
 	idr_init(&udev->commands);
 	spin_lock_init(&udev->commands_lock);
 
 	setup_timer(&udev->timeout, tcmu_device_timedout,
 		(unsigned long)udev);
+	INIT_WORK(&udev->timeout_work, tcmu_timeout_work);
 
 	return &udev->se_dev;
 }
@@ -785,6 +1028,7 @@ static int tcmu_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	struct uio_info *info = &udev->uio_info;
 	struct page *page;
 	unsigned long offset;
+	uint32_t dbi;
 	void *addr;
 
 	int mi = tcmu_find_mem_index(vma);
@@ -796,13 +1040,31 @@ static int tcmu_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	 * to use mem[N].
 	 */
 	offset = (vmf->pgoff - mi) << PAGE_SHIFT;
+	if (offset >= udev->ring_size)
+		return VM_FAULT_SIGBUS;
 
-	addr = (void *)(unsigned long)info->mem[mi].addr + offset;
-	if (info->mem[mi].memtype == UIO_MEM_LOGICAL)
-		page = virt_to_page(addr);
-	else
+	if (offset < udev->data_off) {
+		/* mailbox and command ring */
+		addr = (void *)(unsigned long)info->mem[mi].addr + offset;
 		page = vmalloc_to_page(addr);
-	get_page(page);
+		get_page(page);
+		vmf->page = page;
+		return 0;
+	}
+
+	dbi = (offset - udev->data_off) / DATA_BLOCK_SIZE;
+
+	mutex_lock(&udev->cmdr_lock);
+	page = udev->zc_pages[dbi];
+	if (!page)
+		page = tcmu_get_block_page(udev, dbi);
+	if (page)
+		get_page(page);
+	mutex_unlock(&udev->cmdr_lock);
+
+	if (!page)
+		return VM_FAULT_OOM;
+
 	vmf->page = page;
 	return 0;
 }
@@ -821,7 +1083,7 @@ static int tcmu_mmap(struct uio_info *info, struct vm_area_struct *vma)
 	vma->vm_private_data = udev;
 
 	/* Ensure the mmap is exactly the right size */
-	if (vma_pages(vma) != (TCMU_RING_SIZE >> PAGE_SHIFT))
+	if (vma_pages(vma) != (udev->ring_size >> PAGE_SHIFT))
 		return -EINVAL;
 
 	return 0;
@@ -835,6 +1097,9 @@ static int tcmu_open(struct uio_info *info, struct inode *inode)
 	if (test_and_set_bit(TCMU_DEV_BIT_OPEN, &udev->flags))
 		return -EBUSY;
 
+	/* needed to revoke userspace access to zero-copy pages */
+	udev->inode = inode;
+
 	pr_debug("open\n");
 
 	return 0;
@@ -888,6 +1153,27 @@ free_skb:
 	return ret;
 }
 
+static void tcmu_free_data_area(struct tcmu_dev *udev)
+{
+	uint32_t i;
+
+	if (udev->data_pages) {
+		for (i = 0; i < udev->max_blocks; i++)
+			if (udev->data_pages[i])
+				__free_page(udev->data_pages[i]);
+	}
+	vfree(udev->zc_pages);
+	vfree(udev->data_pages);
+	kfree(udev->data_bitmap);
+	vfree(udev->mb_addr);
+
+	udev->zc_pages = NULL;
+	udev->data_pages = NULL;
+	udev->data_bitmap = NULL;
+	udev->mb_addr = NULL;
+	udev->nr_data_pages = 0;
+}
+
 static int tcmu_configure_device(struct se_device *dev)
 {
 	struct tcmu_dev *udev = TCMU_DEV(dev);
@@ -915,16 +1201,25 @@ static int tcmu_configure_device(struct se_device *dev)
 
 	info->name = str;
 
-	udev->mb_addr = vzalloc(TCMU_RING_SIZE);
-	if (!udev->mb_addr) {
-		ret = -ENOMEM;
-		goto err_vzalloc;
-	}
-
 	/* mailbox fits in first part of CMDR space */
 	udev->cmdr_size = CMDR_SIZE - CMDR_OFF;
 	udev->data_off = CMDR_SIZE;
-	udev->data_size = TCMU_RING_SIZE - CMDR_SIZE;
+	udev->max_blocks = ((size_t)udev->max_data_area_mb << 20) /
+			   DATA_BLOCK_SIZE;
+	udev->data_size = (size_t)udev->max_blocks * DATA_BLOCK_SIZE;
+	udev->ring_size = CMDR_SIZE + udev->data_size;
+
+	/* Only the command ring is allocated now, data pages on demand */
+	udev->mb_addr = vzalloc(CMDR_SIZE);
+	udev->data_bitmap = kcalloc(BITS_TO_LONGS(udev->max_blocks),
+				    sizeof(unsigned long), GFP_KERNEL);
+	udev->data_pages = vzalloc(udev->max_blocks * sizeof(struct page *));
+	udev->zc_pages = vzalloc(udev->max_blocks * sizeof(struct page *));
+	if (!udev->mb_addr || !udev->data_bitmap || !udev->data_pages ||
+	    !udev->zc_pages) {
+		ret = -ENOMEM;
+		goto err_vzalloc;
+	}
 
 	mb = udev->mb_addr;
 	mb->version = TCMU_MAILBOX_VERSION;
@@ -940,7 +1235,7 @@ static int tcmu_configure_device(struct se_device *dev)
 
 	info->mem[0].name = "tcm-user command & data buffer";
 	info->mem[0].addr = (phys_addr_t)(uintptr_t)udev->mb_addr;
-	info->mem[0].size = TCMU_RING_SIZE;
+	info->mem[0].size = udev->ring_size;
 	info->mem[0].memtype = UIO_MEM_VIRTUAL;
 
 	info->irqcontrol = tcmu_irqcontrol;
@@ -952,7 +1247,7 @@ static int tcmu_configure_device(struct se_device *dev)
 
 	ret = uio_register_device(tcmu_root_device, info);
 	if (ret)
-		goto err_register;
+		goto err_vzalloc;
 
 	/* User can set hw_block_size before enable the device */
 	if (dev->dev_attrib.hw_block_size == 0)
@@ -970,9 +1265,8 @@ static int tcmu_configure_device(struct se_device *dev)
 
 err_netlink:
 	uio_unregister_device(&udev->uio_info);
-err_register:
-	vfree(udev->mb_addr);
 err_vzalloc:
+	tcmu_free_data_area(udev);
 	kfree(info->name);
 
 	return ret;
@@ -981,7 +1275,7 @@ err_vzalloc:
 static int tcmu_check_and_free_pending_cmd(struct tcmu_cmd *cmd)
 {
 	if (test_bit(TCMU_CMD_BIT_EXPIRED, &cmd->flags)) {
-		kmem_cache_free(tcmu_cmd_cache, cmd);
+		tcmu_free_cmd(cmd);
 		return 0;
 	}
 	return -EINVAL;
@@ -1003,8 +1297,7 @@ static void tcmu_free_device(struct se_device *dev)
 	int i;
 
 	del_timer_sync(&udev->timeout);
-
-	vfree(udev->mb_addr);
+	cancel_work_sync(&udev->timeout_work);
 
 	/* Upper layer should drain all requests before calling this */
 	spin_lock_irq(&udev->commands_lock);
@@ -1025,17 +1318,21 @@ static void tcmu_free_device(struct se_device *dev)
 		kfree(udev->uio_info.name);
 		kfree(udev->name);
 	}
+	tcmu_free_data_area(udev);
 	call_rcu(&dev->rcu_head, tcmu_dev_call_rcu);
 }
 
 enum {
-	Opt_dev_config, Opt_dev_size, Opt_hw_block_size, Opt_err,
+	Opt_dev_config, Opt_dev_size, Opt_hw_block_size, Opt_max_data_area_mb,
+	Opt_zero_copy, Opt_err,
 };
 
 static match_table_t tokens = {
 	{Opt_dev_config, "dev_config=%s"},
 	{Opt_dev_size, "dev_size=%u"},
 	{Opt_hw_block_size, "hw_block_size=%u"},
+	{Opt_max_data_area_mb, "max_data_area_mb=%u"},
+	{Opt_zero_copy, "zero_copy=%u"},
 	{Opt_err, NULL}
 };
 
@@ -1097,6 +1394,45 @@ static ssize_t tcmu_set_configfs_dev_params(struct se_device *dev,
 			}
 			dev->dev_attrib.hw_block_size = tmp_ul;
 			break;
+		case Opt_max_data_area_mb:
+			if (udev->mb_addr) {
+				pr_err("max_data_area_mb can only be set before the device is enabled\n");
+				ret = -EBUSY;
+				break;
+			}
+			arg_p = match_strdup(&args[0]);
+			if (!arg_p) {
+				ret = -ENOMEM;
+				break;
+			}
+			ret = kstrtoul(arg_p, 0, &tmp_ul);
+			kfree(arg_p);
+			if (ret < 0) {
+				pr_err("kstrtoul() failed for max_data_area_mb=\n");
+				break;
+			}
+			if (!tmp_ul || tmp_ul > TCMU_MAX_DATA_AREA_MB) {
+				pr_err("max_data_area_mb must be between 1 and %u\n",
+				       TCMU_MAX_DATA_AREA_MB);
+				ret = -EINVAL;
+				break;
+			}
+			udev->max_data_area_mb = tmp_ul;
+			break;
+		case Opt_zero_copy:
+			arg_p = match_strdup(&args[0]);
+			if (!arg_p) {
+				ret = -ENOMEM;
+				break;
+			}
+			ret = kstrtoul(arg_p, 0, &tmp_ul);
+			kfree(arg_p);
+			if (ret < 0) {
+				pr_err("kstrtoul() failed for zero_copy=\n");
+				break;
+			}
+			udev->zero_copy = !!tmp_ul;
+			break;
 		default:
 			break;
 		}
@@ -1113,7 +1449,10 @@ static ssize_t tcmu_show_configfs_dev_params(struct se_device *dev, char *b)
 
 	bl = sprintf(b + bl, "Config: %s ",
 		     udev->dev_config[0] ? udev->dev_config : "NULL");
-	bl += sprintf(b + bl, "Size: %zu\n", udev->dev_size);
+	bl += sprintf(b + bl, "Size: %zu ", udev->dev_size);
+	bl += sprintf(b + bl, "MaxDataAreaMB: %u DataPages: %u ZeroCopy: %d\n",
+		      udev->max_data_area_mb, udev->nr_data_pages,
+		      udev->zero_copy);
 
 	return bl;
 }
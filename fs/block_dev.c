@@ -241,6 +241,8 @@ __blkdev_direct_IO_simple(struct kiocb *iocb, struct iov_iter *iter,
 		bio.bi_opf = dio_bio_write_op(iocb);
 		task_io_account_write(ret);
 	}
+	if (iocb->ki_flags & IOCB_HIPRI)
+		bio.bi_opf |= REQ_HIPRI;
 
 	qc = submit_bio(&bio);
 	for (;;) {
@@ -382,6 +384,13 @@ __blkdev_direct_IO(struct kiocb *iocb, struct iov_iter *iter, int nr_pages)
 
 		nr_pages = iov_iter_npages(iter, BIO_MAX_PAGES);
 		if (!nr_pages) {
+			/*
+			 * Only a lone bio of a sync dio can use a poll queue,
+			 * we poll for nothing but the last cookie below.
+			 */
+			if (is_sync && !dio->multi_bio &&
+			    (iocb->ki_flags & IOCB_HIPRI))
+				bio->bi_opf |= REQ_HIPRI;
 			qc = submit_bio(bio);
 			break;
 		}
@@ -31,6 +31,7 @@
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/buffer_head.h>
+#include <linux/bio.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -78,86 +79,165 @@ static struct buffer_head *get_block_length(struct super_block *sb,
 }
 
 
+static void squashfs_bio_end_io(struct bio *bio)
+{
+	struct bio_vec *bvec;
+	int i;
+
+	/*
+	 * Bios are only ever built from runs of consecutive buffers, so
+	 * every buffer of the page inside a segment belongs to this bio.
+	 */
+	bio_for_each_segment_all(bvec, bio, i) {
+		struct buffer_head *head = page_buffers(bvec->bv_page);
+		struct buffer_head *bh = head;
+
+		do {
+			if (bh_offset(bh) < bvec->bv_offset ||
+			    bh_offset(bh) >= bvec->bv_offset + bvec->bv_len)
+				continue;
+			if (bio->bi_error)
+				clear_buffer_uptodate(bh);
+			else
+				set_buffer_uptodate(bh);
+			unlock_buffer(bh);
+			put_bh(bh);
+		} while ((bh = bh->b_this_page) != head);
+	}
+
+	bio_put(bio);
+}
+
+
 /*
- * Read and decompress a metadata block or datablock.  Length is non-zero
- * if a datablock is being read (the size is stored elsewhere in the
- * filesystem), otherwise the length is obtained from the first two bytes of
- * the metadata block.  A bit in the length field indicates if the block
- * is stored uncompressed in the filesystem (usually because compression
- * generated a larger block - this does occasionally happen with compression
- * algorithms).
+ * Issue reads for the buffers in bh[], merging consecutive buffers into as
+ * few bios as possible.  Like ll_rw_block(), buffers which are uptodate or
+ * locked by somebody else are skipped, the caller waits on them all, and
+ * the bios hold their own references so the caller need not wait at all.
  */
-int squashfs_read_data(struct super_block *sb, u64 index, int length,
-		u64 *next_index, struct squashfs_page_actor *output)
+static void squashfs_submit_bh(struct buffer_head **bh, int b)
+{
+	struct bio *bio = NULL;
+	int i;
+
+	for (i = 0; i < b; i++) {
+		if (!trylock_buffer(bh[i]))
+			goto skip;
+		if (buffer_uptodate(bh[i])) {
+			unlock_buffer(bh[i]);
+			goto skip;
+		}
+		get_bh(bh[i]);
+
+		if (bio && bio_add_page(bio, bh[i]->b_page, bh[i]->b_size,
+					bh_offset(bh[i])) == bh[i]->b_size)
+			continue;
+		if (bio)
+			submit_bio(bio);
+
+		bio = bio_alloc(GFP_NOIO, min_t(int, b - i, BIO_MAX_PAGES));
+		bio->bi_bdev = bh[i]->b_bdev;
+		bio->bi_iter.bi_sector = bh[i]->b_blocknr *
+						(bh[i]->b_size >> 9);
+		bio->bi_end_io = squashfs_bio_end_io;
+		bio_set_op_attrs(bio, REQ_OP_READ, 0);
+		bio_add_page(bio, bh[i]->b_page, bh[i]->b_size,
+						bh_offset(bh[i]));
+		continue;
+skip:
+		/* the next buffer doesn't follow on from the bio any more */
+		if (bio)
+			submit_bio(bio);
+		bio = NULL;
+	}
+
+	if (bio)
+		submit_bio(bio);
+}
+
+
+/*
+ * Start reading the datablock of on-disk size @length (compressed bit
+ * included) at @index, of which at most @srclength bytes are expected.
+ * The buffers covering it are returned in @bh, which must have room for
+ * (srclength >> devblksize_log2) + 1 entries, and their number is
+ * returned.  Nothing is waited on, squashfs_read_data_end() does that.
+ */
+int squashfs_read_data_start(struct super_block *sb, u64 index, int length,
+		int srclength, struct buffer_head **bh)
 {
 	struct squashfs_sb_info *msblk = sb->s_fs_info;
-	struct buffer_head **bh;
 	int offset = index & ((1 << msblk->devblksize_log2) - 1);
 	u64 cur_index = index >> msblk->devblksize_log2;
-	int bytes, compressed, b = 0, k = 0, avail, i;
+	int compressed = SQUASHFS_COMPRESSED_BLOCK(length);
+	int bytes = -offset, b;
 
-	bh = kcalloc(((output->length + msblk->devblksize - 1)
-		>> msblk->devblksize_log2) + 1, sizeof(*bh), GFP_KERNEL);
-	if (bh == NULL)
-		return -ENOMEM;
+	length = SQUASHFS_COMPRESSED_SIZE_BLOCK(length);
 
-	if (length) {
-		/*
-		 * Datablock.
-		 */
-		bytes = -offset;
-		compressed = SQUASHFS_COMPRESSED_BLOCK(length);
-		length = SQUASHFS_COMPRESSED_SIZE_BLOCK(length);
-		if (next_index)
-			*next_index = index + length;
+	TRACE("Block @ 0x%llx, %scompressed size %d, src size %d\n",
+		index, compressed ? "" : "un", length, srclength);
 
-		TRACE("Block @ 0x%llx, %scompressed size %d, src size %d\n",
-			index, compressed ? "" : "un", length, output->length);
+	if (length < 0 || length > srclength ||
+			(index + length) > msblk->bytes_used)
+		return -EIO;
 
-		if (length < 0 || length > output->length ||
-				(index + length) > msblk->bytes_used)
-			goto read_failure;
-
-		for (b = 0; bytes < length; b++, cur_index++) {
-			bh[b] = sb_getblk(sb, cur_index);
-			if (bh[b] == NULL)
-				goto block_release;
-			bytes += msblk->devblksize;
+	for (b = 0; bytes < length; b++, cur_index++) {
+		bh[b] = sb_getblk(sb, cur_index);
+		if (bh[b] == NULL) {
+			while (b--)
+				put_bh(bh[b]);
+			return -EIO;
 		}
-		ll_rw_block(REQ_OP_READ, 0, b, bh);
-	} else {
-		/*
-		 * Metadata block.
-		 */
-		if ((index + 2) > msblk->bytes_used)
-			goto read_failure;
+		bytes += msblk->devblksize;
+	}
+	squashfs_submit_bh(bh, b);
 
-		bh[0] = get_block_length(sb, &cur_index, &offset, &length);
-		if (bh[0] == NULL)
-			goto read_failure;
-		b = 1;
+	return b;
+}
 
-		bytes = msblk->devblksize - offset;
-		compressed = SQUASHFS_COMPRESSED(length);
-		length = SQUASHFS_COMPRESSED_SIZE(length);
-		if (next_index)
-			*next_index = index + length + 2;
 
-		TRACE("Block @ 0x%llx, %scompressed size %d\n", index,
-				compressed ? "" : "un", length);
+/*
+ * Start reading the metadata block at @index without waiting for it, so
+ * that it is on its way by the time squashfs_read_data() gets there.  Its
+ * length isn't known yet, so read as much as a metadata block can take.
+ */
+void squashfs_read_data_ahead(struct super_block *sb, u64 index)
+{
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	struct buffer_head *bh[((SQUASHFS_METADATA_SIZE + 2) >>
+					BLOCK_SIZE_BITS) + 2];
+	int offset = index & ((1 << msblk->devblksize_log2) - 1);
+	u64 cur_index = index >> msblk->devblksize_log2;
+	int bytes = -offset, length, b;
 
-		if (length < 0 || length > output->length ||
-					(index + length) > msblk->bytes_used)
-			goto block_release;
+	if (index >= msblk->bytes_used)
+		return;
+	length = min_t(u64, SQUASHFS_METADATA_SIZE + 2,
+			msblk->bytes_used - index);
 
-		for (; bytes < length; b++) {
-			bh[b] = sb_getblk(sb, ++cur_index);
-			if (bh[b] == NULL)
-				goto block_release;
-			bytes += msblk->devblksize;
-		}
-		ll_rw_block(REQ_OP_READ, 0, b - 1, bh + 1);
+	for (b = 0; bytes < length && b < ARRAY_SIZE(bh); b++, cur_index++) {
+		bh[b] = sb_getblk(sb, cur_index);
+		if (bh[b] == NULL)
+			break;
+		bytes += msblk->devblksize;
 	}
+	squashfs_submit_bh(bh, b);
+
+	while (b--)
+		put_bh(bh[b]);
+}
+
+
+/*
+ * Wait for the @b buffers holding @length bytes starting at @offset into
+ * the first one, and decompress or copy them into @output.  The buffers
+ * are released in all cases.
+ */
+static int squashfs_read_bh(struct squashfs_sb_info *msblk,
+		struct buffer_head **bh, int b, int offset, int length,
+		int compressed, struct squashfs_page_actor *output)
+{
+	int bytes, k = 0, avail, i;
 
 	for (i = 0; i < b; i++) {
 		wait_on_buffer(bh[i]);
@@ -165,15 +245,14 @@ int squashfs_read_data(struct super_block *sb, u64 index, int length,
 			goto block_release;
 	}
 
-	if (compressed) {
-		length = squashfs_decompress(msblk, bh, b, offset, length,
+	if (compressed)
+		return squashfs_decompress(msblk, bh, b, offset, length,
 			output);
-		if (length < 0)
-			goto read_failure;
-	} else {
-		/*
-		 * Block is uncompressed.
-		 */
+
+	/*
+	 * Block is uncompressed.
+	 */
+	{
 		int in, pg_offset = 0;
 		void *data = squashfs_first_page(output);
 
@@ -199,6 +278,115 @@ int squashfs_read_data(struct super_block *sb, u64 index, int length,
 		squashfs_finish_page(output);
 	}
 
+	return length;
+
+block_release:
+	for (; k < b; k++)
+		put_bh(bh[k]);
+	return -EIO;
+}
+
+
+/*
+ * Finish a datablock read started by squashfs_read_data_start(), returning
+ * the decompressed length.
+ */
+int squashfs_read_data_end(struct super_block *sb, u64 index, int length,
+		struct buffer_head **bh, int b, struct squashfs_page_actor *output)
+{
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	int offset = index & ((1 << msblk->devblksize_log2) - 1);
+	int res;
+
+	res = squashfs_read_bh(msblk, bh, b, offset,
+		SQUASHFS_COMPRESSED_SIZE_BLOCK(length),
+		SQUASHFS_COMPRESSED_BLOCK(length), output);
+	if (res < 0)
+		ERROR("squashfs_read_data failed to read block 0x%llx\n",
+					(unsigned long long) index);
+	return res;
+}
+
+
+/*
+ * Read and decompress a metadata block or datablock.  Length is non-zero
+ * if a datablock is being read (the size is stored elsewhere in the
+ * filesystem), otherwise the length is obtained from the first two bytes of
+ * the metadata block.  A bit in the length field indicates if the block
+ * is stored uncompressed in the filesystem (usually because compression
+ * generated a larger block - this does occasionally happen with compression
+ * algorithms).
+ */
+int squashfs_read_data(struct super_block *sb, u64 index, int length,
+		u64 *next_index, struct squashfs_page_actor *output)
+{
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	struct buffer_head **bh;
+	int offset = index & ((1 << msblk->devblksize_log2) - 1);
+	u64 cur_index = index >> msblk->devblksize_log2;
+	int bytes, compressed, b = 0, k = 0;
+
+	bh = kcalloc(((output->length + msblk->devblksize - 1)
+		>> msblk->devblksize_log2) + 1, sizeof(*bh), GFP_KERNEL);
+	if (bh == NULL)
+		return -ENOMEM;
+
+	if (length) {
+		/*
+		 * Datablock.
+		 */
+		if (next_index)
+			*next_index = index +
+				SQUASHFS_COMPRESSED_SIZE_BLOCK(length);
+
+		b = squashfs_read_data_start(sb, index, length, output->length,
+			bh);
+		if (b < 0)
+			goto read_failure;
+
+		length = squashfs_read_data_end(sb, index, length, bh, b,
+			output);
+		kfree(bh);
+		return length;
+	}
+
+	/*
+	 * Metadata block.
+	 */
+	if ((index + 2) > msblk->bytes_used)
+		goto read_failure;
+
+	bh[0] = get_block_length(sb, &cur_index, &offset, &length);
+	if (bh[0] == NULL)
+		goto read_failure;
+	b = 1;
+
+	bytes = msblk->devblksize - offset;
+	compressed = SQUASHFS_COMPRESSED(length);
+	length = SQUASHFS_COMPRESSED_SIZE(length);
+	if (next_index)
+		*next_index = index + length + 2;
+
+	TRACE("Block @ 0x%llx, %scompressed size %d\n", index,
+			compressed ? "" : "un", length);
+
+	if (length < 0 || length > output->length ||
+				(index + length) > msblk->bytes_used)
+		goto block_release;
+
+	for (; bytes < length; b++) {
+		bh[b] = sb_getblk(sb, ++cur_index);
+		if (bh[b] == NULL)
+			goto block_release;
+		bytes += msblk->devblksize;
+	}
+	squashfs_submit_bh(bh + 1, b - 1);
+
+	length = squashfs_read_bh(msblk, bh, b, offset, length, compressed,
+		output);
+	if (length < 0)
+		goto read_failure;
+
 	kfree(bh);
 	return length;
 
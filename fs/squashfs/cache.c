@@ -42,6 +42,12 @@
  * have been packed with it, these because of locality-of-reference may be read
  * in the near future. Temporarily caching them ensures they are available for
  * near future access without requiring an additional read and decompress.
+ *
+ * Each cache is split into a power of two number of shards, and a block is
+ * always looked up in the shard its location hashes to.  Lookups of
+ * unrelated blocks therefore neither contend on a lock nor wait for each
+ * other's entries to become free.  Misses in the metadata cache also start
+ * reading the following metadata block, which is very likely needed next.
  */
 
 #include <linux/fs.h>
@@ -52,12 +58,69 @@
 #include <linux/spinlock.h>
 #include <linux/wait.h>
 #include <linux/pagemap.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/cpumask.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
 #include "squashfs.h"
 #include "page_actor.h"
 
+static struct squashfs_cache_shard *squashfs_cache_shard(
+	struct squashfs_cache *cache, u64 block)
+{
+	if (cache->shards == 1)
+		return cache->shard;
+	return &cache->shard[hash_64(block, ilog2(cache->shards))];
+}
+
+
+/*
+ * Find block in shard, starting from the last entry found.  Called with the
+ * shard lock held.
+ */
+static int squashfs_cache_lookup(struct squashfs_cache_shard *shard,
+	u64 block)
+{
+	int i, n;
+
+	for (i = shard->curr_blk, n = 0; n < shard->entries; n++) {
+		if (shard->entry[i].block == block) {
+			shard->curr_blk = i;
+			return i;
+		}
+		i = (i + 1) % shard->entries;
+	}
+
+	return -1;
+}
+
+
+/*
+ * Start reading the metadata block at <block> unless it is already cached.
+ */
+static void squashfs_cache_readahead(struct super_block *sb,
+	struct squashfs_cache *cache, u64 block)
+{
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	struct squashfs_cache_shard *shard = squashfs_cache_shard(cache, block);
+
+	if (block >= msblk->bytes_used)
+		return;
+
+	spin_lock(&shard->lock);
+	if (squashfs_cache_lookup(shard, block) >= 0) {
+		spin_unlock(&shard->lock);
+		return;
+	}
+	shard->stat[SQUASHFS_CACHE_READAHEADS]++;
+	spin_unlock(&shard->lock);
+
+	squashfs_read_data_ahead(sb, block);
+}
+
+
 /*
  * Look-up block in cache, and increment usage count.  If not in cache, read
  * and decompress it from disk.
@@ -65,31 +128,27 @@
 struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 	struct squashfs_cache *cache, u64 block, int length)
 {
+	struct squashfs_cache_shard *shard = squashfs_cache_shard(cache, block);
 	int i, n;
 	struct squashfs_cache_entry *entry;
 
-	spin_lock(&cache->lock);
+	spin_lock(&shard->lock);
 
 	while (1) {
-		for (i = cache->curr_blk, n = 0; n < cache->entries; n++) {
-			if (cache->entry[i].block == block) {
-				cache->curr_blk = i;
-				break;
-			}
-			i = (i + 1) % cache->entries;
-		}
-
-		if (n == cache->entries) {
+		i = squashfs_cache_lookup(shard, block);
+		if (i < 0) {
 			/*
-			 * Block not in cache, if all cache entries are used
-			 * go to sleep waiting for one to become available.
+			 * Block not in cache, if all entries of its shard are
+			 * used go to sleep waiting for one to become
+			 * available.
 			 */
-			if (cache->unused == 0) {
-				cache->num_waiters++;
-				spin_unlock(&cache->lock);
-				wait_event(cache->wait_queue, cache->unused);
-				spin_lock(&cache->lock);
-				cache->num_waiters--;
+			if (shard->unused == 0) {
+				shard->stat[SQUASHFS_CACHE_WAITS]++;
+				shard->num_waiters++;
+				spin_unlock(&shard->lock);
+				wait_event(shard->wait_queue, shard->unused);
+				spin_lock(&shard->lock);
+				shard->num_waiters--;
 				continue;
 			}
 
@@ -98,32 +157,33 @@ struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 			 * round-robin strategy is used to choose the entry to
 			 * be evicted from the cache.
 			 */
-			i = cache->next_blk;
-			for (n = 0; n < cache->entries; n++) {
-				if (cache->entry[i].refcount == 0)
+			i = shard->next_blk;
+			for (n = 0; n < shard->entries; n++) {
+				if (shard->entry[i].refcount == 0)
 					break;
-				i = (i + 1) % cache->entries;
+				i = (i + 1) % shard->entries;
 			}
 
-			cache->next_blk = (i + 1) % cache->entries;
-			entry = &cache->entry[i];
+			shard->next_blk = (i + 1) % shard->entries;
+			entry = &shard->entry[i];
 
 			/*
 			 * Initialise chosen cache entry, and fill it in from
 			 * disk.
 			 */
-			cache->unused--;
+			shard->stat[SQUASHFS_CACHE_MISSES]++;
+			shard->unused--;
 			entry->block = block;
 			entry->refcount = 1;
 			entry->pending = 1;
 			entry->num_waiters = 0;
 			entry->error = 0;
-			spin_unlock(&cache->lock);
+			spin_unlock(&shard->lock);
 
 			entry->length = squashfs_read_data(sb, block, length,
 				&entry->next_index, entry->actor);
 
-			spin_lock(&cache->lock);
+			spin_lock(&shard->lock);
 
 			if (entry->length < 0)
 				entry->error = entry->length;
@@ -136,10 +196,15 @@ struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 			 * waiting for it to become available.
 			 */
 			if (entry->num_waiters) {
-				spin_unlock(&cache->lock);
+				spin_unlock(&shard->lock);
 				wake_up_all(&entry->wait_queue);
 			} else
-				spin_unlock(&cache->lock);
+				spin_unlock(&shard->lock);
+
+			/* Metadata is read sequentially, get the next block */
+			if (!length && !entry->error)
+				squashfs_cache_readahead(sb, cache,
+					entry->next_index);
 
 			goto out;
 		}
@@ -150,9 +215,10 @@ struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 		 * previously unused there's one less cache entry available
 		 * for reuse.
 		 */
-		entry = &cache->entry[i];
+		entry = &shard->entry[i];
+		shard->stat[SQUASHFS_CACHE_HITS]++;
 		if (entry->refcount == 0)
-			cache->unused--;
+			shard->unused--;
 		entry->refcount++;
 
 		/*
@@ -160,11 +226,12 @@ struct squashfs_cache_entry *squashfs_cache_get(struct super_block *sb,
 		 * go to sleep waiting for it to become available.
 		 */
 		if (entry->pending) {
+			shard->stat[SQUASHFS_CACHE_WAITS]++;
 			entry->num_waiters++;
-			spin_unlock(&cache->lock);
+			spin_unlock(&shard->lock);
 			wait_event(entry->wait_queue, !entry->pending);
 		} else
-			spin_unlock(&cache->lock);
+			spin_unlock(&shard->lock);
 
 		goto out;
 	}
@@ -185,23 +252,42 @@ out:
  */
 void squashfs_cache_put(struct squashfs_cache_entry *entry)
 {
-	struct squashfs_cache *cache = entry->cache;
+	struct squashfs_cache_shard *shard = entry->shard;
 
-	spin_lock(&cache->lock);
+	spin_lock(&shard->lock);
 	entry->refcount--;
 	if (entry->refcount == 0) {
-		cache->unused++;
+		shard->unused++;
 		/*
 		 * If there's any processes waiting for a block to become
 		 * available, wake one up.
 		 */
-		if (cache->num_waiters) {
-			spin_unlock(&cache->lock);
-			wake_up(&cache->wait_queue);
+		if (shard->num_waiters) {
+			spin_unlock(&shard->lock);
+			wake_up(&shard->wait_queue);
 			return;
 		}
 	}
-	spin_unlock(&cache->lock);
+	spin_unlock(&shard->lock);
+}
+
+
+/*
+ * Return the sum over all shards of one of the cache statistics.
+ */
+unsigned long squashfs_cache_stat(struct squashfs_cache *cache,
+	enum squashfs_cache_stat stat)
+{
+	unsigned long sum = 0;
+	int i;
+
+	if (cache == NULL)
+		return 0;
+
+	for (i = 0; i < cache->shards; i++)
+		sum += READ_ONCE(cache->shard[i].stat[stat]);
+
+	return sum;
 }
 
 /*
@@ -223,6 +309,7 @@ void squashfs_cache_delete(struct squashfs_cache *cache)
 		kfree(cache->entry[i].actor);
 	}
 
+	kfree(cache->shard);
 	kfree(cache->entry);
 	kfree(cache);
 }
@@ -232,11 +319,15 @@ void squashfs_cache_delete(struct squashfs_cache *cache)
  * Initialise cache allocating the specified number of entries, each of
  * size block_size.  To avoid vmalloc fragmentation issues each entry
  * is allocated as a sequence of kmalloced PAGE_CACHE_SIZE buffers.
+ *
+ * The entries are spread over up to one shard per online cpu, keeping at
+ * least SQUASHFS_CACHE_SHARD_MIN entries in each.
  */
 struct squashfs_cache *squashfs_cache_init(char *name, int entries,
 	int block_size)
 {
-	int i, j;
+	int i, j, shards;
+	struct squashfs_cache_entry *entry;
 	struct squashfs_cache *cache = kzalloc(sizeof(*cache), GFP_KERNEL);
 
 	if (cache == NULL) {
@@ -244,26 +335,39 @@ struct squashfs_cache *squashfs_cache_init(char *name, int entries,
 		return NULL;
 	}
 
+	shards = min3(entries / SQUASHFS_CACHE_SHARD_MIN,
+		(int) num_online_cpus(), SQUASHFS_CACHE_SHARDS_MAX);
+	shards = shards > 1 ? rounddown_pow_of_two(shards) : 1;
+
 	cache->entry = kcalloc(entries, sizeof(*(cache->entry)), GFP_KERNEL);
-	if (cache->entry == NULL) {
+	cache->shard = kcalloc(shards, sizeof(*(cache->shard)), GFP_KERNEL);
+	if (cache->entry == NULL || cache->shard == NULL) {
 		ERROR("Failed to allocate %s cache\n", name);
 		goto cleanup;
 	}
 
-	cache->curr_blk = 0;
-	cache->next_blk = 0;
-	cache->unused = entries;
 	cache->entries = entries;
+	cache->shards = shards;
 	cache->block_size = block_size;
 	cache->pages = block_size >> PAGE_CACHE_SHIFT;
 	cache->pages = cache->pages ? cache->pages : 1;
 	cache->name = name;
-	cache->num_waiters = 0;
-	spin_lock_init(&cache->lock);
-	init_waitqueue_head(&cache->wait_queue);
+
+	for (entry = cache->entry, i = 0; i < shards; i++) {
+		struct squashfs_cache_shard *shard = &cache->shard[i];
+
+		shard->entries = entries / shards + (i < entries % shards);
+		shard->unused = shard->entries;
+		shard->entry = entry;
+		spin_lock_init(&shard->lock);
+		init_waitqueue_head(&shard->wait_queue);
+
+		for (j = 0; j < shard->entries; j++)
+			entry++->shard = shard;
+	}
 
 	for (i = 0; i < entries; i++) {
-		struct squashfs_cache_entry *entry = &cache->entry[i];
+		entry = &cache->entry[i];
 
 		init_waitqueue_head(&cache->entry[i].wait_queue);
 		entry->cache = cache;
@@ -47,6 +47,7 @@
 #include <linux/string.h>
 #include <linux/pagemap.h>
 #include <linux/mutex.h>
+#include <linux/blkdev.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -329,14 +330,16 @@ failed:
 
 
 /*
- * Get the on-disk location and compressed size of the datablock
- * specified by index.  Fill_meta_index() does most of the work.
+ * Get the on-disk location and compressed size of the @n consecutive
+ * datablocks starting at the one specified by index.  Fill_meta_index()
+ * does most of the work.
  */
-static int read_blocklist(struct inode *inode, int index, u64 *block)
+static int read_blocklist_run(struct inode *inode, int index, int n,
+	u64 *block, int *bsize)
 {
 	u64 start;
 	long long blks;
-	int offset;
+	int offset, i;
 	__le32 size;
 	int res = fill_meta_index(inode, index, &start, &offset, block);
 
@@ -361,13 +364,33 @@ static int read_blocklist(struct inode *inode, int index, u64 *block)
 	}
 
 	/*
-	 * Read length of block specified by index.
+	 * Read length of blocks specified by index onwards, each block
+	 * starts where the previous one ends.
 	 */
-	res = squashfs_read_metadata(inode->i_sb, &size, &start, &offset,
-			sizeof(size));
-	if (res < 0)
-		return res;
-	return le32_to_cpu(size);
+	for (i = 0; i < n; i++) {
+		res = squashfs_read_metadata(inode->i_sb, &size, &start,
+				&offset, sizeof(size));
+		if (res < 0)
+			return res;
+		bsize[i] = le32_to_cpu(size);
+		if (i)
+			block[i] = block[i - 1] +
+				SQUASHFS_COMPRESSED_SIZE_BLOCK(bsize[i - 1]);
+	}
+	return 0;
+}
+
+
+/*
+ * Get the on-disk location and compressed size of the datablock
+ * specified by index.
+ */
+static int read_blocklist(struct inode *inode, int index, u64 *block)
+{
+	int bsize;
+	int res = read_blocklist_run(inode, index, 1, block, &bsize);
+
+	return res < 0 ? res : bsize;
 }
 
 /* Copy data into page cache  */
@@ -497,7 +520,123 @@ out:
 	return 0;
 }
 
+#ifdef CONFIG_SQUASHFS_FILE_DIRECT
+/*
+ * Readahead.  Datablocks whose pages are all in the readahead window, or
+ * can be grabbed from the page cache like squashfs_readpage_block() does,
+ * have their reads issued together and are then decompressed in parallel
+ * by squashfs_read_wq.  Everything else (sparse blocks, the fragment tail
+ * end and blocks with busy pages) goes through squashfs_readpage().
+ */
+static int squashfs_readpages(struct file *file, struct address_space *mapping,
+	struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	gfp_t gfp = mapping_gfp_constraint(mapping, GFP_KERNEL);
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+	int mask = (1 << shift) - 1;
+	int file_end = i_size_read(inode) >> msblk->block_log;
+	pgoff_t last_page = (i_size_read(inode) - 1) >> PAGE_CACHE_SHIFT;
+	int first, nblocks, index, start_index, n, i, missing;
+	int *bsize = NULL;
+	u64 *block = NULL;
+	struct page **page;
+	struct page *p;
+	struct blk_plug plug;
+	LIST_HEAD(ra_list);
+
+	page = kcalloc(1 << shift, sizeof(*page), GFP_KERNEL);
+	if (page == NULL)
+		return -ENOMEM;
+
+	first = list_entry(pages->prev, struct page, lru)->index >> shift;
+	nblocks = (list_entry(pages->next, struct page, lru)->index >> shift) -
+		first + 1;
+	if (squashfs_i(inode)->fragment_block != SQUASHFS_INVALID_BLK &&
+			first + nblocks > file_end)
+		nblocks = file_end - first;
+
+	if (nblocks > 0) {
+		block = kmalloc_array(nblocks, sizeof(*block), GFP_KERNEL);
+		bsize = kmalloc_array(nblocks, sizeof(*bsize), GFP_KERNEL);
+		if (block == NULL || bsize == NULL ||
+				read_blocklist_run(inode, first, nblocks, block,
+					bsize) < 0)
+			nblocks = 0;
+	}
+
+	blk_start_plug(&plug);
+	while (!list_empty(pages)) {
+		p = list_entry(pages->prev, struct page, lru);
+		index = (p->index >> shift) - first;
+
+		if (p->index > last_page || index < 0 || index >= nblocks) {
+			list_del(&p->lru);
+			if (!add_to_page_cache_lru(p, mapping, p->index, gfp))
+				squashfs_readpage(file, p);
+			page_cache_release(p);
+			continue;
+		}
+
+		/* Take the pages of this block off the list */
+		start_index = p->index & ~mask;
+		n = min_t(pgoff_t, start_index | mask, last_page) -
+			start_index + 1;
+		memset(page, 0, n * sizeof(*page));
+		while (!list_empty(pages)) {
+			p = list_entry(pages->prev, struct page, lru);
+			if (p->index < start_index ||
+					p->index >= start_index + n)
+				break;
+			list_del(&p->lru);
+			if (!add_to_page_cache_lru(p, mapping, p->index, gfp))
+				page[p->index - start_index] = p;
+			else
+				page_cache_release(p);
+		}
+
+		/* and try to grab the rest */
+		for (missing = 0, i = 0; i < n && bsize[index]; i++) {
+			if (page[i] == NULL)
+				page[i] = grab_cache_page_nowait(mapping,
+					start_index + i);
+			if (page[i] && PageUptodate(page[i])) {
+				unlock_page(page[i]);
+				page_cache_release(page[i]);
+				page[i] = NULL;
+			}
+			if (page[i] == NULL)
+				missing++;
+		}
+
+		if (bsize[index] && !missing &&
+				!squashfs_readahead_block(page, n, block[index],
+					bsize[index], &ra_list))
+			continue;
+
+		for (i = 0; i < n; i++) {
+			if (page[i] == NULL)
+				continue;
+			squashfs_readpage(file, page[i]);
+			page_cache_release(page[i]);
+		}
+	}
+	blk_finish_plug(&plug);
+
+	squashfs_readahead_start(&ra_list);
+
+	kfree(bsize);
+	kfree(block);
+	kfree(page);
+	return 0;
+}
+#endif
+
 
 const struct address_space_operations squashfs_aops = {
-	.readpage = squashfs_readpage
+	.readpage = squashfs_readpage,
+#ifdef CONFIG_SQUASHFS_FILE_DIRECT
+	.readpages = squashfs_readpages,
+#endif
 };
@@ -13,6 +13,8 @@
 #include <linux/string.h>
 #include <linux/pagemap.h>
 #include <linux/mutex.h>
+#include <linux/buffer_head.h>
+#include <linux/workqueue.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -174,3 +176,118 @@ out:
 	squashfs_cache_put(buffer);
 	return res;
 }
+
+
+/*
+ * A datablock being read ahead.  Its compressed data is read along with
+ * that of the blocks next to it, and it is decompressed by a worker of
+ * its own so that the blocks of a readahead window are decompressed in
+ * parallel, each using the decompressor stream of the cpu it runs on.
+ */
+struct squashfs_readahead {
+	struct work_struct		work;
+	struct list_head		list;
+	struct super_block		*sb;
+	struct squashfs_page_actor	*actor;
+	struct page			**page;
+	u64				block;
+	int				bsize;
+	int				pages;
+	int				b;
+	struct buffer_head		*bh[];
+};
+
+static void squashfs_readahead_work(struct work_struct *work)
+{
+	struct squashfs_readahead *ra = container_of(work,
+		struct squashfs_readahead, work);
+	int i, bytes, res;
+	void *pageaddr;
+
+	res = squashfs_read_data_end(ra->sb, ra->block, ra->bsize, ra->bh,
+		ra->b, ra->actor);
+
+	/* Last page may have trailing bytes not filled */
+	bytes = res % PAGE_CACHE_SIZE;
+	if (res > 0 && bytes) {
+		pageaddr = kmap_atomic(ra->page[ra->pages - 1]);
+		memset(pageaddr + bytes, 0, PAGE_CACHE_SIZE - bytes);
+		kunmap_atomic(pageaddr);
+	}
+
+	for (i = 0; i < ra->pages; i++) {
+		flush_dcache_page(ra->page[i]);
+		if (res < 0)
+			SetPageError(ra->page[i]);
+		else
+			SetPageUptodate(ra->page[i]);
+		unlock_page(ra->page[i]);
+		page_cache_release(ra->page[i]);
+	}
+
+	kfree(ra->actor);
+	kfree(ra->page);
+	kfree(ra);
+}
+
+/*
+ * Start reading the datablock covering the locked pages in @page, and add
+ * it to @list for squashfs_readahead_start() to decompress.  On success the
+ * pages, and the references held on them, are handed over.
+ */
+int squashfs_readahead_block(struct page **page, int pages, u64 block,
+	int bsize, struct list_head *list)
+{
+	struct inode *inode = page[0]->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	struct squashfs_readahead *ra;
+	int res = -ENOMEM;
+
+	ra = kzalloc(sizeof(*ra) + ((msblk->block_size >>
+		msblk->devblksize_log2) + 1) * sizeof(ra->bh[0]), GFP_KERNEL);
+	if (ra == NULL)
+		return res;
+
+	ra->page = kmemdup(page, pages * sizeof(*page), GFP_KERNEL);
+	if (ra->page == NULL)
+		goto failed;
+
+	ra->actor = squashfs_page_actor_init_special(ra->page, pages, 0);
+	if (ra->actor == NULL)
+		goto failed;
+
+	ra->b = squashfs_read_data_start(inode->i_sb, block, bsize,
+		ra->actor->length, ra->bh);
+	if (ra->b < 0) {
+		res = ra->b;
+		goto failed;
+	}
+
+	INIT_WORK(&ra->work, squashfs_readahead_work);
+	ra->sb = inode->i_sb;
+	ra->block = block;
+	ra->bsize = bsize;
+	ra->pages = pages;
+	list_add_tail(&ra->list, list);
+	return 0;
+
+failed:
+	kfree(ra->actor);
+	kfree(ra->page);
+	kfree(ra);
+	return res;
+}
+
+/*
+ * Queue the datablocks gathered by squashfs_readahead_block() for
+ * decompression, once their reads have been issued.
+ */
+void squashfs_readahead_start(struct list_head *list)
+{
+	struct squashfs_readahead *ra, *next;
+
+	list_for_each_entry_safe(ra, next, list, list) {
+		list_del(&ra->list);
+		queue_work(squashfs_read_wq, &ra->work);
+	}
+}
@@ -97,7 +97,7 @@ static int lz4_uncompress(struct squashfs_sb_info *msblk, void *strm,
 	struct squashfs_lz4 *stream = strm;
 	void *buff = stream->input, *data;
 	int avail, i, bytes = length, res;
-	size_t dest_len = output->length;
+	size_t dest_len = max_t(int, msblk->block_size, SQUASHFS_METADATA_SIZE);
 
 	for (i = 0; i < b; i++) {
 		avail = min(bytes, msblk->devblksize - offset);
@@ -108,9 +108,13 @@ static int lz4_uncompress(struct squashfs_sb_info *msblk, void *strm,
 		put_bh(bh[i]);
 	}
 
-	res = lz4_decompress_unknownoutputsize(stream->input, length,
-					stream->output, &dest_len);
-	if (res)
+	/*
+	 * Stop decoding once the caller's room is filled, a block that
+	 * decompresses to more than that is corrupt.
+	 */
+	res = lz4_decompress_partial(stream->input, length, stream->output,
+					&dest_len, output->length);
+	if (res || dest_len > output->length)
 		return -EIO;
 
 	bytes = dest_len;
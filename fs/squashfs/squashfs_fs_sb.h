@@ -23,20 +23,39 @@
  * squashfs_fs_sb.h
  */
 
+#include <linux/kobject.h>
+#include <linux/completion.h>
+
 #include "squashfs_fs.h"
 
-struct squashfs_cache {
-	char			*name;
+enum squashfs_cache_stat {
+	SQUASHFS_CACHE_HITS,
+	SQUASHFS_CACHE_MISSES,
+	SQUASHFS_CACHE_WAITS,
+	SQUASHFS_CACHE_READAHEADS,
+	SQUASHFS_CACHE_NR_STATS,
+};
+
+struct squashfs_cache_shard {
 	int			entries;
 	int			curr_blk;
 	int			next_blk;
 	int			num_waiters;
 	int			unused;
-	int			block_size;
-	int			pages;
 	spinlock_t		lock;
 	wait_queue_head_t	wait_queue;
 	struct squashfs_cache_entry *entry;
+	unsigned long		stat[SQUASHFS_CACHE_NR_STATS];
+} ____cacheline_aligned_in_smp;
+
+struct squashfs_cache {
+	char			*name;
+	int			entries;
+	int			shards;
+	int			block_size;
+	int			pages;
+	struct squashfs_cache_shard *shard;
+	struct squashfs_cache_entry *entry;
 };
 
 struct squashfs_cache_entry {
@@ -49,6 +68,7 @@ struct squashfs_cache_entry {
 	int			num_waiters;
 	wait_queue_head_t	wait_queue;
 	struct squashfs_cache	*cache;
+	struct squashfs_cache_shard *shard;
 	void			**data;
 	struct squashfs_page_actor	*actor;
 };
@@ -76,5 +96,7 @@ struct squashfs_sb_info {
 	long long				bytes_used;
 	unsigned int				inodes;
 	int					xattr_ids;
+	struct kobject				kobj;
+	struct completion			kobj_unregister;
 };
 #endif
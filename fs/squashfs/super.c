@@ -38,6 +38,7 @@
 #include <linux/module.h>
 #include <linux/magic.h>
 #include <linux/xattr.h>
+#include <linux/workqueue.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -47,6 +48,7 @@
 #include "xattr.h"
 
 static struct file_system_type squashfs_fs_type;
+struct workqueue_struct *squashfs_read_wq;
 static const struct super_operations squashfs_super_ops;
 
 static const struct squashfs_decompressor *supported_squashfs_filesystem(short
@@ -201,8 +203,13 @@ static int squashfs_fill_super(struct super_block *sb, void *data, int silent)
 
 	err = -ENOMEM;
 
+	/*
+	 * Size the metadata and fragment caches by the number of cpus, so
+	 * that they can be sharded for concurrent readers.
+	 */
 	msblk->block_cache = squashfs_cache_init("metadata",
-			SQUASHFS_CACHED_BLKS, SQUASHFS_METADATA_SIZE);
+			clamp_t(int, 2 * num_online_cpus(), SQUASHFS_CACHED_BLKS,
+				SQUASHFS_CACHED_BLKS_MAX), SQUASHFS_METADATA_SIZE);
 	if (msblk->block_cache == NULL)
 		goto failed_mount;
 
@@ -278,7 +285,9 @@ handle_fragments:
 		goto check_directory_table;
 
 	msblk->fragment_cache = squashfs_cache_init("fragment",
-		SQUASHFS_CACHED_FRAGMENTS, msblk->block_size);
+		max_t(int, SQUASHFS_CACHED_FRAGMENTS, min_t(int,
+			num_online_cpus(), SQUASHFS_CACHED_FRAGMENTS_MAX)),
+		msblk->block_size);
 	if (msblk->fragment_cache == NULL) {
 		err = -ENOMEM;
 		goto failed_mount;
@@ -330,6 +339,10 @@ check_directory_table:
 		goto failed_mount;
 	}
 
+	err = squashfs_sysfs_register(sb);
+	if (err)
+		goto failed_mount;
+
 	TRACE("Leaving squashfs_fill_super\n");
 	kfree(sblk);
 	return 0;
@@ -383,6 +396,7 @@ static void squashfs_put_super(struct super_block *sb)
 {
 	if (sb->s_fs_info) {
 		struct squashfs_sb_info *sbi = sb->s_fs_info;
+		squashfs_sysfs_unregister(sb);
 		squashfs_cache_delete(sbi->block_cache);
 		squashfs_cache_delete(sbi->fragment_cache);
 		squashfs_cache_delete(sbi->read_page);
@@ -444,21 +458,41 @@ static int __init init_squashfs_fs(void)
 	if (err)
 		return err;
 
-	err = register_filesystem(&squashfs_fs_type);
-	if (err) {
-		destroy_inodecache();
-		return err;
+	/* Decompresses readahead datablocks, see squashfs_readpages() */
+	squashfs_read_wq = alloc_workqueue("squashfs_read",
+					   WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!squashfs_read_wq) {
+		err = -ENOMEM;
+		goto out_inodecache;
 	}
 
+	err = squashfs_sysfs_init();
+	if (err)
+		goto out_wq;
+
+	err = register_filesystem(&squashfs_fs_type);
+	if (err)
+		goto out_sysfs;
+
 	pr_info("version 4.0 (2009/01/31) Phillip Lougher\n");
 
 	return 0;
+
+out_sysfs:
+	squashfs_sysfs_exit();
+out_wq:
+	destroy_workqueue(squashfs_read_wq);
+out_inodecache:
+	destroy_inodecache();
+	return err;
 }
 
 
 static void __exit exit_squashfs_fs(void)
 {
 	unregister_filesystem(&squashfs_fs_type);
+	squashfs_sysfs_exit();
+	destroy_workqueue(squashfs_read_wq);
 	destroy_inodecache();
 }
 
@@ -0,0 +1,147 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * sysfs.c
+ */
+
+/*
+ * This file exports the statistics of the metadata, fragment and data
+ * caches of every mounted filesystem in /sys/fs/squashfs/<dev>/, one
+ * <cache>_cache_<stat> file per counter.
+ */
+
+#include <linux/fs.h>
+#include <linux/vfs.h>
+#include <linux/slab.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_fs_sb.h"
+#include "squashfs.h"
+
+/* pseudo statistic, the number of entries of the cache */
+#define SQUASHFS_CACHE_ENTRIES	-1
+
+struct squashfs_attr {
+	struct attribute	attr;
+	int			cache;
+	int			stat;
+};
+
+static struct kset *squashfs_kset;
+
+static ssize_t squashfs_attr_show(struct kobject *kobj,
+	struct attribute *attr, char *buf)
+{
+	struct squashfs_sb_info *msblk = container_of(kobj,
+		struct squashfs_sb_info, kobj);
+	struct squashfs_attr *a = container_of(attr, struct squashfs_attr,
+		attr);
+	struct squashfs_cache *cache = *(struct squashfs_cache **)
+		((char *) msblk + a->cache);
+
+	if (a->stat == SQUASHFS_CACHE_ENTRIES)
+		return sprintf(buf, "%d\n", cache ? cache->entries : 0);
+
+	return sprintf(buf, "%lu\n", squashfs_cache_stat(cache, a->stat));
+}
+
+#define SQUASHFS_CACHE_ATTR(_cache, _field, _name, _stat)		\
+static struct squashfs_attr squashfs_attr_##_cache##_##_name = {	\
+	.attr	= { .name = __stringify(_cache) "_cache_"		\
+			    __stringify(_name), .mode = S_IRUGO },	\
+	.cache	= offsetof(struct squashfs_sb_info, _field),		\
+	.stat	= _stat,						\
+}
+
+#define SQUASHFS_CACHE_ATTRS(_cache, _field)				\
+SQUASHFS_CACHE_ATTR(_cache, _field, entries, SQUASHFS_CACHE_ENTRIES);	\
+SQUASHFS_CACHE_ATTR(_cache, _field, hits, SQUASHFS_CACHE_HITS);	\
+SQUASHFS_CACHE_ATTR(_cache, _field, misses, SQUASHFS_CACHE_MISSES);	\
+SQUASHFS_CACHE_ATTR(_cache, _field, waits, SQUASHFS_CACHE_WAITS);	\
+SQUASHFS_CACHE_ATTR(_cache, _field, readaheads, SQUASHFS_CACHE_READAHEADS)
+
+#define SQUASHFS_CACHE_ATTR_LIST(_cache)				\
+	&squashfs_attr_##_cache##_entries.attr,				\
+	&squashfs_attr_##_cache##_hits.attr,				\
+	&squashfs_attr_##_cache##_misses.attr,				\
+	&squashfs_attr_##_cache##_waits.attr,				\
+	&squashfs_attr_##_cache##_readaheads.attr
+
+SQUASHFS_CACHE_ATTRS(metadata, block_cache);
+SQUASHFS_CACHE_ATTRS(fragment, fragment_cache);
+SQUASHFS_CACHE_ATTRS(data, read_page);
+
+static struct attribute *squashfs_attrs[] = {
+	SQUASHFS_CACHE_ATTR_LIST(metadata),
+	SQUASHFS_CACHE_ATTR_LIST(fragment),
+	SQUASHFS_CACHE_ATTR_LIST(data),
+	NULL,
+};
+
+static const struct sysfs_ops squashfs_attr_ops = {
+	.show	= squashfs_attr_show,
+};
+
+static void squashfs_sb_release(struct kobject *kobj)
+{
+	struct squashfs_sb_info *msblk = container_of(kobj,
+		struct squashfs_sb_info, kobj);
+
+	complete(&msblk->kobj_unregister);
+}
+
+static struct kobj_type squashfs_sb_ktype = {
+	.default_attrs	= squashfs_attrs,
+	.sysfs_ops	= &squashfs_attr_ops,
+	.release	= squashfs_sb_release,
+};
+
+int squashfs_sysfs_register(struct super_block *sb)
+{
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	int err;
+
+	msblk->kobj.kset = squashfs_kset;
+	init_completion(&msblk->kobj_unregister);
+	err = kobject_init_and_add(&msblk->kobj, &squashfs_sb_ktype, NULL,
+		"%s", sb->s_id);
+	if (err) {
+		kobject_put(&msblk->kobj);
+		wait_for_completion(&msblk->kobj_unregister);
+	}
+
+	return err;
+}
+
+void squashfs_sysfs_unregister(struct super_block *sb)
+{
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+
+	kobject_del(&msblk->kobj);
+	kobject_put(&msblk->kobj);
+	wait_for_completion(&msblk->kobj_unregister);
+}
+
+int __init squashfs_sysfs_init(void)
+{
+	squashfs_kset = kset_create_and_add("squashfs", NULL, fs_kobj);
+
+	return squashfs_kset ? 0 : -ENOMEM;
+}
+
+void squashfs_sysfs_exit(void)
+{
+	kset_unregister(squashfs_kset);
+}
@@ -28,6 +28,8 @@ struct blk_mq_hw_ctx {
 
 	unsigned long		flags;		/* BLK_MQ_F_* flags */
 
+	void			*sched_data;
+
 	struct request_queue	*queue;
 	struct blk_flush_queue	*fq;
 
@@ -41,6 +43,13 @@ struct blk_mq_hw_ctx {
 	atomic_t		wait_index;
 
 	struct blk_mq_tags	*tags;
+	/*
+	 * With a scheduler attached, requests are allocated from here and
+	 * only get a tag from ->tags when they are dispatched.
+	 */
+	struct blk_mq_tags	*sched_tags;
+	wait_queue_t		dispatch_wait;	/* for a driver tag */
+	wait_queue_head_t	*dispatch_wait_head;
 
 	struct srcu_struct	queue_rq_srcu;
 
@@ -62,12 +71,27 @@ struct blk_mq_hw_ctx {
 	unsigned long		poll_considered;
 	unsigned long		poll_invoked;
 	unsigned long		poll_success;
+	unsigned long		poll_slept;
+
+	/*
+	 * hybrid poll sleep estimate per direction, and the stat window
+	 * it was last computed in
+	 */
+	unsigned long		poll_stat_window[2];
+	unsigned long		poll_nsecs[2];
 };
 
 struct blk_mq_tag_set {
 	unsigned int		*mq_map;
+	unsigned int		*poll_map;	/* cpu -> poll queue */
 	const struct blk_mq_ops	*ops;
 	unsigned int		nr_hw_queues;
+	/*
+	 * The last nr_poll_queues of the nr_hw_queues hardware queues only
+	 * take REQ_HIPRI requests, which are mapped through poll_map and
+	 * completed by polling instead of by interrupt.
+	 */
+	unsigned int		nr_poll_queues;
 	unsigned int		queue_depth;	/* max hw supported */
 	unsigned int		reserved_tags;
 	unsigned int		cmd_size;	/* per-request extra data */
@@ -157,11 +181,14 @@ enum {
 	BLK_MQ_F_SG_MERGE	= 1 << 2,
 	BLK_MQ_F_DEFER_ISSUE	= 1 << 4,
 	BLK_MQ_F_BLOCKING	= 1 << 5,
+	BLK_MQ_F_POLL_QUEUE	= 1 << 6,	/* hctx only, see nr_poll_queues */
+	BLK_MQ_F_NO_SCHED	= 1 << 7,	/* pdu tied to the driver tag */
 	BLK_MQ_F_ALLOC_POLICY_START_BIT = 8,
 	BLK_MQ_F_ALLOC_POLICY_BITS = 1,
 
 	BLK_MQ_S_STOPPED	= 0,
 	BLK_MQ_S_TAG_ACTIVE	= 1,
+	BLK_MQ_S_TAG_WAITING	= 2,
 
 	BLK_MQ_MAX_DEPTH	= 10240,
 
@@ -193,6 +220,7 @@ bool blk_mq_can_queue(struct blk_mq_hw_ctx *);
 enum {
 	BLK_MQ_REQ_NOWAIT	= (1 << 0), /* return when out of requests */
 	BLK_MQ_REQ_RESERVED	= (1 << 1), /* allocate from reserved pool */
+	BLK_MQ_REQ_INTERNAL	= (1 << 2), /* allocate from hctx->sched_tags */
 };
 
 struct request *blk_mq_alloc_request(struct request_queue *q, int rw,
@@ -232,6 +260,27 @@ void blk_mq_delay_kick_requeue_list(struct request_queue *q, unsigned long msecs
 void blk_mq_abort_requeue_list(struct request_queue *q);
 void blk_mq_complete_request(struct request *rq, int error);
 
+/*
+ * Requests a driver reaped in one pass over a completion queue, to be
+ * ended together with blk_mq_end_request_batch().
+ */
+struct blk_mq_comp_batch {
+	struct list_head list;
+	unsigned int nr;
+};
+
+#define DEFINE_BLK_MQ_COMP_BATCH(name)					\
+	struct blk_mq_comp_batch name = {				\
+		.list = LIST_HEAD_INIT(name.list),			\
+	}
+
+#define blk_mq_batch_for_each_rq(batch, rq)				\
+	list_for_each_entry((rq), &(batch)->list, queuelist)
+
+bool blk_mq_add_to_batch(struct request *rq, struct blk_mq_comp_batch *batch,
+			 int error);
+void blk_mq_end_request_batch(struct blk_mq_comp_batch *batch);
+
 bool blk_mq_queue_stopped(struct request_queue *q);
 void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx);
 void blk_mq_start_hw_queue(struct blk_mq_hw_ctx *hctx);
@@ -249,7 +298,10 @@ void blk_mq_freeze_queue_start(struct request_queue *q);
 int blk_mq_reinit_tagset(struct blk_mq_tag_set *set);
 
 int blk_mq_map_queues(struct blk_mq_tag_set *set);
+int blk_mq_map_poll_queues(struct blk_mq_tag_set *set);
 void blk_mq_update_nr_hw_queues(struct blk_mq_tag_set *set, int nr_hw_queues);
+void blk_mq_update_nr_poll_queues(struct blk_mq_tag_set *set, int nr_hw_queues,
+		int nr_poll_queues);
 
 /*
  * Driver command data is immediately after the request. So subtract request
@@ -39,6 +39,7 @@ struct blkcg_gq;
 struct blk_flush_queue;
 struct pr_ops;
 struct rq_wb;
+struct blk_stat_hist;
 
 #define BLKDEV_MIN_RQ	4
 #define BLKDEV_MAX_RQ	128	/* Default maximum */
@@ -47,7 +48,7 @@ struct rq_wb;
  * Maximum number of blkcg policies allowed to be registered concurrently.
  * Defined here to simplify include dependency.
  */
-#define BLKCG_MAX_POLS		2
+#define BLKCG_MAX_POLS		3
 
 typedef void (rq_end_io_fn)(struct request *, int);
 
@@ -223,6 +224,7 @@ struct request {
 	void *special;		/* opaque pointer available for LLD use */
 
 	int tag;
+	int internal_tag;	/* blk-mq scheduler tag, -1 if none */
 	int errors;
 
 	/*
@@ -410,6 +412,7 @@ struct request_queue {
 	const struct blk_mq_ops	*mq_ops;
 
 	unsigned int		*mq_map;
+	unsigned int		*poll_map;	/* NULL without poll queues */
 
 	/* sw queues */
 	struct blk_mq_ctx __percpu	*queue_ctx;
@@ -505,6 +508,7 @@ struct request_queue {
 	unsigned int		in_flight[2];
 
 	struct blk_rq_stat	rq_stats[2];
+	struct blk_stat_hist __percpu *stat_hist;
 
 	/*
 	 * Number of active block driver functions for which blk_drain_queue()
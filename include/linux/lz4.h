@@ -84,4 +84,22 @@ int lz4_decompress(const unsigned char *src, size_t *src_len,
  */
 int lz4_decompress_unknownoutputsize(const unsigned char *src, size_t src_len,
 		unsigned char *dest, size_t *dest_len);
+
+/*
+ * lz4_decompress_partial()
+ *	src     : source address of the compressed data
+ *	src_len : is the input size, therefore the compressed size
+ *	dest	: output buffer address of the decompressed data
+ *	dest_len: is the max size of the destination buffer, which is
+ *			returned with the number of bytes decoded
+ *	target_len: is the number of bytes actually needed, decoding
+ *			stops once at least that many have been produced
+ *	return  : Success if return 0
+ *		  Error if return (< 0)
+ *	note :  Destination buffer must be already allocated, and large
+ *		enough for the whole decompressed data.  Fewer than
+ *		target_len bytes are only returned if the data is shorter.
+ */
+int lz4_decompress_partial(const unsigned char *src, size_t src_len,
+		unsigned char *dest, size_t *dest_len, size_t target_len);
 #endif
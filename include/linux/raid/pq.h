@@ -151,6 +151,42 @@ extern void (*raid6_datap_recov)(int disks, size_t bytes, int faila,
 void raid6_dual_recov(int disks, size_t bytes, int faila, int failb,
 		      void **ptrs);
 
+/*
+ * Per request size algorithm selection.  raid6_select_algo() benchmarks
+ * every algorithm at each of these sizes; the winner of a class is used
+ * for requests at least that large.  All implementations handle lengths
+ * that are a multiple of RAID6_MIN_SIZE, anything else goes to the
+ * PAGE_SIZE class.
+ */
+#define RAID6_NR_SIZES	3
+#define RAID6_MIN_SIZE	256
+
+struct raid6_sized_calls {
+	size_t bytes;
+	void (*gen_syndrome)(int, size_t, void **);
+	void (*xor_syndrome)(int, int, int, size_t, void **);
+	void (*data2)(int, size_t, int, int, void **);
+	void (*datap)(int, size_t, int, void **);
+};
+
+extern struct raid6_sized_calls raid6_sized[RAID6_NR_SIZES];
+
+static inline const struct raid6_sized_calls *raid6_calls_for(size_t bytes)
+{
+	int i = RAID6_NR_SIZES - 1;
+
+	if (bytes % RAID6_MIN_SIZE)
+		return &raid6_sized[i];
+	while (i > 0 && bytes < raid6_sized[i].bytes)
+		i--;
+	return &raid6_sized[i];
+}
+
+static inline void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	raid6_calls_for(bytes)->gen_syndrome(disks, bytes, ptrs);
+}
+
 /* Some definitions to allow code to be compiled for testing in userspace */
 #ifndef __KERNEL__
 
@@ -164,6 +200,7 @@ void raid6_dual_recov(int disks, size_t bytes, int faila, int failb,
 						     MAP_PRIVATE|MAP_ANONYMOUS,\
 						     0, 0))
 # define free_pages(x, y)	munmap((void *)(x), PAGE_SIZE << (y))
+# define ARRAY_SIZE(x)		(sizeof(x) / sizeof((x)[0]))
 
 static inline void cpu_relax(void)
 {
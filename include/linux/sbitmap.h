@@ -336,6 +336,21 @@ static inline int sbitmap_queue_get(struct sbitmap_queue *sbq,
 void sbitmap_queue_clear(struct sbitmap_queue *sbq, unsigned int nr,
 			 unsigned int cpu);
 
+/**
+ * sbitmap_queue_clear_batch() - Free several allocated bits and wake up
+ * waiters on a &struct sbitmap_queue.
+ * @sbq: Bitmap to free from.
+ * @bits: Bit numbers to free.
+ * @cpus: CPU each bit in @bits was allocated on.
+ * @nr: Number of entries in @bits and @cpus.
+ *
+ * Equivalent to calling sbitmap_queue_clear() for each bit, but the wait
+ * queue accounting is done once for the whole batch.
+ */
+void sbitmap_queue_clear_batch(struct sbitmap_queue *sbq,
+			       const unsigned int *bits,
+			       const unsigned int *cpus, unsigned int nr);
+
 static inline int sbq_index_inc(int index)
 {
 	return (index + 1) & (SBQ_WAIT_QUEUES - 1);
@@ -47,273 +47,280 @@
 
 #include "lz4defs.h"
 
-static const int dec32table[] = {0, 3, 2, 3, 0, 0, 0, 0};
-#if LZ4_ARCH64
-static const int dec64table[] = {0, 0, 0, -1, 0, 1, 2, 3};
-#endif
-
-static int lz4_uncompress(const char *source, char *dest, int osize)
-{
-	const BYTE *ip = (const BYTE *) source;
-	const BYTE *ref;
-	BYTE *op = (BYTE *) dest;
-	BYTE * const oend = op + osize;
-	BYTE *cpy;
-	unsigned token;
-	size_t length;
-
-	while (1) {
-
-		/* get runlength */
-		token = *ip++;
-		length = (token >> ML_BITS);
-		if (length == RUN_MASK) {
-			size_t len;
-
-			len = *ip++;
-			for (; len == 255; length += 255)
-				len = *ip++;
-			if (unlikely(length > (size_t)(length + len)))
-				goto _output_error;
-			length += len;
-		}
-
-		/* copy literals */
-		cpy = op + length;
-		if (unlikely(cpy > oend - COPYLENGTH)) {
-			/*
-			 * Error: not enough place for another match
-			 * (min 4) + 5 literals
-			 */
-			if (cpy != oend)
-				goto _output_error;
-
-			memcpy(op, ip, length);
-			ip += length;
-			break; /* EOF */
-		}
-		LZ4_WILDCOPY(ip, op, cpy);
-		ip -= (op - cpy);
-		op = cpy;
+/*
+ * The decoder is written once, as lz4_decompress_generic(), and
+ * specialised by the compiler for each of the entry points below through
+ * its constant arguments:
+ *
+ *  - end_on_input: the compressed size is known and every read of the
+ *    input is bounds checked, otherwise the decompressed size is known and
+ *    decoding stops once it has been produced.
+ *  - partial: stop as soon as at least target_len bytes have been written,
+ *    instead of decoding the whole block.
+ *
+ * Copies are done with unaligned 8 and 16 byte loads and stores, which may
+ * run up to 15 bytes past their end.  All the bounds below leave room for
+ * that, falling back to careful copies near the end of the buffers.
+ */
 
-		/* get offset */
-		LZ4_READ_LITTLEENDIAN_16(ref, cpy, ip);
-		ip += 2;
+/* Last bytes of a block which are always literals */
+#define LZ4_WILDCOPYLENGTH	8
+/* A match ending closer than this to the end needs a careful copy */
+#define LZ4_MATCH_SAFEGUARD	20
 
-		/* Error: offset create reference outside destination buffer */
-		if (unlikely(ref < (BYTE *const) dest))
-			goto _output_error;
+static const unsigned int inc32table[8] = {0, 1, 2, 1, 4, 4, 4, 4};
+static const int dec64table[8] = {0, 0, 0, -1, 0, 1, 2, 3};
 
-		/* get matchlength */
-		length = token & ML_MASK;
-		if (length == ML_MASK) {
-			for (; *ip == 255; length += 255)
-				ip++;
-			if (unlikely(length > (size_t)(length + *ip)))
-				goto _output_error;
-			length += *ip++;
-		}
+static __always_inline void lz4_copy8(u8 *d, const u8 *s)
+{
+	put_unaligned(get_unaligned((const u64 *) s), (u64 *) d);
+}
 
-		/* copy repeated sequence */
-		if (unlikely((op - ref) < STEPSIZE)) {
-#if LZ4_ARCH64
-			int dec64 = dec64table[op - ref];
-#else
-			const int dec64 = 0;
-#endif
-			op[0] = ref[0];
-			op[1] = ref[1];
-			op[2] = ref[2];
-			op[3] = ref[3];
-			op += 4;
-			ref += 4;
-			ref -= dec32table[op-ref];
-			PUT4(ref, op);
-			op += STEPSIZE - 4;
-			ref -= dec64;
-		} else {
-			LZ4_COPYSTEP(ref, op);
-		}
-		cpy = op + length - (STEPSIZE - 4);
-		if (cpy > (oend - COPYLENGTH)) {
-
-			/* Error: request to write beyond destination buffer */
-			if (cpy > oend)
-				goto _output_error;
-#if LZ4_ARCH64
-			if ((ref + COPYLENGTH) > oend)
-#else
-			if ((ref + COPYLENGTH) > oend ||
-					(op + COPYLENGTH) > oend)
-#endif
-				goto _output_error;
-			LZ4_SECURECOPY(ref, op, (oend - COPYLENGTH));
-			while (op < cpy)
-				*op++ = *ref++;
-			op = cpy;
-			/*
-			 * Check EOF (should never happen, since last 5 bytes
-			 * are supposed to be literals)
-			 */
-			if (op == oend)
-				goto _output_error;
-			continue;
-		}
-		LZ4_SECURECOPY(ref, op, cpy);
-		op = cpy; /* correction */
-	}
-	/* end of decoding */
-	return (int) (((char *)ip) - source);
+static __always_inline void lz4_copy16(u8 *d, const u8 *s)
+{
+	lz4_copy8(d, s);
+	lz4_copy8(d + 8, s + 8);
+}
 
-	/* write overflow error detected */
-_output_error:
-	return -1;
+/* Copy from s to d until d reaches e, may write up to 7 bytes past e */
+static __always_inline void lz4_wild_copy8(u8 *d, const u8 *s, u8 *e)
+{
+	do {
+		lz4_copy8(d, s);
+		d += 8;
+		s += 8;
+	} while (d < e);
 }
 
-static int lz4_uncompress_unknownoutputsize(const char *source, char *dest,
-				int isize, size_t maxoutputsize)
+/*
+ * Copy from s to d until d reaches e, may write up to 15 bytes past e.
+ * s and d must be at least 16 bytes apart.
+ */
+static __always_inline void lz4_wild_copy16(u8 *d, const u8 *s, u8 *e)
 {
-	const BYTE *ip = (const BYTE *) source;
-	const BYTE *const iend = ip + isize;
-	const BYTE *ref;
+	do {
+		lz4_copy16(d, s);
+		d += 16;
+		s += 16;
+	} while (d < e);
+}
 
+/*
+ * Returns the number of bytes written if end_on_input, the number of bytes
+ * read otherwise, or a negative value if the input is malformed.
+ */
+static __always_inline int lz4_decompress_generic(const u8 *src, u8 *dst,
+		int src_len, int dst_len, const bool end_on_input,
+		const bool partial, int target_len)
+{
+	const u8 *ip = src;
+	const u8 * const iend = ip + src_len;
+	u8 *op = dst;
+	u8 * const oend = op + dst_len;
+	u8 *oexit = op + target_len;
+	const u8 *shortiend, *shortoend;
+	const u8 *match;
+	size_t offset, length;
+	unsigned int token, s;
+	u8 *cpy;
+
+	/* Special cases */
+	if (partial && oexit > oend - MFLIMIT)
+		oexit = oend - MFLIMIT;
+	if (end_on_input && unlikely(dst_len == 0))
+		return (src_len == 1 && *ip == 0) ? 0 : -1;
+	if (!end_on_input && unlikely(dst_len == 0))
+		return *ip == 0 ? 1 : -1;
+	if (end_on_input && unlikely(src_len == 0))
+		return -1;
+
+	/*
+	 * Sequences of at most 14 literals and 18 bytes of match starting
+	 * before these bounds can be copied with fixed size moves.
+	 */
+	shortiend = iend - (end_on_input ? 14 : 8) - 2;
+	shortoend = (partial ? oexit : oend) - (end_on_input ? 14 : 8) - 18;
 
-	BYTE *op = (BYTE *) dest;
-	BYTE * const oend = op + maxoutputsize;
-	BYTE *cpy;
+	while (1) {
+		token = *ip++;
+		length = token >> ML_BITS;
+
+		/* Fast path: short literal run and short, distant match */
+		if ((end_on_input ? length != RUN_MASK : length <= 8) &&
+		    likely((end_on_input ? ip < shortiend : 1) &
+			   (op <= shortoend))) {
+			if (end_on_input)
+				lz4_copy16(op, ip);
+			else
+				lz4_copy8(op, ip);
+			op += length;
+			ip += length;
 
-	/* Main Loop */
-	while (ip < iend) {
+			length = token & ML_MASK;
+			offset = get_unaligned_le16(ip);
+			ip += 2;
+			match = op - offset;
+
+			if (length != ML_MASK && offset >= 8 && match >= dst) {
+				lz4_copy16(op, match);
+				put_unaligned(get_unaligned((const u16 *)
+					(match + 16)), (u16 *) (op + 16));
+				op += length + MINMATCH;
+				continue;
+			}
 
-		unsigned token;
-		size_t length;
+			/* the match needs the full treatment */
+			goto copy_match;
+		}
 
-		/* get runlength */
-		token = *ip++;
-		length = (token >> ML_BITS);
+		/* Literal run length */
 		if (length == RUN_MASK) {
-			int s = 255;
-			while ((ip < iend) && (s == 255)) {
+			do {
+				if (end_on_input && unlikely(ip >= iend))
+					goto output_error;
 				s = *ip++;
-				if (unlikely(length > (size_t)(length + s)))
-					goto _output_error;
 				length += s;
-			}
+			} while (s == 255);
+			if (end_on_input &&
+			    unlikely((uintptr_t) op + length < (uintptr_t) op))
+				goto output_error;
+			if (end_on_input &&
+			    unlikely((uintptr_t) ip + length < (uintptr_t) ip))
+				goto output_error;
 		}
-		/* copy literals */
+
+		/* Copy literals */
 		cpy = op + length;
-		if ((cpy > oend - COPYLENGTH) ||
-			(ip + length > iend - COPYLENGTH)) {
-
-			if (cpy > oend)
-				goto _output_error;/* writes beyond buffer */
-
-			if (ip + length != iend)
-				goto _output_error;/*
-						    * Error: LZ4 format requires
-						    * to consume all input
-						    * at this stage
-						    */
+		if ((end_on_input &&
+		     (cpy > (partial ? oexit : oend - MFLIMIT) ||
+		      ip + length > iend - (2 + 1 + LASTLITERALS))) ||
+		    (!end_on_input && cpy > oend - LZ4_WILDCOPYLENGTH)) {
+			if (partial) {
+				/* Stop here, this may be before the end */
+				if (cpy > oend)
+					goto output_error;
+				if (end_on_input && ip + length > iend)
+					goto output_error;
+			} else {
+				/*
+				 * The block must end with exactly these
+				 * literals.
+				 */
+				if (!end_on_input && cpy != oend)
+					goto output_error;
+				if (end_on_input &&
+				    (ip + length != iend || cpy > oend))
+					goto output_error;
+			}
 			memcpy(op, ip, length);
+			ip += length;
 			op += length;
-			break;/* Necessarily EOF, due to parsing restrictions */
+			break;
 		}
-		LZ4_WILDCOPY(ip, op, cpy);
-		ip -= (op - cpy);
+		if (cpy <= oend - 16 &&
+		    (!end_on_input || ip + length <= iend - 16))
+			lz4_wild_copy16(op, ip, cpy);
+		else
+			lz4_wild_copy8(op, ip, cpy);
+		ip += length;
 		op = cpy;
 
-		/* get offset */
-		LZ4_READ_LITTLEENDIAN_16(ref, cpy, ip);
+		/* Match offset */
+		offset = get_unaligned_le16(ip);
 		ip += 2;
-		if (ref < (BYTE * const) dest)
-			goto _output_error;
-			/*
-			 * Error : offset creates reference
-			 * outside of destination buffer
-			 */
-
-		/* get matchlength */
-		length = (token & ML_MASK);
+		match = op - offset;
+		length = token & ML_MASK;
+
+copy_match:
+		/* Error: offset creates reference outside of destination */
+		if (unlikely(match < dst || offset == 0))
+			goto output_error;
+
+		/* Match length */
 		if (length == ML_MASK) {
-			while (ip < iend) {
-				int s = *ip++;
-				if (unlikely(length > (size_t)(length + s)))
-					goto _output_error;
+			do {
+				if (end_on_input &&
+				    unlikely(ip >= iend - LASTLITERALS))
+					goto output_error;
+				s = *ip++;
 				length += s;
-				if (s == 255)
-					continue;
-				break;
+			} while (s == 255);
+			if (end_on_input &&
+			    unlikely((uintptr_t) op + length < (uintptr_t) op))
+				goto output_error;
+		}
+		length += MINMATCH;
+
+		/*
+		 * Near the end of the output, copy byte by byte and only
+		 * enforce the buffer bound: the format wants the last
+		 * LASTLITERALS bytes to be literals, but lz4hc output does
+		 * not always end that way.  Partial decoding cuts the match
+		 * at the end of the buffer.
+		 */
+		cpy = op + length;
+		if (unlikely(cpy > oend - LZ4_MATCH_SAFEGUARD)) {
+			if (cpy > oend) {
+				if (!partial)
+					goto output_error;
+				cpy = oend;
 			}
+			while (op < cpy)
+				*op++ = *match++;
+			if (partial && op == oend)
+				break;
+			continue;
 		}
 
-		/* copy repeated sequence */
-		if (unlikely((op - ref) < STEPSIZE)) {
-#if LZ4_ARCH64
-			int dec64 = dec64table[op - ref];
-#else
-			const int dec64 = 0;
-#endif
-				op[0] = ref[0];
-				op[1] = ref[1];
-				op[2] = ref[2];
-				op[3] = ref[3];
-				op += 4;
-				ref += 4;
-				ref -= dec32table[op - ref];
-				PUT4(ref, op);
-				op += STEPSIZE - 4;
-				ref -= dec64;
+		/*
+		 * Copy the match.  Matches closer than 8 bytes overlap their
+		 * own output, copy the first 8 bytes in two steps spreading
+		 * the pattern, after which match trails op by 8 to 14 bytes.
+		 */
+		if (unlikely(offset < 8)) {
+			op[0] = match[0];
+			op[1] = match[1];
+			op[2] = match[2];
+			op[3] = match[3];
+			match += inc32table[offset];
+			memcpy(op + 4, match, 4);
+			match -= dec64table[offset];
 		} else {
-			LZ4_COPYSTEP(ref, op);
+			lz4_copy8(op, match);
+			match += 8;
 		}
-		cpy = op + length - (STEPSIZE-4);
-		if (cpy > oend - COPYLENGTH) {
-			if (cpy > oend)
-				goto _output_error; /* write outside of buf */
-#if LZ4_ARCH64
-			if ((ref + COPYLENGTH) > oend)
-#else
-			if ((ref + COPYLENGTH) > oend ||
-					(op + COPYLENGTH) > oend)
-#endif
-				goto _output_error;
-			LZ4_SECURECOPY(ref, op, (oend - COPYLENGTH));
-			while (op < cpy)
-				*op++ = *ref++;
-			op = cpy;
-			/*
-			 * Check EOF (should never happen, since last 5 bytes
-			 * are supposed to be literals)
-			 */
-			if (op == oend)
-				goto _output_error;
-			continue;
+		op += 8;
+
+		if (offset >= 16) {
+			lz4_wild_copy16(op, match, cpy);
+		} else {
+			lz4_wild_copy8(op, match, cpy);
 		}
-		LZ4_SECURECOPY(ref, op, cpy);
-		op = cpy; /* correction */
+		op = cpy;	/* correction */
 	}
+
 	/* end of decoding */
-	return (int) (((char *) op) - dest);
+	if (end_on_input)
+		return (int) (op - dst);
+	return (int) (ip - src);
 
-	/* write overflow error detected */
-_output_error:
+	/* malformed input or write overflow detected */
+output_error:
 	return -1;
 }
 
 int lz4_decompress(const unsigned char *src, size_t *src_len,
 		unsigned char *dest, size_t actual_dest_len)
 {
-	int ret = -1;
-	int input_len = 0;
+	int input_len;
 
-	input_len = lz4_uncompress(src, dest, actual_dest_len);
+	input_len = lz4_decompress_generic(src, dest, 0, actual_dest_len,
+					  false, false, 0);
 	if (input_len < 0)
-		goto exit_0;
+		return -1;
 	*src_len = input_len;
 
 	return 0;
-exit_0:
-	return ret;
 }
 #ifndef STATIC
 EXPORT_SYMBOL(lz4_decompress);
@@ -322,21 +329,43 @@ EXPORT_SYMBOL(lz4_decompress);
 int lz4_decompress_unknownoutputsize(const unsigned char *src, size_t src_len,
 		unsigned char *dest, size_t *dest_len)
 {
-	int ret = -1;
-	int out_len = 0;
+	int out_len;
 
-	out_len = lz4_uncompress_unknownoutputsize(src, dest, src_len,
-					*dest_len);
+	out_len = lz4_decompress_generic(src, dest, src_len, *dest_len,
+					true, false, 0);
 	if (out_len < 0)
-		goto exit_0;
+		return -1;
 	*dest_len = out_len;
 
 	return 0;
-exit_0:
-	return ret;
 }
 #ifndef STATIC
 EXPORT_SYMBOL(lz4_decompress_unknownoutputsize);
+#endif
+
+int lz4_decompress_partial(const unsigned char *src, size_t src_len,
+		unsigned char *dest, size_t *dest_len, size_t target_len)
+{
+	int out_len;
+
+	/*
+	 * The last MFLIMIT bytes are decoded by the careful tail code only,
+	 * stopping early there wouldn't buy anything.
+	 */
+	if (target_len + MFLIMIT >= *dest_len)
+		return lz4_decompress_unknownoutputsize(src, src_len, dest,
+							dest_len);
+
+	out_len = lz4_decompress_generic(src, dest, src_len, *dest_len,
+					true, true, target_len);
+	if (out_len < 0)
+		return -1;
+	*dest_len = out_len;
+
+	return 0;
+}
+#ifndef STATIC
+EXPORT_SYMBOL(lz4_decompress_partial);
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_DESCRIPTION("LZ4 Decompressor");
@@ -23,6 +23,8 @@
 #else
 #include <linux/module.h>
 #include <linux/gfp.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #if !RAID6_USE_EMPTY_ZERO_PAGE
 /* In .bss so it's zeroed */
 const char raid6_empty_zero_page[PAGE_SIZE] __attribute__((aligned(256)));
@@ -111,6 +113,23 @@ const struct raid6_recov_calls *const raid6_recov_algos[] = {
 	NULL
 };
 
+struct raid6_sized_calls raid6_sized[RAID6_NR_SIZES] = {
+	{ .bytes = RAID6_MIN_SIZE },
+	{ .bytes = RAID6_MIN_SIZE * 4 },
+	{ .bytes = PAGE_SIZE },
+};
+EXPORT_SYMBOL_GPL(raid6_sized);
+
+/* Benchmark results in MB/s, 0 where an algorithm was not run */
+static unsigned long raid6_gen_perf[ARRAY_SIZE(raid6_algos)][RAID6_NR_SIZES];
+static unsigned long raid6_xor_perf[ARRAY_SIZE(raid6_algos)][RAID6_NR_SIZES];
+static unsigned long
+raid6_recov_perf[ARRAY_SIZE(raid6_recov_algos)][RAID6_NR_SIZES];
+
+static const char *raid6_gen_name[RAID6_NR_SIZES];
+static const char *raid6_xor_name[RAID6_NR_SIZES];
+static const char *raid6_recov_name[RAID6_NR_SIZES];
+
 #ifdef __KERNEL__
 #define RAID6_TIME_JIFFIES_LG2	4
 #else
@@ -119,15 +138,78 @@ const struct raid6_recov_calls *const raid6_recov_algos[] = {
 #define time_before(x, y) ((x) < (y))
 #endif
 
-static inline const struct raid6_recov_calls *raid6_choose_recov(void)
+/* The PAGE_SIZE class gets the full time, the smaller ones a quarter */
+#define RAID6_TIME_LG2(s) \
+	((s) == RAID6_NR_SIZES - 1 ? RAID6_TIME_JIFFIES_LG2 : \
+				     RAID6_TIME_JIFFIES_LG2 - 2)
+
+/* Count how often @call completes within 2^@lg2 jiffies */
+#define raid6_time(lg2, call)						\
+({									\
+	unsigned long __perf = 0, __j0, __j1;				\
+									\
+	preempt_disable();						\
+	__j0 = jiffies;							\
+	while ((__j1 = jiffies) == __j0)				\
+		cpu_relax();						\
+	while (time_before(jiffies, __j1 + (1 << (lg2)))) {		\
+		call;							\
+		__perf++;						\
+	}								\
+	preempt_enable();						\
+	__perf;								\
+})
+
+/* Data disk bytes processed per second, in MB/s */
+static unsigned long raid6_mbs(unsigned long perf, int disks, size_t bytes,
+			       int lg2)
 {
-	const struct raid6_recov_calls *const *algo;
-	const struct raid6_recov_calls *best;
+	return ((u64)perf * (disks - 2) * bytes * HZ) >> (20 + lg2);
+}
+
+static const struct raid6_recov_calls * __init raid6_choose_recov(void **dptrs,
+								 int disks)
+{
+	const struct raid6_recov_calls *algo, *best = NULL;
+	unsigned long perf, bestperf;
+	int i, s, lg2;
+	size_t bytes;
+
+	for (s = RAID6_NR_SIZES - 1; s >= 0; s--) {
+		const struct raid6_recov_calls *sbest = NULL;
 
-	for (best = NULL, algo = raid6_recov_algos; *algo; algo++)
-		if (!best || (*algo)->priority > best->priority)
-			if (!(*algo)->valid || (*algo)->valid())
-				best = *algo;
+		bytes = raid6_sized[s].bytes;
+		lg2 = RAID6_TIME_LG2(s);
+		bestperf = 0;
+
+		for (i = 0; (algo = raid6_recov_algos[i]); i++) {
+			if (algo->valid && !algo->valid())
+				continue;
+
+			perf = raid6_time(lg2, algo->data2(disks, bytes, 0, 1,
+							   dptrs));
+			raid6_recov_perf[i][s] = raid6_mbs(perf, disks, bytes,
+							   lg2);
+			if (!sbest || perf > bestperf ||
+			    (perf == bestperf &&
+			     algo->priority > sbest->priority)) {
+				bestperf = perf;
+				sbest = algo;
+			}
+		}
+
+		if (!sbest)
+			break;
+
+		raid6_sized[s].data2 = sbest->data2;
+		raid6_sized[s].datap = sbest->datap;
+		raid6_recov_name[s] = sbest->name;
+		if (s == RAID6_NR_SIZES - 1)
+			best = sbest;
+		else
+			pr_info("raid6: %5zu bytes: using %s recovery algorithm\n",
+				bytes, sbest->name);
+	}
 
 	if (best) {
 		raid6_2data_recov = best->data2;
@@ -140,78 +222,172 @@ static inline const struct raid6_recov_calls *raid6_choose_recov(void)
 	return best;
 }
 
-static inline const struct raid6_calls *raid6_choose_gen(
-	void *(*const dptrs)[(65536/PAGE_SIZE)+2], const int disks)
+static const struct raid6_calls * __init raid6_choose_gen(void **dptrs,
+							  int disks)
 {
-	unsigned long perf, bestgenperf, bestxorperf, j0, j1;
+	unsigned long perf, bestgenperf, bestxorperf;
 	int start = (disks>>1)-1, stop = disks-3;	/* work on the second half of the disks */
-	const struct raid6_calls *const *algo;
-	const struct raid6_calls *best;
-
-	for (bestgenperf = 0, bestxorperf = 0, best = NULL, algo = raid6_algos; *algo; algo++) {
-		if (!best || (*algo)->prefer >= best->prefer) {
-			if ((*algo)->valid && !(*algo)->valid())
+	const struct raid6_calls *algo, *bestgen, *bestxor;
+	int i, s, lg2, verbose, bestgeni;
+	size_t bytes;
+
+	/*
+	 * Largest size first: it picks raid6_call, and its xor() is the
+	 * fallback for smaller classes where nothing with xor() was run.
+	 */
+	for (s = RAID6_NR_SIZES - 1; s >= 0; s--) {
+		bytes = raid6_sized[s].bytes;
+		lg2 = RAID6_TIME_LG2(s);
+		verbose = s == RAID6_NR_SIZES - 1;
+
+		for (bestgenperf = 0, bestxorperf = 0, bestgen = NULL,
+		     bestxor = NULL, bestgeni = 0, i = 0;
+		     (algo = raid6_algos[i]); i++) {
+			if (bestgen && algo->prefer < bestgen->prefer)
+				continue;
+			if (algo->valid && !algo->valid())
 				continue;
 
-			perf = 0;
-
-			preempt_disable();
-			j0 = jiffies;
-			while ((j1 = jiffies) == j0)
-				cpu_relax();
-			while (time_before(jiffies,
-					    j1 + (1<<RAID6_TIME_JIFFIES_LG2))) {
-				(*algo)->gen_syndrome(disks, PAGE_SIZE, *dptrs);
-				perf++;
-			}
-			preempt_enable();
-
+			perf = raid6_time(lg2, algo->gen_syndrome(disks, bytes,
+								  dptrs));
+			raid6_gen_perf[i][s] = raid6_mbs(perf, disks, bytes,
+							 lg2);
 			if (perf > bestgenperf) {
 				bestgenperf = perf;
-				best = *algo;
+				bestgen = algo;
+				bestgeni = i;
 			}
-			pr_info("raid6: %-8s gen() %5ld MB/s\n", (*algo)->name,
-			       (perf*HZ) >> (20-16+RAID6_TIME_JIFFIES_LG2));
+			if (verbose)
+				pr_info("raid6: %-8s gen() %5ld MB/s\n",
+					algo->name, raid6_gen_perf[i][s]);
 
-			if (!(*algo)->xor_syndrome)
+			if (!algo->xor_syndrome)
 				continue;
 
-			perf = 0;
-
-			preempt_disable();
-			j0 = jiffies;
-			while ((j1 = jiffies) == j0)
-				cpu_relax();
-			while (time_before(jiffies,
-					    j1 + (1<<RAID6_TIME_JIFFIES_LG2))) {
-				(*algo)->xor_syndrome(disks, start, stop,
-						      PAGE_SIZE, *dptrs);
-				perf++;
+			perf = raid6_time(lg2, algo->xor_syndrome(disks, start,
+						stop, bytes, dptrs));
+			raid6_xor_perf[i][s] = raid6_mbs(perf, disks, bytes,
+							 lg2 + 1);
+			if (perf > bestxorperf) {
+				bestxorperf = perf;
+				bestxor = algo;
 			}
-			preempt_enable();
+			if (verbose)
+				pr_info("raid6: %-8s xor() %5ld MB/s\n",
+					algo->name, raid6_xor_perf[i][s]);
+		}
 
-			if (best == *algo)
-				bestxorperf = perf;
+		if (!bestgen) {
+			pr_err("raid6: Yikes!  No algorithm found!\n");
+			return NULL;
+		}
+
+		raid6_sized[s].gen_syndrome = bestgen->gen_syndrome;
+		raid6_gen_name[s] = bestgen->name;
+		if (bestxor) {
+			raid6_sized[s].xor_syndrome = bestxor->xor_syndrome;
+			raid6_xor_name[s] = bestxor->name;
+		} else {
+			raid6_sized[s].xor_syndrome = raid6_call.xor_syndrome;
+			raid6_xor_name[s] = raid6_call.xor_syndrome ?
+					    raid6_call.name : NULL;
+		}
 
-			pr_info("raid6: %-8s xor() %5ld MB/s\n", (*algo)->name,
-				(perf*HZ) >> (20-16+RAID6_TIME_JIFFIES_LG2+1));
+		if (verbose) {
+			/* raid6_call keeps bestgen's own xor(), report that */
+			raid6_call = *bestgen;
+			pr_info("raid6: using algorithm %s gen() %ld MB/s\n",
+				bestgen->name,
+				raid6_mbs(bestgenperf, disks, bytes, lg2));
+			if (raid6_call.xor_syndrome)
+				pr_info("raid6: .... %s xor() %ld MB/s, rmw enabled\n",
+					raid6_call.name,
+					raid6_xor_perf[bestgeni][s]);
 		}
+		pr_info("raid6: %5zu bytes: using %s gen(), %s xor()\n",
+			bytes, bestgen->name, raid6_xor_name[s] ?: "no");
 	}
 
-	if (best) {
-		pr_info("raid6: using algorithm %s gen() %ld MB/s\n",
-		       best->name,
-		       (bestgenperf*HZ) >> (20-16+RAID6_TIME_JIFFIES_LG2));
-		if (best->xor_syndrome)
-			pr_info("raid6: .... xor() %ld MB/s, rmw enabled\n",
-			       (bestxorperf*HZ) >> (20-16+RAID6_TIME_JIFFIES_LG2+1));
-		raid6_call = *best;
-	} else
-		pr_err("raid6: Yikes!  No algorithm found!\n");
+	return &raid6_call;
+}
 
-	return best;
+#ifdef __KERNEL__
+static struct dentry *raid6_debugfs;
+
+static void raid6_show_perf(struct seq_file *m, const char *name,
+			    const unsigned long *perf)
+{
+	int s;
+
+	seq_printf(m, "  %-12s", name);
+	for (s = 0; s < RAID6_NR_SIZES; s++)
+		seq_printf(m, " %8lu", perf[s]);
+	seq_putc(m, '\n');
+}
+
+static void raid6_show_name(struct seq_file *m, const char *what,
+			    const char * const *names)
+{
+	int s;
+
+	seq_printf(m, "  %-12s", what);
+	for (s = 0; s < RAID6_NR_SIZES; s++)
+		seq_printf(m, " %8s", names[s] ?: "-");
+	seq_putc(m, '\n');
+}
+
+static int raid6_perf_show(struct seq_file *m, void *v)
+{
+	int i, s;
+
+	seq_printf(m, "%-14s", "bytes");
+	for (s = 0; s < RAID6_NR_SIZES; s++)
+		seq_printf(m, " %8zu", raid6_sized[s].bytes);
+	seq_puts(m, "\ngen() MB/s\n");
+	for (i = 0; raid6_algos[i]; i++)
+		raid6_show_perf(m, raid6_algos[i]->name, raid6_gen_perf[i]);
+	seq_puts(m, "xor() MB/s\n");
+	for (i = 0; raid6_algos[i]; i++)
+		if (raid6_algos[i]->xor_syndrome)
+			raid6_show_perf(m, raid6_algos[i]->name,
+					raid6_xor_perf[i]);
+	seq_puts(m, "recov MB/s\n");
+	for (i = 0; raid6_recov_algos[i]; i++)
+		raid6_show_perf(m, raid6_recov_algos[i]->name,
+				raid6_recov_perf[i]);
+	seq_puts(m, "selected\n");
+	raid6_show_name(m, "gen()", raid6_gen_name);
+	raid6_show_name(m, "xor()", raid6_xor_name);
+	raid6_show_name(m, "recov", raid6_recov_name);
+	return 0;
+}
+
+static int raid6_perf_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, raid6_perf_show, NULL);
 }
 
+static const struct file_operations raid6_perf_fops = {
+	.owner		= THIS_MODULE,
+	.open		= raid6_perf_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void raid6_debugfs_init(void)
+{
+	raid6_debugfs = debugfs_create_dir("raid6", NULL);
+	if (IS_ERR_OR_NULL(raid6_debugfs)) {
+		raid6_debugfs = NULL;
+		return;
+	}
+	debugfs_create_file("perf", 0444, raid6_debugfs, NULL,
+			    &raid6_perf_fops);
+}
+#else
+static inline void raid6_debugfs_init(void) { }
+#endif
 
 /* Try to pick the best algorithm */
 /* This code uses the gfmul table as convenient data set to abuse */
@@ -222,7 +398,7 @@ int __init raid6_select_algo(void)
 
 	const struct raid6_calls *gen_best;
 	const struct raid6_recov_calls *rec_best;
-	char *syndromes;
+	char *syndromes, *scratch;
 	void *dptrs[(65536/PAGE_SIZE)+2];
 	int i;
 
@@ -241,19 +417,38 @@ int __init raid6_select_algo(void)
 	dptrs[disks-1] = syndromes + PAGE_SIZE;
 
 	/* select raid gen_syndrome function */
-	gen_best = raid6_choose_gen(&dptrs, disks);
+	gen_best = raid6_choose_gen(dptrs, disks);
+
+	/*
+	 * Recovery rewrites the failed blocks, which the read-only gfmul
+	 * table can't stand in for.  It also calls gen_syndrome through
+	 * raid6_sized, so this has to come second.
+	 */
+	scratch = (void *) __get_free_pages(GFP_KERNEL, 1);
+	if (!scratch) {
+		free_pages((unsigned long)syndromes, 1);
+		pr_err("raid6: Yikes!  No memory available.\n");
+		return -ENOMEM;
+	}
+	dptrs[0] = scratch;
+	dptrs[1] = scratch + PAGE_SIZE;
 
 	/* select raid recover functions */
-	rec_best = raid6_choose_recov();
+	rec_best = gen_best ? raid6_choose_recov(dptrs, disks) : NULL;
 
+	free_pages((unsigned long)scratch, 1);
 	free_pages((unsigned long)syndromes, 1);
 
+	raid6_debugfs_init();
+
 	return gen_best && rec_best ? 0 : -EINVAL;
 }
 
 static void raid6_exit(void)
 {
-	do { } while (0);
+#ifdef __KERNEL__
+	debugfs_remove_recursive(raid6_debugfs);
+#endif
 }
 
 subsys_initcall(raid6_select_algo);
@@ -43,7 +43,7 @@ static void raid6_2data_recov_intx1(int disks, size_t bytes, int faila,
 	ptrs[failb] = (void *)raid6_empty_zero_page;
 	ptrs[disks-1] = dq;
 
-	raid6_call.gen_syndrome(disks, bytes, ptrs);
+	raid6_gen_syndrome(disks, bytes, ptrs);
 
 	/* Restore pointer table */
 	ptrs[faila]   = dp;
@@ -81,7 +81,7 @@ static void raid6_datap_recov_intx1(int disks, size_t bytes, int faila,
 	ptrs[faila] = (void *)raid6_empty_zero_page;
 	ptrs[disks-1] = dq;
 
-	raid6_call.gen_syndrome(disks, bytes, ptrs);
+	raid6_gen_syndrome(disks, bytes, ptrs);
 
 	/* Restore pointer table */
 	ptrs[faila]   = dq;
@@ -121,7 +121,7 @@ void raid6_dual_recov(int disks, size_t bytes, int faila, int failb, void **ptrs
 	if ( failb == disks-1 ) {
 		if ( faila == disks-2 ) {
 			/* P+Q failure.  Just rebuild the syndrome. */
-			raid6_call.gen_syndrome(disks, bytes, ptrs);
+			raid6_gen_syndrome(disks, bytes, ptrs);
 		} else {
 			/* data+Q failure.  Reconstruct data from P,
 			   then rebuild syndrome. */
@@ -306,10 +306,10 @@ static struct sbq_wait_state *sbq_wake_ptr(struct sbitmap_queue *sbq)
 	return NULL;
 }
 
-static void sbq_wake_up(struct sbitmap_queue *sbq)
+static void sbq_wake_up(struct sbitmap_queue *sbq, unsigned int nr)
 {
 	struct sbq_wait_state *ws;
-	unsigned int wake_batch;
+	unsigned int wake_batch, sub;
 	int wait_cnt;
 
 	/*
@@ -321,13 +321,23 @@ static void sbq_wake_up(struct sbitmap_queue *sbq)
 	 */
 	smp_mb__after_atomic();
 
-	ws = sbq_wake_ptr(sbq);
-	if (!ws)
-		return;
+	/*
+	 * Account @nr freed bits, at most a wake batch worth against each
+	 * wait queue, so a large batch of frees can wake several of them.
+	 */
+	while (nr) {
+		ws = sbq_wake_ptr(sbq);
+		if (!ws)
+			return;
 
-	wait_cnt = atomic_dec_return(&ws->wait_cnt);
-	if (wait_cnt <= 0) {
 		wake_batch = READ_ONCE(sbq->wake_batch);
+		sub = min(nr, wake_batch);
+		nr -= sub;
+
+		wait_cnt = atomic_sub_return(sub, &ws->wait_cnt);
+		if (wait_cnt > 0)
+			continue;
+
 		/*
 		 * Pairs with the memory barrier in sbitmap_queue_resize() to
 		 * ensure that we see the batch size update before the wait
@@ -351,12 +361,33 @@ void sbitmap_queue_clear(struct sbitmap_queue *sbq, unsigned int nr,
 			 unsigned int cpu)
 {
 	sbitmap_clear_bit(&sbq->sb, nr);
-	sbq_wake_up(sbq);
+	sbq_wake_up(sbq, 1);
 	if (likely(!sbq->round_robin && nr < sbq->sb.depth))
 		*per_cpu_ptr(sbq->alloc_hint, cpu) = nr;
 }
 EXPORT_SYMBOL_GPL(sbitmap_queue_clear);
 
+void sbitmap_queue_clear_batch(struct sbitmap_queue *sbq,
+			       const unsigned int *bits,
+			       const unsigned int *cpus, unsigned int nr)
+{
+	unsigned int i;
+
+	if (!nr)
+		return;
+
+	for (i = 0; i < nr; i++)
+		sbitmap_clear_bit(&sbq->sb, bits[i]);
+	sbq_wake_up(sbq, nr);
+	if (unlikely(sbq->round_robin))
+		return;
+	for (i = 0; i < nr; i++) {
+		if (likely(bits[i] < sbq->sb.depth))
+			*per_cpu_ptr(sbq->alloc_hint, cpus[i]) = bits[i];
+	}
+}
+EXPORT_SYMBOL_GPL(sbitmap_queue_clear_batch);
+
 void sbitmap_queue_wake_all(struct sbitmap_queue *sbq)
 {
 	int i, wake_index;
@@ -0,0 +1,289 @@
+/*
+ * Test cases and benchmark for the LZ4 decompressor.
+ *
+ * Every input is compressed with lz4_compress() (and lz4hc_compress() when
+ * available) and decompressed through each decompression entry point,
+ * checking the output and that nothing is written past the end of it.
+ * Corrupted and truncated inputs must be rejected or at least decoded
+ * within bounds.  The throughput of each entry point is then reported.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/printk.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/lz4.h>
+
+#define MAX_SIZE	(64 * 1024)
+#define GUARD_SIZE	64
+#define GUARD_CHAR	0xa5
+
+static unsigned int bench_size = MAX_SIZE;
+module_param(bench_size, uint, 0444);
+MODULE_PARM_DESC(bench_size, "Size of the benchmark buffers (max 65536)");
+
+static unsigned int bench_iters = 200;
+module_param(bench_iters, uint, 0444);
+MODULE_PARM_DESC(bench_iters, "Iterations of each benchmark, 0 to skip");
+
+static unsigned int total_tests __initdata;
+static unsigned int failed_tests __initdata;
+
+static u8 *src, *comp, *dst, *wrkmem;
+static struct rnd_state rnd;
+
+enum {
+	DATA_ZERO,
+	DATA_RANDOM,
+	DATA_TEXT,
+	DATA_SHORT_PERIOD,	/* overlapping matches, offsets below 16 */
+	DATA_MIXED,
+	NR_DATA_KINDS,
+};
+
+static const char * const data_names[] = {
+	"zero", "random", "text", "short-period", "mixed",
+};
+
+static void __init fill(u8 *buf, size_t len, int kind, unsigned int arg)
+{
+	static const char words[] =
+		"the quick brown fox jumps over the lazy dog while squashfs "
+		"and zram keep calling into the lz4 decompressor ";
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		switch (kind) {
+		case DATA_ZERO:
+			buf[i] = 0;
+			break;
+		case DATA_RANDOM:
+			buf[i] = prandom_u32_state(&rnd);
+			break;
+		case DATA_TEXT:
+			buf[i] = words[(i + arg) % (sizeof(words) - 1)];
+			break;
+		case DATA_SHORT_PERIOD:
+			buf[i] = i < arg % 20 + 1 ? prandom_u32_state(&rnd) :
+				buf[i - (arg % 20 + 1)];
+			break;
+		default:
+			/* repeats at random distances, sprinkled with noise */
+			if (i < 64 || prandom_u32_state(&rnd) % 8 == 0)
+				buf[i] = prandom_u32_state(&rnd);
+			else
+				buf[i] = buf[i - 1 - prandom_u32_state(&rnd) %
+					     min_t(size_t, i, 64)];
+			break;
+		}
+	}
+}
+
+static bool __init guard_intact(const u8 *buf)
+{
+	int i;
+
+	for (i = 0; i < GUARD_SIZE; i++)
+		if (buf[i] != GUARD_CHAR)
+			return false;
+	return true;
+}
+
+static void __init check(bool ok, const char *what, int kind, size_t len,
+			 size_t arg)
+{
+	total_tests++;
+	if (ok)
+		return;
+	pr_warn("%s failed for %s data, %zu bytes (%zu)\n", what,
+		data_names[kind], len, arg);
+	failed_tests++;
+}
+
+static void __init test_decompress(int kind, size_t len, size_t clen)
+{
+	size_t dlen, slen, target;
+	int ret;
+
+	memset(dst, GUARD_CHAR, len + GUARD_SIZE);
+	dlen = len;
+	ret = lz4_decompress_unknownoutputsize(comp, clen, dst, &dlen);
+	check(!ret && dlen == len && !memcmp(src, dst, len) &&
+	      guard_intact(dst + len), "lz4_decompress_unknownoutputsize",
+	      kind, len, 0);
+
+	memset(dst, GUARD_CHAR, len + GUARD_SIZE);
+	ret = lz4_decompress(comp, &slen, dst, len);
+	check(!ret && slen == clen && !memcmp(src, dst, len) &&
+	      guard_intact(dst + len), "lz4_decompress", kind, len, 0);
+
+	for (target = 0; target <= len; target += len / 7 + 1) {
+		memset(dst, GUARD_CHAR, len + GUARD_SIZE);
+		dlen = len;
+		ret = lz4_decompress_partial(comp, clen, dst, &dlen, target);
+		check(!ret && dlen >= target && dlen <= len &&
+		      !memcmp(src, dst, target) && guard_intact(dst + len),
+		      "lz4_decompress_partial", kind, len, target);
+	}
+}
+
+static void __init test_corrupt(int kind, size_t len, size_t clen)
+{
+	size_t dlen, bad_len;
+	int i, pos;
+	u8 bit;
+
+	for (i = 0; i < 16 && clen; i++) {
+		pos = prandom_u32_state(&rnd) % clen;
+		bit = 1 << (prandom_u32_state(&rnd) % 8);
+		comp[pos] ^= bit;
+		bad_len = i < 8 ? clen : prandom_u32_state(&rnd) % clen;
+
+		memset(dst, GUARD_CHAR, len + GUARD_SIZE);
+		dlen = len;
+		lz4_decompress_unknownoutputsize(comp, bad_len, dst, &dlen);
+		check(guard_intact(dst + len), "corrupt input", kind, len, pos);
+
+		memset(dst, GUARD_CHAR, len + GUARD_SIZE);
+		dlen = len;
+		lz4_decompress_partial(comp, bad_len, dst, &dlen, len / 2);
+		check(guard_intact(dst + len), "corrupt partial input", kind,
+		      len, pos);
+
+		comp[pos] ^= bit;
+	}
+}
+
+static void __init test_lz4(void)
+{
+	static const size_t sizes[] __initconst = {
+		0, 1, 5, 12, 13, 16, 31, 64, 100, 1000, 4096, 65535, 65536,
+	};
+	size_t clen;
+	int kind, i;
+
+	for (kind = 0; kind < NR_DATA_KINDS; kind++) {
+		for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+			fill(src, sizes[i], kind, i);
+
+			if (lz4_compress(src, sizes[i], comp, &clen, wrkmem)) {
+				check(false, "lz4_compress", kind, sizes[i], 0);
+				continue;
+			}
+			test_decompress(kind, sizes[i], clen);
+			test_corrupt(kind, sizes[i], clen);
+
+#if IS_ENABLED(CONFIG_LZ4HC_COMPRESS)
+			if (lz4hc_compress(src, sizes[i], comp, &clen,
+					   wrkmem)) {
+				check(false, "lz4hc_compress", kind, sizes[i],
+				      0);
+				continue;
+			}
+			test_decompress(kind, sizes[i], clen);
+#endif
+		}
+	}
+}
+
+static unsigned int __init mbps(size_t bytes, u64 ns)
+{
+	return ns ? div64_u64((u64) bytes * NSEC_PER_SEC, ns) >> 20 : 0;
+}
+
+static void __init bench_lz4(void)
+{
+	size_t len = min_t(size_t, bench_size, MAX_SIZE);
+	size_t clen, dlen, slen;
+	u64 t_comp, t_unk, t_known, t_part;
+	unsigned int i;
+	ktime_t start;
+	int kind;
+
+	if (!bench_iters || !len)
+		return;
+
+	for (kind = 0; kind < NR_DATA_KINDS; kind++) {
+		fill(src, len, kind, 3);
+
+		start = ktime_get();
+		for (i = 0; i < bench_iters; i++)
+			lz4_compress(src, len, comp, &clen, wrkmem);
+		t_comp = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		start = ktime_get();
+		for (i = 0; i < bench_iters; i++) {
+			dlen = len;
+			lz4_decompress_unknownoutputsize(comp, clen, dst,
+							 &dlen);
+		}
+		t_unk = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		start = ktime_get();
+		for (i = 0; i < bench_iters; i++)
+			lz4_decompress(comp, &slen, dst, len);
+		t_known = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		/* a quarter of the output, like a sub-page read */
+		start = ktime_get();
+		for (i = 0; i < bench_iters; i++) {
+			dlen = len;
+			lz4_decompress_partial(comp, clen, dst, &dlen,
+					       len / 4);
+		}
+		t_part = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		pr_info("%-12s %zu -> %zu bytes: compress %u MB/s, decompress %u MB/s, known size %u MB/s, partial 1/4 %u MB/s\n",
+			data_names[kind], len, clen,
+			mbps(len * bench_iters, t_comp),
+			mbps(len * bench_iters, t_unk),
+			mbps(len * bench_iters, t_known),
+			mbps(len / 4 * bench_iters, t_part));
+
+		cond_resched();
+	}
+}
+
+static int __init test_lz4_init(void)
+{
+	int ret = -ENOMEM;
+
+	src = vmalloc(MAX_SIZE);
+	comp = vmalloc(lz4_compressbound(MAX_SIZE));
+	dst = vmalloc(MAX_SIZE + GUARD_SIZE);
+	wrkmem = vmalloc(max_t(size_t, LZ4_MEM_COMPRESS, LZ4HC_MEM_COMPRESS));
+	if (!src || !comp || !dst || !wrkmem)
+		goto out;
+
+	prandom_seed_state(&rnd, 0x4c5a34);
+
+	test_lz4();
+
+	if (failed_tests == 0)
+		pr_info("all %u tests passed\n", total_tests);
+	else
+		pr_warn("failed %u out of %u tests\n", failed_tests,
+			total_tests);
+
+	bench_lz4();
+
+	ret = failed_tests ? -EINVAL : 0;
+out:
+	vfree(wrkmem);
+	vfree(dst);
+	vfree(comp);
+	vfree(src);
+	return ret;
+}
+
+module_init(test_lz4_init);
+
+MODULE_DESCRIPTION("LZ4 decompressor test and benchmark");
+MODULE_LICENSE("GPL");
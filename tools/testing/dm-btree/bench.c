@@ -0,0 +1,291 @@
+/*
+ * Userspace benchmark and sanity check for dm-btree batched insertion and
+ * the prefetching cursor.
+ *
+ * Inserts the same keys into a fresh tree once with dm_btree_insert() and
+ * once with dm_btree_insert_many(), committing after every batch like the
+ * thin and cache targets do, and compares the time taken and the work done
+ * by the transaction manager.  Both trees are then checked against each
+ * other and walked with a cursor.
+ */
+#include "tm.h"
+#include "dm-btree.h"
+
+#include <linux/blkdev.h>
+#include <getopt.h>
+#include <time.h>
+
+static unsigned nr_keys = 1000000;
+static unsigned batch = 1000;
+static bool sequential;
+
+static struct dm_transaction_manager *tm;
+
+#define fail(...)					\
+do {							\
+	fprintf(stderr, __VA_ARGS__);			\
+	exit(1);					\
+} while (0)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t value_of(uint64_t key, unsigned round)
+{
+	return key * 3 + round;
+}
+
+static void init_info(struct dm_btree_info *info, unsigned levels)
+{
+	memset(info, 0, sizeof(*info));
+	info->tm = tm;
+	info->levels = levels;
+	info->value_type.size = sizeof(__le64);
+}
+
+static dm_block_t insert_keys(struct dm_btree_info *info, dm_block_t root,
+			      uint64_t *keys, unsigned nr, bool many,
+			      unsigned round)
+{
+	struct dm_btree_kv *kvs = malloc(batch * sizeof(*kvs));
+	__le64 *values = malloc(batch * sizeof(*values));
+	uint64_t path[2] = { 0, 0 };
+	unsigned i, j, n, inserted;
+	int r;
+
+	for (i = 0; i < nr; i += n) {
+		n = min(batch, nr - i);
+
+		for (j = 0; j < n; j++) {
+			values[j] = cpu_to_le64(value_of(keys[i + j], round));
+			kvs[j].key = keys[i + j];
+			kvs[j].value = values + j;
+		}
+
+		if (many) {
+			r = dm_btree_insert_many(info, root, path, kvs, n,
+						 &root, &inserted);
+			if (r)
+				fail("dm_btree_insert_many: %d\n", r);
+			if (inserted != (round ? 0 : n))
+				fail("inserted %u of %u new keys\n",
+				     inserted, n);
+		} else {
+			for (j = 0; j < n; j++) {
+				path[info->levels - 1] = kvs[j].key;
+				r = dm_btree_insert(info, root, path,
+						    kvs[j].value, &root);
+				if (r)
+					fail("dm_btree_insert: %d\n", r);
+			}
+		}
+
+		tm_commit(tm);
+	}
+
+	free(kvs);
+	free(values);
+	return root;
+}
+
+static void check_keys(struct dm_btree_info *info, dm_block_t root,
+		       uint64_t *keys, unsigned nr, unsigned round)
+{
+	uint64_t path[2] = { 0, 0 };
+	__le64 value;
+	unsigned i;
+	int r;
+
+	for (i = 0; i < nr; i++) {
+		path[info->levels - 1] = keys[i];
+		r = dm_btree_lookup(info, root, path, &value);
+		if (r)
+			fail("lookup of %llu failed: %d\n",
+			     (unsigned long long) keys[i], r);
+		if (le64_to_cpu(value) != value_of(keys[i], round))
+			fail("wrong value for %llu\n",
+			     (unsigned long long) keys[i]);
+	}
+}
+
+static void report(const char *what, double t, unsigned nr)
+{
+	struct tm_stats s;
+
+	tm_get_stats(tm, &s);
+	printf("%-22s %8.3fs %9.0f ops/s  read locks %9lu  write locks %9lu  shadow copies %8lu  new blocks %6lu  prefetches %7lu\n",
+	       what, t, nr / t, s.read_locks, s.write_locks, s.shadow_copies,
+	       s.new_blocks, s.prefetches);
+}
+
+static void bench_insert(uint64_t *keys, bool many)
+{
+	struct dm_btree_info info;
+	dm_block_t root;
+	double t;
+
+	tm = tm_create();
+	init_info(&info, 1);
+	if (dm_btree_empty(&info, &root))
+		fail("dm_btree_empty failed\n");
+	tm_commit(tm);
+
+	tm_reset_stats(tm);
+	t = now();
+	root = insert_keys(&info, root, keys, nr_keys, many, 0);
+	report(many ? "dm_btree_insert_many" : "dm_btree_insert", now() - t,
+	       nr_keys);
+
+	check_keys(&info, root, keys, nr_keys, 0);
+
+	if (many) {
+		/* overwriting must not count as inserting */
+		tm_reset_stats(tm);
+		t = now();
+		root = insert_keys(&info, root, keys, nr_keys, true, 1);
+		report("  overwrite", now() - t, nr_keys);
+		check_keys(&info, root, keys, nr_keys, 1);
+	}
+
+	tm_destroy(tm);
+}
+
+static void bench_cursor(uint64_t *keys)
+{
+	struct dm_btree_info info;
+	struct dm_btree_cursor c;
+	dm_block_t root;
+	uint64_t key, last = 0;
+	__le64 value;
+	unsigned n = 0;
+	double t;
+	int r;
+
+	tm = tm_create();
+	init_info(&info, 1);
+	if (dm_btree_empty(&info, &root))
+		fail("dm_btree_empty failed\n");
+	root = insert_keys(&info, root, keys, nr_keys, true, 0);
+
+	tm_reset_stats(tm);
+	t = now();
+	r = dm_btree_cursor_begin(&info, root, false, &c);
+	while (!r) {
+		if (dm_btree_cursor_get_value(&c, &key, &value))
+			fail("dm_btree_cursor_get_value failed\n");
+		if ((n && key <= last) || le64_to_cpu(value) != value_of(key, 0))
+			fail("cursor returned %llu out of order\n",
+			     (unsigned long long) key);
+		last = key;
+		n++;
+		r = dm_btree_cursor_next(&c);
+	}
+	dm_btree_cursor_end(&c);
+	report("cursor walk", now() - t, nr_keys);
+
+	if (r != -ENODATA || n != nr_keys)
+		fail("cursor saw %u of %u keys (%d)\n", n, nr_keys, r);
+
+	tm_destroy(tm);
+}
+
+/* Two bottom level trees under one top level key each */
+static void check_two_level(uint64_t *keys)
+{
+	struct dm_btree_info info;
+	struct dm_btree_kv kv[2];
+	dm_block_t root;
+	__le64 v[2];
+	uint64_t path[2];
+	unsigned i;
+
+	tm = tm_create();
+	init_info(&info, 2);
+	if (dm_btree_empty(&info, &root))
+		fail("dm_btree_empty failed\n");
+
+	for (i = 0; i < nr_keys / 10; i++) {
+		path[0] = i & 1;
+		v[0] = cpu_to_le64(value_of(keys[i], path[0]));
+		kv[0].key = keys[i];
+		kv[0].value = v;
+		if (dm_btree_insert_many(&info, root, path, kv, 1, &root, NULL))
+			fail("two level insert failed\n");
+	}
+
+	for (i = 0; i < nr_keys / 10; i++) {
+		path[0] = i & 1;
+		path[1] = keys[i];
+		if (dm_btree_lookup(&info, root, path, v) ||
+		    le64_to_cpu(v[0]) != value_of(keys[i], path[0]))
+			fail("two level lookup of %llu failed\n",
+			     (unsigned long long) keys[i]);
+	}
+
+	/* duplicates are refused */
+	kv[0].key = kv[1].key = 1;
+	kv[1].value = v + 1;
+	if (dm_btree_insert_many(&info, root, path, kv, 2, &root, NULL) !=
+	    -EINVAL)
+		fail("duplicate keys weren't refused\n");
+
+	tm_destroy(tm);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t *keys, tmp;
+	unsigned i, j;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:b:s")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_keys = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			sequential = true;
+			break;
+		default:
+			fail("usage: %s [-n keys] [-b batch size] [-s]\n",
+			     argv[0]);
+		}
+	}
+	if (!nr_keys || !batch)
+		fail("need at least one key and a batch size\n");
+
+	keys = malloc(nr_keys * sizeof(*keys));
+	if (!keys)
+		fail("out of memory\n");
+
+	srandom(1);
+	for (i = 0; i < nr_keys; i++)
+		keys[i] = (uint64_t) i * 8;
+	if (!sequential) {
+		for (i = nr_keys - 1; i > 0; i--) {
+			j = random() % (i + 1);
+			tmp = keys[i];
+			keys[i] = keys[j];
+			keys[j] = tmp;
+		}
+	}
+
+	printf("%u %s keys, committing every %u\n", nr_keys,
+	       sequential ? "sequential" : "random", batch);
+
+	bench_insert(keys, false);
+	bench_insert(keys, true);
+	bench_cursor(keys);
+	check_two_level(keys);
+
+	free(keys);
+	return 0;
+}
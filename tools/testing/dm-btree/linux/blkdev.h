@@ -0,0 +1,31 @@
+#ifndef _DM_BTREE_TEST_BLKDEV_H
+#define _DM_BTREE_TEST_BLKDEV_H
+
+/*
+ * The persistent-data headers pull everything in through here, so this is
+ * where the bits of the kernel environment they need are faked up.
+ */
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <errno.h>
+#include <string.h>
+
+#define __packed		__attribute__((packed))
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+
+#define U64_MAX			((u64)~0ULL)
+
+#define le32_to_cpu(x)		((u32)(x))
+#define le64_to_cpu(x)		((u64)(x))
+
+/* dm-btree.c has its own */
+#define bsearch			dm_btree_bsearch
+
+#define GFP_NOIO		GFP_KERNEL
+#define kmalloc(size, gfp)	malloc(size)
+#define kfree(p)		free(p)
+
+struct block_device;
+
+#endif
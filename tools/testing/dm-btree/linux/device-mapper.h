@@ -0,0 +1,11 @@
+#ifndef _DM_BTREE_TEST_DEVICE_MAPPER_H
+#define _DM_BTREE_TEST_DEVICE_MAPPER_H
+
+#include <stdio.h>
+
+#define DMERR(fmt, ...) \
+	fprintf(stderr, DM_MSG_PREFIX ": " fmt "\n", ##__VA_ARGS__)
+#define DMERR_LIMIT		DMERR
+#define DMWARN			DMERR
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _DM_BTREE_TEST_SORT_H
+#define _DM_BTREE_TEST_SORT_H
+
+#include <stdlib.h>
+
+static inline void sort(void *base, size_t num, size_t size,
+			int (*cmp)(const void *, const void *),
+			void (*swap)(void *, void *, int))
+{
+	qsort(base, num, size, cmp);
+}
+
+#endif
@@ -0,0 +1,312 @@
+/*
+ * In-core transaction manager for exercising dm-btree in userspace.
+ *
+ * Blocks live in a malloc()ed array, reference counts in another.  Shadowing
+ * follows dm-transaction-manager.c: a block that was already shadowed in
+ * this transaction, and isn't shared, is just write locked; otherwise it's
+ * copied to a new block.  Like the block manager, validators prepare blocks
+ * for writing when the transaction is committed and check them the first
+ * time they're read after that, so the btree checksums get exercised too.
+ */
+#include "tm.h"
+
+#include <linux/blkdev.h>
+#include <stdlib.h>
+
+#define BLOCK_SIZE	4096
+
+struct dm_block {
+	dm_block_t loc;
+	void *data;
+	struct dm_block_validator *v;
+	bool write_locked;
+	bool checked;
+};
+
+struct dm_block_manager {
+	int unused;
+};
+
+struct dm_transaction_manager {
+	struct dm_block_manager bm;
+
+	dm_block_t nr_blocks;
+	struct dm_block *blocks;
+	uint32_t *ref_counts;
+	bool *shadowed;
+
+	dm_block_t *free_list;
+	dm_block_t nr_free;
+
+	/* blocks shadowed or allocated in this transaction */
+	dm_block_t *dirty;
+	dm_block_t nr_dirty;
+
+	struct tm_stats stats;
+};
+
+static struct dm_transaction_manager *the_tm;
+
+dm_block_t dm_block_location(struct dm_block *b)
+{
+	return b->loc;
+}
+
+void *dm_block_data(struct dm_block *b)
+{
+	return b->data;
+}
+
+unsigned dm_bm_block_size(struct dm_block_manager *bm)
+{
+	return BLOCK_SIZE;
+}
+
+u32 dm_bm_checksum(const void *data, size_t len, u32 init_xor)
+{
+	const unsigned char *p = data;
+	u64 h = 14695981039346656037ull, w;
+
+	for (; len >= sizeof(w); len -= sizeof(w), p += sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		h = (h ^ w) * 1099511628211ull;
+	}
+	while (len--)
+		h = (h ^ *p++) * 1099511628211ull;
+
+	return (h ^ (h >> 32)) ^ init_xor;
+}
+
+void dm_bm_prefetch(struct dm_block_manager *bm, dm_block_t b)
+{
+	the_tm->stats.prefetches++;
+}
+
+static int check(struct dm_transaction_manager *tm, dm_block_t b,
+		 struct dm_block_validator *v)
+{
+	struct dm_block *blk = tm->blocks + b;
+
+	if (b >= tm->nr_blocks || !tm->ref_counts[b]) {
+		fprintf(stderr, "tm: access to unallocated block %llu\n",
+			(unsigned long long) b);
+		abort();
+	}
+
+	blk->v = v;
+	if (blk->checked || tm->shadowed[b] || !v || !v->check)
+		return 0;
+
+	blk->checked = true;
+	return v->check(v, blk, BLOCK_SIZE);
+}
+
+int dm_bm_read_try_lock(struct dm_block_manager *bm, dm_block_t b,
+			struct dm_block_validator *v, struct dm_block **result)
+{
+	return dm_tm_read_lock(the_tm, b, v, result);
+}
+
+void dm_bm_unlock(struct dm_block *b)
+{
+	b->write_locked = false;
+}
+
+struct dm_block_manager *dm_tm_get_bm(struct dm_transaction_manager *tm)
+{
+	return &tm->bm;
+}
+
+int dm_tm_read_lock(struct dm_transaction_manager *tm, dm_block_t b,
+		    struct dm_block_validator *v, struct dm_block **result)
+{
+	int r = check(tm, b, v);
+
+	if (r)
+		return r;
+
+	tm->stats.read_locks++;
+	*result = tm->blocks + b;
+	return 0;
+}
+
+void dm_tm_unlock(struct dm_transaction_manager *tm, struct dm_block *b)
+{
+	dm_bm_unlock(b);
+}
+
+static int alloc_block(struct dm_transaction_manager *tm, dm_block_t *b)
+{
+	dm_block_t n;
+
+	if (!tm->nr_free)
+		return -ENOSPC;
+
+	n = tm->free_list[--tm->nr_free];
+	if (!tm->blocks[n].data) {
+		tm->blocks[n].data = malloc(BLOCK_SIZE);
+		if (!tm->blocks[n].data)
+			return -ENOMEM;
+	}
+
+	tm->ref_counts[n] = 1;
+	tm->shadowed[n] = true;
+	tm->dirty[tm->nr_dirty++] = n;
+	*b = n;
+	return 0;
+}
+
+int dm_tm_new_block(struct dm_transaction_manager *tm,
+		    struct dm_block_validator *v, struct dm_block **result)
+{
+	dm_block_t b;
+	int r = alloc_block(tm, &b);
+
+	if (r)
+		return r;
+
+	tm->stats.new_blocks++;
+	tm->stats.write_locks++;
+	*result = tm->blocks + b;
+	memset((*result)->data, 0, BLOCK_SIZE);
+	(*result)->v = v;
+	(*result)->write_locked = true;
+	return 0;
+}
+
+int dm_tm_shadow_block(struct dm_transaction_manager *tm, dm_block_t orig,
+		       struct dm_block_validator *v, struct dm_block **result,
+		       int *inc_children)
+{
+	dm_block_t b;
+	int r = check(tm, orig, v);
+
+	if (r)
+		return r;
+
+	*inc_children = tm->ref_counts[orig] > 1;
+	if (tm->shadowed[orig] && !*inc_children) {
+		tm->stats.write_locks++;
+		*result = tm->blocks + orig;
+		(*result)->write_locked = true;
+		return 0;
+	}
+
+	r = alloc_block(tm, &b);
+	if (r)
+		return r;
+
+	dm_tm_dec(tm, orig);
+
+	tm->stats.shadow_copies++;
+	tm->stats.write_locks++;
+	*result = tm->blocks + b;
+	memcpy((*result)->data, tm->blocks[orig].data, BLOCK_SIZE);
+	(*result)->v = v;
+	(*result)->write_locked = true;
+	return 0;
+}
+
+void dm_tm_inc(struct dm_transaction_manager *tm, dm_block_t b)
+{
+	tm->ref_counts[b]++;
+}
+
+void dm_tm_dec(struct dm_transaction_manager *tm, dm_block_t b)
+{
+	BUG_ON(!tm->ref_counts[b]);
+	if (!--tm->ref_counts[b]) {
+		tm->shadowed[b] = false;
+		tm->free_list[tm->nr_free++] = b;
+	}
+}
+
+int dm_tm_ref(struct dm_transaction_manager *tm, dm_block_t b,
+	      uint32_t *result)
+{
+	*result = tm->ref_counts[b];
+	return 0;
+}
+
+struct dm_transaction_manager *tm_create(void)
+{
+	struct dm_transaction_manager *tm = calloc(1, sizeof(*tm));
+	dm_block_t i;
+
+	BUG_ON(the_tm);
+
+	tm->nr_blocks = 1 << 18;
+	tm->blocks = calloc(tm->nr_blocks, sizeof(*tm->blocks));
+	tm->ref_counts = calloc(tm->nr_blocks, sizeof(*tm->ref_counts));
+	tm->shadowed = calloc(tm->nr_blocks, sizeof(*tm->shadowed));
+	tm->dirty = calloc(tm->nr_blocks, sizeof(*tm->dirty));
+	tm->free_list = calloc(tm->nr_blocks, sizeof(*tm->free_list));
+	if (!tm->blocks || !tm->ref_counts || !tm->shadowed || !tm->dirty ||
+	    !tm->free_list) {
+		perror("tm_create");
+		exit(1);
+	}
+
+	for (i = 0; i < tm->nr_blocks; i++) {
+		tm->blocks[i].loc = i;
+		tm->free_list[tm->nr_free++] = tm->nr_blocks - 1 - i;
+	}
+
+	the_tm = tm;
+	return tm;
+}
+
+void tm_destroy(struct dm_transaction_manager *tm)
+{
+	dm_block_t i;
+
+	for (i = 0; i < tm->nr_blocks; i++)
+		free(tm->blocks[i].data);
+	free(tm->blocks);
+	free(tm->ref_counts);
+	free(tm->shadowed);
+	free(tm->dirty);
+	free(tm->free_list);
+	free(tm);
+	the_tm = NULL;
+}
+
+void tm_commit(struct dm_transaction_manager *tm)
+{
+	struct dm_block *b;
+	dm_block_t i;
+
+	for (i = 0; i < tm->nr_dirty; i++) {
+		if (!tm->shadowed[tm->dirty[i]])
+			continue;
+
+		b = tm->blocks + tm->dirty[i];
+		BUG_ON(b->write_locked);
+		if (b->v && b->v->prepare_for_write)
+			b->v->prepare_for_write(b->v, b, BLOCK_SIZE);
+		b->checked = false;
+		tm->shadowed[tm->dirty[i]] = false;
+	}
+	tm->nr_dirty = 0;
+}
+
+void tm_get_stats(struct dm_transaction_manager *tm, struct tm_stats *stats)
+{
+	*stats = tm->stats;
+}
+
+void tm_reset_stats(struct dm_transaction_manager *tm)
+{
+	memset(&tm->stats, 0, sizeof(tm->stats));
+}
+
+unsigned long tm_nr_allocated(struct dm_transaction_manager *tm)
+{
+	unsigned long n = 0;
+	dm_block_t i;
+
+	for (i = 0; i < tm->nr_blocks; i++)
+		n += !!tm->ref_counts[i];
+
+	return n;
+}
@@ -0,0 +1,28 @@
+#ifndef _DM_BTREE_TEST_TM_H
+#define _DM_BTREE_TEST_TM_H
+
+#include "dm-transaction-manager.h"
+
+/*
+ * An in-core stand-in for the transaction manager, block manager and space
+ * map, which counts what the btree code asks of them.
+ */
+struct tm_stats {
+	unsigned long read_locks;
+	unsigned long write_locks;
+	unsigned long new_blocks;
+	unsigned long shadow_copies;
+	unsigned long prefetches;
+};
+
+struct dm_transaction_manager *tm_create(void);
+void tm_destroy(struct dm_transaction_manager *tm);
+
+/* Ends the transaction: blocks have to be shadowed again to be changed */
+void tm_commit(struct dm_transaction_manager *tm);
+
+void tm_get_stats(struct dm_transaction_manager *tm, struct tm_stats *stats);
+void tm_reset_stats(struct dm_transaction_manager *tm);
+unsigned long tm_nr_allocated(struct dm_transaction_manager *tm);
+
+#endif